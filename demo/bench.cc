@@ -0,0 +1,1218 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+/* Benchmarks Calculon: the per-call latency of a tiny script, and the
+ * throughput of the fractal, noise and vector arithmetic scripts in each
+ * execution mode, at both precisions, each against hand-written C++ doing
+ * the same work. Then every maths function, at every accuracy tier, and
+ * the vector methods, on reals and vectors, with the worst error found in
+ * ulps. Results go to stdout as a table and optionally to a JSON file
+ * whose keys and case order never change, so runs can be compared.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <limits>
+#include <math.h>
+#include <boost/program_options.hpp>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "calculon.h"
+
+using std::string;
+using std::vector;
+namespace po = boost::program_options;
+
+static double mintime = 0.2;
+static string filter;
+static unsigned threads = 0;
+static string scriptdir = ".";
+
+/* Hardware counters for the calling thread, where the kernel allows them
+ * (perf_event_paranoid, containers and non-Linux systems often don't). */
+
+class PerfCounters
+{
+public:
+	PerfCounters():
+		_cycles(-1),
+		_instructions(-1)
+	{
+#if defined(__linux__)
+		_cycles = open(PERF_COUNT_HW_CPU_CYCLES, -1);
+		if (_cycles != -1)
+			_instructions = open(PERF_COUNT_HW_INSTRUCTIONS, _cycles);
+#endif
+	}
+
+	~PerfCounters()
+	{
+		if (_instructions != -1)
+			close(_instructions);
+		if (_cycles != -1)
+			close(_cycles);
+	}
+
+	bool available() const
+	{
+		return (_cycles != -1) && (_instructions != -1);
+	}
+
+	void start()
+	{
+#if defined(__linux__)
+		ioctl(_cycles, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(_cycles, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+	}
+
+	void stop(uint64_t& cycles, uint64_t& instructions)
+	{
+		cycles = instructions = 0;
+#if defined(__linux__)
+		ioctl(_cycles, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		if (read(_cycles, &cycles, sizeof(cycles)) != sizeof(cycles))
+			cycles = 0;
+		if (read(_instructions, &instructions, sizeof(instructions)) !=
+				sizeof(instructions))
+			instructions = 0;
+#endif
+	}
+
+private:
+#if defined(__linux__)
+	static int open(uint64_t config, int group)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = config;
+		attr.disabled = (group == -1);
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+	}
+#endif
+
+	int _cycles;
+	int _instructions;
+};
+
+static PerfCounters counters;
+
+struct Result
+{
+	string workload;
+	string mode;
+	string precision;
+	uint64_t items;       /* per run */
+	double compilems;
+	double ns;            /* per item, best run */
+	double baselinens;    /* per item, or 0 */
+	bool threaded;
+	double cycles;        /* per item, or -1 */
+	double instructions;  /* per item, or -1 */
+	double maxulp;        /* worst finite error, or -1 */
+	uint64_t mismatches;  /* results with the wrong NaN or infinity */
+
+	string name() const
+	{
+		return workload + "/" + mode + "/" + precision;
+	}
+};
+
+static vector<Result> results;
+
+static double since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+static bool wanted(const string& name)
+{
+	return filter.empty() || (name.find(filter) != string::npos);
+}
+
+static string readscript(const string& name)
+{
+	std::ifstream f((scriptdir + "/" + name).c_str());
+	if (!f)
+	{
+		std::cerr << "bench: can't open '" << scriptdir << "/" << name
+			<< "' (try --scripts)\n";
+		exit(1);
+	}
+	std::stringstream s;
+	s << f.rdbuf();
+	return s.str();
+}
+
+/* Runs fn (which processes `items` items) until `seconds` have passed
+ * (mintime by default), and returns the best time per item in ns. With
+ * counters, one more run is counted. */
+
+template <class F>
+static double measure(F fn, uint64_t items, Result* result = NULL,
+		double seconds = -1)
+{
+	if (seconds < 0)
+		seconds = mintime;
+
+	fn();
+
+	double best = std::numeric_limits<double>::infinity();
+	double total = 0;
+	unsigned runs = 0;
+	do
+	{
+		std::chrono::steady_clock::time_point start =
+			std::chrono::steady_clock::now();
+		fn();
+		double t = since(start);
+		best = std::min(best, t);
+		total += t;
+		runs++;
+	}
+	while ((total < seconds) || (runs < 3));
+
+	if (result && !result->threaded && counters.available())
+	{
+		uint64_t cycles;
+		uint64_t instructions;
+		counters.start();
+		fn();
+		counters.stop(cycles, instructions);
+		result->cycles = (double)cycles / items;
+		result->instructions = (double)instructions / items;
+	}
+
+	return best * 1e9 / items;
+}
+
+/* Compiles a program, recording how long it took. */
+
+template <class Program, class Symbols, class Options>
+static Program* compile(Symbols& symbols, const string& code,
+		const string& signature, const Options& options, Result& result)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	Program* p = new Program(symbols, code, signature, {}, options);
+	result.compilems = since(start) * 1000;
+	return p;
+}
+
+static Result newresult(const string& workload, const string& mode,
+		const string& precision, uint64_t items)
+{
+	Result r;
+	r.workload = workload;
+	r.mode = mode;
+	r.precision = precision;
+	r.items = items;
+	r.compilems = 0;
+	r.ns = 0;
+	r.baselinens = 0;
+	r.threaded = (mode.find("threads") != string::npos);
+	r.cycles = -1;
+	r.instructions = -1;
+	r.maxulp = -1;
+	r.mismatches = 0;
+	return r;
+}
+
+static void report(const Result& r)
+{
+	printf("%-40s %10.2f ns %10.2f Mitem/s", r.name().c_str(), r.ns,
+		1000.0 / r.ns);
+	if (r.baselinens)
+		printf("   C++ %8.2f ns  x%.2f", r.baselinens, r.ns / r.baselinens);
+	else if (r.compilems)
+		printf("   compiled in %.2f ms", r.compilems);
+	if (r.maxulp >= 0)
+		printf("   %8.2f ulp", r.maxulp);
+	if (r.mismatches)
+		printf(" (%llu wrong NaN/inf)", (unsigned long long)r.mismatches);
+	printf("\n");
+	fflush(stdout);
+	results.push_back(r);
+}
+
+/* Keeps results alive so the optimiser can't discard the work. */
+
+static volatile double sink;
+
+template <typename Real>
+static void consume(const vector<Real>& v)
+{
+	double d = 0;
+	for (size_t i = 0; i < v.size(); i += 61)
+		d += v[i];
+	sink = d;
+}
+
+/* --- Per-call latency of a tiny script ----------------------------------- */
+
+enum
+{
+	LATENCY_CALLS = 1<<20
+};
+
+template <typename Real>
+__attribute__((noinline)) static void tinybaseline(Real x, Real* y)
+{
+	*y = x*2 + 1;
+}
+
+template <typename Settings>
+static void latency(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+	typedef void TinyFunction(Real x, Real* y);
+
+	Result result = newresult("latency", "scalar", precision, LATENCY_CALLS);
+	if (!wanted(result.name()))
+		return;
+
+	typename Compiler::StandardSymbolTable symbols;
+	typename Compiler::Options options;
+	std::unique_ptr<typename Compiler::template Program<TinyFunction> > func(
+		compile<typename Compiler::template Program<TinyFunction> >(symbols,
+			"let y = x*2 + 1 in return", "(x: real): (y: real)", options,
+			result));
+
+	/* Both are called through a function pointer the compiler can't see
+	 * through. */
+
+	TinyFunction* volatile fp = *func;
+	TinyFunction* volatile bp = tinybaseline<Real>;
+	vector<Real> out(1);
+
+	result.ns = measure(
+		[&]
+		{
+			TinyFunction* f = fp;
+			Real acc = 0;
+			for (unsigned i = 0; i < LATENCY_CALLS; i++)
+			{
+				Real y;
+				f((Real)(i & 1023), &y);
+				acc += y;
+			}
+			out[0] = acc;
+		},
+		LATENCY_CALLS, &result);
+
+	result.baselinens = measure(
+		[&]
+		{
+			TinyFunction* f = bp;
+			Real acc = 0;
+			for (unsigned i = 0; i < LATENCY_CALLS; i++)
+			{
+				Real y;
+				f((Real)(i & 1023), &y);
+				acc += y;
+			}
+			out[0] = acc;
+		},
+		LATENCY_CALLS);
+
+	consume(out);
+	report(result);
+}
+
+/* --- Fractal (demo/fractal.cal) ------------------------------------------ */
+
+enum
+{
+	FRACTAL_SIZE = 256
+};
+
+template <typename Real>
+static void fractalbaseline(vector<Real>& image)
+{
+	for (unsigned y = 0; y < FRACTAL_SIZE; y++)
+	{
+		Real ci = -1 + 2*((Real)y/FRACTAL_SIZE);
+		for (unsigned x = 0; x < FRACTAL_SIZE; x++)
+		{
+			Real cr = -2 + 3*((Real)x/FRACTAL_SIZE);
+			Real r = cr;
+			Real i = ci;
+			int n = 0;
+			while ((n <= 32) && ((r*r + i*i) <= 4))
+			{
+				Real t = r*r - i*i + cr;
+				i = 2*r*i + ci;
+				r = t;
+				n++;
+			}
+			image[y*FRACTAL_SIZE + x] = (n > 32) ? 0 : (Real)n/32;
+		}
+	}
+}
+
+template <typename Settings>
+static void fractal(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+	typedef void FractalFunction(Real r, Real i, Real* intensity);
+	typedef typename Compiler::template Program<FractalFunction> Program;
+
+	const size_t items = FRACTAL_SIZE * FRACTAL_SIZE;
+	const char* modes[] = { "scalar", "batch", "grid", "grid-threads" };
+	string code = readscript("fractal.cal");
+	Calculon::Dispatch dispatch(threads);
+
+	vector<Real> image(items);
+	double baselinens = 0;
+
+	for (const char* mode : modes)
+	{
+		Result result = newresult("fractal", mode, precision, items);
+		if (!wanted(result.name()))
+			continue;
+
+		if (!baselinens)
+			baselinens = measure([&] { fractalbaseline(image); }, items);
+		result.baselinens = baselinens;
+
+		typename Compiler::StandardSymbolTable symbols;
+		typename Compiler::Options options;
+		string m = mode;
+		if (m == "batch")
+		{
+			options.batch = true;
+			options.inputLayouts["i"] = Compiler::Layout::uniform();
+		}
+		else if (m != "scalar")
+		{
+			options.grid = true;
+			options.inputLayouts["r"] = Compiler::Layout::grid();
+			options.inputLayouts["i"] = Compiler::Layout::grid();
+		}
+		std::unique_ptr<Program> func(compile<Program>(symbols, code,
+			"(r:real, i:real): (intensity:real)", options, result));
+
+		vector<Real> rs(FRACTAL_SIZE);
+		for (unsigned x = 0; x < FRACTAL_SIZE; x++)
+			rs[x] = -2 + 3*((Real)x/FRACTAL_SIZE);
+		Real r[] = { -2, (Real)3/FRACTAL_SIZE, 0 };
+		Real i[] = { -1, 0, (Real)2/FRACTAL_SIZE };
+		typename Compiler::Binding bindings[] = { r, i, &image[0] };
+
+		result.ns = measure(
+			[&]
+			{
+				if (m == "scalar")
+				{
+					FractalFunction* f = *func;
+					for (unsigned y = 0; y < FRACTAL_SIZE; y++)
+						for (unsigned x = 0; x < FRACTAL_SIZE; x++)
+							f(rs[x], -1 + 2*((Real)y/FRACTAL_SIZE),
+								&image[y*FRACTAL_SIZE + x]);
+				}
+				else if (m == "batch")
+				{
+					for (unsigned y = 0; y < FRACTAL_SIZE; y++)
+					{
+						Real i = -1 + 2*((Real)y/FRACTAL_SIZE);
+						typename Compiler::Binding bindings[] =
+							{ &rs[0], &i, &image[y*FRACTAL_SIZE] };
+						func->batch(0, FRACTAL_SIZE, bindings);
+					}
+				}
+				else if (m == "grid")
+					func->grid(0, 0, FRACTAL_SIZE, FRACTAL_SIZE, FRACTAL_SIZE,
+						bindings);
+				else
+					dispatch.grid(*func, FRACTAL_SIZE, FRACTAL_SIZE,
+						FRACTAL_SIZE, bindings, 16);
+			},
+			items, &result);
+
+		consume(image);
+		report(result);
+	}
+}
+
+/* --- Noise (demo/noise.cal) ---------------------------------------------- */
+
+/* libnoise isn't needed: perlin() is a small value noise function, which
+ * the baseline calls too. */
+
+static double lattice(int x, int y, int z)
+{
+	uint32_t h = x*374761393u + y*668265263u + z*2246822519u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	h ^= h >> 16;
+	return (h & 0xffff) / 32767.5 - 1;
+}
+
+static double fade(double t)
+{
+	return t*t*(3 - 2*t);
+}
+
+static double valuenoise(double x, double y, double z)
+{
+	double fx = floor(x);
+	double fy = floor(y);
+	double fz = floor(z);
+	int ix = fx;
+	int iy = fy;
+	int iz = fz;
+	double tx = fade(x - fx);
+	double ty = fade(y - fy);
+	double tz = fade(z - fz);
+
+	double v[2];
+	for (int k = 0; k < 2; k++)
+	{
+		double a = lattice(ix, iy, iz+k) +
+			tx*(lattice(ix+1, iy, iz+k) - lattice(ix, iy, iz+k));
+		double b = lattice(ix, iy+1, iz+k) +
+			tx*(lattice(ix+1, iy+1, iz+k) - lattice(ix, iy+1, iz+k));
+		v[k] = a + ty*(b - a);
+	}
+	return v[0] + tz*(v[1] - v[0]);
+}
+
+template <typename Settings>
+static double perlin(typename Calculon::Instance<Settings>::template Vector<3>* v)
+{
+	return valuenoise(v->x, v->y, v->z);
+}
+
+enum
+{
+	NOISE_SIZE = 128
+};
+
+template <typename Real>
+static Real clamp01(Real x)
+{
+	return (x > 0) ? ((x > 1) ? 1 : x) : 0;
+}
+
+template <typename Real>
+static void noisebaseline(vector<Real>& image)
+{
+	for (unsigned y = 0; y < NOISE_SIZE; y++)
+	{
+		for (unsigned x = 0; x < NOISE_SIZE; x++)
+		{
+			Real px = -1 + x*(2/(Real)NOISE_SIZE);
+			Real py = -1 + y*(2/(Real)NOISE_SIZE);
+			Real* c = &image[(y*NOISE_SIZE + x) * 3];
+			c[0] = clamp01((Real)valuenoise(px*4, py*4, 0));
+			c[1] = clamp01((Real)valuenoise(px*(Real)4.1, py*(Real)3.9, 0));
+			c[2] = clamp01((Real)valuenoise(px*(Real)3.9, py*(Real)4.1, 0));
+		}
+	}
+}
+
+template <typename Settings>
+static void noise(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+	typedef typename Compiler::template Vector<2> Vector2;
+	typedef typename Compiler::template Vector<3> Vector3;
+	typedef void NoiseFunction(Vector2* pos, Vector3* colour);
+	typedef typename Compiler::template Program<NoiseFunction> Program;
+
+	const size_t items = NOISE_SIZE * NOISE_SIZE;
+	const char* modes[] = { "scalar", "batch", "grid", "grid-threads" };
+	string code = readscript("noise.cal");
+	Calculon::Dispatch dispatch(threads);
+
+	vector<Real> image(items * 3);
+	vector<Real> positions(items * 2);
+	for (unsigned y = 0; y < NOISE_SIZE; y++)
+		for (unsigned x = 0; x < NOISE_SIZE; x++)
+		{
+			positions[(y*NOISE_SIZE + x)*2 + 0] = -1 + x*(2/(Real)NOISE_SIZE);
+			positions[(y*NOISE_SIZE + x)*2 + 1] = -1 + y*(2/(Real)NOISE_SIZE);
+		}
+	double baselinens = 0;
+
+	for (const char* mode : modes)
+	{
+		Result result = newresult("noise", mode, precision, items);
+		if (!wanted(result.name()))
+			continue;
+
+		if (!baselinens)
+			baselinens = measure([&] { noisebaseline(image); }, items);
+		result.baselinens = baselinens;
+
+		typename Compiler::StandardSymbolTable symbols;
+		symbols.add("perlin", "(vector*3): double", perlin<Settings>,
+			Compiler::PURE | Compiler::NOUNWIND | Compiler::WILLRETURN);
+
+		typename Compiler::Options options;
+		string m = mode;
+		if (m == "batch")
+			options.batch = true;
+		else if (m != "scalar")
+		{
+			options.grid = true;
+			options.inputLayouts["pos"] = Compiler::Layout::grid();
+		}
+		std::unique_ptr<Program> func(compile<Program>(symbols, code,
+			"(pos:vector*2): (colour: vector*3)", options, result));
+
+		Real grid[] = { -1, -1, 2/(Real)NOISE_SIZE, 0, 0, 2/(Real)NOISE_SIZE };
+		typename Compiler::Binding gridbindings[] = { grid, &image[0] };
+		typename Compiler::Binding batchbindings[] = { &positions[0], &image[0] };
+
+		result.ns = measure(
+			[&]
+			{
+				if (m == "scalar")
+				{
+					NoiseFunction* f = *func;
+					for (size_t i = 0; i < items; i++)
+					{
+						Vector2 pos;
+						Vector3 colour;
+						pos.x = positions[i*2 + 0];
+						pos.y = positions[i*2 + 1];
+						f(&pos, &colour);
+						image[i*3 + 0] = colour.x;
+						image[i*3 + 1] = colour.y;
+						image[i*3 + 2] = colour.z;
+					}
+				}
+				else if (m == "batch")
+					func->batch(0, items, batchbindings);
+				else if (m == "grid")
+					func->grid(0, 0, NOISE_SIZE, NOISE_SIZE, NOISE_SIZE,
+						gridbindings);
+				else
+					dispatch.grid(*func, NOISE_SIZE, NOISE_SIZE, NOISE_SIZE,
+						gridbindings, 8);
+			},
+			items, &result);
+
+		consume(image);
+		report(result);
+	}
+}
+
+/* --- Vector arithmetic --------------------------------------------------- */
+
+enum
+{
+	VECTOR_ITEMS = 1<<16
+};
+
+static const char* vectorscript =
+	"let l = sqrt(in.x*in.x + in.y*in.y + in.z*in.z) in\n"
+	"let out = in/l*2 + [1, 2, 3] in\n"
+	"return\n";
+
+template <typename Real>
+static void vectorbaseline(const vector<Real>& in, vector<Real>& out)
+{
+	for (size_t i = 0; i < VECTOR_ITEMS; i++)
+	{
+		const Real* v = &in[i*3];
+		Real l = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2]);
+		out[i*3 + 0] = v[0]/l*2 + 1;
+		out[i*3 + 1] = v[1]/l*2 + 2;
+		out[i*3 + 2] = v[2]/l*2 + 3;
+	}
+}
+
+template <typename Settings>
+static void vectors(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+	typedef typename Compiler::template Vector<3> Vector3;
+	typedef void VectorFunction(Vector3* in, Vector3* out);
+	typedef typename Compiler::template Program<VectorFunction> Program;
+
+	const char* modes[] = { "scalar", "batch", "soa", "batch-threads" };
+	Calculon::Dispatch dispatch(threads);
+
+	vector<Real> in(VECTOR_ITEMS * 3);
+	vector<Real> out(VECTOR_ITEMS * 3);
+	for (size_t i = 0; i < in.size(); i++)
+		in[i] = (Real)((i * 7919) % 1000) / 100 + 1;
+
+	/* The same data, a column per element. */
+
+	vector<Real> soain(VECTOR_ITEMS * 3);
+	for (size_t i = 0; i < VECTOR_ITEMS; i++)
+		for (unsigned j = 0; j < 3; j++)
+			soain[j*VECTOR_ITEMS + i] = in[i*3 + j];
+	void* icolumns[3];
+	void* ocolumns[3];
+	for (unsigned j = 0; j < 3; j++)
+	{
+		icolumns[j] = &soain[j*VECTOR_ITEMS];
+		ocolumns[j] = &out[j*VECTOR_ITEMS];
+	}
+	double baselinens = 0;
+
+	for (const char* mode : modes)
+	{
+		Result result = newresult("vector", mode, precision, VECTOR_ITEMS);
+		if (!wanted(result.name()))
+			continue;
+
+		if (!baselinens)
+			baselinens = measure([&] { vectorbaseline(in, out); }, VECTOR_ITEMS);
+		result.baselinens = baselinens;
+
+		typename Compiler::StandardSymbolTable symbols;
+		typename Compiler::Options options;
+		string m = mode;
+		if (m != "scalar")
+			options.batch = true;
+		if (m == "soa")
+		{
+			options.inputLayouts["in"] = Compiler::Layout::soa();
+			options.outputLayouts["out"] = Compiler::Layout::soa();
+		}
+		std::unique_ptr<Program> func(compile<Program>(symbols, vectorscript,
+			"(in: vector*3): (out: vector*3)", options, result));
+
+		typename Compiler::Binding aosbindings[] = { &in[0], &out[0] };
+		typename Compiler::Binding soabindings[] = { icolumns, ocolumns };
+
+		result.ns = measure(
+			[&]
+			{
+				if (m == "scalar")
+				{
+					VectorFunction* f = *func;
+					for (size_t i = 0; i < VECTOR_ITEMS; i++)
+					{
+						Vector3 v;
+						Vector3 o;
+						v.x = in[i*3 + 0];
+						v.y = in[i*3 + 1];
+						v.z = in[i*3 + 2];
+						f(&v, &o);
+						out[i*3 + 0] = o.x;
+						out[i*3 + 1] = o.y;
+						out[i*3 + 2] = o.z;
+					}
+				}
+				else if (m == "batch")
+					func->batch(0, VECTOR_ITEMS, aosbindings);
+				else if (m == "soa")
+					func->batch(0, VECTOR_ITEMS, soabindings);
+				else
+					dispatch.batch(*func, VECTOR_ITEMS, aosbindings, 1024);
+			},
+			VECTOR_ITEMS, &result);
+
+		consume(out);
+		report(result);
+	}
+}
+
+/* --- A generated script, with and without folding ----------------------- */
+
+enum
+{
+	GENERATED_TERMS = 100,
+	GENERATED_CALLS = 1<<16
+};
+
+/* Like the output of a code generator: long chains of lets, most of which
+ * depend only on globals, and conditionals and recursion on them. */
+
+static string generatedscript()
+{
+	std::stringstream s;
+	s << "let poly(n, t) = if n <= 0 then 1 else 1 + t*poly(n - 1, t) in\n";
+	for (unsigned i = 0; i < GENERATED_TERMS; i++)
+	{
+		string c = "c" + std::to_string(i);
+		string cp = i ? ("c" + std::to_string(i-1)) : "gain";
+		string yp = i ? ("y" + std::to_string(i-1)) : "x";
+		s << "let " << c << " = (" << cp << " * " << (i%7 + 1) << "/8"
+		  << " + sin(pi * " << i << " / " << GENERATED_TERMS << ")) / 2 in\n"
+		  << "let y" << i << " = " << yp << " * " << c
+		  << " + (if mode == " << (i%3) << " then poly(4, " << c << ")"
+		  << " else -" << c << ") in\n";
+	}
+	s << "let y = y" << (GENERATED_TERMS-1) << " in return\n";
+	return s.str();
+}
+
+template <typename Settings>
+static void generated(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+	typedef void GeneratedFunction(Real x, Real* y);
+	typedef typename Compiler::template Program<GeneratedFunction> Program;
+
+	const char* modes[] = { "fold", "nofold" };
+	string script = generatedscript();
+
+	for (const char* mode : modes)
+	{
+		Result result = newresult("generated", mode, precision,
+			GENERATED_CALLS);
+		if (!wanted(result.name()))
+			continue;
+
+		typename Compiler::StandardSymbolTable symbols;
+		symbols.add("gain", 1.5);
+		symbols.add("mode", 1);
+		typename Compiler::Options options;
+		options.fold = (string(mode) == "fold");
+		std::unique_ptr<Program> func(compile<Program>(symbols, script,
+			"(x: real): (y: real)", options, result));
+
+		vector<Real> out(1);
+		result.ns = measure(
+			[&]
+			{
+				GeneratedFunction* f = *func;
+				Real acc = 0;
+				for (unsigned i = 0; i < GENERATED_CALLS; i++)
+				{
+					Real y;
+					f((Real)(i & 1023) / 1024, &y);
+					acc += y;
+				}
+				out[0] = acc;
+			},
+			GENERATED_CALLS, &result);
+
+		consume(out);
+		report(result);
+	}
+}
+
+/* --- Maths functions and vector methods ---------------------------------- */
+
+enum
+{
+	MATH_ELEMENTS = 8192
+};
+
+static long double rsqrtl(long double x)
+{
+	return 1 / sqrtl(x);
+}
+
+struct MathFunction
+{
+	const char* name;
+	int params;
+	long double (*f1)(long double);
+	long double (*f2)(long double, long double);
+	long double (*f3)(long double, long double, long double);
+};
+
+static const MathFunction mathfunctions[] =
+{
+	#define REAL1(n) { #n, 1, n##l, NULL, NULL },
+	#define REAL2(n) { #n, 2, NULL, n##l, NULL },
+	#define REAL3(n) { #n, 3, NULL, NULL, n##l },
+	#include "calculon_libm.h"
+	#undef REAL1
+	#undef REAL2
+	#undef REAL3
+	{ "rsqrt", 1, rsqrtl, NULL, NULL },
+};
+
+/* The functions which can also be computed inline (see sin_fast etc). */
+
+static bool tiered(const string& name)
+{
+	static const char* names[] =
+		{ "atan2", "cos", "exp", "exp2", "log", "log2", "pow", "rsqrt",
+		  "sin", "sqrt" };
+	for (const char* n : names)
+		if (name == n)
+			return true;
+	return false;
+}
+
+/* Where each function's parameters are drawn from: somewhere interesting,
+ * and inside the domain. */
+
+static void mathdomain(const string& name, int param, double& lo, double& hi)
+{
+	lo = -10;
+	hi = 10;
+	if ((name == "acos") || (name == "asin") || (name == "atanh"))
+		lo = -1, hi = 1;
+	else if (name == "acosh")
+		lo = 1, hi = 100;
+	else if ((name == "log") || (name == "log2") || (name == "log10") ||
+			(name == "sqrt") || (name == "rsqrt"))
+		lo = 1e-3, hi = 1000;
+	else if (name == "log1p")
+		lo = -0.9, hi = 100;
+	else if ((name == "lgamma") || (name == "tgamma"))
+		lo = 0.1, hi = 10;
+	else if ((name == "j0") || (name == "j1") || (name == "y0") || (name == "y1"))
+		lo = 0.1, hi = 30;
+	else if ((name == "exp") || (name == "exp2") || (name == "expm1"))
+		lo = -30, hi = 30;
+	else if ((name == "sinh") || (name == "cosh"))
+		lo = -20, hi = 20;
+	else if (name == "tan")
+		lo = -1.5, hi = 1.5;
+	else if (name == "pow")
+	{
+		if (param == 0)
+			lo = 0.01, hi = 10;
+		else
+			lo = -5, hi = 5;
+	}
+	else if (((name == "fmod") || (name == "remainder")) && (param == 1))
+		lo = 0.5, hi = 5;
+}
+
+/* How far got is from want, in units in the last place of Real; infinite
+ * if one is a NaN or infinity and the other isn't. */
+
+template <typename Real>
+static double ulperror(Real got, long double want)
+{
+	if (isnan(want) || isnan(got))
+		return (isnan(want) && isnan(got)) ? 0 :
+			std::numeric_limits<double>::infinity();
+
+	Real rounded = (Real)want;
+	if (isinf(rounded) || isinf(got))
+		return (got == rounded) ? 0 : std::numeric_limits<double>::infinity();
+
+	int e = std::numeric_limits<Real>::min_exponent - 1;
+	if (rounded != 0)
+		e = std::max(e, ilogb(rounded));
+	long double ulp = ldexpl(1, e - (std::numeric_limits<Real>::digits - 1));
+	return fabsl((long double)got - want) / ulp;
+}
+
+template <typename Real>
+static void accumulate(Result& result, Real got, long double want)
+{
+	double e = ulperror(got, want);
+	if (isinf(e))
+		result.mismatches++;
+	else
+		result.maxulp = std::max(result.maxulp, e);
+}
+
+static uint64_t lcg(uint64_t& seed)
+{
+	seed = seed*6364136223846793005ULL + 1442695040888963407ULL;
+	return seed >> 11;
+}
+
+static string widthtype(unsigned width)
+{
+	return (width == 1) ? string("real") : ("vector*" + std::to_string(width));
+}
+
+template <typename Settings>
+static void math(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+	typedef void MathsFunction();
+	typedef typename Compiler::template Program<MathsFunction> Program;
+
+	const unsigned widths[] = { 1, 4, 8 };
+	const char* tiers[] = { "libm", "ulp1", "ulp4", "fast" };
+	double seconds = mintime / 10;
+
+	vector<Real> in[3];
+	for (int p = 0; p < 3; p++)
+		in[p].resize(MATH_ELEMENTS);
+	vector<Real> out(MATH_ELEMENTS);
+
+	for (const MathFunction& f : mathfunctions)
+	{
+		for (int p = 0; p < f.params; p++)
+		{
+			double lo;
+			double hi;
+			mathdomain(f.name, p, lo, hi);
+			uint64_t seed = p + 1;
+			for (Real& v : in[p])
+				v = lo + (hi - lo) * ((double)lcg(seed) / (1ULL<<53));
+		}
+
+		for (const char* tier : tiers)
+		{
+			if (!tiered(f.name) && (string(tier) != "libm"))
+				continue;
+
+			for (unsigned width : widths)
+			{
+				Result result = newresult(string("math/") + f.name,
+					string(tier) + "-" + widthtype(width), precision,
+					MATH_ELEMENTS);
+				if (!wanted(result.name()))
+					continue;
+
+				string type = widthtype(width);
+				string signature = "(";
+				string call = f.name;
+				if (tiered(f.name))
+					call += string("_") + tier;
+				call += "(";
+				for (int p = 0; p < f.params; p++)
+				{
+					string name(1, 'a' + p);
+					signature += (p ? ", " : "") + name + ": " + type;
+					call += (p ? ", " : "") + name;
+				}
+				signature += "): (y: " + type + ")";
+				call += ")";
+
+				typename Compiler::StandardSymbolTable symbols;
+				typename Compiler::Options options;
+				options.batch = true;
+				std::unique_ptr<Program> func(compile<Program>(symbols,
+					"let y = " + call + " in return", signature, options,
+					result));
+
+				vector<typename Compiler::Binding> bindings;
+				for (int p = 0; p < f.params; p++)
+					bindings.push_back(&in[p][0]);
+				bindings.push_back(&out[0]);
+
+				result.ns = measure(
+					[&]
+					{
+						func->batch(0, MATH_ELEMENTS / width, &bindings[0]);
+					},
+					MATH_ELEMENTS, &result, seconds);
+
+				for (size_t i = 0; i < MATH_ELEMENTS; i++)
+				{
+					long double want;
+					if (f.params == 1)
+						want = f.f1(in[0][i]);
+					else if (f.params == 2)
+						want = f.f2(in[0][i], in[1][i]);
+					else
+						want = f.f3(in[0][i], in[1][i], in[2][i]);
+					accumulate(result, out[i], want);
+				}
+				report(result);
+			}
+		}
+	}
+
+	/* Vector methods and indexing, timed per element of the vector. The
+	 * sum is checked against the exact sum, so cancellation between
+	 * elements shows up as a large error relative to a small result.
+	 * .length is left out, as it's a compile time constant. */
+
+	static const struct
+	{
+		const char* name;
+		const char* script;
+	}
+	methods[] =
+	{
+		{ "sum",      "let y = x.sum in return" },
+		{ "element",  "let y = x[1] in return" },
+		{ "index",    "let y = x[n] in return" },
+	};
+
+	vector<int32_t> indices(MATH_ELEMENTS);
+	uint64_t seed = 1;
+	for (Real& v : in[0])
+		v = -10 + 20 * ((double)lcg(seed) / (1ULL<<53));
+	for (int32_t& n : indices)
+		n = lcg(seed) % 32;
+
+	for (const auto& m : methods)
+	{
+		for (unsigned width : widths)
+		{
+			if (width == 1)
+				continue;
+
+			Result result = newresult(string("math/") + m.name,
+				widthtype(width), precision, MATH_ELEMENTS);
+			if (!wanted(result.name()))
+				continue;
+
+			bool index = (string(m.name) == "index");
+			string signature = "(x: " + widthtype(width) +
+				(index ? ", n: int" : "") + "): (y: real)";
+
+			typename Compiler::StandardSymbolTable symbols;
+			typename Compiler::Options options;
+			options.batch = true;
+			std::unique_ptr<Program> func(compile<Program>(symbols,
+				m.script, signature, options, result));
+
+			size_t items = MATH_ELEMENTS / width;
+			vector<typename Compiler::Binding> bindings;
+			bindings.push_back(&in[0][0]);
+			if (index)
+				bindings.push_back(&indices[0]);
+			bindings.push_back(&out[0]);
+
+			result.ns = measure(
+				[&]
+				{
+					func->batch(0, items, &bindings[0]);
+				},
+				MATH_ELEMENTS, &result, seconds);
+
+			for (size_t i = 0; i < items; i++)
+			{
+				const Real* v = &in[0][i * width];
+				long double want = 0;
+				if (string(m.name) == "sum")
+				{
+					for (unsigned j = 0; j < width; j++)
+						want += v[j];
+				}
+				else if (string(m.name) == "element")
+					want = v[1];
+				else
+					want = v[indices[i] % width];
+				accumulate(result, out[i], want);
+			}
+			report(result);
+		}
+	}
+}
+
+/* --- JSON ---------------------------------------------------------------- */
+
+static string number(double d)
+{
+	if (d < 0)
+		return "null";
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.4f", d);
+	return buffer;
+}
+
+static void writejson(const string& filename)
+{
+	std::ofstream f(filename.c_str());
+	f << "{\n"
+	  << "  \"format\": 1,\n"
+	  << "  \"llvm\": \"" << LLVM_VERSION_STRING << "\",\n"
+	  << "  \"threads\": " << Calculon::Dispatch(threads).threads() << ",\n"
+	  << "  \"counters\": " << (counters.available() ? "true" : "false") << ",\n"
+	  << "  \"results\": [\n";
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		f << "    {\n"
+		  << "      \"name\": \"" << r.name() << "\",\n"
+		  << "      \"workload\": \"" << r.workload << "\",\n"
+		  << "      \"mode\": \"" << r.mode << "\",\n"
+		  << "      \"precision\": \"" << r.precision << "\",\n"
+		  << "      \"items\": " << r.items << ",\n"
+		  << "      \"compile_ms\": " << number(r.compilems) << ",\n"
+		  << "      \"ns_per_item\": " << number(r.ns) << ",\n"
+		  << "      \"items_per_second\": " << number(1e9 / r.ns) << ",\n"
+		  << "      \"baseline_ns_per_item\": "
+		  << number(r.baselinens ? r.baselinens : -1) << ",\n"
+		  << "      \"baseline_ratio\": "
+		  << number(r.baselinens ? (r.ns / r.baselinens) : -1) << ",\n"
+		  << "      \"cycles_per_item\": " << number(r.cycles) << ",\n"
+		  << "      \"instructions_per_item\": " << number(r.instructions) << ",\n"
+		  << "      \"max_ulp\": " << number(r.maxulp) << ",\n"
+		  << "      \"mismatches\": " << r.mismatches << "\n"
+		  << "    }" << ((i+1) < results.size() ? "," : "") << "\n";
+	}
+
+	f << "  ]\n"
+	  << "}\n";
+}
+
+int main(int argc, const char* argv[])
+{
+	string jsonfilename;
+
+	string argv0 = argv[0];
+	string::size_type slash = argv0.rfind('/');
+	if (slash != string::npos)
+		scriptdir = argv0.substr(0, slash);
+
+	po::options_description options("Allowed options");
+	options.add_options()
+	    ("help,h",
+	    		"produce help message")
+	    ("json,o",    po::value(&jsonfilename),
+	    		"also write the results to this JSON file")
+	    ("filter,F",  po::value(&filter),
+	    		"only run cases whose names contain this (e.g. fractal/grid)")
+	    ("time,t",    po::value(&mintime),
+	    		"minimum seconds to spend timing each case")
+	    ("threads,j", po::value(&threads),
+	    		"threads for the *-threads modes (0 means one per CPU)")
+	    ("scripts,s", po::value(&scriptdir),
+	    		"directory containing fractal.cal and noise.cal")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, options), vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+		std::cout << options << "\n"
+			"Times are the best of several runs, per item (one call, pixel,\n"
+			"vector or, for the maths cases, element); C++ is a hand-written\n"
+			"equivalent and x is how many times slower Calculon is. Errors are\n"
+			"against long double versions of the same functions.\n";
+		exit(1);
+	}
+
+	if (!counters.available())
+		std::cout << "(hardware counters are not available)\n";
+
+	latency<Calculon::RealIsFloat>("float");
+	latency<Calculon::RealIsDouble>("double");
+	fractal<Calculon::RealIsFloat>("float");
+	fractal<Calculon::RealIsDouble>("double");
+	noise<Calculon::RealIsFloat>("float");
+	noise<Calculon::RealIsDouble>("double");
+	vectors<Calculon::RealIsFloat>("float");
+	vectors<Calculon::RealIsDouble>("double");
+	generated<Calculon::RealIsFloat>("float");
+	generated<Calculon::RealIsDouble>("double");
+	math<Calculon::RealIsFloat>("float");
+	math<Calculon::RealIsDouble>("double");
+
+	if (!jsonfilename.empty())
+		writejson(jsonfilename);
+
+	return 0;
+}
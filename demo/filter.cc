@@ -4,8 +4,20 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
 #include <math.h>
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string/split.hpp>
@@ -25,57 +37,1512 @@ enum
 	MAX_VECTOR_ELEMENTS = 16
 };
 
+static bool parsenumber(const string& s, double& d)
+{
+    const char* p = s.c_str();
+    char* endp;
+    d = strtod(p, &endp);
+    if (*endp)
+        return false;
+    return true;
+}
+
+/* from_chars() is much faster than strtod(), but doesn't allow a leading +
+ * or hex; anything it doesn't like gets a second chance with strtod(), so
+ * exactly the same things are accepted. */
+
+static bool parsenumber(const char* p, const char* end, double& d)
+{
+    const char* q = p;
+    if ((q != end) && (*q == '+') && ((q+1) != end) && (q[1] != '-'))
+        q++;
+
+    std::from_chars_result r = std::from_chars(q, end, d);
+    if ((r.ec == std::errc()) && (r.ptr == end))
+        return true;
+
+    return parsenumber(string(p, end), d);
+}
+
+/* Input and output go through big buffers rather than iostreams, which
+ * otherwise dominate the runtime on big inputs. Numbers are either text
+ * (whitespace separated, or CSV or TSV with a header line) or raw
+ * little-endian float32 or float64 values; files given with --input and
+ * --output are memory-mapped rather than read and written. */
+
+enum NumberFormat
+{
+    FORMAT_TEXT = 0,
+    FORMAT_CSV = 1,
+    FORMAT_TSV = 2,
+    FORMAT_FLOAT32 = 4, /* raw formats are their size in bytes */
+    FORMAT_FLOAT64 = 8
+};
+
+static bool israw(NumberFormat format)
+{
+    return (format == FORMAT_FLOAT32) || (format == FORMAT_FLOAT64);
+}
+
+static bool istable(NumberFormat format)
+{
+    return (format == FORMAT_CSV) || (format == FORMAT_TSV);
+}
+
+static bool parseformat(const string& s, NumberFormat& format)
+{
+    if (s == "text")
+        format = FORMAT_TEXT;
+    else if (s == "csv")
+        format = FORMAT_CSV;
+    else if (s == "tsv")
+        format = FORMAT_TSV;
+    else if (s == "float32")
+        format = FORMAT_FLOAT32;
+    else if (s == "float64")
+        format = FORMAT_FLOAT64;
+    else
+        return false;
+    return true;
+}
+
+static const bool LITTLE_ENDIAN_HOST =
+    (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+template <typename T>
+static T swaplittle(T value)
+{
+    if (!LITTLE_ENDIAN_HOST)
+    {
+        char* p = (char*)&value;
+        std::reverse(p, p + sizeof(T));
+    }
+    return value;
+}
+
+static void ioerror(const string& what, const string& filename)
+{
+    std::cerr << "filter: " << what << " '" << filename << "': "
+              << strerror(errno) << "\n";
+    exit(1);
+}
+
+class NumberWriter
+{
+public:
+    /* With no file, everything is kept in memory; see data(). */
+
+    NumberWriter(FILE* fp = NULL, size_t buffersize = BUFFER_SIZE):
+        _fp(fp),
+        _fd(-1),
+        _format(FORMAT_TEXT),
+        _buffer(buffersize),
+        _data(&_buffer[0]),
+        _capacity(_buffer.size()),
+        _pos(0),
+        _count(0)
+    {
+    }
+
+    ~NumberWriter()
+    {
+        close();
+    }
+
+    void setformat(NumberFormat format)
+    {
+        _format = format;
+    }
+
+    NumberFormat format() const
+    {
+        return _format;
+    }
+
+    /* Writes to a memory-mapped file instead, which grows as needed. */
+
+    void open(const string& filename)
+    {
+        _filename = filename;
+        _fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (_fd == -1)
+            ioerror("can't open", filename);
+        _data = NULL;
+        _capacity = 0;
+        _pos = 0;
+    }
+
+    /* Separators only exist in text. */
+
+    void put(char c)
+    {
+        if (israw(_format))
+            return;
+        if (_pos == _capacity)
+            makeroom(1);
+        _data[_pos++] = c;
+    }
+
+    template <typename Real>
+    void number(Real d)
+    {
+        if ((_capacity - _pos) < MAX_NUMBER_SIZE)
+            makeroom(MAX_NUMBER_SIZE);
+
+        char* p = _data + _pos;
+        switch (_format)
+        {
+            case FORMAT_FLOAT32:
+            {
+                float f = swaplittle((float)d);
+                memcpy(p, &f, sizeof(f));
+                p += sizeof(f);
+                break;
+            }
+
+            case FORMAT_FLOAT64:
+            {
+                double f = swaplittle((double)d);
+                memcpy(p, &f, sizeof(f));
+                p += sizeof(f);
+                break;
+            }
+
+            case FORMAT_TEXT:
+            case FORMAT_CSV:
+            case FORMAT_TSV:
+                switch (fpclassify(d))
+                {
+                    case FP_NAN:
+                        p = append(p, "nan");
+                        break;
+
+                    case FP_INFINITE:
+                        p = append(p, (d < 0) ? "-inf" : "+inf");
+                        break;
+
+                    default:
+                        /* Just like stream << d. */
+                        p = std::to_chars(p, _data + _capacity, d,
+                            std::chars_format::general, 6).ptr;
+                }
+                break;
+        }
+        _pos = p - _data;
+        _count++;
+    }
+
+    /* Writes a column name, for CSV and TSV headers. */
+
+    void name(const string& s)
+    {
+        makeroom(s.size());
+        memcpy(_data + _pos, s.data(), s.size());
+        _pos += s.size();
+    }
+
+    /* Goes between numbers on a line. */
+
+    char separator() const
+    {
+        switch (_format)
+        {
+            case FORMAT_CSV: return ',';
+            case FORMAT_TSV: return '\t';
+            default:         return ' ';
+        }
+    }
+
+    /* Returns space for `count` raw numbers to be written directly. */
+
+    char* reserve(size_t count)
+    {
+        size_t bytes = count * _format;
+        makeroom(bytes);
+        char* p = _data + _pos;
+        _pos += bytes;
+        _count += count;
+        return p;
+    }
+
+    /* Copies out numbers written by another writer. */
+
+    void write(const char* p, size_t bytes, uint64_t count)
+    {
+        makeroom(bytes);
+        memcpy(_data + _pos, p, bytes);
+        _pos += bytes;
+        _count += count;
+    }
+
+    const char* data() const
+    {
+        return _data;
+    }
+
+    size_t size() const
+    {
+        return _pos;
+    }
+
+    void clear()
+    {
+        _pos = 0;
+        _count = 0;
+    }
+
+    void flush()
+    {
+        if ((_fd != -1) || !_fp)
+            return;
+        fwrite(_data, 1, _pos, _fp);
+        fflush(_fp);
+        _pos = 0;
+    }
+
+    void close()
+    {
+        flush();
+        if (_fd == -1)
+            return;
+
+        if (_data)
+            munmap(_data, _capacity);
+        if (ftruncate(_fd, _pos) == -1)
+            ioerror("can't write", _filename);
+        ::close(_fd);
+        _fd = -1;
+        _data = &_buffer[0];
+        _capacity = _buffer.size();
+        _pos = 0;
+    }
+
+    uint64_t count() const
+    {
+        return _count;
+    }
+
+private:
+    enum
+    {
+        BUFFER_SIZE = 1<<20,
+        MAX_NUMBER_SIZE = 32
+    };
+
+    static char* append(char* p, const char* s)
+    {
+        while (*s)
+            *p++ = *s++;
+        return p;
+    }
+
+    /* Makes sure there are at least `bytes` free after _pos. */
+
+    void makeroom(size_t bytes)
+    {
+        if ((_capacity - _pos) >= bytes)
+            return;
+
+        if (_fd == -1)
+        {
+            flush();
+            if ((_pos + bytes) > _buffer.size())
+                _buffer.resize(std::max(_buffer.size() * 2, _pos + bytes));
+            _data = &_buffer[0];
+            _capacity = _buffer.size();
+            return;
+        }
+
+        size_t capacity = std::max(_capacity * 2, (size_t)BUFFER_SIZE * 64);
+        while ((capacity - _pos) < bytes)
+            capacity *= 2;
+
+        if (_data)
+            munmap(_data, _capacity);
+        if (ftruncate(_fd, capacity) == -1)
+            ioerror("can't write", _filename);
+        void* p = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+            _fd, 0);
+        if (p == MAP_FAILED)
+            ioerror("can't map", _filename);
+        _data = (char*)p;
+        _capacity = capacity;
+    }
+
+    FILE* _fp;
+    int _fd;
+    string _filename;
+    NumberFormat _format;
+    vector<char> _buffer;
+    char* _data;
+    size_t _capacity;
+    size_t _pos;
+    uint64_t _count;
+};
+
+class NumberReader
+{
+public:
+    NumberReader(FILE* fp):
+        _fp(fp),
+        _format(FORMAT_TEXT),
+        _buffer(BUFFER_SIZE),
+        _data(&_buffer[0]),
+        _mapped(0),
+        _pos(0),
+        _end(0),
+        _eof(false),
+        _malformed(false),
+        _count(0)
+    {
+    }
+
+    /* Reads from memory which the caller keeps alive. */
+
+    NumberReader(const char* data, size_t size, NumberFormat format):
+        _fp(NULL),
+        _format(format),
+        _data((char*)data),
+        _mapped(0),
+        _pos(0),
+        _end(size),
+        _eof(true),
+        _malformed(false),
+        _count(0)
+    {
+    }
+
+    ~NumberReader()
+    {
+        if (_mapped)
+            munmap(_data, _mapped);
+    }
+
+    void setformat(NumberFormat format)
+    {
+        _format = format;
+    }
+
+    NumberFormat format() const
+    {
+        return _format;
+    }
+
+    /* Reads from a memory-mapped file instead. */
+
+    void open(const string& filename)
+    {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd == -1)
+            ioerror("can't open", filename);
+
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            ioerror("can't read", filename);
+        if (st.st_size)
+        {
+            void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+                ioerror("can't map", filename);
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            _data = (char*)p;
+            _mapped = st.st_size;
+        }
+        ::close(fd);
+
+        _pos = 0;
+        _end = _mapped;
+        _eof = true;
+        _started = std::chrono::steady_clock::now();
+    }
+
+    /* Returns false at the end of the input. */
+
+    bool read(double& d)
+    {
+        if (israw(_format))
+            return readraw(d);
+
+        for (;;)
+        {
+            while ((_pos != _end) && isspace((unsigned char)_data[_pos]))
+                _pos++;
+            if (_pos == _end)
+            {
+                if (!fill())
+                    return false;
+                continue;
+            }
+
+            /* Make sure the whole number is in the buffer. */
+
+            size_t e = _pos;
+            while ((e != _end) && !isspace((unsigned char)_data[e]))
+                e++;
+            if ((e == _end) && !_eof)
+            {
+                fill();
+                continue;
+            }
+
+            if (!parsenumber(_data + _pos, _data + e, d))
+                return false;
+            _pos = e;
+            _count++;
+            return true;
+        }
+    }
+
+    /* Reads the names from a CSV or TSV header line. */
+
+    bool readheader(vector<string>& names)
+    {
+        names.clear();
+        if (!readfields())
+            return false;
+
+        for (const Field& f : _fields)
+        {
+            const char* p = f.first;
+            const char* e = f.second;
+            if (((e - p) >= 2) && (*p == '"') && (e[-1] == '"'))
+            {
+                p++;
+                e--;
+            }
+            names.push_back(string(p, e));
+        }
+        return true;
+    }
+
+    /* Reads one CSV or TSV line of numbers. Returns false at the end of the
+     * input, or if a number is malformed. */
+
+    bool readrow(vector<double>& values)
+    {
+        values.clear();
+        if (!readfields())
+            return false;
+
+        for (const Field& f : _fields)
+        {
+            double d;
+            if (!parsenumber(f.first, f.second, d))
+            {
+                _malformed = true;
+                return false;
+            }
+            values.push_back(d);
+            _count++;
+        }
+        return true;
+    }
+
+    /* Returns all the remaining raw input in one piece. */
+
+    const char* rest(size_t& bytes)
+    {
+        while (fill())
+            ;
+        const char* p = _data + _pos;
+        bytes = _end - _pos;
+        _count += bytes / _format;
+        _pos = _end;
+        return p;
+    }
+
+    /* Takes the next chunk of about `size` bytes of raw input, ending at
+     * the end of a row of `values` numbers (or of a line for CSV and TSV),
+     * so that chunks can be parsed independently. Returns false at the end
+     * of the input. */
+
+    bool readchunk(vector<char>& chunk, size_t values, size_t size)
+    {
+        size_t length = 0;
+        if (israw(_format))
+        {
+            size_t rowsize = values * _format;
+            length = std::max((size_t)1, size / rowsize) * rowsize;
+            while (((_end - _pos) < length) && fill())
+                ;
+        }
+        else if (istable(_format))
+        {
+            for (;;)
+            {
+                const char* nl = NULL;
+                if ((_end - _pos) > size)
+                    nl = (const char*)memchr(_data + _pos + size, '\n',
+                        _end - _pos - size);
+                if (nl)
+                {
+                    length = nl + 1 - (_data + _pos);
+                    break;
+                }
+                if (!fill())
+                    break;
+            }
+        }
+        else
+        {
+            /* Cut just before a token which starts a row. */
+
+            size_t i = 0;
+            uint64_t tokens = 0;
+            bool intoken = false;
+            for (;;)
+            {
+                if ((_pos + i) == _end)
+                {
+                    if (!fill())
+                        break;
+                    continue;
+                }
+
+                bool space = isspace((unsigned char)_data[_pos + i]);
+                if (!space && !intoken)
+                {
+                    if (tokens && !(tokens % values) && (i >= size))
+                    {
+                        length = i;
+                        break;
+                    }
+                    tokens++;
+                }
+                intoken = !space;
+                i++;
+            }
+        }
+
+        if (!length || (length > (_end - _pos)))
+            length = _end - _pos;
+        if (!length)
+            return false;
+
+        chunk.assign(_data + _pos, _data + _pos + length);
+        _pos += length;
+        return true;
+    }
+
+    bool malformed() const
+    {
+        return _malformed || (_pos != _end);
+    }
+
+    uint64_t count() const
+    {
+        return _count;
+    }
+
+    /* Adds numbers read by another reader. */
+
+    void counted(uint64_t count)
+    {
+        _count += count;
+    }
+
+    /* When the first number was asked for. */
+
+    std::chrono::steady_clock::time_point started() const
+    {
+        return _started;
+    }
+
+private:
+    enum
+    {
+        BUFFER_SIZE = 1<<20
+    };
+
+    typedef std::pair<const char*, const char*> Field;
+
+    /* Splits the next non-blank line into _fields, trimming spaces and any
+     * \r. */
+
+    bool readfields()
+    {
+        char separator = (_format == FORMAT_TSV) ? '\t' : ',';
+        for (;;)
+        {
+            const char* nl;
+            for (;;)
+            {
+                nl = (const char*)memchr(_data + _pos, '\n', _end - _pos);
+                if (nl || !fill())
+                    break;
+            }
+            if (!nl && (_pos == _end))
+                return false;
+
+            const char* p = _data + _pos;
+            const char* end = nl ? nl : (_data + _end);
+            _pos = nl ? (nl + 1 - _data) : _end;
+
+            _fields.clear();
+            for (;;)
+            {
+                const char* e = (const char*)memchr(p, separator, end - p);
+                const char* q = e ? e : end;
+                const char* fp = p;
+                const char* fe = q;
+                while ((fp != fe) && isspace((unsigned char)*fp))
+                    fp++;
+                while ((fe != fp) && isspace((unsigned char)fe[-1]))
+                    fe--;
+                _fields.push_back(Field(fp, fe));
+                if (!e)
+                    break;
+                p = e + 1;
+            }
+
+            if ((_fields.size() > 1) || (_fields[0].first != _fields[0].second))
+                return true;
+        }
+    }
+
+    bool readraw(double& d)
+    {
+        while (((_end - _pos) < (size_t)_format) && fill())
+            ;
+        if ((_end - _pos) < (size_t)_format)
+            return false; /* any partial value left over is malformed */
+
+        if (_format == FORMAT_FLOAT32)
+        {
+            float f;
+            memcpy(&f, _data + _pos, sizeof(f));
+            d = swaplittle(f);
+        }
+        else
+        {
+            double f;
+            memcpy(&f, _data + _pos, sizeof(f));
+            d = swaplittle(f);
+        }
+        _pos += _format;
+        _count++;
+        return true;
+    }
+
+    /* Moves any partial number to the start of the buffer and reads more
+     * after it. Returns false if there was no more. */
+
+    bool fill()
+    {
+        if (_started == std::chrono::steady_clock::time_point())
+            _started = std::chrono::steady_clock::now();
+        if (_eof)
+            return false;
+
+        size_t remaining = _end - _pos;
+        memmove(&_buffer[0], &_buffer[_pos], remaining);
+        _pos = 0;
+        _end = remaining;
+        if (_end == _buffer.size())
+            _buffer.resize(_buffer.size() * 2);
+        _data = &_buffer[0];
+
+        size_t n = fread(&_buffer[_end], 1, _buffer.size() - _end, _fp);
+        _end += n;
+        if (!n)
+            _eof = true;
+        return (n != 0);
+    }
+
+    FILE* _fp;
+    NumberFormat _format;
+    vector<char> _buffer;
+    char* _data;
+    size_t _mapped;
+    size_t _pos;
+    size_t _end;
+    bool _eof;
+    bool _malformed;
+    uint64_t _count;
+    vector<Field> _fields;
+    std::chrono::steady_clock::time_point _started;
+};
+
+static NumberReader input(stdin);
+static NumberWriter output(stdout);
+
+/* Bad input data stops processing once everything before it has been
+ * written out; a partial row at the end isn't fatal. */
+
+class DataError : public std::runtime_error
+{
+public:
+    DataError(const string& what, bool fatal):
+        std::runtime_error(what),
+        fatal(fatal)
+    {
+    }
+
+    bool fatal;
+};
+
+static void malformednumber()
+{
+    throw DataError("malformed number in input data", true);
+}
+
 template <typename Real>
-static bool parsenumber(const string& s, Real& d)
+static bool readnumber(NumberReader& reader, Real& d)
+{
+    double v;
+    if (!reader.read(v))
+    {
+        if (reader.malformed())
+            malformednumber();
+        return false;
+    }
+
+    d = v;
+    return true;
+}
+
+static void partialrow()
+{
+    throw DataError("found partial row, aborting", false);
+}
+
+/* Runs fn over all the input, writing to the output. With --threads, the
+ * input is cut into chunks of whole rows of `values` numbers, which are
+ * parsed, run and formatted in parallel a round at a time and then written
+ * out in order; only one round of chunks is ever in memory, so unbounded
+ * input is fine. */
+
+typedef std::function<void (NumberReader& reader, NumberWriter& writer)>
+    ChunkFunction;
+
+enum
+{
+    CHUNK_SIZE = 16<<10,
+    CHUNKS_PER_THREAD = 8
+};
+
+static size_t chunksize = CHUNK_SIZE;
+
+/* If set, calls to the program are counted and some of them timed. */
+
+static Calculon::Stats* stats = NULL;
+
+/* If set, compilation and the work done by each thread are recorded. */
+
+static Calculon::Trace* trace = NULL;
+
+/* If set, a sample of the calls to the program is recorded for replaying. */
+
+static Calculon::Capture* capture = NULL;
+
+/* Cleared by --no-fold, to compile the script exactly as written. */
+
+static bool fold = true;
+
+struct Chunk
+{
+    vector<char> data;
+    NumberWriter writer;
+    uint64_t count;
+    std::exception_ptr error;
+
+    Chunk():
+        writer(NULL, CHUNK_SIZE),
+        count(0)
+    {
+    }
+};
+
+static void filterdata(unsigned threads, size_t values, const ChunkFunction& fn)
+{
+    if (threads <= 1)
+    {
+        fn(input, output);
+        return;
+    }
+
+    Calculon::Dispatch dispatch(threads, false, trace);
+    vector<Chunk> chunks(threads * CHUNKS_PER_THREAD);
+    for (;;)
+    {
+        size_t n = 0;
+        while ((n < chunks.size()) &&
+                input.readchunk(chunks[n].data, values, chunksize))
+            n++;
+        if (!n)
+            return;
+
+        dispatch.run(n,
+            [&](size_t start, size_t count)
+            {
+                for (size_t i = start; i < (start+count); i++)
+                {
+                    Chunk& chunk = chunks[i];
+                    NumberReader reader(chunk.data.data(), chunk.data.size(),
+                        input.format());
+                    chunk.writer.setformat(output.format());
+                    chunk.writer.clear();
+                    chunk.error = NULL;
+                    try
+                    {
+                        fn(reader, chunk.writer);
+                    }
+                    catch (...)
+                    {
+                        chunk.error = std::current_exception();
+                    }
+                    chunk.count = reader.count();
+                }
+            });
+
+        for (size_t i = 0; i < n; i++)
+        {
+            Chunk& chunk = chunks[i];
+            input.counted(chunk.count);
+            output.write(chunk.writer.data(), chunk.writer.size(),
+                chunk.writer.count());
+            if (chunk.error)
+                std::rethrow_exception(chunk.error);
+        }
+    }
+}
+
+/* With --storage, vector elements are passed to and from the script in this
+ * format; the raw stored values are what's read and written. */
+
+enum StorageFormat
+{
+    STORE_REAL,
+    STORE_HALF,
+    STORE_FLOAT,
+    STORE_DOUBLE,
+    STORE_UINT8,
+    STORE_INT8,
+    STORE_UINT16,
+    STORE_INT16
+};
+
+static bool parsestorage(string s, StorageFormat& format)
+{
+    const string suffix = " normalized";
+    bool normalized = false;
+    if ((s.size() > suffix.size()) &&
+        (s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0))
+    {
+        normalized = true;
+        s.erase(s.size() - suffix.size());
+    }
+
+    if (s == "uint8")
+        format = STORE_UINT8;
+    else if (s == "int8")
+        format = STORE_INT8;
+    else if (s == "uint16")
+        format = STORE_UINT16;
+    else if (s == "int16")
+        format = STORE_INT16;
+    else if (normalized)
+        return false;
+    else if (s == "")
+        format = STORE_REAL;
+    else if (s == "half")
+        format = STORE_HALF;
+    else if (s == "float")
+        format = STORE_FLOAT;
+    else if (s == "double")
+        format = STORE_DOUBLE;
+    else
+        return false;
+    return true;
+}
+
+template <typename Real>
+static void putelement(StorageFormat format, void* p, size_t i, double d)
+{
+    switch (format)
+    {
+        case STORE_REAL:   ((Real*)p)[i] = d; break;
+        case STORE_HALF:   ((_Float16*)p)[i] = d; break;
+        case STORE_FLOAT:  ((float*)p)[i] = d; break;
+        case STORE_DOUBLE: ((double*)p)[i] = d; break;
+        case STORE_UINT8:  ((uint8_t*)p)[i] = d; break;
+        case STORE_INT8:   ((int8_t*)p)[i] = d; break;
+        case STORE_UINT16: ((uint16_t*)p)[i] = d; break;
+        case STORE_INT16:  ((int16_t*)p)[i] = d; break;
+    }
+}
+
+template <typename Real>
+static double getelement(StorageFormat format, const void* p, size_t i)
+{
+    switch (format)
+    {
+        case STORE_REAL:   return ((const Real*)p)[i];
+        case STORE_HALF:   return ((const _Float16*)p)[i];
+        case STORE_FLOAT:  return ((const float*)p)[i];
+        case STORE_DOUBLE: return ((const double*)p)[i];
+        case STORE_UINT8:  return ((const uint8_t*)p)[i];
+        case STORE_INT8:   return ((const int8_t*)p)[i];
+        case STORE_UINT16: return ((const uint16_t*)p)[i];
+        case STORE_INT16:  return ((const int16_t*)p)[i];
+    }
+    return 0;
+}
+
+template <typename Real>
+static size_t elementsize(StorageFormat format)
+{
+    switch (format)
+    {
+        case STORE_REAL:   return sizeof(Real);
+        case STORE_HALF:   return sizeof(_Float16);
+        case STORE_FLOAT:  return sizeof(float);
+        case STORE_DOUBLE: return sizeof(double);
+        case STORE_UINT8:  return sizeof(uint8_t);
+        case STORE_INT8:   return sizeof(int8_t);
+        case STORE_UINT16: return sizeof(uint16_t);
+        case STORE_INT16:  return sizeof(int16_t);
+    }
+    return 0;
+}
+
+/* With --layout, all the rows are read first and then processed with a
+ * single batch call, with the buffers arranged like this. */
+
+enum
+{
+    AOSOA_BLOCK = 8
+};
+
+static size_t layoutindex(const string& layout, size_t rows, unsigned vsize,
+        size_t row, unsigned element)
+{
+    if (layout == "soa")
+        return element*rows + row;
+    if (layout == "aosoa")
+        return (row/AOSOA_BLOCK)*AOSOA_BLOCK*vsize + element*AOSOA_BLOCK +
+            (row % AOSOA_BLOCK);
+    return row*vsize + element;
+}
+
+template <typename Compiler>
+static typename Compiler::Layout make_layout(const string& layout,
+        unsigned vsize, size_t esize)
+{
+    if (layout == "soa")
+        return Compiler::Layout::soa();
+    if (layout == "aosoa")
+        return Compiler::Layout::aosoa(AOSOA_BLOCK);
+    return Compiler::Layout::aos(vsize * esize);
+}
+
+/* With --counters, scripts may also call twice(x), which has an array form
+ * for batch calls, and tally(x), which hasn't. Both count their calls, and
+ * the counts are written to stderr at the end, showing what batch calls do
+ * with external functions. */
+
+static bool counters = false;
+static std::atomic<uint64_t> twicecalls(0);
+static std::atomic<uint64_t> twicearraycalls(0);
+static std::atomic<uint64_t> twicearrayitems(0);
+static std::atomic<uint64_t> tallycalls(0);
+
+template <typename Real>
+static Real twice(Real x)
+{
+    twicecalls++;
+    return x * 2;
+}
+
+template <typename Real>
+static void twice_n(size_t n, const Real* in, Real* out)
+{
+    twicearraycalls++;
+    twicearrayitems += n;
+    for (size_t i = 0; i < n; i++)
+        out[i] = in[i] * 2;
+}
+
+template <typename Real>
+static Real tally(Real x)
+{
+    tallycalls++;
+    return x;
+}
+
+template <typename Compiler>
+static void add_counters(typename Compiler::StandardSymbolTable& symbols)
+{
+    typedef typename Compiler::Real Real;
+
+    if (!counters)
+        return;
+    symbols.add("twice", "(real): real", (void (*)()) twice<Real>,
+        (void (*)()) twice_n<Real>);
+    symbols.add("tally", "(real): real", (void (*)()) tally<Real>);
+}
+
+static void report_counters()
+{
+    std::cerr << "filter: twice() called " << twicecalls
+              << " times, its array form " << twicearraycalls
+              << " times for " << twicearrayitems
+              << " items; tally() called " << tallycalls << " times\n";
+}
+
+template <typename Compiler>
+static typename Compiler::Options make_options(const string& accuracy)
+{
+    typename Compiler::Options options;
+    if (accuracy == "ulp1")
+        options.accuracy = Compiler::ULP1;
+    else if (accuracy == "ulp4")
+        options.accuracy = Compiler::ULP4;
+    else if (accuracy == "fast")
+        options.accuracy = Compiler::FAST;
+    else
+        options.accuracy = Compiler::LIBM;
+    options.trace = trace;
+    options.fold = fold;
+    return options;
+}
+
+template <typename Settings>
+static void process_data(std::istream& codestream, const string& typesignature,
+        bool dump, const string& accuracy, unsigned threads,
+        const map<string, double>& realvariables,
+        const map<string, vector<double> >& vectorvariables,
+        const map<string, string>& typealiases)
+{
+    typedef Calculon::Instance<Settings> Compiler;
+    typedef typename Compiler::Real Real;
+
+    typename Compiler::StandardSymbolTable symbols;
+
+	try
+	{
+		for (map<string, double>::const_iterator i = realvariables.begin(),
+				e = realvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+
+		for (map<string, vector<double> >::const_iterator i = vectorvariables.begin(),
+				e = vectorvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+		add_counters<Compiler>(symbols);
+
+		typedef void TranslateFunction(Real in, Real* out);
+		typename Compiler::template Program<TranslateFunction> func(symbols, codestream,
+				typesignature, typealiases, make_options<Compiler>(accuracy));
+		if (dump)
+			func.dump();
+		auto captured = Calculon::captured(func, capture);
+		auto program = Calculon::timed(captured, stats);
+
+		filterdata(threads, 1,
+			[&](NumberReader& reader, NumberWriter& writer)
+			{
+				Real in;
+				while (readnumber(reader, in))
+				{
+					Real out;
+					program(in, &out);
+					writer.number(out);
+					writer.put('\n');
+				}
+			});
+	}
+	catch (const typename Compiler::CompilationException& e)
+	{
+		std::cerr << "Calculon compilation error: "
+			<< e.what()
+			<< "\n";
+		exit(1);
+	}
+}
+
+template <typename Settings>
+static void process_data_rows(std::istream& codestream, const string& typesignature,
+        bool dump, const string& accuracy, unsigned threads,
+        unsigned ivsize, unsigned ovsize,
+        StorageFormat storage, const string& layout,
+        const map<string, double>& realvariables,
+        const map<string, vector<double> >& vectorvariables,
+        const map<string, string>& typealiases)
+{
+    typedef Calculon::Instance<Settings> Compiler;
+    typedef typename Compiler::Real Real;
+    typedef typename Compiler::template Vector<MAX_VECTOR_ELEMENTS> BigVector;
+
+    typename Compiler::StandardSymbolTable symbols;
+
+	try
+	{
+		for (map<string, double>::const_iterator i = realvariables.begin(),
+				e = realvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+
+		for (map<string, vector<double> >::const_iterator i = vectorvariables.begin(),
+				e = vectorvariables.end(); i != e; i++)
+		{
+			symbols.add(i->first, i->second);
+		}
+		add_counters<Compiler>(symbols);
+
+		size_t esize = elementsize<Real>(storage);
+		typename Compiler::Options options = make_options<Compiler>(accuracy);
+		if (!layout.empty())
+		{
+			options.batch = true;
+			options.inputLayouts["in"] = make_layout<Compiler>(layout, ivsize, esize);
+			options.outputLayouts["out"] = make_layout<Compiler>(layout, ovsize, esize);
+		}
+
+		typedef void TranslateFunction(Real* in, Real* out);
+		typename Compiler::template Program<TranslateFunction> func(symbols, codestream,
+				typesignature, typealiases, options);
+		if (dump)
+			func.dump();
+		auto captured = Calculon::captured(func, layout.empty() ? capture : NULL);
+		auto program = Calculon::timed(captured, stats);
+
+		filterdata(threads, ivsize,
+			[&](NumberReader& reader, NumberWriter& writer)
+			{
+				if ((layout == "aos") && (storage == STORE_REAL) && LITTLE_ENDIAN_HOST &&
+					(reader.format() == sizeof(Real)) &&
+					(writer.format() == sizeof(Real)))
+				{
+					/* The raw input is already laid out exactly as the program
+					 * wants it, so bind it (and the output) directly. */
+
+					size_t bytes;
+					const char* data = reader.rest(bytes);
+					size_t rows = bytes / (ivsize * sizeof(Real));
+					typename Compiler::Binding bindings[] =
+					{
+						(void*)data,
+						(void*)writer.reserve(rows * ovsize)
+					};
+					program.batch(0, rows, bindings);
+
+					if (bytes % (ivsize * sizeof(Real)))
+						partialrow();
+					return;
+				}
+
+				if (!layout.empty())
+				{
+					/* Bad data ends the input, but only after the rows
+					 * before it have been run and written out. */
+
+					vector<double> values;
+					std::exception_ptr error;
+					try
+					{
+						double d;
+						while (readnumber(reader, d))
+							values.push_back(d);
+						if (values.size() % ivsize)
+							partialrow();
+					}
+					catch (const DataError&)
+					{
+						error = std::current_exception();
+					}
+
+					/* Plenty of room for any storage format and any padding. */
+
+					size_t rows = values.size() / ivsize;
+					size_t blocks = (rows + AOSOA_BLOCK - 1) / AOSOA_BLOCK;
+					vector<double> ibuffer(blocks * AOSOA_BLOCK * ivsize);
+					vector<double> obuffer(blocks * AOSOA_BLOCK * ovsize);
+
+					for (size_t r = 0; r < rows; r++)
+						for (unsigned i = 0; i < ivsize; i++)
+							putelement<Real>(storage, ibuffer.data(),
+								layoutindex(layout, rows, ivsize, r, i),
+								values[r*ivsize + i]);
+
+					vector<void*> icolumns;
+					for (unsigned i = 0; i < ivsize; i++)
+						icolumns.push_back((char*)ibuffer.data() + i*rows*esize);
+					vector<void*> ocolumns;
+					for (unsigned i = 0; i < ovsize; i++)
+						ocolumns.push_back((char*)obuffer.data() + i*rows*esize);
+
+					vector<typename Compiler::Binding> bindings;
+					if (layout == "soa")
+					{
+						bindings.push_back(&icolumns[0]);
+						bindings.push_back(&ocolumns[0]);
+					}
+					else
+					{
+						bindings.push_back((void*)ibuffer.data());
+						bindings.push_back((void*)obuffer.data());
+					}
+
+					program.batch(0, rows, &bindings[0]);
+
+					for (size_t r = 0; r < rows; r++)
+					{
+						for (unsigned i = 0; i < ovsize; i++)
+						{
+							Real o = getelement<Real>(storage, obuffer.data(),
+								layoutindex(layout, rows, ovsize, r, i));
+							writer.number(o);
+							writer.put(' ');
+						}
+						writer.put('\n');
+					}
+
+					if (error)
+						std::rethrow_exception(error);
+					return;
+				}
+
+				/* Big enough for any storage format. */
+
+				union
+				{
+					BigVector v;
+					double d[MAX_VECTOR_ELEMENTS];
+				}
+				istorage, ostorage;
+				Real* in = &istorage.v.m[0];
+				Real* out = &ostorage.v.m[0];
+
+				for (;;)
+				{
+					for (unsigned i = 0; i < ivsize; i++)
+					{
+						double d;
+						if (!readnumber(reader, d))
+						{
+							if (i != 0)
+								partialrow();
+							return;
+						}
+						putelement<Real>(storage, in, i, d);
+					}
+
+					program(in, out);
+
+					for (unsigned i = 0; i < ovsize; i++)
+					{
+						Real o = getelement<Real>(storage, out, i);
+						writer.number(o);
+						writer.put(' ');
+					}
+					writer.put('\n');
+				}
+			});
+	}
+	catch (const typename Compiler::CompilationException& e)
+	{
+		std::cerr << "Calculon compilation error: "
+			<< e.what()
+			<< "\n";
+		exit(1);
+	}
+}
+
+/* With --signature, each parameter of the script is read from and written
+ * to its own columns: one for a real, int or boolean, and one per element
+ * for a vector or matrix (named like w[0] in CSV and TSV headers). Rows are
+ * processed in chunks with batch calls, each parameter reading from or
+ * writing to its own columns of the row buffers in place. */
+
+enum ColumnType
 {
-    const char* p = s.c_str();
-    char* endp;
-    d = strtod(p, &endp);
-    if (*endp)
-        return false;
+    COLUMN_REAL,
+    COLUMN_INT,
+    COLUMN_BOOLEAN
+};
+
+struct Column
+{
+    string name;
+    ColumnType type;
+    size_t offset; /* within the row */
+};
+
+struct Parameter
+{
+    string name;
+    ColumnType type;
+    unsigned count;
+};
+
+static string trim(const string& s)
+{
+    size_t b = s.find_first_not_of(" \t");
+    if (b == string::npos)
+        return "";
+    size_t e = s.find_last_not_of(" \t");
+    return s.substr(b, e-b+1);
+}
+
+static bool parsetype(string type, const map<string, string>& typealiases,
+        Parameter& parameter)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        map<string, string>::const_iterator a = typealiases.find(type);
+        if (a == typealiases.end())
+            break;
+        type = trim(a->second);
+    }
+
+    parameter.count = 1;
+    if ((type == "") || (type == "real"))
+        parameter.type = COLUMN_REAL;
+    else if (type == "int")
+        parameter.type = COLUMN_INT;
+    else if (type == "boolean")
+        parameter.type = COLUMN_BOOLEAN;
+    else
+    {
+        unsigned rows;
+        unsigned columns;
+        char c;
+        parameter.type = COLUMN_REAL;
+        if (sscanf(type.c_str(), "vector * %u %c", &rows, &c) == 1)
+            parameter.count = rows;
+        else if (sscanf(type.c_str(), "matrix * %u x %u %c",
+                &rows, &columns, &c) == 2)
+            parameter.count = rows * columns;
+        else
+            return false;
+        if (!parameter.count)
+            return false;
+    }
     return true;
 }
 
-template <typename Real>
-static bool readnumber(Real& d)
+/* Parses a bracketed parameter list, e.g. (a: real, w: vector*4). */
+
+static bool parseparameters(const string& s, size_t& pos,
+        const map<string, string>& typealiases, vector<Parameter>& parameters)
 {
-    string s;
-    if (!(std::cin >> s))
+    pos = s.find_first_not_of(" \t", pos);
+    if ((pos == string::npos) || (s[pos] != '('))
+        return false;
+
+    size_t close = s.find(')', pos);
+    if (close == string::npos)
         return false;
 
-    if (!parsenumber(s, d))
+    vector<string> items;
+    string list = s.substr(pos+1, close-pos-1);
+    boost::algorithm::split(items, list, boost::algorithm::is_any_of(","));
+    for (const string& item : items)
     {
-        std::cerr << "filter: malformed number in input data";
-        exit(1);
+        string::size_type colon = item.find(':');
+        Parameter parameter;
+        parameter.name = trim(item.substr(0, colon));
+        string type = (colon == string::npos) ? "" : trim(item.substr(colon+1));
+        if (parameter.name.empty() ||
+                !parsetype(type, typealiases, parameter))
+            return false;
+        parameters.push_back(parameter);
     }
 
+    pos = close+1;
     return true;
 }
 
+static bool parsesignature(const string& signature,
+        const map<string, string>& typealiases,
+        vector<Parameter>& inputs, vector<Parameter>& outputs)
+{
+    size_t pos = 0;
+    if (!parseparameters(signature, pos, typealiases, inputs))
+        return false;
+
+    pos = signature.find_first_not_of(" \t", pos);
+    if ((pos == string::npos) || (signature[pos] != ':'))
+        return false;
+    pos++;
+
+    if (!parseparameters(signature, pos, typealiases, outputs))
+        return false;
+    return signature.find_first_not_of(" \t", pos) == string::npos;
+}
+
+/* Lays out the parameters' columns in a row, one real-sized slot each (so
+ * vector elements are packed exactly as the program expects). */
+
 template <typename Real>
-static void render(std::ostream& stream, Real d)
+static size_t layoutcolumns(const vector<Parameter>& parameters,
+        vector<Column>& columns, vector<size_t>& offsets)
 {
-	switch (fpclassify(d))
-	{
-		case FP_NAN:
-			stream << "nan";
-			break;
-
-		case FP_INFINITE:
-			if (d < 0)
-				stream << "-inf";
-			else
-				stream << "+inf";
-			break;
-
-		default:
-			stream << d;
-	}
+    size_t offset = 0;
+    for (const Parameter& p : parameters)
+    {
+        offsets.push_back(offset);
+        for (unsigned i = 0; i < p.count; i++)
+        {
+            Column c;
+            c.name = p.name;
+            if (p.count > 1)
+                c.name += "[" + std::to_string(i) + "]";
+            c.type = p.type;
+            c.offset = offset;
+            columns.push_back(c);
+            offset += sizeof(Real);
+        }
+    }
+    return offset;
+}
+
+template <typename Real>
+static void putcolumn(const Column& c, char* row, double d)
+{
+    char* p = row + c.offset;
+    switch (c.type)
+    {
+        case COLUMN_REAL:    *(Real*)p = d; break;
+        case COLUMN_INT:
+            /* Written so that NaN fails too. */
+            if (!((d >= INT32_MIN) && (d <= INT32_MAX)))
+                throw DataError("value out of range for int column '"
+                    + c.name + "'", true);
+            *(int32_t*)p = (int32_t)d;
+            break;
+        case COLUMN_BOOLEAN: *(uint8_t*)p = (d != 0); break;
+    }
+}
+
+template <typename Real>
+static void writecolumn(NumberWriter& writer, const Column& c, const char* row)
+{
+    const char* p = row + c.offset;
+    switch (c.type)
+    {
+        case COLUMN_REAL:    writer.number(*(const Real*)p); break;
+        case COLUMN_INT:     writer.number((double)*(const int32_t*)p); break;
+        case COLUMN_BOOLEAN: writer.number((double)(*(const uint8_t*)p & 1)); break;
+    }
 }
 
+enum
+{
+    SIGNATURE_CHUNK = 1024
+};
+
 template <typename Settings>
-static void process_data(std::istream& codestream, const string& typesignature,
-        bool dump, const map<string, double>& realvariables,
+static void process_data_signature(std::istream& codestream,
+        const string& typesignature, bool dump, const string& accuracy,
+        unsigned threads,
+        const vector<Parameter>& inputs, const vector<Parameter>& outputs,
+        const map<string, double>& realvariables,
         const map<string, vector<double> >& vectorvariables,
         const map<string, string>& typealiases)
 {
@@ -97,21 +1564,154 @@ static void process_data(std::istream& codestream, const string& typesignature,
 		{
 			symbols.add(i->first, i->second);
 		}
+		add_counters<Compiler>(symbols);
 
-		typedef void TranslateFunction(Real in, Real* out);
-		typename Compiler::template Program<TranslateFunction> func(symbols, codestream,
-				typesignature, typealiases);
+		vector<Column> icolumns;
+		vector<size_t> ioffsets;
+		size_t irowsize = layoutcolumns<Real>(inputs, icolumns, ioffsets);
+		vector<Column> ocolumns;
+		vector<size_t> ooffsets;
+		size_t orowsize = layoutcolumns<Real>(outputs, ocolumns, ooffsets);
+
+		typename Compiler::Options options = make_options<Compiler>(accuracy);
+		options.batch = true;
+		for (const Parameter& p : inputs)
+			options.inputLayouts[p.name] = Compiler::Layout::aos(irowsize);
+		for (const Parameter& p : outputs)
+			options.outputLayouts[p.name] = Compiler::Layout::aos(orowsize);
+
+		/* The scalar entrypoint's C type depends on the signature, so it's
+		 * never called; everything goes through the batch entrypoint. */
+
+		typedef void SignatureFunction();
+		typename Compiler::template Program<SignatureFunction> func(symbols, codestream,
+				typesignature, typealiases, options);
 		if (dump)
 			func.dump();
+		auto program = Calculon::timed(func, stats);
+
+		/* For CSV and TSV, find which field each input column comes from,
+		 * and write a header naming the output columns. */
+
+		vector<size_t> fields;
+		if (istable(input.format()))
+		{
+			vector<string> names;
+			if (!input.readheader(names))
+				return;
+			for (const Column& c : icolumns)
+			{
+				vector<string>::const_iterator i =
+					std::find(names.begin(), names.end(), c.name);
+				if (i == names.end())
+				{
+					std::cerr << "filter: input has no column '" << c.name << "'\n";
+					exit(1);
+				}
+				fields.push_back(i - names.begin());
+			}
+		}
 
-		Real in;
-		while (readnumber(in))
+		if (istable(output.format()))
 		{
-			Real out;
-			func(in, &out);
-			render(std::cout, out);
-			std::cout << "\n";
+			for (unsigned i = 0; i < ocolumns.size(); i++)
+			{
+				if (i)
+					output.put(output.separator());
+				output.name(ocolumns[i].name);
+			}
+			output.put('\n');
 		}
+
+		filterdata(threads, icolumns.size(),
+			[&](NumberReader& reader, NumberWriter& writer)
+			{
+				vector<double> values;
+				vector<char> ibuffer(SIGNATURE_CHUNK * irowsize);
+				vector<char> obuffer(SIGNATURE_CHUNK * orowsize);
+
+				vector<typename Compiler::Binding> bindings;
+				for (size_t offset : ioffsets)
+					bindings.push_back((void*)&ibuffer[offset]);
+				for (size_t offset : ooffsets)
+					bindings.push_back((void*)&obuffer[offset]);
+
+				/* Bad data ends the input, but only after the rows before it
+				 * have been run and written out. */
+
+				std::exception_ptr error;
+				bool eof = false;
+				while (!eof)
+				{
+					size_t rows = 0;
+					try
+					{
+						while (rows < SIGNATURE_CHUNK)
+						{
+							char* row = &ibuffer[rows * irowsize];
+							if (istable(reader.format()))
+							{
+								if (!reader.readrow(values))
+								{
+									if (reader.malformed())
+										malformednumber();
+									eof = true;
+									break;
+								}
+								for (unsigned i = 0; i < icolumns.size(); i++)
+								{
+									if (fields[i] >= values.size())
+										partialrow();
+									putcolumn<Real>(icolumns[i], row, values[fields[i]]);
+								}
+							}
+							else
+							{
+								unsigned i;
+								for (i = 0; i < icolumns.size(); i++)
+								{
+									double d;
+									if (!readnumber(reader, d))
+										break;
+									putcolumn<Real>(icolumns[i], row, d);
+								}
+								if (i != icolumns.size())
+								{
+									if (i != 0)
+										partialrow();
+									eof = true;
+									break;
+								}
+							}
+							rows++;
+						}
+					}
+					catch (const DataError&)
+					{
+						error = std::current_exception();
+						eof = true;
+					}
+
+					program.batch(0, rows, &bindings[0]);
+
+					for (size_t r = 0; r < rows; r++)
+					{
+						const char* row = &obuffer[r * orowsize];
+						for (unsigned i = 0; i < ocolumns.size(); i++)
+						{
+							if (istable(writer.format()) && i)
+								writer.put(writer.separator());
+							writecolumn<Real>(writer, ocolumns[i], row);
+							if (!istable(writer.format()))
+								writer.put(' ');
+						}
+						writer.put('\n');
+					}
+				}
+
+				if (error)
+					std::rethrow_exception(error);
+			});
 	}
 	catch (const typename Compiler::CompilationException& e)
 	{
@@ -122,16 +1722,23 @@ static void process_data(std::istream& codestream, const string& typesignature,
 	}
 }
 
+/* With --grid, there's no stream of rows: the script is run once for each
+ * point of a width x height grid, with `at` set to the point's [x, y] and
+ * `in` to a single row read from the input, shared by every point. Results
+ * are written a row of the grid at a time, whatever order the tiles were
+ * run in. */
+
 template <typename Settings>
-static void process_data_rows(std::istream& codestream, const string& typesignature,
-        bool dump, unsigned ivsize, unsigned ovsize,
+static void process_data_grid(std::istream& codestream, bool dump,
+        const string& accuracy, unsigned threads,
+        unsigned ivsize, unsigned ovsize,
+        size_t width, size_t height, size_t tile, bool morton,
         const map<string, double>& realvariables,
         const map<string, vector<double> >& vectorvariables,
         const map<string, string>& typealiases)
 {
     typedef Calculon::Instance<Settings> Compiler;
     typedef typename Compiler::Real Real;
-    typedef typename Compiler::template Vector<MAX_VECTOR_ELEMENTS> BigVector;
 
     typename Compiler::StandardSymbolTable symbols;
 
@@ -148,38 +1755,72 @@ static void process_data_rows(std::istream& codestream, const string& typesignat
 		{
 			symbols.add(i->first, i->second);
 		}
+		add_counters<Compiler>(symbols);
 
-		typedef void TranslateFunction(Real* in, Real* out);
-		typename Compiler::template Program<TranslateFunction> func(symbols, codestream,
-				typesignature, typealiases);
+		unsigned isize = std::max(ivsize, 1U);
+		unsigned osize = std::max(ovsize, 1U);
+
+		std::stringstream signature;
+		signature << "(at: vector*2, in: ";
+		if (ivsize)
+			signature << "vector*" << ivsize;
+		else
+			signature << "real";
+		signature << "): (out: ";
+		if (ovsize)
+			signature << "vector*" << ovsize;
+		else
+			signature << "real";
+		signature << ")";
+
+		typename Compiler::Options options = make_options<Compiler>(accuracy);
+		options.grid = true;
+		options.tile = tile;
+		options.morton = morton;
+		options.inputLayouts["at"] = Compiler::Layout::grid();
+		options.inputLayouts["in"] = Compiler::Layout::uniform();
+		options.outputLayouts["out"] = Compiler::Layout::aos(osize * sizeof(Real));
+
+		/* Only the grid entrypoint is ever called. */
+
+		typedef void GridFunction();
+		typename Compiler::template Program<GridFunction> func(symbols, codestream,
+				signature.str(), typealiases, options);
 		if (dump)
 			func.dump();
 
-		BigVector istorage;
-		Real* in = &istorage.m[0];
+		vector<Real> in(isize);
+		for (unsigned i = 0; i < isize; i++)
+		{
+			if (!readnumber(input, in[i]))
+			{
+				if (i != 0)
+					partialrow();
+				return;
+			}
+		}
 
-		BigVector ostorage;
-		Real* out = &ostorage.m[0];
+		/* at = [0, 0] + x*[1, 0] + y*[0, 1] */
 
-		for (;;)
+		Real at[] = { 0, 0, 1, 0, 0, 1 };
+		vector<Real> out(width * height * osize);
+		typename Compiler::Binding bindings[] = { at, &in[0], &out[0] };
+		if (threads > 1)
 		{
-			for (unsigned i = 0; i < ivsize; i++)
-				if (!readnumber(in[i]))
-				{
-					if (i != 0)
-						std::cerr << "filter: found partial row, aborting\n";
-					return;
-				}
-
-			func(in, out);
+			Calculon::Dispatch dispatch(threads, false, trace);
+			dispatch.grid(func, width, height, width, bindings, 1);
+		}
+		else
+			func.grid(0, 0, width, height, width, bindings);
 
-			for (unsigned i = 0; i < ovsize; i++)
+		for (size_t i = 0; i < (width * height); i++)
+		{
+			for (unsigned j = 0; j < osize; j++)
 			{
-				Real o = out[i];
-				render(std::cout, o);
-				std::cout << " ";
+				output.number(out[i*osize + j]);
+				output.put(' ');
 			}
-			std::cout << "\n";
+			output.put('\n');
 		}
 	}
 	catch (const typename Compiler::CompilationException& e)
@@ -194,6 +1835,7 @@ static void process_data_rows(std::istream& codestream, const string& typesignat
 int main(int argc, const char* argv[])
 {
     string precision = "double";
+    string accuracy = "libm";
 
     po::options_description options("Allowed options");
     options.add_options()
@@ -205,8 +1847,14 @@ int main(int argc, const char* argv[])
                 "literal Calculon script")
         ("precision,p", po::value(&precision),
                 "specifies whether to use double or float precision")
+        ("accuracy,a", po::value(&accuracy),
+                "maths library accuracy: libm, ulp1, ulp4 or fast")
         ("dump,d",
                 "dump LLVM bitcode after compilation")
+        ("counters",
+                "provide twice(x) and tally(x), and report how often they were called")
+        ("no-fold",
+                "don't work out constant expressions before generating code")
         ("define,D", po::value< vector<string> >(),
                 "defines a global real variable")
         ("vector,V", po::value< vector<string> >(),
@@ -217,6 +1865,46 @@ int main(int argc, const char* argv[])
                 "read each row of values as a vector this big")
         ("ovector,o", po::value<unsigned>(),
                 "return the result as a vector this big")
+        ("storage,S", po::value<string>(),
+                "pass vectors as this storage type (e.g. half, 'uint8 normalized')")
+        ("layout,L", po::value<string>(),
+                "process all rows in one batch call, laid out as aos, soa or aosoa")
+        ("signature,g", po::value<string>(),
+                "script signature, e.g. '(a: real, w: vector*4): (b: real)'")
+        ("input-format", po::value<string>(),
+                "read numbers as text, csv, tsv, float32 or float64 (raw little-endian)")
+        ("output-format", po::value<string>(),
+                "write numbers as text, csv, tsv, float32 or float64 (raw little-endian)")
+        ("input,I", po::value<string>(),
+                "memory-map this file and read from it instead of stdin")
+        ("output,O", po::value<string>(),
+                "memory-map this file and write to it instead of stdout")
+        ("grid", po::value<string>(),
+                "run the script once for each point of a WxH grid (e.g. 16x8) instead")
+        ("tile", po::value<size_t>(),
+                "with --grid, run it in squares this many points across (default 64)")
+        ("morton",
+                "with --grid, visit the squares in Z order rather than in rows")
+        ("threads,j", po::value<unsigned>(),
+                "parse and process the input on this many threads (0 means one per CPU)")
+        ("chunk-size", po::value(&chunksize),
+                "with --threads, bytes of input per chunk (default 16384)")
+        ("benchmark,b",
+                "report how many numbers were processed per second on stderr")
+        ("stats", po::value<string>(),
+                "when done, write call counts and latencies to this file ('-' for stdout)")
+        ("stats-format", po::value<string>(),
+                "write --stats as json (the default) or prometheus")
+        ("stats-interval", po::value<unsigned>(),
+                "with --stats, time one call in this many on each thread (default 64)")
+        ("stats-name", po::value<string>(),
+                "with --stats, the program's name (default the script's file name)")
+        ("trace", po::value<string>(),
+                "when done, write a Chrome trace of compilation and threads to this file ('-' for stdout)")
+        ("capture", po::value<string>(),
+                "record the script and the calls made to it to this file, for demo/replay")
+        ("capture-interval", po::value<unsigned>(),
+                "with --capture, record one call in this many (default 1)")
     ;
 
     po::variables_map vm;
@@ -232,6 +1920,30 @@ int main(int argc, const char* argv[])
                      "If you use --ivector, you must also use --ovector (but you're allowed a\n"
                      "vector with one element).\n"
                      "\n"
+                     "Raw float32 and float64 data is just the numbers back to back, so rows\n"
+                     "are only defined by --ivector and --ovector. With --layout aos and\n"
+                     "raw data of the same precision, rows are processed in place.\n"
+                     "\n"
+                     "--signature gives each parameter its own columns (one per element for\n"
+                     "vectors and matrices), in signature order; with CSV or TSV they are\n"
+                     "found by name in the header line, e.g. 'price' or 'w[0]'.\n"
+                     "\n"
+                     "--grid reads a single row and runs the script at every point of the\n"
+                     "grid, with 'at' set to [x, y] and 'in' to the row; the results are\n"
+                     "written out a row of the grid at a time.\n"
+                     "\n"
+                     "--threads cuts the input into chunks of whole rows which are parsed,\n"
+                     "processed and formatted in parallel; the output is still in order.\n"
+                     "\n"
+                     "--stats counts the calls made to the script and times a sample of\n"
+                     "them, then writes the counts and latency percentiles as JSON or in\n"
+                     "the Prometheus text format. --trace records how long each phase of\n"
+                     "compilation took and what each thread did, for chrome://tracing or\n"
+                     "ui.perfetto.dev.\n"
+                     "\n"
+                     "--capture records the script and the calls made to it; replay them\n"
+                     "with demo/replay to compare accuracies and execution modes.\n"
+                     "\n"
                      "Try: echo 1 | filter --script 'sin(n)'\n";
 
         exit(1);
@@ -354,6 +2066,8 @@ int main(int argc, const char* argv[])
         codestream = new std::stringstream(script);
     }
     bool dump = (vm.count("dump") > 0);
+    fold = (vm.count("no-fold") == 0);
+    counters = (vm.count("counters") > 0);
 
     unsigned ivsize = 0;
     if (vm.count("ivector"))
@@ -377,38 +2091,361 @@ int main(int argc, const char* argv[])
         exit(1);
     }
 
+    if ((accuracy != "libm") && (accuracy != "ulp1") &&
+        (accuracy != "ulp4") && (accuracy != "fast"))
+    {
+        std::cerr << "filter: accuracy must be 'libm', 'ulp1', 'ulp4' or 'fast'\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    string storagename;
+    StorageFormat storage = STORE_REAL;
+    if (vm.count("storage"))
+    {
+        storagename = vm["storage"].as<string>();
+        if (!parsestorage(storagename, storage) || (storage == STORE_REAL))
+        {
+            std::cerr << "filter: unknown storage type\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+        if (ivsize == 0)
+        {
+            std::cerr << "filter: storage types only work with vectors\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+    }
+
+    string layout;
+    if (vm.count("layout"))
+    {
+        layout = vm["layout"].as<string>();
+        if ((layout != "aos") && (layout != "soa") && (layout != "aosoa"))
+        {
+            std::cerr << "filter: layout must be 'aos', 'soa' or 'aosoa'\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+        if (ivsize == 0)
+        {
+            std::cerr << "filter: layouts only work with vectors\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+    }
+
+    NumberFormat format;
+    if (vm.count("input-format"))
+    {
+        if (!parseformat(vm["input-format"].as<string>(), format))
+        {
+            std::cerr << "filter: input format must be 'text', 'csv', 'tsv', 'float32' or 'float64'\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+        input.setformat(format);
+    }
+    if (vm.count("output-format"))
+    {
+        if (!parseformat(vm["output-format"].as<string>(), format))
+        {
+            std::cerr << "filter: output format must be 'text', 'csv', 'tsv', 'float32' or 'float64'\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+        output.setformat(format);
+    }
+
+    vector<Parameter> inputs;
+    vector<Parameter> outputs;
+    if (vm.count("signature"))
+    {
+        if (ivsize != 0)
+        {
+            std::cerr << "filter: --signature can't be used with vectors\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+        if (!parsesignature(vm["signature"].as<string>(), typealiases,
+                inputs, outputs))
+        {
+            std::cerr << "filter: malformed signature (parameters may be real, int, boolean,\n"
+                         "vector*N or matrix*RxC)\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+    }
+    else if (istable(input.format()) || istable(output.format()))
+    {
+        std::cerr << "filter: CSV and TSV only work with --signature\n"
+                  << "(try --help)\n";
+        exit(1);
+    }
+
+    if (vm.count("input"))
+        input.open(vm["input"].as<string>());
+    if (vm.count("output"))
+        output.open(vm["output"].as<string>());
+
     string typesignature;
-    if (ivsize == 0)
+    if (vm.count("signature"))
+        typesignature = vm["signature"].as<string>();
+    else if (ivsize == 0)
         typesignature = "(in: real): (out: real)";
     else
     {
         std::stringstream s;
-        s << "(in: vector*" << ivsize << "): (out: vector*" << ovsize << ")";
+        s << "(in: vector*" << ivsize;
+        if (storage != STORE_REAL)
+            s << " of " << storagename;
+        s << "): (out: vector*" << ovsize;
+        if (storage != STORE_REAL)
+            s << " of " << storagename;
+        s << ")";
         typesignature = s.str();
     }
 
-    if (ivsize == 0)
+    unsigned threads = 1;
+    if (vm.count("threads"))
+    {
+        threads = vm["threads"].as<unsigned>();
+        if (!threads)
+            threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    Calculon::Stats::Format statsformat = Calculon::Stats::JSON;
+    if (vm.count("stats-format"))
+    {
+        string s = vm["stats-format"].as<string>();
+        if (s == "prometheus")
+            statsformat = Calculon::Stats::PROMETHEUS;
+        else if (s != "json")
+        {
+            std::cerr << "filter: stats format must be 'json' or 'prometheus'\n";
+            exit(1);
+        }
+    }
+
+    size_t gridwidth = 0;
+    size_t gridheight = 0;
+    size_t tile = 64;
+    if (vm.count("grid"))
+    {
+        char x;
+        std::istringstream s(vm["grid"].as<string>());
+        if (!(s >> gridwidth >> x >> gridheight) || (x != 'x') || !s.eof() ||
+            !gridwidth || !gridheight)
+        {
+            std::cerr << "filter: malformed grid size (use --grid WxH)\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+        if (vm.count("signature") || vm.count("layout") ||
+            vm.count("storage") || vm.count("capture") || vm.count("stats"))
+        {
+            std::cerr << "filter: --grid can't be used with --signature, --layout,\n"
+                         "--storage, --capture or --stats\n"
+                      << "(try --help)\n";
+            exit(1);
+        }
+        if (vm.count("tile"))
+            tile = vm["tile"].as<size_t>();
+    }
+
+    std::unique_ptr<Calculon::Stats> programstats;
+    if (vm.count("stats"))
+    {
+        unsigned interval = 64;
+        if (vm.count("stats-interval"))
+            interval = vm["stats-interval"].as<unsigned>();
+        string name = vm.count("file") ? vm["file"].as<string>() : string("script");
+        if (vm.count("stats-name"))
+            name = vm["stats-name"].as<string>();
+        programstats.reset(new Calculon::Stats(name, interval));
+        stats = programstats.get();
+    }
+
+    std::unique_ptr<Calculon::Capture> programcapture;
+    if (vm.count("capture"))
+    {
+        if (vm.count("signature") || vm.count("layout"))
+        {
+            std::cerr << "filter: --capture only works with one call per row, "
+                         "so not with --signature or --layout\n";
+            exit(1);
+        }
+
+        /* The capture needs the script itself. */
+
+        std::stringstream code;
+        code << codestream->rdbuf();
+        delete codestream;
+        codestream = new std::stringstream(code.str());
+
+        unsigned interval = 1;
+        if (vm.count("capture-interval"))
+            interval = vm["capture-interval"].as<unsigned>();
+        try
+        {
+            programcapture.reset(new Calculon::Capture(
+                vm["capture"].as<string>(), code.str(), typesignature,
+                interval));
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << "filter: " << e.what() << "\n";
+            exit(1);
+        }
+        for (auto& i : typealiases)
+            programcapture->alias(i.first, i.second);
+        for (auto& i : realvariables)
+            programcapture->global(i.first, i.second);
+        for (auto& i : vectorvariables)
+            programcapture->global(i.first, i.second);
+        capture = programcapture.get();
+    }
+
+    std::unique_ptr<Calculon::Trace> programtrace;
+    if (vm.count("trace"))
+    {
+        programtrace.reset(new Calculon::Trace());
+        trace = programtrace.get();
+    }
+
+    try
     {
-        /* Data is a simple stream of numbers. */
-        if (precision == "double")
-            process_data<Calculon::RealIsDouble>(*codestream, typesignature,
-                    dump, realvariables, vectorvariables, typealiases);
+        if (vm.count("grid"))
+        {
+            /* Data is a single row, shared by every point of the grid. */
+            if (precision == "double")
+                process_data_grid<Calculon::RealIsDouble>(*codestream, dump,
+                        accuracy, threads, ivsize, ovsize, gridwidth, gridheight,
+                        tile, vm.count("morton") > 0, realvariables,
+                        vectorvariables, typealiases);
+            else
+                process_data_grid<Calculon::RealIsFloat>(*codestream, dump,
+                        accuracy, threads, ivsize, ovsize, gridwidth, gridheight,
+                        tile, vm.count("morton") > 0, realvariables,
+                        vectorvariables, typealiases);
+        }
+        else if (vm.count("signature"))
+        {
+            /* Data is a stream of rows, one column per parameter element. */
+            if (precision == "double")
+                process_data_signature<Calculon::RealIsDouble>(*codestream,
+                        typesignature, dump, accuracy, threads, inputs, outputs,
+                        realvariables, vectorvariables, typealiases);
+            else
+                process_data_signature<Calculon::RealIsFloat>(*codestream,
+                        typesignature, dump, accuracy, threads, inputs, outputs,
+                        realvariables, vectorvariables, typealiases);
+        }
+        else if (ivsize == 0)
+        {
+            /* Data is a simple stream of numbers. */
+            if (precision == "double")
+                process_data<Calculon::RealIsDouble>(*codestream, typesignature,
+                        dump, accuracy, threads, realvariables, vectorvariables,
+                        typealiases);
+            else
+                process_data<Calculon::RealIsFloat>(*codestream, typesignature,
+                        dump, accuracy, threads, realvariables, vectorvariables,
+                        typealiases);
+        }
         else
-            process_data<Calculon::RealIsFloat>(*codestream, typesignature,
-                    dump, realvariables, vectorvariables, typealiases);
+        {
+            /* Data is a stream of rows. */
+            if (precision == "double")
+                process_data_rows<Calculon::RealIsDouble>(*codestream,
+                        typesignature, dump, accuracy, threads, ivsize, ovsize, storage,
+                        layout, realvariables, vectorvariables, typealiases);
+            else
+                process_data_rows<Calculon::RealIsFloat>(*codestream,
+                        typesignature, dump, accuracy, threads, ivsize, ovsize, storage,
+                        layout, realvariables, vectorvariables, typealiases);
+        }
     }
-    else
+    catch (const DataError& e)
+    {
+        output.flush();
+        std::cerr << "filter: " << e.what() << "\n";
+        if (e.fatal)
+            exit(1);
+    }
+
+    if (counters)
     {
-        /* Data is a stream of rows. */
-        if (precision == "double")
-            process_data_rows<Calculon::RealIsDouble>(*codestream,
-                    typesignature, dump, ivsize, ovsize,
-                    realvariables, vectorvariables, typealiases);
+        output.flush();
+        report_counters();
+    }
+
+    if (stats)
+    {
+        output.flush();
+        string filename = vm["stats"].as<string>();
+        vector<Calculon::Stats::Snapshot> snapshots(1, stats->snapshot());
+        if (filename == "-")
+            Calculon::Stats::write(std::cout, statsformat, snapshots);
+        else
+        {
+            try
+            {
+                Calculon::Stats::write(filename, statsformat, snapshots);
+            }
+            catch (const std::runtime_error& e)
+            {
+                std::cerr << "filter: " << e.what() << "\n";
+                exit(1);
+            }
+        }
+    }
+
+    if (capture)
+    {
+        try
+        {
+            capture->flush();
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << "filter: " << e.what() << "\n";
+            exit(1);
+        }
+    }
+
+    if (trace)
+    {
+        output.flush();
+        string filename = vm["trace"].as<string>();
+        if (filename == "-")
+            trace->write(std::cout);
         else
-            process_data_rows<Calculon::RealIsFloat>(*codestream,
-                    typesignature, dump, ivsize, ovsize,
-                    realvariables, vectorvariables, typealiases);
+        {
+            try
+            {
+                trace->write(filename);
+            }
+            catch (const std::runtime_error& e)
+            {
+                std::cerr << "filter: " << e.what() << "\n";
+                exit(1);
+            }
+        }
     }
 
+    if (vm.count("benchmark"))
+    {
+        output.flush();
+        double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - input.started()).count();
+        std::cerr << "filter: read " << input.count() << " numbers and wrote "
+                  << output.count() << " in " << seconds << "s ("
+                  << (uint64_t)(input.count() / seconds) << " numbers/s)\n";
+    }
+
+    output.close();
+
     return 0;
 }
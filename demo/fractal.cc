@@ -4,14 +4,23 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <chrono>
 #include <math.h>
 #include <boost/program_options.hpp>
 
 #include "calculon.h"
 
 using std::string;
+using std::vector;
 namespace po = boost::program_options;
 
 typedef Calculon::Instance<Calculon::RealIsDouble> Compiler;
@@ -19,6 +28,86 @@ typedef Compiler::Real Real;
 
 Compiler::StandardSymbolTable symbols;
 
+/* The image is written as a binary 16-bit PGM, straight into a memory-mapped
+ * output file (or into memory, if the output can't be mapped). */
+
+class Image
+{
+public:
+	Image(const string& filename, unsigned width, unsigned height):
+		_filename(filename),
+		_fd(-1),
+		_data(NULL)
+	{
+		char header[64];
+		_header = snprintf(header, sizeof(header), "P5\n%u %u\n65535\n",
+			width, height);
+		_size = _header + (size_t)width*height*2;
+
+		_fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+		if (_fd == -1)
+		{
+			std::cerr << "fractal: can't open '" << filename << "': "
+				<< strerror(errno) << "\n";
+			exit(1);
+		}
+
+		if (ftruncate(_fd, _size) == 0)
+		{
+			void* p = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				_fd, 0);
+			if (p != MAP_FAILED)
+				_data = (uint8_t*)p;
+		}
+		if (!_data)
+		{
+			_buffer.resize(_size);
+			_data = &_buffer[0];
+		}
+
+		memcpy(_data, header, _header);
+	}
+
+	~Image()
+	{
+		if (_buffer.empty())
+			munmap(_data, _size);
+		else if (write(_fd, _data, _size) != (ssize_t)_size)
+			std::cerr << "fractal: can't write '" << _filename << "'\n";
+		close(_fd);
+	}
+
+	/* Stores pixels [start, start+count) of the image. Intensities are
+	 * clamped to 0..1 first, with NaN going to 0, as converting anything
+	 * out of range to an integer is undefined. */
+
+	void store(size_t start, size_t count, const Real* intensities)
+	{
+		uint8_t* p = _data + _header + start*2;
+		for (size_t i = 0; i < count; i++)
+		{
+			Real d = intensities[i];
+			unsigned v = (d > 0) ? ((d < 1) ? (unsigned)(d * 65535.0) : 65535) : 0;
+			*p++ = v >> 8;
+			*p++ = v;
+		}
+	}
+
+private:
+	string _filename;
+	int _fd;
+	size_t _header;
+	size_t _size;
+	uint8_t* _data;
+	vector<uint8_t> _buffer;
+};
+
+static double since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
 int main(int argc, const char* argv[])
 {
 	Real minr = -2.0;
@@ -27,8 +116,12 @@ int main(int argc, const char* argv[])
 	Real maxi = 1.0;
 	unsigned width = 1024;
 	unsigned height = 1024;
+	unsigned threads = 0;
+	string mode = "grid";
 	string scriptfilename = "fractal.cal";
 	string outputfilename = "fractal.pgm";
+	string tracefilename;
+	string capturefilename;
 
 	po::options_description options("Allowed options");
 	options.add_options()
@@ -52,6 +145,16 @@ int main(int argc, const char* argv[])
 	    		"dump LLVM bitcode after compilation")
 	    ("output,o", po::value(&outputfilename),
 	    		"output filename")
+	    ("mode,m",   po::value(&mode),
+	    		"how pixels are computed: scalar (one call each), batch (one call per row) or grid (tiles, coordinates computed by the script)")
+	    ("threads,j", po::value(&threads),
+	    		"number of threads to render with (0 means one per CPU)")
+	    ("bench,b",
+	    		"report compile time and rendering speed on stderr")
+	    ("trace,t",  po::value(&tracefilename),
+	    		"write a Chrome trace of compilation and rendering to this file")
+	    ("capture",  po::value(&capturefilename),
+	    		"in scalar mode, record every call to this file for demo/replay")
 	;
 
 	po::variables_map vm;
@@ -64,34 +167,148 @@ int main(int argc, const char* argv[])
 		exit(1);
 	}
 
+	if ((mode != "scalar") && (mode != "batch") && (mode != "grid"))
+	{
+		std::cerr << "fractal: mode must be 'scalar', 'batch' or 'grid'\n";
+		exit(1);
+	}
+
+	if (!capturefilename.empty() && (mode != "scalar"))
+	{
+		std::cerr << "fractal: --capture only works in scalar mode\n";
+		exit(1);
+	}
+
 	bool dump = (vm.count("dump") > 0);
 
-	/* Load the Calculon function to generate the pixels. */
+	Calculon::Trace trace;
+	Calculon::Trace* tracing = tracefilename.empty() ? NULL : &trace;
+
+	/* Load the Calculon function to generate the pixels. In batch mode r
+	 * comes from an array shared by all rows and i is the same for the
+	 * whole row; in grid mode both are computed from the pixel position. */
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	Compiler::Options calculonoptions;
+	calculonoptions.trace = tracing;
+	if (mode == "batch")
+	{
+		calculonoptions.batch = true;
+		calculonoptions.inputLayouts["i"] = Compiler::Layout::uniform();
+	}
+	else if (mode == "grid")
+	{
+		calculonoptions.grid = true;
+		calculonoptions.inputLayouts["r"] = Compiler::Layout::grid();
+		calculonoptions.inputLayouts["i"] = Compiler::Layout::grid();
+	}
 
 	typedef Real FractalFunction(Real r, Real i, Real* intensity);
-	std::ifstream code(scriptfilename.c_str());
-	Compiler::Program<FractalFunction> func(symbols, code, "(r:real, i:real): (intensity:real)");
+	const string signature = "(r:real, i:real): (intensity:real)";
+	std::ifstream codestream(scriptfilename.c_str());
+	std::stringstream code;
+	code << codestream.rdbuf();
+	Compiler::Program<FractalFunction> func(symbols, code.str(), signature,
+			{}, calculonoptions);
 	if (dump)
 		func.dump();
 
-	/* Open the output file. */
+	std::unique_ptr<Calculon::Capture> capture;
+	if (!capturefilename.empty())
+		capture.reset(new Calculon::Capture(capturefilename, code.str(),
+			signature));
+	auto program = Calculon::captured(func, capture.get());
+
+	double compiletime = since(start);
 
-	std::ofstream outputfile(outputfilename.c_str());
-	outputfile << "P2\n" << width << "\n" << height << "\n" << "65535\n";
+	/* Render the image a band of rows at a time on each thread. */
+
+	Calculon::Dispatch dispatch(threads, false, tracing);
+	Image image(outputfilename, width, height);
+	vector<Real> intensities((size_t)width * height);
 
 	Real rw = maxr - minr;
 	Real rh = maxi - mini;
 
-	for (Real y = 0; y < height; y++)
+	start = std::chrono::steady_clock::now();
+
+	if (mode == "scalar")
+	{
+		dispatch.run(height,
+			[&](size_t y0, size_t count)
+			{
+				for (size_t y = y0; y < (y0+count); y++)
+				{
+					Real* row = &intensities[y * width];
+					for (unsigned x = 0; x < width; x++)
+					{
+						Real r = minr + rw*((Real)x/width);
+						Real i = mini + rh*((Real)y/height);
+						program(r, i, &row[x]);
+					}
+				}
+			});
+	}
+	else if (mode == "batch")
 	{
-		for (Real x = 0; x < width; x++)
+		vector<Real> rs(width);
+		for (unsigned x = 0; x < width; x++)
+			rs[x] = minr + rw*((Real)x/width);
+
+		dispatch.run(height,
+			[&](size_t y0, size_t count)
+			{
+				for (size_t y = y0; y < (y0+count); y++)
+				{
+					Real i = mini + rh*((Real)y/height);
+					Compiler::Binding bindings[] =
+						{ &rs[0], &i, &intensities[y * width] };
+					func.batch(0, width, bindings);
+				}
+			});
+	}
+	else
+	{
+		/* r = minr + x*(rw/width), i = mini + y*(rh/height) */
+
+		Real r[] = { minr, rw/width, 0 };
+		Real i[] = { mini, 0, rh/height };
+		Compiler::Binding bindings[] = { r, i, &intensities[0] };
+		dispatch.grid(func, width, height, width, bindings);
+	}
+
+	dispatch.run(height,
+		[&](size_t y0, size_t count)
 		{
-			Real r = minr + rw*(x/width);
-			Real i = mini + rh*(y/height);
-			Real intensity;
+			image.store(y0 * width, count * width, &intensities[y0 * width]);
+		});
 
-			func(r, i, &intensity);
-			outputfile << (int)(intensity * 65535.0) << "\n";
+	double rendertime = since(start);
+
+	if (vm.count("bench"))
+	{
+		std::cerr << "fractal: compiled in " << (compiletime * 1000) << "ms; "
+			<< "rendered " << width << "x" << height << " in "
+			<< (rendertime * 1000) << "ms ("
+			<< ((double)width * height / rendertime / 1e6) << " Mpixel/s), "
+			<< mode << " mode on " << dispatch.threads()
+			<< ((dispatch.threads() == 1) ? " thread\n" : " threads\n");
+	}
+
+	if (capture)
+		capture->flush();
+
+	if (tracing)
+	{
+		try
+		{
+			trace.write(tracefilename);
+		}
+		catch (const std::runtime_error& e)
+		{
+			std::cerr << "fractal: " << e.what() << "\n";
+			exit(1);
 		}
 	}
 
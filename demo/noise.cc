@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
+#include <vector>
 #include <math.h>
 #include <boost/program_options.hpp>
 #include NOISEINC
@@ -22,10 +23,14 @@ typedef Compiler::Vector<3> Vector3;
 
 Compiler::StandardSymbolTable symbols;
 
+/* perlin() only reads the generator, so it can be registered as PURE; a
+ * function-local static would write its guard variable on first use. */
+
+static noise::module::Perlin generator;
+
 extern "C"
 double perlin(Vector3* v)
 {
-	static noise::module::Perlin generator;
 	return generator.GetValue(v->x, v->y, v->z);
 }
 
@@ -66,38 +71,43 @@ int main(int argc, const char* argv[])
 
 	/* Register the noise function. */
 
-	symbols.add("perlin", "(vector*3): double", perlin);
+	symbols.add("perlin", "(vector*3): double", perlin,
+			Compiler::PURE | Compiler::NOUNWIND | Compiler::WILLRETURN);
+
+	/* Load the Calculon function to generate the pixels. pos is computed
+	 * by the compiled code from each pixel's position, and the image is
+	 * rendered a tile at a time. */
 
-	/* Load the Calculon function to generate the pixels. */
+	Compiler::Options calculonoptions;
+	calculonoptions.grid = true;
+	calculonoptions.morton = true;
+	calculonoptions.inputLayouts["pos"] = Compiler::Layout::grid();
+	calculonoptions.outputLayouts["colour"] = Compiler::Layout::aos(sizeof(Vector3));
 
 	typedef void FractalFunction(Vector2* pos, Vector3* colour);
 	std::ifstream code(scriptfilename.c_str());
-	Compiler::Program<FractalFunction> func(symbols, code, "(pos:vector*2): (colour: vector*3)");
+	Compiler::Program<FractalFunction> func(symbols, code,
+			"(pos:vector*2): (colour: vector*3)", {}, calculonoptions);
 	if (dump)
 		func.dump();
 
+	/* pos = [-1, -1] + x*[2/width, 0] + y*[0, 2/height] */
+
+	Real grid[] = { -1, -1, 2/(Real)width, 0, 0, 2/(Real)height };
+	std::vector<Vector3> image(width * height);
+	Compiler::Binding bindings[] = { grid, &image[0] };
+	func.grid(0, 0, width, height, width, bindings);
+
 	/* Open the output file. */
 
 	std::ofstream outputfile(outputfilename.c_str());
 	outputfile << "P3\n" << width << "\n" << height << "\n" << "65535\n";
 
-	for (Real y = 0; y < height; y++)
+	for (const Vector3& colour : image)
 	{
-		for (Real x = 0; x < width; x++)
-		{
-			Real xx = -1 + x * (2/(Real)width);
-			Real yy = -1 + y * (2/(Real)height);
-
-			Vector2 pos;
-			Vector3 colour;
-			pos.x = xx;
-			pos.y = yy;
-			func(&pos, &colour);
-
-			outputfile << (int)(colour.x * 65535.0) << " "
-					   << (int)(colour.y * 65535.0) << " "
-					   << (int)(colour.z * 65535.0) << "\n";
-		}
+		outputfile << (int)(colour.x * 65535.0) << " "
+				   << (int)(colour.y * 65535.0) << " "
+				   << (int)(colour.z * 65535.0) << "\n";
 	}
 
 	return 0;
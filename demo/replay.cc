@@ -0,0 +1,371 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+/* Replays the calls recorded by Calculon::Capture (e.g. with filter
+ * --capture): recompiles the script at each maths accuracy, runs the
+ * recorded inputs through it one call at a time, in one batch and on all
+ * threads, and reports how fast each was and how far its outputs are from
+ * the recorded ones and from the first case's.
+ *
+ * Everything goes through the batch entrypoint, with each parameter laid out
+ * AOS in one record per call, as the scalar Entrypoint's C type isn't known
+ * until the capture is read. The per-call mode is one batch call per item.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <limits>
+#include <math.h>
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string/split.hpp>
+#include <boost/algorithm/string/classification.hpp>
+
+#include "calculon.h"
+
+using std::string;
+using std::vector;
+namespace po = boost::program_options;
+
+static double mintime = 0.2;
+static unsigned threads = 0;
+static bool check = false;
+
+static double since(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+static vector<string> split(const string& list)
+{
+	vector<string> items;
+	boost::algorithm::split(items, list, boost::algorithm::is_any_of(","));
+	return items;
+}
+
+/* Runs fn until mintime has passed, and returns the best time in seconds;
+ * with --check, just runs it once. */
+
+template <class F>
+static double measure(F fn)
+{
+	double best = std::numeric_limits<double>::infinity();
+	double total = 0;
+	unsigned runs = 0;
+	do
+	{
+		std::chrono::steady_clock::time_point start =
+			std::chrono::steady_clock::now();
+		fn();
+		double t = since(start);
+		best = std::min(best, t);
+		total += t;
+		runs++;
+	}
+	while (!check && ((total < mintime) || (runs < 3)));
+	return best;
+}
+
+/* How far apart two sets of outputs are: the worst distance between two
+ * reals, in ulps (NaNs are equal to each other), and how many other values
+ * differ at all. */
+
+struct Difference
+{
+	uint64_t ulps;
+	uint64_t mismatches;
+};
+
+template <typename Real, typename Bits>
+static uint64_t ulps(Real a, Real b)
+{
+	if (isnan(a) || isnan(b))
+		return (isnan(a) && isnan(b)) ? 0 : UINT64_MAX;
+	if (a == b)
+		return 0;
+
+	/* Map the bit patterns onto a line on which adjacent reals are adjacent
+	 * integers. */
+
+	Bits ia;
+	Bits ib;
+	memcpy(&ia, &a, sizeof(a));
+	memcpy(&ib, &b, sizeof(b));
+	const Bits sign = (Bits)1 << (sizeof(Bits)*8 - 1);
+	int64_t la = (ia & sign) ? -(int64_t)(ia & ~sign) : (int64_t)ia;
+	int64_t lb = (ib & sign) ? -(int64_t)(ib & ~sign) : (int64_t)ib;
+	return (la > lb) ? (la - lb) : (lb - la);
+}
+
+template <typename Real>
+static Difference compare(const vector<Calculon::Parameter>& parameters,
+		const vector<size_t>& offsets, size_t count,
+		const char* a, size_t astride, const char* b, size_t bstride)
+{
+	typedef typename std::conditional<sizeof(Real) == 4, uint32_t, uint64_t>::type
+		Bits;
+
+	Difference d = { 0, 0 };
+	for (size_t i = 0; i < count; i++)
+	{
+		for (unsigned p = 0; p < parameters.size(); p++)
+		{
+			const char* pa = a + i*astride + offsets[p];
+			const char* pb = b + i*bstride + offsets[p];
+			if (!parameters[p].real)
+			{
+				if (memcmp(pa, pb, parameters[p].size))
+					d.mismatches++;
+				continue;
+			}
+
+			for (size_t e = 0; e < (parameters[p].size / sizeof(Real)); e++)
+			{
+				Real ra;
+				Real rb;
+				memcpy(&ra, pa + e*sizeof(Real), sizeof(Real));
+				memcpy(&rb, pb + e*sizeof(Real), sizeof(Real));
+				uint64_t u = ulps<Real, Bits>(ra, rb);
+				if (u == UINT64_MAX)
+					d.mismatches++;
+				else
+					d.ulps = std::max(d.ulps, u);
+			}
+		}
+	}
+	return d;
+}
+
+static string describe(const Difference& d)
+{
+	std::stringstream s;
+	s << d.ulps << " ulp";
+	if (d.mismatches)
+		s << " (" << d.mismatches << " differ)";
+	return s.str();
+}
+
+template <typename Settings>
+static void replay(const Calculon::Capture::Recording& recording,
+		const vector<string>& accuracies, const vector<string>& modes)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+	typedef void ReplayFunction();
+
+	typename Compiler::StandardSymbolTable symbols;
+	for (auto& i : recording.reals)
+		symbols.add(i.first, i.second);
+	for (auto& i : recording.vectors)
+		symbols.add(i.first, i.second);
+
+	/* Inputs and outputs each get one record per call, of the same size, as
+	 * an output with the same name as an input shares its layout. */
+
+	size_t n = recording.count();
+	if (!n)
+		return;
+	size_t stride = std::max(recording.inputsize, recording.outputsize);
+	stride = (stride + sizeof(Real) - 1) & ~(sizeof(Real) - 1);
+
+	vector<size_t> ioffsets;
+	size_t offset = 0;
+	for (const Calculon::Parameter& p : recording.inputs)
+	{
+		ioffsets.push_back(offset);
+		offset += p.size;
+	}
+	vector<size_t> ooffsets;
+	offset = 0;
+	for (const Calculon::Parameter& p : recording.outputs)
+	{
+		ooffsets.push_back(offset);
+		offset += p.size;
+	}
+
+	vector<char> in(n * stride);
+	vector<char> out(n * stride);
+	for (size_t i = 0; i < n; i++)
+		memcpy(&in[i * stride], recording.input(i), recording.inputsize);
+
+	vector<typename Compiler::Binding> bindings;
+	for (size_t o : ioffsets)
+		bindings.push_back((void*)&in[o]);
+	for (size_t o : ooffsets)
+		bindings.push_back((void*)&out[o]);
+
+	Calculon::Dispatch dispatch(threads);
+	string first;
+	vector<char> reference;
+
+	printf("%-20s %10s %10s %10s   %-20s %s\n", "case", "compile ms",
+		"ns/call", "Mcall/s", "vs capture", "vs first case");
+	for (const string& accuracy : accuracies)
+	{
+		typename Compiler::Options options;
+		if (accuracy == "libm")
+			options.accuracy = Compiler::LIBM;
+		else if (accuracy == "ulp1")
+			options.accuracy = Compiler::ULP1;
+		else if (accuracy == "ulp4")
+			options.accuracy = Compiler::ULP4;
+		else if (accuracy == "fast")
+			options.accuracy = Compiler::FAST;
+		else
+		{
+			std::cerr << "replay: unknown accuracy '" << accuracy << "'\n";
+			exit(1);
+		}
+
+		options.batch = true;
+		for (const Calculon::Parameter& p : recording.inputs)
+			options.inputLayouts[p.name] = Compiler::Layout::aos(stride);
+		for (const Calculon::Parameter& p : recording.outputs)
+			options.outputLayouts[p.name] = Compiler::Layout::aos(stride);
+
+		std::chrono::steady_clock::time_point start =
+			std::chrono::steady_clock::now();
+		typename Compiler::template Program<ReplayFunction> func(symbols,
+			recording.code, recording.signature, recording.aliases, options);
+		double compiletime = since(start);
+
+		for (const string& mode : modes)
+		{
+			double t;
+			std::fill(out.begin(), out.end(), 0);
+			if (mode == "call")
+				t = measure(
+					[&]
+					{
+						for (size_t i = 0; i < n; i++)
+							func.batch(i, 1, &bindings[0]);
+					});
+			else if (mode == "batch")
+				t = measure(
+					[&]
+					{
+						func.batch(0, n, &bindings[0]);
+					});
+			else if (mode == "threads")
+				t = measure(
+					[&]
+					{
+						dispatch.batch(func, n, &bindings[0]);
+					});
+			else
+			{
+				std::cerr << "replay: unknown mode '" << mode << "'\n";
+				exit(1);
+			}
+
+			string name = accuracy + "/" + mode;
+			Difference captured = compare<Real>(recording.outputs,
+				ooffsets, n, &out[0], stride, recording.output(0),
+				recording.inputsize + recording.outputsize);
+			if (first.empty())
+			{
+				first = name;
+				reference = out;
+			}
+			Difference firstcase = compare<Real>(recording.outputs,
+				ooffsets, n, &out[0], stride, &reference[0], stride);
+
+			if (check)
+				printf("%-20s %10s %10s %10s   %-20s %s\n", name.c_str(), "-",
+					"-", "-", describe(captured).c_str(),
+					describe(firstcase).c_str());
+			else
+				printf("%-20s %10.2f %10.2f %10.2f   %-20s %s\n", name.c_str(),
+					compiletime * 1000, t * 1e9 / n, n / t / 1e6,
+					describe(captured).c_str(), describe(firstcase).c_str());
+			fflush(stdout);
+		}
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	string accuracies = "libm,ulp1,ulp4,fast";
+	string modes = "call,batch,threads";
+
+	po::options_description options("Allowed options");
+	options.add_options()
+	    ("help,h",
+	    		"produce help message")
+	    ("accuracy,a", po::value(&accuracies),
+	    		"comma-separated maths accuracies to compile with (libm, ulp1, ulp4, fast)")
+	    ("mode,m",     po::value(&modes),
+	    		"comma-separated ways to run the calls (call, batch, threads)")
+	    ("threads,j",  po::value(&threads),
+	    		"number of threads for the threads mode (0 means one per CPU)")
+	    ("time,t",     po::value(&mintime),
+	    		"minimum time to spend on each case, in seconds")
+	    ("check,c",
+	    		"run each case once and only compare the outputs")
+	;
+
+	po::options_description hidden;
+	hidden.add_options()
+	    ("capture", po::value<string>(), "capture file")
+	;
+
+	po::options_description all;
+	all.add(options).add(hidden);
+
+	po::positional_options_description positional;
+	positional.add("capture", 1);
+
+	po::variables_map vm;
+	po::store(po::command_line_parser(argc, argv)
+		.options(all).positional(positional).run(), vm);
+	po::notify(vm);
+
+	if (vm.count("help") || !vm.count("capture"))
+	{
+		std::cout << "Usage: replay [options] capturefile\n"
+				  << options << "\n"
+				  << "Capture files are written by Calculon::Capture, e.g. with\n"
+				  << "filter --capture. Outputs are compared with the recorded\n"
+				  << "ones and with the first case's, in ulps for reals.\n";
+		exit(1);
+	}
+	check = (vm.count("check") > 0);
+
+	Calculon::Capture::Recording recording;
+	try
+	{
+		recording = Calculon::Capture::load(vm["capture"].as<string>());
+	}
+	catch (const std::runtime_error& e)
+	{
+		std::cerr << "replay: " << e.what() << "\n";
+		exit(1);
+	}
+
+	printf("replay: %zu calls to %s, %s precision\n", recording.count(),
+		recording.signature.c_str(),
+		(recording.realsize == sizeof(float)) ? "float" : "double");
+
+	try
+	{
+		if (recording.realsize == sizeof(float))
+			replay<Calculon::RealIsFloat>(recording, split(accuracies),
+				split(modes));
+		else
+			replay<Calculon::RealIsDouble>(recording, split(accuracies),
+				split(modes));
+	}
+	catch (const std::invalid_argument& e)
+	{
+		std::cerr << "replay: " << e.what() << "\n";
+		exit(1);
+	}
+
+	return 0;
+}
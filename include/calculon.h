@@ -12,9 +12,29 @@
 #include <set>
 #include <vector>
 #include <sstream>
+#include <fstream>
 #include <cassert>
 #include <cctype>
 #include <memory>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <initializer_list>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
 #include <boost/aligned_storage.hpp>
 #include <boost/static_assert.hpp>
 #include <boost/algorithm/string/split.hpp>
@@ -27,10 +47,21 @@
 #include "llvm/IR/Attributes.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Support/SourceMgr.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/Analysis/Passes.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
@@ -87,6 +118,8 @@ namespace Calculon
 	};
 
 	#include "calculon_allocator.h"
+	#include "calculon_trace.h"
+	#include "calculon_capture.h"
 
 	namespace Impl
 	{
@@ -199,6 +232,24 @@ namespace Calculon
 		{
 		};
 
+		/* Matrices are stored row-major, exactly like a Vector with
+		 * rows*columns elements.
+		 */
+
+		template <int rows, int columns> struct Matrix :
+				public Impl::Vector<S, rows*columns>
+		{
+			Real& at(int row, int column)
+			{
+				return this->m[row*columns + column];
+			}
+
+			const Real& at(int row, int column) const
+			{
+				return this->m[row*columns + column];
+			}
+		};
+
 		class CompilationException : public std::invalid_argument
 		{
 		public:
@@ -208,6 +259,185 @@ namespace Calculon
 			}
 		};
 
+		/* How the maths library functions are computed. LIBM calls the
+		 * system maths library; the others use inline kernels which the
+		 * optimisers can see into, trading accuracy for speed. */
+
+		enum MathAccuracy
+		{
+			LIBM,
+			ULP1, /* within about 1 ulp */
+			ULP4, /* within about 4 ulp */
+			FAST  /* relative error of about 1e-5 */
+		};
+
+		/* How the items of one parameter are arranged in memory for a batch
+		 * call. AOS stores each item contiguously, one record every `size`
+		 * bytes (0 means packed elements, with no Vector padding). SOA
+		 * stores each vector element in its own column. AOSOA stores blocks
+		 * of `size` items, each block holding one column per vector element.
+		 * Inputs may also be UNIFORM, one value shared by all items, or
+		 * GRID, computed from the item's position as origin + x*dx + y*dy
+		 * (reals only; the binding points at origin, dx and dy, each one
+		 * real per element). */
+
+		struct Layout
+		{
+			enum Kind
+			{
+				AOS,
+				SOA,
+				AOSOA,
+				UNIFORM,
+				GRID
+			};
+
+			Kind kind;
+			size_t size;
+
+			Layout(Kind kind = AOS, size_t size = 0):
+				kind(kind),
+				size(size)
+			{
+			}
+
+			static Layout aos(size_t recordsize = 0)
+			{
+				return Layout(AOS, recordsize);
+			}
+
+			static Layout soa()
+			{
+				return Layout(SOA);
+			}
+
+			static Layout aosoa(size_t blocksize)
+			{
+				return Layout(AOSOA, blocksize);
+			}
+
+			static Layout uniform()
+			{
+				return Layout(UNIFORM);
+			}
+
+			static Layout grid()
+			{
+				return Layout(GRID);
+			}
+		};
+
+		/* Where one parameter's items live for a batch call: the first item
+		 * for AOS and AOSOA, or one pointer per vector element for SOA. */
+
+		struct Binding
+		{
+			void* base;
+			void* const* columns;
+
+			Binding(void* base):
+				base(base),
+				columns(NULL)
+			{
+			}
+
+			Binding(void* const* columns):
+				base(NULL),
+				columns(columns)
+			{
+			}
+		};
+
+		/* A C struct whose fields are script parameters. Register it in
+		 * Options::structs and use its name as a parameter type in the
+		 * signature: Entrypoint then takes a pointer to the struct, and each
+		 * field becomes a variable of the same name, read or written in
+		 * place. `size` is only needed for batch calls. */
+
+		struct Struct
+		{
+			struct Field
+			{
+				string name;
+				size_t offset;
+				string type;
+			};
+
+			size_t size;
+			vector<Field> fields;
+
+			Struct(size_t size = 0):
+				size(size)
+			{
+			}
+
+			Struct& add(const string& name, size_t offset, const string& type)
+			{
+				fields.push_back(Field { name, offset, type });
+				return *this;
+			}
+		};
+
+		/* What an external function is known to do; pass these to
+		 * StandardSymbolTable::add(). They let the optimisers combine, hoist
+		 * and delete calls, so if they're wrong, so are the results. */
+
+		enum ExternalFlags
+		{
+			PURE       = 1<<0, /* no side effects, but may read global memory */
+			READNONE   = 1<<1, /* no side effects, reads only its parameters */
+			NOUNWIND   = 1<<2, /* never throws */
+			WILLRETURN = 1<<3, /* always returns */
+			BYVALUE    = 1<<4  /* real vectors of up to 16 bytes are passed
+			                    * and returned in registers, as compiler
+			                    * vector types */
+		};
+
+		/* Per-Program compilation options. */
+
+		struct Options
+		{
+			MathAccuracy accuracy;
+
+			/* If set, also generate a batch entrypoint; parameters not
+			 * mentioned in the layouts for their direction are packed AOS.
+			 * An input and an output may share a name. */
+			bool batch;
+			map<string, Layout> inputLayouts;
+			map<string, Layout> outputLayouts;
+
+			/* If set, also generate a grid entrypoint, which runs over a
+			 * rectangle of items one tile x tile square at a time, visiting
+			 * the squares in rows or (if morton is set) in Z order. */
+			bool grid;
+			size_t tile;
+			bool morton;
+
+			map<string, Struct> structs;
+
+			/* If set (the default), the script is simplified before any
+			 * code is generated: expressions on known values are worked
+			 * out, including let-functions called with known arguments,
+			 * and conditionals on known values generate only one arm.
+			 * Folded arithmetic is never fused into multiply-adds, which
+			 * the generated code may be, so results can differ slightly. */
+			bool fold;
+
+			/* If set, each phase of compilation is recorded here. */
+			Trace* trace;
+
+			Options():
+				accuracy(LIBM),
+				batch(false),
+				grid(false),
+				tile(64),
+				morton(false),
+				fold(true),
+				trace(NULL)
+			{
+			}
+		};
+
 	private:
 		struct Position
 		{
@@ -226,6 +456,9 @@ namespace Calculon
 		class TypeRegistry;
 		class Type;
 		class VectorType;
+		class MatrixType;
+		class ExternalFunctionSymbol;
+		class BitcodeModule;
 
 		class CompilerState : public Allocator
 		{
@@ -234,29 +467,84 @@ namespace Calculon
 			llvm::Module* module;
 			llvm::IRBuilder<> builder;
 			llvm::ExecutionEngine* engine;
+			const Options options;
 			Position position;
 			TypeRegistry* types;
-			llvm::Type* intType;
+			llvm::Type* intType;       /* i32, for element numbers and counts */
 			Type* realType;
 			llvm::Type* doubleType;
 			llvm::Type* floatType;
 			Type* booleanType;
+			Type* scriptIntType;       /* the script's int */
+
+			/* The function being compiled for the script's top level, and
+			 * the placeholders for any external calls in it which may be
+			 * batched. */
+			llvm::Function* toplevelFunction;
+			vector<pair<llvm::Function*, ExternalFunctionSymbol*> > batchSites;
+
+			/* Bitcode modules already linked into this one. */
+			set<BitcodeModule*> linkedBitcode;
 
 			CompilerState(llvm::LLVMContext& context, llvm::Module* module,
-					llvm::ExecutionEngine* engine):
+					llvm::ExecutionEngine* engine, const Options& options):
 				context(context),
 				module(module),
 				builder(context),
 				engine(engine),
+				options(options),
 				types(NULL),
 				intType(NULL),
-				realType(NULL), doubleType(NULL), floatType(NULL)
+				realType(NULL), doubleType(NULL), floatType(NULL),
+				booleanType(NULL), scriptIntType(NULL),
+				toplevelFunction(NULL)
+			{
+			}
+
+			/* Number literals are reals, but one with an integral value may
+			 * be used wherever an int is wanted. Anything else is returned
+			 * unchanged for the caller to type check. */
+
+			llvm::Value* coerceConstant(llvm::Value* value, const Type* type)
+			{
+				if (type != scriptIntType)
+					return value;
+
+				llvm::ConstantFP* c = llvm::dyn_cast_or_null<llvm::ConstantFP>(value);
+				if (!c)
+					return value;
+
+				double d = c->getValueAPF().convertToDouble();
+				if ((d != floor(d)) || (d < INT32_MIN) || (d > INT32_MAX))
+					return value;
+
+				return llvm::ConstantInt::get(type->llvm, (int64_t)d, true);
+			}
+
+			/* Stack slots go in the entry block, where they're allocated
+			 * once per call and the optimisers can promote them. */
+
+			llvm::AllocaInst* createEntryAlloca(llvm::Type* type)
+			{
+				llvm::Function* f = builder.GetInsertBlock()->getParent();
+				llvm::IRBuilder<> entry(&f->getEntryBlock(),
+						f->getEntryBlock().begin());
+				return entry.CreateAlloca(type);
+			}
+
+			/* a*b + c, fused where the target allows it. */
+
+			llvm::Value* createFMulAdd(llvm::Value* a, llvm::Value* b,
+					llvm::Value* c)
 			{
+				return builder.CreateIntrinsic(llvm::Intrinsic::fmuladd,
+						a->getType(), { a, b, c });
 			}
 		};
 
 		#include "calculon_symbol.h"
 		#include "calculon_types.h"
+		#include "calculon_mathkernels.h"
 	private:
 		#include "calculon_lexer.h"
 	public:
@@ -274,24 +562,49 @@ namespace Calculon
 			llvm::Module* _module;
 			std::unique_ptr<llvm::ExecutionEngine> _engine;
 			llvm::Function* _function;
+			llvm::Function* _batchfunction;
+			llvm::Function* _gridfunction;
 			FuncType* _funcptr;
+			void (*_batchptr)(size_t start, size_t count, const Binding* bindings);
+			void (*_gridptr)(size_t x, size_t y, size_t width, size_t height,
+					size_t pitch, const Binding* bindings);
+			size_t _tile;
+			bool _morton;
+			vector<Parameter> _inputs;
+			vector<Parameter> _outputs;
 
 		public:
 			typedef typename S::Real Real;
+			typedef FuncType Function;
 
 		public:
 			Program(SymbolTable& symbols, const string& code, const string& signature,
 						const map<string, string>& typealiases):
 					_symbols(symbols),
-					_funcptr(NULL)
+					_funcptr(NULL),
+					_batchptr(NULL),
+					_gridptr(NULL)
 			{
 				std::istringstream stream(code);
 				init(stream, signature, typealiases);
 			}
 
+			Program(SymbolTable& symbols, const string& code, const string& signature,
+						const map<string, string>& typealiases, const Options& options):
+					_symbols(symbols),
+					_funcptr(NULL),
+					_batchptr(NULL),
+					_gridptr(NULL)
+			{
+				std::istringstream stream(code);
+				init(stream, signature, typealiases, options);
+			}
+
 			Program(SymbolTable& symbols, const string& code, const string& signature):
 					_symbols(symbols),
-					_funcptr(NULL)
+					_funcptr(NULL),
+					_batchptr(NULL),
+					_gridptr(NULL)
 			{
 				std::istringstream stream(code);
 				map<string, string> typealiases;
@@ -301,14 +614,28 @@ namespace Calculon
 			Program(SymbolTable& symbols, std::istream& code, const string& signature,
 						const map<string, string>& typealiases):
 					_symbols(symbols),
-					_funcptr(NULL)
+					_funcptr(NULL),
+					_batchptr(NULL),
+					_gridptr(NULL)
 			{
 				init(code, signature, typealiases);
 			}
 
+			Program(SymbolTable& symbols, std::istream& code, const string& signature,
+						const map<string, string>& typealiases, const Options& options):
+					_symbols(symbols),
+					_funcptr(NULL),
+					_batchptr(NULL),
+					_gridptr(NULL)
+			{
+				init(code, signature, typealiases, options);
+			}
+
 			Program(SymbolTable& symbols, std::istream& code, const string& signature):
 					_symbols(symbols),
-					_funcptr(NULL)
+					_funcptr(NULL),
+					_batchptr(NULL),
+					_gridptr(NULL)
 			{
 				map<string, string> typealiases;
 				init(code, signature, typealiases);
@@ -323,15 +650,114 @@ namespace Calculon
 				return _funcptr;
 			}
 
+			/* Runs the program over items [start, start+count). There is one
+			 * binding per parameter, inputs first and then outputs, in
+			 * signature order. The Program must have been compiled with
+			 * Options::batch set. */
+
+			void batch(size_t start, size_t count, const Binding* bindings) const
+			{
+				assert(_batchptr);
+				_batchptr(start, count, bindings);
+			}
+
+			/* Runs the program over a rectangle of items in a 2D array of
+			 * pitch items per row, so item (x, y) is number y*pitch + x.
+			 * Bindings are as for batch(). The Program must have been
+			 * compiled with Options::grid set. */
+
+			void grid(size_t x, size_t y, size_t width, size_t height,
+					size_t pitch, const Binding* bindings) const
+			{
+				assert(_gridptr);
+				size_t tilesx = (width + _tile - 1) / _tile;
+				size_t tilesy = (height + _tile - 1) / _tile;
+
+				if (!_morton)
+				{
+					for (size_t ty = 0; ty < tilesy; ty++)
+						for (size_t tx = 0; tx < tilesx; tx++)
+							gridTile(x, y, width, height, tx, ty, pitch, bindings);
+					return;
+				}
+
+				/* Walk the Z curve over squares of a power-of-two number of
+				 * tiles, big enough to cover the shorter side, skipping the
+				 * tiles outside the rectangle. The squares are visited in a
+				 * line along the longer side, which is the order a single
+				 * square covering everything would visit them in; but a
+				 * long thin rectangle doesn't have to walk all of that. */
+
+				size_t side = 1;
+				while ((side < tilesx) && (side < tilesy))
+					side *= 2;
+				bool wide = (tilesx >= tilesy);
+				size_t squares = ((wide ? tilesx : tilesy) + side - 1) / side;
+				for (size_t s = 0; s < squares; s++)
+				{
+					size_t sx = wide ? (s * side) : 0;
+					size_t sy = wide ? 0 : (s * side);
+					for (uint64_t d = 0; d < (side*side); d++)
+					{
+						size_t tx = sx + unshuffle(d);
+						size_t ty = sy + unshuffle(d >> 1);
+						if ((tx < tilesx) && (ty < tilesy))
+							gridTile(x, y, width, height, tx, ty, pitch, bindings);
+					}
+				}
+			}
+
+			/* How Entrypoint's parameters are passed. */
+
+			const vector<Parameter>& inputs() const
+			{
+				return _inputs;
+			}
+
+			const vector<Parameter>& outputs() const
+			{
+				return _outputs;
+			}
+
 			void dump()
 			{
 				_module->print(llvm::outs(), nullptr);
 			}
 
 		private:
+			void gridTile(size_t x, size_t y, size_t width, size_t height,
+					size_t tx, size_t ty, size_t pitch,
+					const Binding* bindings) const
+			{
+				size_t x0 = tx * _tile;
+				size_t y0 = ty * _tile;
+				_gridptr(x + x0, y + y0,
+					std::min(_tile, width - x0), std::min(_tile, height - y0),
+					pitch, bindings);
+			}
+
+			/* Gathers the even bits of a Morton code. */
+
+			static size_t unshuffle(uint64_t d)
+			{
+				d &= 0x5555555555555555ULL;
+				d = (d | (d >> 1)) & 0x3333333333333333ULL;
+				d = (d | (d >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+				d = (d | (d >> 4)) & 0x00ff00ff00ff00ffULL;
+				d = (d | (d >> 8)) & 0x0000ffff0000ffffULL;
+				d = (d | (d >> 16)) & 0x00000000ffffffffULL;
+				return d;
+			}
+
 			void init(std::istream& codestream, const string& signature,
-					const map<string, string>& typealiases)
+					const map<string, string>& typealiases,
+					const Options& calculonoptions = Options())
 			{
+				Trace* trace = calculonoptions.trace;
+				Trace::Scope compiling(trace, "compile", "compile",
+					"\"signature\": " + Trace::quote(signature));
+				Trace::Scope setup(trace, "compile", "setup");
+
 				unique_ptr<llvm::Module> module(new llvm::Module("Calculon Function", _context));
 				_module = module.get();
 
@@ -345,6 +771,17 @@ namespace Calculon
 				options.GuaranteedTailCallOpt = true;
 				options.AllowFPOpFusion = llvm::FPOpFusion::Fast;
 
+				/* Generate code for the host CPU, so that we get FMA and the
+				 * widest vector units available. */
+
+				llvm::StringMap<bool> hostfeatures;
+				vector<string> attrs;
+				if (llvm::sys::getHostCPUFeatures(hostfeatures))
+				{
+					for (auto& f : hostfeatures)
+						attrs.push_back((f.second ? "+" : "-") + f.first().str());
+				}
+
 				string s;
 				_engine.reset(
 					llvm::EngineBuilder(std::move(module))
@@ -352,6 +789,8 @@ namespace Calculon
 						.setErrorStr(&s)
 						.setOptLevel(llvm::CodeGenOpt::Aggressive)
 						.setTargetOptions(options)
+						.setMCPU(llvm::sys::getHostCPUName())
+						.setMAttrs(attrs)
 						.create()
 				);
 				if (!_engine)
@@ -359,7 +798,10 @@ namespace Calculon
 				_engine->DisableLazyCompilation();
 	//			_engine->DisableSymbolSearching();
 
-				Compiler compiler(_context, _module, _engine.get(), typealiases);
+				setup.end();
+
+				Compiler compiler(_context, _module, _engine.get(), typealiases,
+						calculonoptions);
 
 				/* Compile the program. */
 
@@ -367,35 +809,86 @@ namespace Calculon
 				ToplevelSymbol* f = compiler.compile(signaturestream, codestream,
 						&_symbols);
 				_function = f->function;
-
-				generate_machine_code();
+				_batchfunction = compiler.batchFunction();
+				_gridfunction = compiler.gridFunction();
+				_inputs = compiler.inputParameters();
+				_outputs = compiler.outputParameters();
+				_tile = std::max(calculonoptions.tile, (size_t)1);
+				_morton = calculonoptions.morton;
+
+				generate_machine_code(trace);
 			}
 
 		private:
 
-			void generate_machine_code()
+			void generate_machine_code(Trace* trace)
 			{
 				//_module->dump();
 				llvm::verifyFunction(*_function);
+				if (_batchfunction)
+					llvm::verifyFunction(*_batchfunction);
+				if (_gridfunction)
+					llvm::verifyFunction(*_gridfunction);
 
 				llvm::legacy::FunctionPassManager fpm(_module);
 				llvm::legacy::PassManager mpm;
+
+				/* Tell the optimisers what the target can do, or the
+				 * vectorisers will assume that it has no vector units. */
+
+				llvm::TargetMachine* tm = _engine->getTargetMachine();
+				fpm.add(llvm::createTargetTransformInfoWrapperPass(
+						tm->getTargetIRAnalysis()));
+				mpm.add(llvm::createTargetTransformInfoWrapperPass(
+						tm->getTargetIRAnalysis()));
+
 				llvm::PassManagerBuilder pmb;
 				pmb.OptLevel = 3;
+				pmb.SLPVectorize = true;
+				pmb.LoopVectorize = true;
 				pmb.populateFunctionPassManager(fpm);
 
 				pmb.Inliner = llvm::createFunctionInliningPass(275);
 				pmb.populateModulePassManager(mpm);
 
+				Trace::Scope optimising(trace, "compile", "optimise functions");
 				fpm.doInitialization();
 				fpm.run(*_function);
+				if (_batchfunction)
+					fpm.run(*_batchfunction);
+				if (_gridfunction)
+					fpm.run(*_gridfunction);
+				optimising.end();
+
+				Trace::Scope linking(trace, "compile", "optimise module");
 				mpm.run(*_module);
+				linking.end();
 
+				/* The machine code is emitted on the first lookup. */
+
+				Trace::Scope emitting(trace, "compile", "emit");
 				_funcptr = (FuncType*) _engine->getFunctionAddress("Entrypoint");
 				assert(_funcptr);
+
+				if (_batchfunction)
+				{
+					_batchptr = (decltype(_batchptr))
+						_engine->getFunctionAddress("BatchEntrypoint");
+					assert(_batchptr);
+				}
+
+				if (_gridfunction)
+				{
+					_gridptr = (decltype(_gridptr))
+						_engine->getFunctionAddress("GridEntrypoint");
+					assert(_gridptr);
+				}
 			}
 		};
 	};
+
+	#include "calculon_dispatch.h"
+	#include "calculon_stats.h"
 }
 
 #endif
@@ -31,7 +31,7 @@ struct ASTNode : public Object
 
 	llvm::Value* codegen_to_type(Compiler& compiler, Type* type)
 	{
-		llvm::Value* v = codegen(compiler);
+		llvm::Value* v = compiler.coerceConstant(codegen(compiler), type);
 		Type* t = compiler.types->find(v->getType());
 
 		if (!t->equals(type))
@@ -58,6 +58,77 @@ struct ASTNode : public Object
 	{
 	}
 
+	/* Constant folding, between resolveVariables() and codegen(): returns
+	 * the node to use in place of this one, which may be this one with
+	 * its children folded. */
+
+	virtual ASTNode* fold(Compiler& compiler)
+	{
+		return this;
+	}
+
+	/* Returns true, with the value, if this is a literal. */
+
+	virtual bool constant(Constant& result)
+	{
+		return false;
+	}
+
+	/* Works out the value at compile time, with any let-function
+	 * arguments bound in compiler._constants. Returns false if it can't. */
+
+	virtual bool evaluate(Compiler& compiler, Constant& result)
+	{
+		return false;
+	}
+
+	/* Whether this might turn out to be an int. A number literal in one
+	 * arm of a conditional becomes an int if the other arm is, so a
+	 * conditional can't be evaluated to such an arm unless this is false
+	 * for the other. */
+
+	virtual bool mayBeInteger(Compiler& compiler)
+	{
+		return true;
+	}
+
+	/* Type checks code which folding has shown can never run, without
+	 * keeping any of it: it's generated into a scratch function, which is
+	 * then thrown away. Returns what codegen() would have returned if that
+	 * was a constant, otherwise an undef of the same type (or NULL for a
+	 * return). */
+
+	llvm::Value* typeCheck(Compiler& compiler)
+	{
+		llvm::BasicBlock* bb = compiler.builder.GetInsertBlock();
+		llvm::BasicBlock::iterator bi = compiler.builder.GetInsertPoint();
+
+		llvm::Function* scratch = llvm::Function::Create(
+				llvm::FunctionType::get(compiler.builder.getVoidTy(), false),
+				llvm::Function::InternalLinkage, "typecheck", compiler.module);
+		compiler.builder.SetInsertPoint(
+				llvm::BasicBlock::Create(compiler.context, "", scratch));
+
+		llvm::Value* v = codegen(compiler);
+		if (v && !llvm::isa<llvm::Constant>(v))
+			v = llvm::UndefValue::get(v->getType());
+
+		compiler.builder.SetInsertPoint(bb, bi);
+		scratch->dropAllReferences();
+		scratch->eraseFromParent();
+		return v;
+	}
+
+	static ASTNode* literal(Compiler& compiler, const Position& position,
+			const Constant& value)
+	{
+		if (value.boolean)
+			return compiler.retain(new ASTBoolean(position,
+					value.value ? "true" : "false"));
+		return compiler.retain(new ASTConstant(position, value.value,
+				value.opaque));
+	}
+
 	virtual ASTFrame* getFrame()
 	{
 		return parent->getFrame();
@@ -72,16 +143,41 @@ struct ASTNode : public Object
 struct ASTConstant : public ASTNode
 {
 	Real value;
+	bool opaque;
 
-	ASTConstant(const Position& position, Real value):
+	ASTConstant(const Position& position, Real value, bool opaque = false):
 		ASTNode(position),
-		value(value)
+		value(value), opaque(opaque)
 	{
 	}
 
+	/* A folded value which wouldn't have been an LLVM constant is hidden
+	 * behind a freeze (which the optimisers remove), so that it isn't
+	 * coerced to an int where a literal would be. */
+
 	llvm::Value* codegen(Compiler& compiler)
 	{
-		return llvm::ConstantFP::get(compiler.realType->llvm, value);
+		llvm::Value* v = llvm::ConstantFP::get(compiler.realType->llvm, value);
+		if (opaque)
+			v = compiler.builder.CreateFreeze(v);
+		return v;
+	}
+
+	bool constant(Constant& result)
+	{
+		result = Constant::real(value);
+		result.opaque = opaque;
+		return true;
+	}
+
+	bool evaluate(Compiler& compiler, Constant& result)
+	{
+		return constant(result);
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		return false;
 	}
 };
 
@@ -102,20 +198,38 @@ struct ASTBoolean : public ASTNode
 		else
 			return llvm::ConstantInt::getFalse(compiler.booleanType->llvm);
 	}
+
+	bool constant(Constant& result)
+	{
+		result = Constant::truth(id == "true");
+		return true;
+	}
+
+	bool evaluate(Compiler& compiler, Constant& result)
+	{
+		return constant(result);
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		return false;
+	}
 };
 
 struct ASTVariable : public ASTNode
 {
 	string id;
 	ValuedSymbol* symbol;
+	VariableSymbol* variable; /* before importing as an upvalue */
 
 	using ASTNode::getFrame;
 	using ASTNode::getFunction;
 	using ASTNode::position;
+	using ASTNode::literal;
 
 	ASTVariable(const Position& position, const string& id):
 		ASTNode(position),
-		id(id), symbol(NULL)
+		id(id), symbol(NULL), variable(NULL)
 	{
 	}
 
@@ -133,15 +247,57 @@ struct ASTVariable : public ASTNode
 			throw CompilationException(position.formatError(s.str()));
 		}
 
-		VariableSymbol* v = symbol->isVariable();
-		if (v)
-			symbol = getFunction()->importUpvalue(compiler, v);
+		variable = symbol->isVariable();
+		if (variable)
+			symbol = getFunction()->importUpvalue(compiler, variable);
 	}
 
 	llvm::Value* codegen(Compiler& compiler)
 	{
 		return symbol->emitValue(compiler);
 	}
+
+	ASTNode* fold(Compiler& compiler)
+	{
+		Constant c;
+		if (evaluate(compiler, c))
+			return literal(compiler, position, c);
+		return this;
+	}
+
+	bool evaluate(Compiler& compiler, Constant& result)
+	{
+		if (!variable)
+			return symbol->fold(compiler, result);
+
+		typename map<VariableSymbol*, Constant>::const_iterator i =
+				compiler._constants.find(variable);
+		if (i == compiler._constants.end())
+			return false;
+		result = i->second;
+
+		/* An upvalue is passed in as a parameter. */
+
+		if (symbol != variable)
+			result.opaque = true;
+		return true;
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		if (!variable)
+			return false;
+		if (variable->type)
+			return variable->type->llvm == compiler.scriptIntType->llvm;
+
+		/* An untyped let is whatever its value is. */
+
+		typename map<VariableSymbol*, ASTNode*>::const_iterator i =
+				compiler._bindings.find(variable);
+		if (i == compiler._bindings.end())
+			return true;
+		return i->second->mayBeInteger(compiler);
+	}
 };
 
 struct ASTVector : public ASTNode
@@ -180,6 +336,21 @@ struct ASTVector : public ASTNode
 		for (unsigned i = 0; i < elements.size(); i++)
 			elements[i]->resolveVariables(compiler);
 	}
+
+	ASTNode* fold(Compiler& compiler)
+	{
+		for (unsigned i = 0; i < elements.size(); i++)
+		{
+			elements[i] = elements[i]->fold(compiler);
+			elements[i]->parent = this;
+		}
+		return this;
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		return false;
+	}
 };
 
 struct ASTVectorSplat : public ASTNode
@@ -216,6 +387,18 @@ struct ASTVectorSplat : public ASTNode
 	{
 		value->resolveVariables(compiler);
 	}
+
+	ASTNode* fold(Compiler& compiler)
+	{
+		value = value->fold(compiler);
+		value->parent = this;
+		return this;
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		return false;
+	}
 };
 
 struct ASTFrame : public ASTNode
@@ -271,6 +454,60 @@ struct ASTDefineVariable : public ASTFrame
 		body->resolveVariables(compiler);
 	}
 
+	/* A variable set to a literal is replaced by the literal, unless its
+	 * declared type would make it something else (e.g. an int). */
+
+	bool bindable(Compiler& compiler, const Constant& c)
+	{
+		if (!type)
+			return true;
+		return c.boolean ? (type == compiler.booleanType) :
+				(type == compiler.realType);
+	}
+
+	ASTNode* fold(Compiler& compiler)
+	{
+		value = value->fold(compiler);
+		value->parent = parent;
+
+		Constant c;
+		if (value->constant(c) && bindable(compiler, c))
+			compiler._constants[_symbol] = c;
+		if (!type)
+			compiler._bindings[_symbol] = value;
+
+		body = body->fold(compiler);
+		body->parent = this;
+		return this;
+	}
+
+	bool evaluate(Compiler& compiler, Constant& result)
+	{
+		Constant c;
+		if (!value->evaluate(compiler, c) || !bindable(compiler, c))
+			return false;
+
+		/* Recursive calls rebind the same variable. */
+
+		typename map<VariableSymbol*, Constant>::iterator i =
+				compiler._constants.find(_symbol);
+		bool bound = (i != compiler._constants.end());
+		Constant old = bound ? i->second : c;
+
+		compiler._constants[_symbol] = c;
+		bool ok = body->evaluate(compiler, result);
+		if (bound)
+			compiler._constants[_symbol] = old;
+		else
+			compiler._constants.erase(_symbol);
+		return ok;
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		return body->mayBeInteger(compiler);
+	}
+
 	llvm::Value* codegen(Compiler& compiler)
 	{
 		llvm::Value* v = value->codegen(compiler);
@@ -291,6 +528,8 @@ struct ASTDefineVariable : public ASTFrame
 
 			_symbol->type = type = compiler.types->find(v->getType());
 		}
+		else
+			_symbol->value = v = compiler.coerceConstant(v, type);
 
 		if (v->getType() != type->llvm)
 		{
@@ -312,6 +551,7 @@ struct ASTFunctionBody : public ASTFrame
 	FunctionSymbol* function;
 	ASTNode* body;
 
+	using ASTNode::position;
 	using ASTNode::parent;
 	using ASTFrame::symbolTable;
 
@@ -346,6 +586,13 @@ struct ASTFunctionBody : public ASTFrame
 		body->resolveVariables(compiler);
 	}
 
+	ASTNode* fold(Compiler& compiler)
+	{
+		body = body->fold(compiler);
+		body->parent = this;
+		return this;
+	}
+
 	llvm::Value* codegen(Compiler& compiler)
 	{
 		/* Assemble the LLVM function type. */
@@ -385,10 +632,28 @@ struct ASTFunctionBody : public ASTFrame
 				function->name, compiler.module);
 		function->function = f;
 
+		/* A memo function is split in two: the function itself allocates an
+		 * empty cache and calls the .memo function, which does the work and
+		 * passes the cache on to any recursive calls. */
+
+		llvm::Function* impl = f;
+		llvm::StructType* entrytype = NULL;
+		if (function->memo)
+		{
+			entrytype = memoEntryType(compiler);
+			llvmtypes.push_back(llvm::PointerType::get(entrytype, 0));
+			impl = llvm::Function::Create(
+					llvm::FunctionType::get(returntype, llvmtypes, false),
+					llvm::Function::InternalLinkage,
+					function->name + ".memo", compiler.module);
+			function->memofunction = impl;
+			codegenMemoWrapper(compiler, f, impl, entrytype);
+		}
+
 		/* Bind the argument symbols to their LLVM values. */
 
 		{
-			llvm::Function::arg_iterator vi = f->arg_begin();
+			llvm::Function::arg_iterator vi = impl->arg_begin();
 
 			/* First, normal parameters. */
 
@@ -423,20 +688,31 @@ struct ASTFunctionBody : public ASTFrame
 				li++;
 			}
 
-			assert(vi == f->arg_end());
+			if (function->memo)
+			{
+				assert(vi != impl->arg_end());
+				vi->setName("cache");
+				vi++;
+			}
+
+			assert(vi == impl->arg_end());
 		}
 
 		/* Generate the code. */
 
 		llvm::BasicBlock* toplevel = llvm::BasicBlock::Create(
-				compiler.context, "", f);
+				compiler.context, "", impl);
 
 		llvm::BasicBlock* bb = compiler.builder.GetInsertBlock();
 		llvm::BasicBlock::iterator bi = compiler.builder.GetInsertPoint();
 		compiler.builder.SetInsertPoint(toplevel);
 
-		llvm::Value* v = body->codegen(compiler);
-		compiler.builder.CreateRet(v);
+		llvm::Value* entry = NULL;
+		if (function->memo)
+			entry = codegenMemoLookup(compiler, impl, entrytype);
+
+		llvm::Value* v = compiler.coerceConstant(body->codegen(compiler),
+				function->returntype);
 		if (v->getType() != returntype)
 		{
 			std::stringstream s;
@@ -448,10 +724,144 @@ struct ASTFunctionBody : public ASTFrame
 			throw TypeException(s.str(), this);
 		}
 
+		if (entry)
+		{
+			unsigned n = arguments.size();
+			llvm::Function::arg_iterator vi = impl->arg_begin();
+			compiler.builder.CreateStore(compiler.builder.getTrue(),
+				compiler.builder.CreateStructGEP(entrytype, entry, 0));
+			for (unsigned i=0; i<n; i++, vi++)
+				compiler.builder.CreateStore(&*vi,
+					compiler.builder.CreateStructGEP(entrytype, entry, i+1));
+			compiler.builder.CreateStore(v,
+				compiler.builder.CreateStructGEP(entrytype, entry, n+1));
+		}
+		compiler.builder.CreateRet(v);
+
 		compiler.builder.SetInsertPoint(bb, bi);
 
 		return f;
 	}
+
+private:
+	enum
+	{
+		MEMO_BITS = 7 /* the cache has 1<<MEMO_BITS entries */
+	};
+
+	/* Each cache entry is { valid, arguments..., result }. */
+
+	llvm::StructType* memoEntryType(Compiler& compiler)
+	{
+		vector<llvm::Type*> fields;
+		fields.push_back(compiler.builder.getInt1Ty());
+		for (VariableSymbol* symbol : function->arguments)
+		{
+			if (!symbol->type->llvm->getPrimitiveSizeInBits())
+			{
+				std::stringstream s;
+				s << "memo functions can't take a " << symbol->type->name;
+				throw CompilationException(position.formatError(s.str()));
+			}
+			fields.push_back(symbol->type->llvm);
+		}
+		fields.push_back(function->returntype->llvm);
+		return llvm::StructType::get(compiler.context, fields);
+	}
+
+	void codegenMemoWrapper(Compiler& compiler, llvm::Function* f,
+			llvm::Function* impl, llvm::StructType* entrytype)
+	{
+		llvm::IRBuilder<>& builder = compiler.builder;
+		llvm::BasicBlock* bb = builder.GetInsertBlock();
+		llvm::BasicBlock::iterator bi = builder.GetInsertPoint();
+		builder.SetInsertPoint(llvm::BasicBlock::Create(compiler.context, "", f));
+
+		llvm::AllocaInst* cache = builder.CreateAlloca(entrytype,
+			builder.getInt32(1 << MEMO_BITS));
+		const llvm::DataLayout& dl = compiler.engine->getDataLayout();
+		builder.CreateMemSet(cache, builder.getInt8(0),
+			dl.getTypeAllocSize(entrytype) << MEMO_BITS, cache->getAlign());
+
+		vector<llvm::Value*> parameters;
+		for (llvm::Argument& a : f->args())
+			parameters.push_back(&a);
+		parameters.push_back(cache);
+		builder.CreateRet(builder.CreateCall(impl, parameters));
+
+		builder.SetInsertPoint(bb, bi);
+	}
+
+	/* Looks up the arguments in the cache, returning the cached result if
+	 * they're found; otherwise, leaves the builder where the result should
+	 * be computed and returns the entry to store it in. */
+
+	llvm::Value* codegenMemoLookup(Compiler& compiler, llvm::Function* impl,
+			llvm::StructType* entrytype)
+	{
+		llvm::IRBuilder<>& builder = compiler.builder;
+		unsigned n = function->arguments.size();
+		llvm::Type* i64 = builder.getInt64Ty();
+
+		/* Hash the bits of all the arguments (multiplicatively, so the top
+		 * bits depend on all of them). */
+
+		llvm::Value* hash = builder.getInt64(0);
+		llvm::Function::arg_iterator vi = impl->arg_begin();
+		for (unsigned i=0; i<n; i++, vi++)
+		{
+			llvm::Value* bits = memoBits(compiler, &*vi);
+			unsigned width = bits->getType()->getIntegerBitWidth();
+			unsigned chunks = (width + 63) / 64;
+			bits = builder.CreateZExt(bits, builder.getIntNTy(chunks*64));
+			for (unsigned j=0; j<chunks; j++)
+			{
+				llvm::Value* chunk = builder.CreateTrunc(
+					builder.CreateLShr(bits, j*64), i64);
+				hash = builder.CreateMul(builder.CreateXor(hash, chunk),
+					builder.getInt64(0x9e3779b97f4a7c15ULL));
+			}
+		}
+
+		llvm::Value* cache = &*(impl->arg_end() - 1);
+		llvm::Value* entry = builder.CreateGEP(entrytype, cache,
+			builder.CreateLShr(hash, 64 - MEMO_BITS));
+
+		llvm::Value* hit = builder.CreateLoad(builder.getInt1Ty(),
+			builder.CreateStructGEP(entrytype, entry, 0));
+		vi = impl->arg_begin();
+		for (unsigned i=0; i<n; i++, vi++)
+		{
+			llvm::Value* cached = builder.CreateLoad(vi->getType(),
+				builder.CreateStructGEP(entrytype, entry, i+1));
+			hit = builder.CreateAnd(hit, builder.CreateICmpEQ(
+				memoBits(compiler, cached), memoBits(compiler, &*vi)));
+		}
+
+		llvm::BasicBlock* hitbb = llvm::BasicBlock::Create(
+			compiler.context, "hit", impl);
+		llvm::BasicBlock* missbb = llvm::BasicBlock::Create(
+			compiler.context, "miss", impl);
+		builder.CreateCondBr(hit, hitbb, missbb);
+
+		builder.SetInsertPoint(hitbb);
+		builder.CreateRet(builder.CreateLoad(function->returntype->llvm,
+			builder.CreateStructGEP(entrytype, entry, n+1)));
+
+		builder.SetInsertPoint(missbb);
+		return entry;
+	}
+
+	/* Arguments are compared bitwise (so a NaN matches itself). */
+
+	llvm::Value* memoBits(Compiler& compiler, llvm::Value* value)
+	{
+		llvm::Type* type = value->getType();
+		if (type->isIntegerTy())
+			return value;
+		return compiler.builder.CreateBitCast(value,
+			compiler.builder.getIntNTy(type->getPrimitiveSizeInBits()));
+	}
 };
 
 struct ASTToplevel : public ASTFunctionBody
@@ -502,6 +912,11 @@ struct ASTReturn : public ASTNode
 	{
 	}
 
+	bool mayBeInteger(Compiler& compiler)
+	{
+		return false;
+	}
+
 	void resolveVariables(Compiler& compiler)
 	{
 		ToplevelSymbol* toplevel = getFunction()->isToplevel();
@@ -539,11 +954,22 @@ struct ASTReturn : public ASTNode
 				throw CompilationException(position.formatError(s.str()));
 			}
 
-			llvm::Value* value = insym->isValued()->emitValue(compiler);
-			if (outsym->type->asVector())
-				outsym->type->asVector()->storeToArray(value, ptr);
+			llvm::Value* value = compiler.coerceConstant(
+					insym->isValued()->emitValue(compiler), outsym->type);
+			if (value->getType() != outsym->type->llvm)
+			{
+				std::stringstream s;
+				s << "output value '" << outsym->name << "' is declared as a "
+				  << outsym->type->name << " but was set to a "
+				  << compiler.types->find(value->getType())->name;
+				throw CompilationException(position.formatError(s.str()));
+			}
+
+			if (outsym->type->isAggregate())
+				outsym->type->storeToArray(value, ptr);
 			else
-				compiler.builder.CreateStore(value, ptr);
+				compiler.builder.CreateStore(
+						outsym->type->convertToExternal(value), ptr);
 		}
 
 		return NULL;
@@ -553,7 +979,7 @@ struct ASTReturn : public ASTNode
 struct ASTDefineFunction : public ASTFrame
 {
 	FunctionSymbol* function;
-	ASTNode* definition;
+	ASTFunctionBody* definition;
 	ASTNode* body;
 
 	using ASTNode::parent;
@@ -561,7 +987,7 @@ struct ASTDefineFunction : public ASTFrame
 	using ASTFrame::symbolTable;
 
 	ASTDefineFunction(const Position& position, FunctionSymbol* function,
-			ASTNode* definition, ASTNode* body):
+			ASTFunctionBody* definition, ASTNode* body):
 		ASTFrame(position),
 		function(function), definition(definition), body(body)
 	{
@@ -579,11 +1005,34 @@ struct ASTDefineFunction : public ASTFrame
 		body->resolveVariables(compiler);
 	}
 
+	/* The definition is generated even if every call was folded away,
+	 * so that it's type checked; Compiler::removeUnusedFunctions() then
+	 * removes it again. */
+
 	llvm::Value* codegen(Compiler& compiler)
 	{
 		definition->codegen(compiler);
 		return body->codegen(compiler);
 	}
+
+	ASTNode* fold(Compiler& compiler)
+	{
+		compiler._functions[function] = definition;
+		definition->fold(compiler);
+		body = body->fold(compiler);
+		body->parent = this;
+		return this;
+	}
+
+	bool evaluate(Compiler& compiler, Constant& result)
+	{
+		return body->evaluate(compiler, result);
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		return body->mayBeInteger(compiler);
+	}
 };
 
 struct ASTFunctionCall : public ASTNode
@@ -680,6 +1129,133 @@ struct ASTFunctionCall : public ASTNode
 		compiler.position = position;
 		return function->emitCall(compiler, parameters);
 	}
+
+	ASTNode* fold(Compiler& compiler)
+	{
+		vector<Constant> parameters;
+		for (unsigned i = 0; i < arguments.size(); i++)
+		{
+			arguments[i] = arguments[i]->fold(compiler);
+			arguments[i]->parent = this;
+
+			Constant c;
+			if (arguments[i]->constant(c))
+				parameters.push_back(c);
+		}
+
+		if (parameters.size() == arguments.size())
+		{
+			Constant result;
+			compiler._foldBudget = Compiler::FOLD_BUDGET;
+			if (call(compiler, parameters, result))
+				return literal(compiler, position, result);
+		}
+		return this;
+	}
+
+	bool evaluate(Compiler& compiler, Constant& result)
+	{
+		vector<Constant> parameters;
+		for (unsigned i = 0; i < arguments.size(); i++)
+		{
+			Constant c;
+			if (!arguments[i]->evaluate(compiler, c))
+				return false;
+			parameters.push_back(c);
+		}
+		return call(compiler, parameters, result);
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		bool integers = false;
+		for (unsigned i = 0; i < arguments.size(); i++)
+			integers = integers || arguments[i]->mayBeInteger(compiler);
+		return function->mayReturnInteger(compiler, integers);
+	}
+
+private:
+	using ASTNode::literal;
+
+	bool call(Compiler& compiler, const vector<Constant>& parameters,
+			Constant& result)
+	{
+		/* Let codegen() report the wrong number of parameters. */
+
+		try
+		{
+			function->checkParameterCount(compiler, parameters.size());
+		}
+		catch (const CompilationException&)
+		{
+			return false;
+		}
+
+		FunctionSymbol* callee = function->isFunction();
+		if (!callee)
+		{
+			if (!function->fold(compiler, parameters, result))
+				return false;
+			for (const Constant& p : parameters)
+				result.opaque = result.opaque || p.opaque;
+			return true;
+		}
+
+		/* A let-function is evaluated by walking its body, within a limited
+		 * number of calls, so recursion with known arguments unrolls
+		 * completely or not at all. */
+
+		typename Compiler::FunctionDefinitions::const_iterator i =
+				compiler._functions.find(callee);
+		if ((i == compiler._functions.end()) ||
+				!compiler._foldBudget || (compiler._foldDepth == Compiler::FOLD_DEPTH))
+			return false;
+		compiler._foldBudget--;
+
+		const Type* returntype = callee->returntype;
+		if ((returntype != compiler.realType) && (returntype != compiler.booleanType))
+			return false;
+
+		const vector<VariableSymbol*>& arguments = callee->arguments;
+		for (unsigned j = 0; j < arguments.size(); j++)
+		{
+			Type* type = parameters[j].boolean ?
+					compiler.booleanType : compiler.realType;
+			if (arguments[j]->type != type)
+				return false;
+		}
+
+		/* Bind the arguments, saving any from an outer call to the same
+		 * function. */
+
+		vector<pair<bool, Constant> > saved;
+		for (unsigned j = 0; j < arguments.size(); j++)
+		{
+			typename map<VariableSymbol*, Constant>::const_iterator k =
+					compiler._constants.find(arguments[j]);
+			bool bound = (k != compiler._constants.end());
+			saved.push_back(pair<bool, Constant>(bound,
+					bound ? k->second : parameters[j]));
+			compiler._constants[arguments[j]] = parameters[j];
+		}
+
+		compiler._foldDepth++;
+		bool ok = i->second->body->evaluate(compiler, result);
+		compiler._foldDepth--;
+
+		for (unsigned j = 0; j < arguments.size(); j++)
+		{
+			if (saved[j].first)
+				compiler._constants[arguments[j]] = saved[j].second;
+			else
+				compiler._constants.erase(arguments[j]);
+		}
+
+		/* The generated call isn't a constant. */
+
+		result.opaque = true;
+		return ok && (result.boolean == (returntype == compiler.booleanType));
+	}
 };
 
 struct ASTCondition : public ASTNode
@@ -687,13 +1263,16 @@ struct ASTCondition : public ASTNode
 	ASTNode* condition;
 	ASTNode* trueval;
 	ASTNode* falseval;
+	ASTNode* dead; /* the arm folding showed is never taken, if known */
 
 	using ASTNode::position;
+	using ASTNode::literal;
 
 	ASTCondition(const Position& position, ASTNode* condition,
 			ASTNode* trueval, ASTNode* falseval):
 		ASTNode(position),
-		condition(condition), trueval(trueval), falseval(falseval)
+		condition(condition), trueval(trueval), falseval(falseval),
+		dead(NULL)
 	{
 		condition->parent = trueval->parent = falseval->parent = this;
 	}
@@ -705,8 +1284,72 @@ struct ASTCondition : public ASTNode
 		falseval->resolveVariables(compiler);
 	}
 
+	/* A conditional is only replaced by the value it picks if both arms
+	 * are known, and so known to be the same type; otherwise, if the
+	 * condition is known, codegen() generates only the arm it picks, and
+	 * just type checks the other. */
+
+	ASTNode* fold(Compiler& compiler)
+	{
+		condition = condition->fold(compiler);
+		condition->parent = this;
+		trueval = trueval->fold(compiler);
+		trueval->parent = this;
+		falseval = falseval->fold(compiler);
+		falseval->parent = this;
+
+		Constant c;
+		Constant t;
+		Constant f;
+		if (!condition->constant(c) || !c.boolean)
+			return this;
+		dead = c.value ? falseval : trueval;
+		if (!trueval->constant(t) || !falseval->constant(f) ||
+				(t.boolean != f.boolean))
+			return this;
+
+		Constant result = c.value ? t : f;
+		result.opaque = true;
+		return literal(compiler, position, result);
+	}
+
+	bool evaluate(Compiler& compiler, Constant& result)
+	{
+		Constant c;
+		if (!condition->evaluate(compiler, c) || !c.boolean)
+			return false;
+
+		ASTNode* live = c.value ? trueval : falseval;
+		ASTNode* dead = c.value ? falseval : trueval;
+		if (!live->evaluate(compiler, result))
+			return false;
+		return !result.integral() || !dead->mayBeInteger(compiler);
+	}
+
+	bool mayBeInteger(Compiler& compiler)
+	{
+		return trueval->mayBeInteger(compiler) ||
+				falseval->mayBeInteger(compiler);
+	}
+
 	llvm::Value* codegen(Compiler& compiler)
 	{
+		if (dead)
+		{
+			llvm::Value* trueresult = (dead == trueval) ?
+					trueval->typeCheck(compiler) : trueval->codegen(compiler);
+			llvm::Value* falseresult = (dead == falseval) ?
+					falseval->typeCheck(compiler) : falseval->codegen(compiler);
+			checkArms(compiler, trueresult, falseresult);
+
+			/* A phi wouldn't have been a constant, so it isn't coerced. */
+
+			llvm::Value* v = (dead == trueval) ? falseresult : trueresult;
+			if (llvm::isa<llvm::Constant>(v))
+				v = compiler.builder.CreateFreeze(v);
+			return v;
+		}
+
 		llvm::Value* cv = condition->codegen_to_boolean(compiler);
 
 		llvm::BasicBlock* bb = compiler.builder.GetInsertBlock();
@@ -730,6 +1373,21 @@ struct ASTCondition : public ASTNode
 		falseblock = compiler.builder.GetInsertBlock();
 		compiler.builder.CreateBr(mergeblock);
 
+		checkArms(compiler, trueresult, falseresult);
+
+		compiler.builder.SetInsertPoint(mergeblock);
+		llvm::PHINode* phi = compiler.builder.CreatePHI(trueresult->getType(), 2);
+		phi->addIncoming(trueresult, trueblock);
+		phi->addIncoming(falseresult, falseblock);
+		return phi;
+	}
+
+private:
+	/* Makes the values of the two arms the same type, or complains. */
+
+	void checkArms(Compiler& compiler, llvm::Value*& trueresult,
+			llvm::Value*& falseresult)
+	{
 		if (!trueresult || !falseresult)
 		{
 			std::stringstream s;
@@ -737,18 +1395,19 @@ struct ASTCondition : public ASTNode
 			throw CompilationException(position.formatError(s.str()));
 		}
 
+		/* A number literal on one side may be an int to match the other. */
+
+		trueresult = compiler.coerceConstant(trueresult,
+				compiler.types->find(falseresult->getType()));
+		falseresult = compiler.coerceConstant(falseresult,
+				compiler.types->find(trueresult->getType()));
+
 		if (trueresult->getType() != falseresult->getType())
 		{
 			std::stringstream s;
 			s << "the true and false value of a conditional must be the same type";
 			throw CompilationException(position.formatError(s.str()));
 		}
-
-		compiler.builder.SetInsertPoint(mergeblock);
-		llvm::PHINode* phi = compiler.builder.CreatePHI(trueresult->getType(), 2);
-		phi->addIncoming(trueresult, trueblock);
-		phi->addIncoming(falseresult, falseblock);
-		return phi;
 	}
 };
 
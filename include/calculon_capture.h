@@ -0,0 +1,494 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_CAPTURE_H
+#define CALCULON_CAPTURE_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* One parameter of a Program's Entrypoint, as the caller sees it: passed by
+ * value, or as a pointer to `size` bytes. Vectors and matrices are `size`
+ * bytes of packed elements, exactly as a batch call with a packed AOS
+ * layout expects them; structs have a size of 0. */
+
+struct Parameter
+{
+	string name;
+	bool pointer;
+	size_t size;
+	bool real; /* made of reals (rather than ints, booleans or storage types) */
+
+	bool operator == (const Parameter& other) const
+	{
+		return (name == other.name) && (pointer == other.pointer) &&
+			(size == other.size) && (real == other.real);
+	}
+};
+
+/* Records a sample of the calls made to a Program --- the script, its
+ * signature, the globals it was compiled with, and the inputs and outputs
+ * of each call --- to a compact binary file, so that the calls can be
+ * replayed later (see demo/replay.cc) under other options.
+ *
+ * Wrap the Program in a Captured and call that instead. Only calls through
+ * Entrypoint are captured; batch and grid calls are passed straight on, as
+ * their items may be in any layout. Programs with struct parameters can't be
+ * captured.
+ *
+ * The file is in the host's byte order:
+ *
+ *   "CALCAPT1", u32 sizeof(Real), str script, str signature,
+ *   u32 aliases, { str name, str type },
+ *   u32 reals, { str name, f64 value },
+ *   u32 vectors, { str name, u32 elements, f64 values[elements] },
+ *   u32 inputs, { str name, u8 pointer, u8 real, u64 size },
+ *   u32 outputs, { ...likewise },
+ *   records: { inputs, outputs } until the end of the file
+ *
+ * where a str is a u32 length followed by that many bytes, and each input
+ * and output takes `size` bytes.
+ */
+
+class Capture
+{
+public:
+	/* Everything in a capture file. */
+
+	struct Recording
+	{
+		unsigned realsize;
+		string code;
+		string signature;
+		map<string, string> aliases;
+		map<string, double> reals;
+		map<string, vector<double> > vectors;
+		vector<Parameter> inputs;
+		vector<Parameter> outputs;
+		size_t inputsize;
+		size_t outputsize;
+		vector<char> records;
+
+		size_t count() const
+		{
+			size_t size = inputsize + outputsize;
+			return size ? (records.size() / size) : 0;
+		}
+
+		const char* input(size_t record) const
+		{
+			return &records[record * (inputsize + outputsize)];
+		}
+
+		const char* output(size_t record) const
+		{
+			return input(record) + inputsize;
+		}
+	};
+
+	/* Captures one call in every interval, and stops after limit calls (0
+	 * means never). */
+
+	Capture(const string& filename, const string& code,
+			const string& signature, unsigned interval = 1, uint64_t limit = 0):
+		_filename(filename),
+		_code(code),
+		_signature(signature),
+		_interval(std::max(interval, 1U)),
+		_limit(limit),
+		_calls(0),
+		_count(0),
+		_realsize(0),
+		_stream(filename.c_str(), std::ios::binary)
+	{
+		if (!_stream)
+			throw std::runtime_error("can't open '" + filename + "'");
+	}
+
+	/* Records the type aliases and globals the Program was compiled with;
+	 * call these before the first capture. */
+
+	void alias(const string& name, const string& type)
+	{
+		_aliases[name] = type;
+	}
+
+	void global(const string& name, double value)
+	{
+		_reals[name] = value;
+	}
+
+	void global(const string& name, const vector<double>& value)
+	{
+		_vectors[name] = value;
+	}
+
+	uint64_t count() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _count;
+	}
+
+	/* Whether to capture the next call. */
+
+	bool sample()
+	{
+		uint64_t n = _calls.fetch_add(1, std::memory_order_relaxed);
+		return ((n % _interval) == 0) &&
+			(!_limit || ((n / _interval) < _limit));
+	}
+
+	/* Called by Captured: writes the header, or checks that a later Program
+	 * takes the same parameters. */
+
+	void attach(unsigned realsize, const vector<Parameter>& inputs,
+			const vector<Parameter>& outputs)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_realsize)
+		{
+			if ((realsize != _realsize) || !(inputs == _inputs) ||
+					!(outputs == _outputs))
+				throw std::invalid_argument(
+					"programs captured together must have the same parameters");
+			return;
+		}
+
+		for (const Parameter& p : inputs)
+			checkParameter(p);
+		for (const Parameter& p : outputs)
+			checkParameter(p);
+
+		_realsize = realsize;
+		_inputs = inputs;
+		_outputs = outputs;
+
+		_stream.write("CALCAPT1", 8);
+		put<uint32_t>(realsize);
+		putString(_code);
+		putString(_signature);
+
+		put<uint32_t>(_aliases.size());
+		for (auto& i : _aliases)
+		{
+			putString(i.first);
+			putString(i.second);
+		}
+
+		put<uint32_t>(_reals.size());
+		for (auto& i : _reals)
+		{
+			putString(i.first);
+			put<double>(i.second);
+		}
+
+		put<uint32_t>(_vectors.size());
+		for (auto& i : _vectors)
+		{
+			putString(i.first);
+			put<uint32_t>(i.second.size());
+			for (double d : i.second)
+				put<double>(d);
+		}
+
+		putParameters(inputs);
+		putParameters(outputs);
+		check();
+	}
+
+	/* Doesn't throw, as it's called after the call has been made; a write
+	 * error is reported by the next flush(). */
+
+	void write(const vector<char>& record)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!record.empty())
+			_stream.write(&record[0], record.size());
+		_count++;
+	}
+
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stream.flush();
+		check();
+	}
+
+	static Recording load(const string& filename)
+	{
+		std::ifstream stream(filename.c_str(), std::ios::binary);
+		if (!stream)
+			throw std::runtime_error("can't open '" + filename + "'");
+
+		Recording r;
+		char magic[8];
+		stream.read(magic, sizeof(magic));
+		if (!stream || memcmp(magic, "CALCAPT1", sizeof(magic)))
+			throw std::runtime_error("'" + filename + "' isn't a capture");
+
+		r.realsize = get<uint32_t>(stream);
+		r.code = getString(stream);
+		r.signature = getString(stream);
+
+		for (uint32_t n = get<uint32_t>(stream); n && stream; n--)
+		{
+			string name = getString(stream);
+			r.aliases[name] = getString(stream);
+		}
+
+		for (uint32_t n = get<uint32_t>(stream); n && stream; n--)
+		{
+			string name = getString(stream);
+			r.reals[name] = get<double>(stream);
+		}
+
+		for (uint32_t n = get<uint32_t>(stream); n && stream; n--)
+		{
+			string name = getString(stream);
+			vector<double>& values = r.vectors[name];
+			for (uint32_t e = get<uint32_t>(stream); e && stream; e--)
+				values.push_back(get<double>(stream));
+		}
+
+		r.inputs = getParameters(stream);
+		r.outputs = getParameters(stream);
+		if (!stream)
+			throw std::runtime_error("'" + filename + "' is truncated");
+
+		r.inputsize = r.outputsize = 0;
+		for (const Parameter& p : r.inputs)
+			r.inputsize += p.size;
+		for (const Parameter& p : r.outputs)
+			r.outputsize += p.size;
+
+		r.records.assign(std::istreambuf_iterator<char>(stream),
+			std::istreambuf_iterator<char>());
+		size_t size = r.inputsize + r.outputsize;
+		if (size && (r.records.size() % size))
+			throw std::runtime_error("'" + filename + "' ends with a partial record");
+		return r;
+	}
+
+private:
+	void check()
+	{
+		if (!_stream)
+			throw std::runtime_error("can't write '" + _filename + "'");
+	}
+
+	static void checkParameter(const Parameter& p)
+	{
+		if (p.pointer && !p.size)
+			throw std::invalid_argument("can't capture struct parameter '" +
+				p.name + "'");
+	}
+
+	template <typename T>
+	void put(T value)
+	{
+		_stream.write((const char*)&value, sizeof(value));
+	}
+
+	void putString(const string& s)
+	{
+		put<uint32_t>(s.size());
+		_stream.write(s.data(), s.size());
+	}
+
+	void putParameters(const vector<Parameter>& parameters)
+	{
+		put<uint32_t>(parameters.size());
+		for (const Parameter& p : parameters)
+		{
+			putString(p.name);
+			put<uint8_t>(p.pointer);
+			put<uint8_t>(p.real);
+			put<uint64_t>(p.size);
+		}
+	}
+
+	template <typename T>
+	static T get(std::istream& stream)
+	{
+		T value = T();
+		stream.read((char*)&value, sizeof(value));
+		return value;
+	}
+
+	static string getString(std::istream& stream)
+	{
+		uint32_t size = get<uint32_t>(stream);
+		if (!stream || (size > (1U<<30)))
+			throw std::runtime_error("malformed capture");
+		string s(size, '\0');
+		stream.read(&s[0], size);
+		return s;
+	}
+
+	static vector<Parameter> getParameters(std::istream& stream)
+	{
+		vector<Parameter> parameters;
+		for (uint32_t n = get<uint32_t>(stream); n && stream; n--)
+		{
+			Parameter p;
+			p.name = getString(stream);
+			p.pointer = get<uint8_t>(stream);
+			p.real = get<uint8_t>(stream);
+			p.size = get<uint64_t>(stream);
+			parameters.push_back(p);
+		}
+		return parameters;
+	}
+
+private:
+	string _filename;
+	string _code;
+	string _signature;
+	unsigned _interval;
+	uint64_t _limit;
+	std::atomic<uint64_t> _calls;
+	uint64_t _count;
+	map<string, string> _aliases;
+	map<string, double> _reals;
+	map<string, vector<double> > _vectors;
+	unsigned _realsize;
+	vector<Parameter> _inputs;
+	vector<Parameter> _outputs;
+	mutable std::mutex _mutex;
+	std::ofstream _stream;
+};
+
+/* Forwards to a Program (or a Timed), capturing a sample of the calls in
+ * capture (which may be NULL, in which case it just forwards). */
+
+template <class P, class F = typename P::Function>
+class Captured;
+
+template <class P, class R, class... Ps>
+class Captured<P, R(Ps...)>
+{
+public:
+	typedef R Function(Ps...);
+
+	Captured(const P& program, Capture* capture):
+		_program(program),
+		_capture(capture)
+	{
+		if (!_capture)
+			return;
+
+		const vector<Parameter>& inputs = program.inputs();
+		const vector<Parameter>& outputs = program.outputs();
+		const bool pointers[] = { std::is_pointer<Ps>::value..., false };
+		const size_t sizes[] = { sizeof(Ps)..., 0 };
+		if (sizeof...(Ps) != (inputs.size() + outputs.size()))
+			throw std::invalid_argument(
+				"function type doesn't match the program's signature");
+		for (unsigned i=0; i<sizeof...(Ps); i++)
+		{
+			const Parameter& p = (i < inputs.size()) ?
+				inputs[i] : outputs[i - inputs.size()];
+			if ((p.pointer != pointers[i]) || (!p.pointer && (p.size != sizes[i])))
+				throw std::invalid_argument("function type doesn't match '" +
+					p.name + "' in the program's signature");
+		}
+
+		_capture->attach(sizeof(typename P::Real), inputs, outputs);
+	}
+
+	R operator () (Ps... args) const
+	{
+		if (!_capture || !_capture->sample())
+			return _program(args...);
+
+		Recorder recorder(*this);
+		unsigned i = 0;
+		(void) std::initializer_list<int> { (recorder.gather(i++, args), 0)... };
+		return _program(args...);
+	}
+
+	template <class B>
+	void batch(size_t start, size_t count, const B* bindings) const
+	{
+		_program.batch(start, count, bindings);
+	}
+
+	template <class B>
+	void grid(size_t x, size_t y, size_t width, size_t height,
+			size_t pitch, const B* bindings) const
+	{
+		_program.grid(x, y, width, height, pitch, bindings);
+	}
+
+	const vector<Parameter>& inputs() const
+	{
+		return _program.inputs();
+	}
+
+	const vector<Parameter>& outputs() const
+	{
+		return _program.outputs();
+	}
+
+private:
+	/* Copies the inputs when the call is made, and the outputs (and writes
+	 * the record) when it's finished. */
+
+	class Recorder
+	{
+	public:
+		Recorder(const Captured& captured):
+			_captured(captured)
+		{
+		}
+
+		~Recorder()
+		{
+			const vector<Parameter>& outputs = _captured.outputs();
+			for (unsigned i=0; i<outputs.size(); i++)
+				append(_outputs[i], outputs[i].size);
+			_captured._capture->write(_record);
+		}
+
+		template <class T>
+		void gather(unsigned i, T* value)
+		{
+			const vector<Parameter>& inputs = _captured.inputs();
+			if (i < inputs.size())
+				append(value, inputs[i].size);
+			else
+				_outputs.push_back(value);
+		}
+
+		template <class T>
+		void gather(unsigned i, T value)
+		{
+			append(&value, sizeof(value));
+		}
+
+	private:
+		void append(const void* p, size_t size)
+		{
+			const char* c = (const char*)p;
+			_record.insert(_record.end(), c, c+size);
+		}
+
+		const Captured& _captured;
+		vector<char> _record;
+		vector<const void*> _outputs;
+	};
+
+	const P& _program;
+	Capture* _capture;
+};
+
+template <class P>
+Captured<P> captured(const P& program, Capture* capture)
+{
+	return Captured<P>(program, capture);
+}
+
+#endif
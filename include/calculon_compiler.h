@@ -20,6 +20,7 @@ public:
 private:
 	class ASTNode;
 	class ASTVariable;
+	class ASTFunctionBody;
 
 	typedef Lexer L;
 	typedef pair<string, char> Argument;
@@ -27,15 +28,43 @@ private:
 	using CompilerState::retain;
 	using CompilerState::types;
 	using CompilerState::intType;
+	using CompilerState::engine;
+	using CompilerState::options;
+	using CompilerState::toplevelFunction;
+	using CompilerState::batchSites;
 public:
 	using CompilerState::realType;
 	using CompilerState::doubleType;
 	using CompilerState::floatType;
 	using CompilerState::booleanType;
+	using CompilerState::scriptIntType;
 private:
 
 	map<string, int> _operatorPrecedence;
 	TypeRegistry _typeRegistry;
+	llvm::Function* _batchFunction;
+	llvm::Function* _gridFunction;
+	vector<Parameter> _inputParameters;
+	vector<Parameter> _outputParameters;
+
+	/* State for the AST folder: variables whose values are known (let
+	 * variables set to literals, and the arguments of let-functions being
+	 * evaluated), what untyped lets were set to, and each let-function's
+	 * definition. */
+
+	typedef map<FunctionSymbol*, ASTFunctionBody*> FunctionDefinitions;
+
+	enum
+	{
+		FOLD_BUDGET = 10000, /* let-function calls evaluated per folded call */
+		FOLD_DEPTH = 200     /* nested let-function calls */
+	};
+
+	map<VariableSymbol*, Constant> _constants;
+	map<VariableSymbol*, ASTNode*> _bindings;
+	FunctionDefinitions _functions;
+	unsigned _foldBudget;
+	unsigned _foldDepth;
 
 	class TypeException : public CompilationException
 	{
@@ -96,9 +125,14 @@ private:
 
 public:
 	Compiler(llvm::LLVMContext& context, llvm::Module* module,
-			llvm::ExecutionEngine* engine, const map<string, string>& typealiases):
-		CompilerState(context, module, engine),
-		_typeRegistry(*this, typealiases)
+			llvm::ExecutionEngine* engine, const map<string, string>& typealiases,
+			const Options& options):
+		CompilerState(context, module, engine, options),
+		_typeRegistry(*this, typealiases),
+		_batchFunction(NULL),
+		_gridFunction(NULL),
+		_foldBudget(0),
+		_foldDepth(0)
 	{
 		types = &_typeRegistry;
 
@@ -107,6 +141,7 @@ public:
 		doubleType = llvm::Type::getDoubleTy(context);
 		floatType = llvm::Type::getFloatTy(context);
 		booleanType = types->find("boolean");
+		scriptIntType = types->find("int");
 
 		_operatorPrecedence["and"] = 5;
 		_operatorPrecedence["or"] = 5;
@@ -120,18 +155,33 @@ public:
 		_operatorPrecedence["-"] = 20;
 		_operatorPrecedence["*"] = 30;
 		_operatorPrecedence["/"] = 30;
+		_operatorPrecedence["%"] = 30;
 	}
 
 public:
 	ToplevelSymbol* compile(std::istream& signaturestream, std::istream& codestream,
 			SymbolTable* globals)
 	{
-		vector<VariableSymbol*> arguments;
-		vector<VariableSymbol*> returns;
+		vector<ToplevelParameter> inputs;
+		vector<ToplevelParameter> outputs;
+
+		/* The lexer is driven by the parser, so lexing is timed as part of
+		 * parsing. */
 
+		Trace::Scope parsing(options.trace, "compile", "parse signature");
 		L signaturelexer(signaturestream);
-		parse_toplevelsignature(signaturelexer, arguments, returns);
+		parse_toplevelsignature(signaturelexer, inputs, outputs);
 		expect_eof(signaturelexer);
+		parsing.end();
+
+		/* The script sees struct fields as ordinary parameters. */
+
+		vector<VariableSymbol*> arguments;
+		vector<VariableSymbol*> returns;
+		for (ToplevelParameter& p : inputs)
+			arguments.insert(arguments.end(), p.fields.begin(), p.fields.end());
+		for (ToplevelParameter& p : outputs)
+			returns.insert(returns.end(), p.fields.begin(), p.fields.end());
 
 		/* Create the special symbol which represents the toplevel function. */
 
@@ -140,6 +190,7 @@ public:
 
 		/* Compile the code to an AST. */
 
+		Trace::Scope parsingcode(options.trace, "compile", "parse");
 		L codelexer(codestream);
 		MultipleSymbolTable symboltable(globals);
 		ASTToplevel* ast = parse_toplevel(codelexer, toplevelsymbol, &symboltable);
@@ -147,24 +198,32 @@ public:
 		/* Ensure we've reached the end of the file. */
 
 		expect(codelexer, L::ENDOFFILE);
+		parsingcode.end();
 
-		/* Create the interface function from this signature. */
+		/* Create the interface function from this signature. Structs are
+		 * passed as a pointer to the whole struct. */
 
 		vector<llvm::Type*> externaltypes;
 
-		for (unsigned i=0; i<arguments.size(); i++)
+		for (unsigned i=0; i<inputs.size(); i++)
 		{
-			VariableSymbol* symbol = arguments[i];
-			externaltypes.push_back(symbol->type->llvmx);
+			if (inputs[i].structure)
+				externaltypes.push_back(builder.getInt8PtrTy());
+			else
+				externaltypes.push_back(inputs[i].symbol->type->llvmx);
 		}
 
-		for (unsigned i=0; i<returns.size(); i++)
+		for (unsigned i=0; i<outputs.size(); i++)
 		{
-			VariableSymbol* symbol = returns[i];
-			llvm::Type* t = symbol->type->llvmx;
-			if (!t->isPointerTy())
-				t = t->getPointerTo();
-			externaltypes.push_back(t);
+			if (outputs[i].structure)
+				externaltypes.push_back(builder.getInt8PtrTy());
+			else
+			{
+				llvm::Type* t = outputs[i].symbol->type->llvmx;
+				if (!t->isPointerTy())
+					t = t->getPointerTo();
+				externaltypes.push_back(t);
+			}
 		}
 
 		llvm::FunctionType* ft = llvm::FunctionType::get(
@@ -174,6 +233,7 @@ public:
 		toplevelsymbol->function = llvm::Function::Create(ft,
 				llvm::Function::ExternalLinkage,
 				"Entrypoint", module);
+		toplevelFunction = toplevelsymbol->function;
 
 		llvm::BasicBlock* bb = llvm::BasicBlock::Create(context, "entry",
 			toplevelsymbol->function);
@@ -182,17 +242,32 @@ public:
 		/* Marshal any input parameters to internal types. */
 
 		llvm::Function::arg_iterator ii = toplevelsymbol->function->arg_begin();
-		for (unsigned i=0; i<arguments.size(); i++)
+		for (unsigned i=0; i<inputs.size(); i++)
 		{
-			llvm::Value* v = ii;
-			VariableSymbol* symbol = arguments[i];
+			llvm::Value* arg = ii;
+			ToplevelParameter& p = inputs[i];
+			arg->setName(p.name);
+
+			for (unsigned j=0; j<p.fields.size(); j++)
+			{
+				VariableSymbol* symbol = p.fields[j];
+				llvm::Value* v = arg;
+				if (p.structure)
+				{
+					v = fieldPointer(arg, p.structure->fields[j].offset,
+							symbol->type);
+					if (!symbol->type->isAggregate())
+						v = builder.CreateLoad(symbol->type->llvmx, v);
+				}
 
-			v->setName(symbol->name);
-			if (symbol->type->asVector())
-				v = symbol->type->asVector()->loadFromArray(v);
-			symbol->value = v;
+				if (symbol->type->isAggregate())
+					v = symbol->type->loadFromArray(v);
+				else
+					v = symbol->type->convertToInternal(v);
+				symbol->value = v;
 
-			symboltable.add(symbol);
+				symboltable.add(symbol);
+			}
 
 			ii++;
 		}
@@ -200,25 +275,1215 @@ public:
 		/* ...and remember the LLVM values where the output parameters will be
 		 * stored. */
 
-		for (unsigned i=0; i<returns.size(); i++)
+		for (unsigned i=0; i<outputs.size(); i++)
 		{
-			llvm::Value* v = ii;
-			VariableSymbol* symbol = returns[i];
+			llvm::Value* arg = ii;
+			ToplevelParameter& p = outputs[i];
+			arg->setName(p.name);
 
-			v->setName(symbol->name);
-			symbol->value = v;
+			for (unsigned j=0; j<p.fields.size(); j++)
+			{
+				VariableSymbol* symbol = p.fields[j];
+				if (p.structure)
+					symbol->value = fieldPointer(arg,
+							p.structure->fields[j].offset, symbol->type);
+				else
+					symbol->value = arg;
+			}
 
 			ii++;
 		}
 
 		/* Generate the IR code. */
 
+		Trace::Scope resolving(options.trace, "compile", "resolve");
 		ast->resolveVariables(*this);
+		resolving.end();
+
+		if (options.fold)
+		{
+			Trace::Scope folding(options.trace, "compile", "fold");
+			ast->fold(*this);
+		}
+
+		Trace::Scope generating(options.trace, "compile", "codegen");
 		ast->codegen(*this);
+		removeUnusedFunctions();
+
+		_inputParameters = describeParameters(inputs, false);
+		_outputParameters = describeParameters(outputs, true);
+
+		if (options.batch)
+			_batchFunction = compileBatch(toplevelsymbol, inputs, outputs);
+		if (options.grid)
+			_gridFunction = compileGrid(toplevelsymbol, inputs, outputs);
+
+		/* Outside batch calls, external calls are just calls. */
+
+		lowerBatchSites(toplevelsymbol->function,
+			[&](unsigned site, llvm::CallInst* call)
+			{
+				vector<llvm::Value*> args(call->arg_begin(), call->arg_end());
+				return batchSites[site].second->emitScalarCall(*this, args);
+			});
+		for (auto& i : batchSites)
+			i.first->eraseFromParent();
 
 		return toplevelsymbol;
 	}
 
+	/* Let-functions are generated even when folding has left no calls to
+	 * them, so that they're type checked; this removes them again, along
+	 * with any which only they called. */
+
+	void removeUnusedFunctions()
+	{
+		bool removed;
+		do
+		{
+			removed = false;
+			for (auto& i : _functions)
+			{
+				FunctionSymbol* symbol = i.first;
+				set<llvm::Function*> fs = { symbol->function,
+					symbol->memofunction };
+				fs.erase(NULL);
+				if (fs.empty() || !unused(fs))
+					continue;
+
+				for (llvm::Function* f : fs)
+					f->dropAllReferences();
+				for (llvm::Function* f : fs)
+					f->eraseFromParent();
+				symbol->function = symbol->memofunction = NULL;
+				removed = true;
+			}
+		}
+		while (removed);
+	}
+
+	/* Whether functions are only called by each other. */
+
+	bool unused(const set<llvm::Function*>& fs)
+	{
+		for (llvm::Function* f : fs)
+			for (llvm::User* u : f->users())
+			{
+				llvm::Instruction* i = llvm::dyn_cast<llvm::Instruction>(u);
+				if (!i || !fs.count(i->getFunction()))
+					return false;
+			}
+		return true;
+	}
+
+	llvm::Function* batchFunction() const
+	{
+		return _batchFunction;
+	}
+
+	llvm::Function* gridFunction() const
+	{
+		return _gridFunction;
+	}
+
+	const vector<Parameter>& inputParameters() const
+	{
+		return _inputParameters;
+	}
+
+	const vector<Parameter>& outputParameters() const
+	{
+		return _outputParameters;
+	}
+
+private:
+	/* One parameter of Entrypoint: either a single variable, or a registered
+	 * struct whose fields are the variables. */
+
+	struct ToplevelParameter
+	{
+		string name;
+		VariableSymbol* symbol;
+		const Struct* structure;
+		vector<VariableSymbol*> fields;
+	};
+
+	/* How Entrypoint's callers see each parameter. Element sizes are as
+	 * compileBatchSlots() works them out, so that a captured item can be
+	 * fed straight back in to a batch call. */
+
+	vector<Parameter> describeParameters(
+			const vector<ToplevelParameter>& parameters, bool outputs)
+	{
+		const llvm::DataLayout& dl = engine->getDataLayout();
+		vector<Parameter> result;
+		for (const ToplevelParameter& p : parameters)
+		{
+			Parameter d;
+			d.name = p.name;
+			d.pointer = outputs || p.structure;
+			d.real = false;
+			if (p.structure)
+				d.size = 0; /* in place, so no elements to describe */
+			else
+			{
+				Type* type = p.symbol->type;
+				llvm::Type* t = type->llvmx;
+				unsigned count = 1;
+				if (type->isAggregate())
+				{
+					d.pointer = true;
+					t = t->getPointerElementType();
+					if (t->isStructTy())
+						t = t->getStructElementType(0);
+
+					llvm::FixedVectorType* vt = llvm::cast<llvm::FixedVectorType>(t);
+					t = vt->getElementType();
+					count = vt->getNumElements();
+				}
+				d.size = count * dl.getTypeAllocSize(t);
+				d.real = (t == realType->llvm);
+			}
+			result.push_back(d);
+		}
+		return result;
+	}
+
+	/* Where a struct field lives, as the pointer type loadFromArray() and
+	 * storeToArray() expect for aggregates, or a plain pointer otherwise. */
+
+	llvm::Value* fieldPointer(llvm::Value* base, size_t offset, Type* type)
+	{
+		llvm::Type* t = type->llvmx;
+		if (!type->isAggregate())
+			t = t->getPointerTo();
+
+		llvm::Value* p = builder.CreateConstInBoundsGEP1_64(
+				builder.getInt8Ty(), base, offset);
+		return builder.CreateBitCast(p, t);
+	}
+
+	/* One parameter of the batch entrypoint. Every parameter is treated as
+	 * `count` elements of type `element`; `pointee` is what Entrypoint wants
+	 * a pointer to, or NULL if the parameter is passed by value. */
+
+	struct BatchSlot
+	{
+		const ToplevelParameter* parameter;
+		Layout layout;
+		llvm::Type* element;
+		llvm::Type* pointee;
+		unsigned count;
+		uint64_t elementsize;
+		uint64_t itemsize;
+		llvm::Value* base;
+		vector<llvm::Value*> columns;
+		vector<llvm::MDNode*> scopes;
+		vector<llvm::MDNode*> noalias;
+		vector<llvm::Value*> grid;
+		llvm::Value* temp;
+		llvm::Value* scratch;
+	};
+
+	/* Generates BatchEntrypoint(start, count, bindings), which runs the
+	 * program once per item. Each item's elements are gathered into the
+	 * form Entrypoint expects and its results scattered back out again;
+	 * Entrypoint is inlined into the loop, so the temporaries vanish and
+	 * the loop vectoriser sees plain strided loads and stores. AOSOA data
+	 * is walked a block at a time, so that the inner loop is unit stride. */
+
+	llvm::Function* compileBatch(ToplevelSymbol* toplevel,
+			const vector<ToplevelParameter>& inputs,
+			const vector<ToplevelParameter>& outputs)
+	{
+		const llvm::DataLayout& dl = engine->getDataLayout();
+		llvm::Type* sizetype = dl.getIntPtrType(context, 0);
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				builder.getVoidTy(),
+				{ sizetype, sizetype, bindingType()->getPointerTo() },
+				false);
+		llvm::Function* f = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage,
+				"BatchEntrypoint", module);
+		toplevel->function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		llvm::Function::arg_iterator ii = f->arg_begin();
+		llvm::Value* start = ii++;
+		llvm::Value* count = ii++;
+		llvm::Value* bindings = ii++;
+		start->setName("start");
+		count->setName("count");
+		bindings->setName("bindings");
+
+		llvm::BasicBlock* bb = llvm::BasicBlock::Create(context, "entry", f);
+		builder.SetInsertPoint(bb);
+
+		uint64_t blocksize = 0;
+		vector<BatchSlot> slots = compileBatchSlots(inputs, outputs, bindings,
+			blocksize);
+
+		llvm::Value* end = builder.CreateAdd(start, count);
+		llvm::Value* one = llvm::ConstantInt::get(sizetype, 1);
+		llvm::Value* zero = llvm::ConstantFP::get(realType->llvm, 0);
+
+		vector<bool> collected = collectableSites(toplevel->function);
+		if (std::find(collected.begin(), collected.end(), true) !=
+				collected.end())
+			compileBatchChunks(toplevel, f, slots, inputs.size(), start, end,
+				collected);
+		else if (!blocksize)
+		{
+			/* for (item = start; item < end; item++) */
+
+			llvm::BasicBlock* loopbb = llvm::BasicBlock::Create(context, "loop", f);
+			llvm::BasicBlock* bodybb = llvm::BasicBlock::Create(context, "body", f);
+			llvm::BasicBlock* exitbb = llvm::BasicBlock::Create(context, "exit", f);
+
+			builder.CreateBr(loopbb);
+			builder.SetInsertPoint(loopbb);
+			llvm::PHINode* item = builder.CreatePHI(sizetype, 2, "item");
+			item->addIncoming(start, bb);
+			builder.CreateCondBr(builder.CreateICmpULT(item, end), bodybb, exitbb);
+
+			builder.SetInsertPoint(bodybb);
+			compileBatchItem(toplevel, slots, inputs.size(), item, NULL, NULL,
+				builder.CreateUIToFP(item, realType->llvm), zero);
+			item->addIncoming(builder.CreateAdd(item, one), builder.GetInsertBlock());
+			builder.CreateBr(loopbb);
+
+			builder.SetInsertPoint(exitbb);
+		}
+		else
+		{
+			/* for (block = start/L; block < (end+L-1)/L; block++)
+			 *     for (lane = max(start, block*L) - block*L;
+			 *             lane < min(end, block*L + L) - block*L; lane++) */
+
+			llvm::Value* l = llvm::ConstantInt::get(sizetype, blocksize);
+			llvm::Value* firstblock = builder.CreateUDiv(start, l);
+			llvm::Value* endblock = builder.CreateUDiv(
+				builder.CreateAdd(end, builder.CreateSub(l, one)), l);
+
+			llvm::BasicBlock* outerbb = llvm::BasicBlock::Create(context, "outer", f);
+			llvm::BasicBlock* blockbb = llvm::BasicBlock::Create(context, "block", f);
+			llvm::BasicBlock* innerbb = llvm::BasicBlock::Create(context, "inner", f);
+			llvm::BasicBlock* bodybb = llvm::BasicBlock::Create(context, "body", f);
+			llvm::BasicBlock* latchbb = llvm::BasicBlock::Create(context, "latch", f);
+			llvm::BasicBlock* exitbb = llvm::BasicBlock::Create(context, "exit", f);
+
+			builder.CreateBr(outerbb);
+			builder.SetInsertPoint(outerbb);
+			llvm::PHINode* block = builder.CreatePHI(sizetype, 2, "block");
+			block->addIncoming(firstblock, bb);
+			builder.CreateCondBr(builder.CreateICmpULT(block, endblock),
+				blockbb, exitbb);
+
+			builder.SetInsertPoint(blockbb);
+			llvm::Value* first = builder.CreateMul(block, l);
+			llvm::Value* last = builder.CreateAdd(first, l);
+			llvm::Value* lo = builder.CreateSub(
+				builder.CreateSelect(builder.CreateICmpUGT(start, first), start, first),
+				first);
+			llvm::Value* hi = builder.CreateSub(
+				builder.CreateSelect(builder.CreateICmpULT(end, last), end, last),
+				first);
+			builder.CreateBr(innerbb);
+
+			builder.SetInsertPoint(innerbb);
+			llvm::PHINode* lane = builder.CreatePHI(sizetype, 2, "lane");
+			lane->addIncoming(lo, blockbb);
+			builder.CreateCondBr(builder.CreateICmpULT(lane, hi), bodybb, latchbb);
+
+			builder.SetInsertPoint(bodybb);
+			llvm::Value* item = builder.CreateAdd(first, lane);
+			compileBatchItem(toplevel, slots, inputs.size(), item, block, lane,
+				builder.CreateUIToFP(item, realType->llvm), zero);
+			lane->addIncoming(builder.CreateAdd(lane, one), builder.GetInsertBlock());
+			builder.CreateBr(innerbb);
+
+			builder.SetInsertPoint(latchbb);
+			block->addIncoming(builder.CreateAdd(block, one), latchbb);
+			builder.CreateBr(outerbb);
+
+			builder.SetInsertPoint(exitbb);
+		}
+
+		builder.CreateRetVoid();
+		return f;
+	}
+
+	/* Generates GridEntrypoint(x, y, width, height, pitch, bindings), which
+	 * runs Entrypoint for the items of a rectangle, row by row. Item (x, y)
+	 * is number y*pitch + x. GRID inputs are computed from x and y, with
+	 * the part that depends on y computed once per row. */
+
+	llvm::Function* compileGrid(ToplevelSymbol* toplevel,
+			const vector<ToplevelParameter>& inputs,
+			const vector<ToplevelParameter>& outputs)
+	{
+		const llvm::DataLayout& dl = engine->getDataLayout();
+		llvm::Type* sizetype = dl.getIntPtrType(context, 0);
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				builder.getVoidTy(),
+				{ sizetype, sizetype, sizetype, sizetype, sizetype,
+					bindingType()->getPointerTo() },
+				false);
+		llvm::Function* f = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage,
+				"GridEntrypoint", module);
+		toplevel->function->addFnAttr(llvm::Attribute::AlwaysInline);
+
+		llvm::Function::arg_iterator ii = f->arg_begin();
+		llvm::Value* x0 = ii++;
+		llvm::Value* y0 = ii++;
+		llvm::Value* width = ii++;
+		llvm::Value* height = ii++;
+		llvm::Value* pitch = ii++;
+		llvm::Value* bindings = ii++;
+		x0->setName("x");
+		y0->setName("y");
+		width->setName("width");
+		height->setName("height");
+		pitch->setName("pitch");
+		bindings->setName("bindings");
+
+		llvm::BasicBlock* bb = llvm::BasicBlock::Create(context, "entry", f);
+		builder.SetInsertPoint(bb);
+
+		uint64_t blocksize = 0;
+		vector<BatchSlot> slots = compileBatchSlots(inputs, outputs, bindings,
+			blocksize);
+
+		llvm::Value* one = llvm::ConstantInt::get(sizetype, 1);
+		llvm::Value* x1 = builder.CreateAdd(x0, width);
+		llvm::Value* y1 = builder.CreateAdd(y0, height);
+
+		/* for (y = y0; y < y1; y++)
+		 *     for (x = x0; x < x1; x++) */
+
+		llvm::BasicBlock* outerbb = llvm::BasicBlock::Create(context, "outer", f);
+		llvm::BasicBlock* rowbb = llvm::BasicBlock::Create(context, "row", f);
+		llvm::BasicBlock* innerbb = llvm::BasicBlock::Create(context, "inner", f);
+		llvm::BasicBlock* bodybb = llvm::BasicBlock::Create(context, "body", f);
+		llvm::BasicBlock* latchbb = llvm::BasicBlock::Create(context, "latch", f);
+		llvm::BasicBlock* exitbb = llvm::BasicBlock::Create(context, "exit", f);
+
+		builder.CreateBr(outerbb);
+		builder.SetInsertPoint(outerbb);
+		llvm::PHINode* y = builder.CreatePHI(sizetype, 2, "y");
+		y->addIncoming(y0, bb);
+		builder.CreateCondBr(builder.CreateICmpULT(y, y1), rowbb, exitbb);
+
+		builder.SetInsertPoint(rowbb);
+		llvm::Value* row = builder.CreateMul(y, pitch);
+		llvm::Value* yr = gridCoordinate(y);
+		builder.CreateBr(innerbb);
+
+		builder.SetInsertPoint(innerbb);
+		llvm::PHINode* x = builder.CreatePHI(sizetype, 2, "x");
+		x->addIncoming(x0, rowbb);
+		builder.CreateCondBr(builder.CreateICmpULT(x, x1), bodybb, latchbb);
+
+		builder.SetInsertPoint(bodybb);
+		compileBatchItem(toplevel, slots, inputs.size(),
+			builder.CreateAdd(row, x), NULL, NULL,
+			gridCoordinate(x), yr);
+		x->addIncoming(builder.CreateAdd(x, one), builder.GetInsertBlock());
+		builder.CreateBr(innerbb);
+
+		builder.SetInsertPoint(latchbb);
+		y->addIncoming(builder.CreateAdd(y, one), latchbb);
+		builder.CreateBr(outerbb);
+
+		builder.SetInsertPoint(exitbb);
+		builder.CreateRetVoid();
+		return f;
+	}
+
+	/* Grid positions are assumed to fit in an int, which is much cheaper to
+	 * convert to a real than a size_t. */
+
+	llvm::Value* gridCoordinate(llvm::Value* v)
+	{
+		return builder.CreateSIToFP(builder.CreateTrunc(v, intType),
+			realType->llvm);
+	}
+
+	/* The C Binding struct. */
+
+	llvm::StructType* bindingType()
+	{
+		llvm::Type* voidp = builder.getInt8PtrTy();
+		return llvm::StructType::get(context, { voidp, voidp->getPointerTo() });
+	}
+
+	/* Every layout must be for a parameter in its direction. */
+
+	void checkLayouts(const map<string, Layout>& layouts,
+			const vector<ToplevelParameter>& parameters, const string& direction)
+	{
+		for (auto& i : layouts)
+		{
+			bool found = false;
+			for (const ToplevelParameter& p : parameters)
+				found |= (p.name == i.first);
+			if (!found)
+				throw CompilationException("layout given for unknown " +
+					direction + " parameter '" + i.first + "'");
+		}
+	}
+
+	/* Works out where each parameter's items live, loading the bindings in
+	 * the current block. */
+
+	vector<BatchSlot> compileBatchSlots(const vector<ToplevelParameter>& inputs,
+			const vector<ToplevelParameter>& outputs, llvm::Value* bindings,
+			uint64_t& blocksize)
+	{
+		const llvm::DataLayout& dl = engine->getDataLayout();
+		llvm::Type* sizetype = dl.getIntPtrType(context, 0);
+		llvm::Type* voidp = builder.getInt8PtrTy();
+		llvm::StructType* bindingtype = bindingType();
+
+		vector<const ToplevelParameter*> parameters;
+		for (const ToplevelParameter& p : inputs)
+			parameters.push_back(&p);
+		for (const ToplevelParameter& p : outputs)
+			parameters.push_back(&p);
+
+		checkLayouts(options.inputLayouts, inputs, "input");
+		checkLayouts(options.outputLayouts, outputs, "output");
+
+		vector<BatchSlot> slots(parameters.size());
+		for (unsigned i=0; i<parameters.size(); i++)
+		{
+			BatchSlot& slot = slots[i];
+			slot.parameter = parameters[i];
+
+			const map<string, Layout>& layouts = (i < inputs.size()) ?
+				options.inputLayouts : options.outputLayouts;
+			auto li = layouts.find(slot.parameter->name);
+			if (li != layouts.end())
+				slot.layout = li->second;
+
+			/* Structs are passed to Entrypoint in place, so there are no
+			 * elements to move. */
+
+			const Struct* structure = slot.parameter->structure;
+			if (structure)
+			{
+				if (slot.layout.kind != Layout::AOS)
+					throw CompilationException("struct parameter '" +
+						slot.parameter->name + "' must have an AOS layout");
+				if (!slot.layout.size && !structure->size)
+					throw CompilationException("struct parameter '" +
+						slot.parameter->name + "' has no size");
+			}
+
+			bool shared = (slot.layout.kind == Layout::UNIFORM) ||
+				(slot.layout.kind == Layout::GRID);
+			if (shared && (i >= inputs.size()))
+				throw CompilationException("output parameter '" +
+					slot.parameter->name + "' can't be UNIFORM or GRID");
+
+			Type* type = structure ? NULL : slot.parameter->symbol->type;
+			llvm::Type* t = structure ? builder.getInt8Ty() : type->llvmx;
+			slot.element = t;
+			slot.pointee = NULL;
+			slot.count = structure ? 0 : 1;
+			if (type && type->isAggregate())
+			{
+				slot.pointee = t->getPointerElementType();
+				t = slot.pointee;
+				if (t->isStructTy())
+					t = t->getStructElementType(0);
+
+				llvm::FixedVectorType* vt = llvm::cast<llvm::FixedVectorType>(t);
+				slot.element = vt->getElementType();
+				slot.count = vt->getNumElements();
+			}
+			slot.elementsize = dl.getTypeAllocSize(slot.element);
+
+			if ((slot.layout.kind == Layout::GRID) &&
+					(slot.element != realType->llvm))
+				throw CompilationException("GRID parameter '" +
+					slot.parameter->name + "' must be made of reals");
+
+			slot.itemsize = slot.layout.size;
+			if (!slot.itemsize)
+				slot.itemsize = structure ? structure->size :
+					(slot.count * slot.elementsize);
+
+			if (slot.layout.kind == Layout::AOSOA)
+			{
+				if (!slot.layout.size)
+					throw CompilationException(
+						"AOSOA layout of '" + slot.parameter->name + "' has no block size");
+				if (blocksize && (blocksize != slot.layout.size))
+					throw CompilationException(
+						"all AOSOA parameters must use the same block size");
+				blocksize = slot.layout.size;
+			}
+
+			llvm::Value* binding = builder.CreateConstInBoundsGEP1_32(
+					bindingtype, bindings, i);
+			if (slot.layout.kind == Layout::SOA)
+			{
+				llvm::Value* columns = builder.CreateLoad(voidp->getPointerTo(),
+					builder.CreateStructGEP(bindingtype, binding, 1));
+				for (unsigned j=0; j<slot.count; j++)
+					slot.columns.push_back(builder.CreateLoad(voidp,
+						builder.CreateConstInBoundsGEP1_32(voidp, columns, j)));
+			}
+			else
+				slot.base = builder.CreateLoad(voidp,
+					builder.CreateStructGEP(bindingtype, binding, 0));
+
+			/* origin, dx, dy */
+
+			if (slot.layout.kind == Layout::GRID)
+			{
+				llvm::Value* p = builder.CreateBitCast(slot.base,
+					slot.element->getPointerTo());
+				for (unsigned j=0; j<(slot.count*3); j++)
+					slot.grid.push_back(builder.CreateLoad(slot.element,
+						builder.CreateConstInBoundsGEP1_32(slot.element, p, j)));
+			}
+
+			slot.scratch = NULL;
+			if (structure && (i >= inputs.size()))
+			{
+				llvm::AllocaInst* a = builder.CreateAlloca(builder.getInt8Ty(),
+					llvm::ConstantInt::get(sizetype, slot.itemsize));
+				a->setAlignment(llvm::Align(16));
+				slot.scratch = a;
+			}
+
+			slot.temp = NULL;
+			if (slot.pointee)
+				slot.temp = builder.CreateAlloca(slot.pointee);
+			else if (!structure && (i >= inputs.size()))
+				slot.temp = builder.CreateAlloca(slot.element);
+		}
+
+		/* Bindings may not overlap each other, so give every element of
+		 * every parameter its own alias scope; otherwise the vectoriser
+		 * would need a runtime check for each pair of columns. */
+
+		llvm::MDBuilder mdb(context);
+		llvm::MDNode* domain = mdb.createAnonymousAliasScopeDomain("batch");
+		vector<llvm::Metadata*> allscopes;
+		for (BatchSlot& slot : slots)
+		{
+			for (unsigned j=0; j<slot.count; j++)
+			{
+				llvm::MDNode* scope = mdb.createAnonymousAliasScope(domain);
+				slot.scopes.push_back(llvm::MDNode::get(context, scope));
+				allscopes.push_back(scope);
+			}
+		}
+
+		unsigned index = 0;
+		for (BatchSlot& slot : slots)
+		{
+			for (unsigned j=0; j<slot.count; j++)
+			{
+				vector<llvm::Metadata*> others(allscopes);
+				others.erase(others.begin() + index++);
+				slot.noalias.push_back(llvm::MDNode::get(context, others));
+			}
+		}
+
+		return slots;
+	}
+
+	/* The buffers an external call site uses to collect its parameters
+	 * and results across a chunk of items. */
+
+	struct BatchBuffers
+	{
+		vector<Type*> types;
+		Type* returntype;
+		vector<llvm::Value*> inputs;
+		llvm::Value* output;
+		llvm::Value* recorded;
+	};
+
+	enum
+	{
+		BATCH_CHUNK = 64
+	};
+
+	/* When the script calls external functions with array forms, and some
+	 * of those calls are collectable (see collectable()), items are run a
+	 * chunk at a time in two passes. The first runs the script only to
+	 * collect each collectable call's parameters; it makes no other calls
+	 * except harmless ones, and the rest return 0. Then each array function
+	 * is called once for the whole chunk; then the second pass runs the
+	 * script for real, taking a collected call's result from the array if
+	 * its parameters match those collected, and calling the ordinary
+	 * function if not. Every other call is made once, in the second pass,
+	 * and everything the first pass computes which doesn't feed a collected
+	 * call is optimised away. */
+
+	void compileBatchChunks(ToplevelSymbol* toplevel, llvm::Function* f,
+			vector<BatchSlot>& slots, unsigned inputs, llvm::Value* start,
+			llvm::Value* end, const vector<bool>& collected)
+	{
+		llvm::Type* sizetype = start->getType();
+		llvm::Value* zero = llvm::ConstantInt::get(sizetype, 0);
+		llvm::Value* one = llvm::ConstantInt::get(sizetype, 1);
+		llvm::Value* chunksize = llvm::ConstantInt::get(sizetype, BATCH_CHUNK);
+		llvm::Value* zeroreal = llvm::ConstantFP::get(realType->llvm, 0);
+		const llvm::DataLayout& dl = engine->getDataLayout();
+
+		vector<BatchBuffers> buffers(batchSites.size());
+		for (unsigned i=0; i<batchSites.size(); i++)
+		{
+			if (!collected[i])
+				continue;
+
+			BatchBuffers& b = buffers[i];
+			ExternalFunctionSymbol* symbol = batchSites[i].second;
+			b.types = symbol->inputTypes(*this);
+			b.returntype = symbol->returnType(*this);
+
+			for (Type* t : b.types)
+			{
+				llvm::Value* p = createArray(t);
+				builder.CreateMemSet(p, builder.getInt8(0),
+					BATCH_CHUNK * arrayCount(t) *
+						dl.getTypeAllocSize(arrayElement(t)),
+					llvm::MaybeAlign());
+				b.inputs.push_back(p);
+			}
+			b.output = createArray(b.returntype);
+			b.recorded = builder.CreateAlloca(builder.getInt8Ty(),
+				llvm::ConstantInt::get(intType, BATCH_CHUNK));
+		}
+
+		llvm::BasicBlock* entrybb = builder.GetInsertBlock();
+		llvm::BasicBlock* chunkbb = llvm::BasicBlock::Create(context, "chunk", f);
+		llvm::BasicBlock* firstbb = llvm::BasicBlock::Create(context, "first", f);
+		llvm::BasicBlock* callsbb = llvm::BasicBlock::Create(context, "calls", f);
+		llvm::BasicBlock* secondbb = llvm::BasicBlock::Create(context, "second", f);
+		llvm::BasicBlock* latchbb = llvm::BasicBlock::Create(context, "latch", f);
+		llvm::BasicBlock* exitbb = llvm::BasicBlock::Create(context, "exit", f);
+
+		/* for (chunk = start; chunk < end; chunk += BATCH_CHUNK) */
+
+		builder.CreateBr(chunkbb);
+		builder.SetInsertPoint(chunkbb);
+		llvm::PHINode* chunk = builder.CreatePHI(sizetype, 2, "chunk");
+		chunk->addIncoming(start, entrybb);
+		llvm::BasicBlock* chunkbodybb = llvm::BasicBlock::Create(context,
+			"chunkbody", f);
+		builder.CreateCondBr(builder.CreateICmpULT(chunk, end),
+			chunkbodybb, exitbb);
+
+		builder.SetInsertPoint(chunkbodybb);
+		llvm::Value* remaining = builder.CreateSub(end, chunk);
+		llvm::Value* n = builder.CreateSelect(
+			builder.CreateICmpULT(remaining, chunksize), remaining, chunksize);
+		builder.CreateBr(firstbb);
+
+		/* First pass: collect the parameters. */
+
+		builder.SetInsertPoint(firstbb);
+		llvm::PHINode* lane = builder.CreatePHI(sizetype, 2, "lane");
+		lane->addIncoming(zero, chunkbodybb);
+		llvm::BasicBlock* firstbodybb = llvm::BasicBlock::Create(context,
+			"firstbody", f);
+		builder.CreateCondBr(builder.CreateICmpULT(lane, n), firstbodybb, callsbb);
+
+		builder.SetInsertPoint(firstbodybb);
+		for (unsigned i=0; i<batchSites.size(); i++)
+			if (collected[i])
+				builder.CreateStore(builder.getInt8(0),
+					builder.CreateGEP(builder.getInt8Ty(), buffers[i].recorded,
+						lane));
+		llvm::Value* item = builder.CreateAdd(chunk, lane);
+		llvm::CallInst* call = compileBatchItem(toplevel, slots, inputs,
+			item, NULL, NULL, builder.CreateUIToFP(item, realType->llvm),
+			zeroreal, false);
+		llvm::BasicBlock* nextbb = llvm::BasicBlock::Create(context, "firstnext", f);
+		builder.CreateBr(nextbb);
+		builder.SetInsertPoint(nextbb);
+		lane->addIncoming(builder.CreateAdd(lane, one), nextbb);
+		builder.CreateBr(firstbb);
+
+		inlineBatchItem(call);
+		lowerBatchSites(f,
+			[&](unsigned site, llvm::CallInst* call)
+			{
+				if (!collected[site])
+					return llvm::Constant::getNullValue(call->getType());
+
+				BatchBuffers& b = buffers[site];
+				for (unsigned i=0; i<b.types.size(); i++)
+					storeArrayElement(b.types[i], call->getArgOperand(i),
+						b.inputs[i], lane);
+				builder.CreateStore(builder.getInt8(1),
+					builder.CreateGEP(builder.getInt8Ty(), b.recorded, lane));
+				return llvm::Constant::getNullValue(call->getType());
+			});
+
+		/* Nothing the collected calls don't need may run in the first pass,
+		 * so that the script's other calls are each made once per item. */
+
+		map<llvm::Function*, unsigned> sites = batchSiteIndices();
+		vector<llvm::CallInst*> unwanted;
+		for (llvm::BasicBlock& bb : *f)
+			for (llvm::Instruction& i : bb)
+				if (llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(&i))
+					if (!harmless(call, sites))
+						unwanted.push_back(call);
+		for (llvm::CallInst* call : unwanted)
+		{
+			if (!call->getType()->isVoidTy())
+				call->replaceAllUsesWith(
+					llvm::Constant::getNullValue(call->getType()));
+			call->eraseFromParent();
+		}
+
+		/* The calls proper. */
+
+		builder.SetInsertPoint(callsbb);
+		for (unsigned i=0; i<batchSites.size(); i++)
+		{
+			if (!collected[i])
+				continue;
+
+			vector<llvm::Value*> arrays(buffers[i].inputs);
+			arrays.push_back(buffers[i].output);
+			batchSites[i].second->emitArrayCall(*this, n, arrays);
+		}
+		builder.CreateBr(secondbb);
+
+		/* Second pass: run the script using the results. */
+
+		builder.SetInsertPoint(secondbb);
+		lane = builder.CreatePHI(sizetype, 2, "lane");
+		lane->addIncoming(zero, callsbb);
+		llvm::BasicBlock* secondbodybb = llvm::BasicBlock::Create(context,
+			"secondbody", f);
+		builder.CreateCondBr(builder.CreateICmpULT(lane, n), secondbodybb, latchbb);
+
+		builder.SetInsertPoint(secondbodybb);
+		item = builder.CreateAdd(chunk, lane);
+		call = compileBatchItem(toplevel, slots, inputs,
+			item, NULL, NULL, builder.CreateUIToFP(item, realType->llvm),
+			zeroreal);
+		nextbb = llvm::BasicBlock::Create(context, "secondnext", f);
+		builder.CreateBr(nextbb);
+		builder.SetInsertPoint(nextbb);
+		lane->addIncoming(builder.CreateAdd(lane, one), nextbb);
+		builder.CreateBr(secondbb);
+
+		inlineBatchItem(call);
+		lowerBatchSites(f,
+			[&](unsigned site, llvm::CallInst* call) -> llvm::Value*
+			{
+				vector<llvm::Value*> args(call->arg_begin(), call->arg_end());
+				if (!collected[site])
+					return batchSites[site].second->emitScalarCall(*this, args);
+
+				BatchBuffers& b = buffers[site];
+				llvm::Value* ok = builder.CreateICmpNE(
+					builder.CreateLoad(builder.getInt8Ty(),
+						builder.CreateGEP(builder.getInt8Ty(), b.recorded, lane)),
+					builder.getInt8(0));
+				for (unsigned i=0; i<b.types.size(); i++)
+					ok = builder.CreateAnd(ok,
+						compareArrayElement(b.types[i], call->getArgOperand(i),
+							b.inputs[i], lane));
+
+				llvm::Instruction* thenterm;
+				llvm::Instruction* elseterm;
+				llvm::SplitBlockAndInsertIfThenElse(ok, call, &thenterm, &elseterm);
+
+				builder.SetInsertPoint(thenterm);
+				llvm::Value* result = loadArrayElement(b.returntype,
+					b.output, lane);
+
+				builder.SetInsertPoint(elseterm);
+				llvm::Value* called = batchSites[site].second->emitScalarCall(
+					*this, args);
+
+				builder.SetInsertPoint(call);
+				llvm::PHINode* phi = builder.CreatePHI(call->getType(), 2);
+				phi->addIncoming(result, thenterm->getParent());
+				phi->addIncoming(called, elseterm->getParent());
+				return phi;
+			});
+
+		builder.SetInsertPoint(latchbb);
+		chunk->addIncoming(builder.CreateAdd(chunk, chunksize), latchbb);
+		builder.CreateBr(chunkbb);
+
+		builder.SetInsertPoint(exitbb);
+	}
+
+	/* Which of the batch sites in f are collectable. */
+
+	vector<bool> collectableSites(llvm::Function* f)
+	{
+		map<llvm::Function*, unsigned> sites = batchSiteIndices();
+		vector<bool> collected(batchSites.size(), false);
+		for (llvm::BasicBlock& bb : *f)
+			for (llvm::Instruction& i : bb)
+				if (llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(&i))
+					if (sites.count(call->getCalledFunction()))
+						collected[sites[call->getCalledFunction()]] =
+							collectable(call, sites);
+		return collected;
+	}
+
+	/* A site is collectable if the first pass can work out exactly the
+	 * parameters the second will call it with, and whether it's reached at
+	 * all: so these may depend only on the item's inputs and on harmless
+	 * calls, never on another site's result (which the first pass doesn't
+	 * have) or on anything else the first pass mustn't call. Memory is
+	 * followed through allocas, which hold the aggregates passed to and
+	 * from external functions. */
+
+	bool collectable(llvm::CallInst* site,
+			const map<llvm::Function*, unsigned>& sites)
+	{
+		set<llvm::Value*> seen;
+		set<llvm::BasicBlock*> reached;
+		vector<llvm::Value*> pending(site->arg_begin(), site->arg_end());
+
+		/* A value depends on the branches which lead to its block. */
+
+		std::function<void (llvm::BasicBlock*)> reach =
+			[&](llvm::BasicBlock* bb)
+			{
+				for (llvm::BasicBlock* pred : llvm::predecessors(bb))
+					if (reached.insert(pred).second)
+					{
+						pending.push_back(pred->getTerminator());
+						reach(pred);
+					}
+			};
+		reach(site->getParent());
+
+		while (!pending.empty())
+		{
+			llvm::Value* v = pending.back();
+			pending.pop_back();
+			if (!seen.insert(v).second)
+				continue;
+
+			llvm::Instruction* i = llvm::dyn_cast<llvm::Instruction>(v);
+			if (!i)
+				continue;
+			if (llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(i))
+				if (!harmless(call, sites))
+					return false;
+
+			pending.insert(pending.end(), i->op_begin(), i->op_end());
+			if (i->getType()->isPointerTy())
+				pending.insert(pending.end(), i->user_begin(), i->user_end());
+			reach(i->getParent());
+		}
+		return true;
+	}
+
+	/* Whether a call may be made in the first pass without anyone noticing:
+	 * built-in maths functions, and external functions marked PURE or
+	 * READNONE, NOUNWIND and WILLRETURN. Batch sites, let-functions (which
+	 * may call anything, or never return) and other external functions
+	 * aren't. */
+
+	bool harmless(llvm::CallInst* call,
+			const map<llvm::Function*, unsigned>& sites)
+	{
+		llvm::Function* callee = call->getCalledFunction();
+		if (callee && sites.count(callee))
+			return false;
+		if (callee && callee->isDeclaration())
+			return true;
+		return call->doesNotThrow() && call->willReturn() &&
+			(call->onlyReadsMemory() || call->onlyAccessesArgMemory());
+	}
+
+	void inlineBatchItem(llvm::CallInst* call)
+	{
+		llvm::InlineFunctionInfo ifi;
+		llvm::InlineResult r = llvm::InlineFunction(*call, ifi);
+		assert(r.isSuccess());
+	}
+
+	/* Replaces each call to a batch site placeholder in f with whatever
+	 * lower() generates. */
+
+	void lowerBatchSites(llvm::Function* f,
+			const std::function<llvm::Value* (unsigned, llvm::CallInst*)>& lower)
+	{
+		map<llvm::Function*, unsigned> sites = batchSiteIndices();
+		vector<llvm::CallInst*> calls;
+		for (llvm::BasicBlock& bb : *f)
+			for (llvm::Instruction& i : bb)
+				if (llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(&i))
+					if (sites.count(call->getCalledFunction()))
+						calls.push_back(call);
+
+		for (llvm::CallInst* call : calls)
+		{
+			builder.SetInsertPoint(call);
+			llvm::Value* v = lower(sites[call->getCalledFunction()], call);
+			call->replaceAllUsesWith(v);
+			call->eraseFromParent();
+		}
+	}
+
+	/* Maps each batch site's placeholder to its index in batchSites. */
+
+	map<llvm::Function*, unsigned> batchSiteIndices()
+	{
+		map<llvm::Function*, unsigned> sites;
+		for (unsigned i=0; i<batchSites.size(); i++)
+			sites[batchSites[i].first] = i;
+		return sites;
+	}
+
+	/* Array parameters hold external values: scalars as themselves and
+	 * vectors as packed reals. */
+
+	llvm::Type* arrayElement(Type* type)
+	{
+		return type->isAggregate() ? realType->llvm : type->llvmx;
+	}
+
+	unsigned arrayCount(Type* type)
+	{
+		return type->isAggregate() ? type->asVector()->size : 1;
+	}
+
+	llvm::Value* createArray(Type* type)
+	{
+		return builder.CreateAlloca(arrayElement(type),
+			llvm::ConstantInt::get(intType, BATCH_CHUNK * arrayCount(type)));
+	}
+
+	llvm::Value* arrayPointer(Type* type, llvm::Value* array, llvm::Value* lane,
+			unsigned j)
+	{
+		unsigned count = arrayCount(type);
+		llvm::Value* index = builder.CreateAdd(
+			builder.CreateMul(lane, llvm::ConstantInt::get(lane->getType(), count)),
+			llvm::ConstantInt::get(lane->getType(), j));
+		return builder.CreateGEP(arrayElement(type), array, index);
+	}
+
+	void storeArrayElement(Type* type, llvm::Value* value, llvm::Value* array,
+			llvm::Value* lane)
+	{
+		if (!type->isAggregate())
+		{
+			builder.CreateStore(type->convertToExternal(value),
+				arrayPointer(type, array, lane, 0));
+			return;
+		}
+
+		for (unsigned j=0; j<arrayCount(type); j++)
+			builder.CreateStore(builder.CreateExtractElement(value, j),
+				arrayPointer(type, array, lane, j));
+	}
+
+	llvm::Value* loadArrayElement(Type* type, llvm::Value* array,
+			llvm::Value* lane)
+	{
+		llvm::Type* element = arrayElement(type);
+		if (!type->isAggregate())
+			return type->convertToInternal(
+				builder.CreateLoad(element, arrayPointer(type, array, lane, 0)));
+
+		llvm::Value* v = llvm::UndefValue::get(type->llvm);
+		for (unsigned j=0; j<arrayCount(type); j++)
+			v = builder.CreateInsertElement(v,
+				builder.CreateLoad(element, arrayPointer(type, array, lane, j)),
+				j);
+		return v;
+	}
+
+	llvm::Value* compareArrayElement(Type* type, llvm::Value* value,
+			llvm::Value* array, llvm::Value* lane)
+	{
+		llvm::Type* element = arrayElement(type);
+		llvm::Value* result = builder.getTrue();
+		for (unsigned j=0; j<arrayCount(type); j++)
+		{
+			llvm::Value* v = type->isAggregate() ?
+				builder.CreateExtractElement(value, j) :
+				type->convertToExternal(value);
+			llvm::Value* c = builder.CreateLoad(element,
+				arrayPointer(type, array, lane, j));
+			if (element->isFloatingPointTy())
+			{
+				/* Bitwise, so that NaNs match. */
+
+				llvm::Type* bits = builder.getIntNTy(
+					element->getPrimitiveSizeInBits());
+				v = builder.CreateBitCast(v, bits);
+				c = builder.CreateBitCast(c, bits);
+			}
+			result = builder.CreateAnd(result, builder.CreateICmpEQ(v, c));
+		}
+		return result;
+	}
+
+	/* Calls Entrypoint for one item; x and y are its position, as reals,
+	 * for GRID inputs. */
+
+	llvm::CallInst* compileBatchItem(ToplevelSymbol* toplevel,
+			vector<BatchSlot>& slots, unsigned inputs, llvm::Value* item,
+			llvm::Value* block, llvm::Value* lane, llvm::Value* x,
+			llvm::Value* y, bool scatter = true)
+	{
+		vector<llvm::Value*> args;
+		for (unsigned i=0; i<slots.size(); i++)
+		{
+			BatchSlot& slot = slots[i];
+			if (slot.parameter->structure && !scatter && (i >= inputs))
+				args.push_back(slot.scratch);
+			else if (slot.parameter->structure)
+				args.push_back(batchAddress(slot, 0, item, block, lane));
+			else if (i >= inputs)
+				args.push_back(slot.temp);
+			else if (!slot.pointee)
+				args.push_back(batchLoad(slot, 0, item, block, lane, x, y));
+			else
+			{
+				for (unsigned j=0; j<slot.count; j++)
+					builder.CreateStore(
+						batchLoad(slot, j, item, block, lane, x, y),
+						batchTemporary(slot, j));
+				args.push_back(slot.temp);
+			}
+		}
+
+		llvm::CallInst* call = builder.CreateCall(toplevel->function, args);
+
+		for (unsigned i=inputs; scatter && (i<slots.size()); i++)
+		{
+			BatchSlot& slot = slots[i];
+			for (unsigned j=0; j<slot.count; j++)
+			{
+				llvm::Value* v = builder.CreateLoad(slot.element,
+					batchTemporary(slot, j));
+				batchAccess(slot, j, builder.CreateAlignedStore(v,
+					batchAddress(slot, j, item, block, lane),
+					llvm::Align(slot.elementsize)));
+			}
+		}
+
+		return call;
+	}
+
+	template <class T>
+	T* batchAccess(BatchSlot& slot, unsigned j, T* access)
+	{
+		access->setMetadata(llvm::LLVMContext::MD_alias_scope, slot.scopes[j]);
+		access->setMetadata(llvm::LLVMContext::MD_noalias, slot.noalias[j]);
+		return access;
+	}
+
+	llvm::Value* batchTemporary(BatchSlot& slot, unsigned j)
+	{
+		llvm::Value* p = builder.CreateBitCast(slot.temp,
+				slot.element->getPointerTo());
+		return builder.CreateConstInBoundsGEP1_32(slot.element, p, j);
+	}
+
+	/* Element j of an item: loaded, or for a grid, worked out from the
+	 * item's coordinates. */
+
+	llvm::Value* batchLoad(BatchSlot& slot, unsigned j, llvm::Value* item,
+			llvm::Value* block, llvm::Value* lane, llvm::Value* x,
+			llvm::Value* y)
+	{
+		if (slot.layout.kind == Layout::GRID)
+		{
+			/* origin + y*dy first, so it can be hoisted out of rows. */
+
+			llvm::Value* origin = slot.grid[j];
+			llvm::Value* dx = slot.grid[slot.count + j];
+			llvm::Value* dy = slot.grid[slot.count*2 + j];
+			return builder.CreateFAdd(
+				builder.CreateFAdd(origin, builder.CreateFMul(y, dy)),
+				builder.CreateFMul(x, dx));
+		}
+
+		return batchAccess(slot, j,
+			builder.CreateAlignedLoad(slot.element,
+				batchAddress(slot, j, item, block, lane),
+				llvm::Align(slot.elementsize)));
+	}
+
+	/* The address of element j of an item. */
+
+	llvm::Value* batchAddress(BatchSlot& slot, unsigned j, llvm::Value* item,
+			llvm::Value* block, llvm::Value* lane)
+	{
+		llvm::Type* sizetype = item->getType();
+		llvm::Value* base;
+		llvm::Value* offset;
+		switch (slot.layout.kind)
+		{
+			case Layout::AOS:
+				base = slot.base;
+				offset = builder.CreateAdd(
+					builder.CreateMul(item,
+						llvm::ConstantInt::get(sizetype, slot.itemsize)),
+					llvm::ConstantInt::get(sizetype, j*slot.elementsize));
+				break;
+
+			case Layout::UNIFORM:
+			case Layout::GRID:
+				base = slot.base;
+				offset = llvm::ConstantInt::get(sizetype, j*slot.elementsize);
+				break;
+
+			case Layout::SOA:
+				base = slot.columns[j];
+				offset = builder.CreateMul(item,
+					llvm::ConstantInt::get(sizetype, slot.elementsize));
+				break;
+
+			case Layout::AOSOA:
+			{
+				uint64_t l = slot.layout.size;
+				if (!block)
+				{
+					block = builder.CreateUDiv(item,
+						llvm::ConstantInt::get(sizetype, l));
+					lane = builder.CreateURem(item,
+						llvm::ConstantInt::get(sizetype, l));
+				}
+				base = slot.base;
+				offset = builder.CreateAdd(
+					builder.CreateMul(block,
+						llvm::ConstantInt::get(sizetype, l*slot.count*slot.elementsize)),
+					builder.CreateMul(lane,
+						llvm::ConstantInt::get(sizetype, slot.elementsize)));
+				offset = builder.CreateAdd(offset,
+					llvm::ConstantInt::get(sizetype, j*l*slot.elementsize));
+				break;
+			}
+
+			default:
+				assert(false);
+				throw 0;
+		}
+
+		llvm::Value* p = builder.CreateInBoundsGEP(builder.getInt8Ty(), base, offset);
+		return builder.CreateBitCast(p, slot.element->getPointerTo());
+	}
+
 private:
 	#include "calculon_ast.h"
 
@@ -286,39 +1551,21 @@ private:
 		else
 		{
 			expect(lexer, L::COLON);
+			type = parse_type(lexer);
+		}
+	}
 
-			if (lexer.token() != L::IDENTIFIER)
-				lexer.error("expected a type name");
-
-			std::stringstream typenm;
-			typenm << lexer.id();
-			lexer.next();
-
-			if ((lexer.token() == L::OPERATOR) && (lexer.id() == "*"))
-			{
-				typenm << "*";
-				lexer.next();
-
-				if (lexer.token() != L::NUMBER)
-					lexer.error("invalid n-vector type specifier");
-				int size = (int)lexer.real();
-				if ((Real)size != lexer.real())
-					lexer.error("n-vector size must be an integer");
-				if (size <= 0)
-					lexer.error("n-vector size must be greater than 0");
-
-				typenm << size;
-				lexer.next();
-			}
-
-			type = types->find(typenm.str());
-			if (!type)
-			{
-				std::stringstream s;
-				s << "unknown type '" << typenm.str() << "'";
-				lexer.error(s.str());
-			}
+	Type* parse_type(L& lexer)
+	{
+		string typenm = lexer.typeName();
+		Type* type = types->find(typenm);
+		if (!type)
+		{
+			std::stringstream s;
+			s << "unknown type '" << typenm << "'";
+			lexer.error(s.str());
 		}
+		return type;
 	}
 
 	void parse_paramlist(L& lexer, vector<VariableSymbol*>& list)
@@ -352,12 +1599,64 @@ private:
 			returntype = realType;
 	}
 
-	void parse_toplevelsignature(L& lexer, vector<VariableSymbol*>& arguments,
-			vector<VariableSymbol*>& returns)
+	/* Toplevel parameters may also be registered structs. */
+
+	void parse_toplevelparamlist(L& lexer, vector<ToplevelParameter>& list)
 	{
-		parse_paramlist(lexer, arguments);
+		expect(lexer, L::OPENPAREN);
+
+		while (lexer.token() != L::CLOSEPAREN)
+		{
+			ToplevelParameter p;
+			parse_identifier(lexer, p.name);
+			p.symbol = NULL;
+			p.structure = NULL;
+
+			Type* type = NULL;
+			if (lexer.token() == L::COLON)
+			{
+				expect(lexer, L::COLON);
+
+				auto i = (lexer.token() == L::IDENTIFIER) ?
+						options.structs.find(lexer.id()) : options.structs.end();
+				if (i != options.structs.end())
+				{
+					lexer.next();
+					p.structure = &i->second;
+					for (const typename Struct::Field& field : i->second.fields)
+					{
+						Type* t = types->find(field.type);
+						if (!t)
+							lexer.error("unknown type '" + field.type +
+									"' for field '" + field.name + "'");
+						p.fields.push_back(retain(new VariableSymbol(field.name, t)));
+					}
+				}
+				else
+					type = parse_type(lexer);
+			}
+
+			if (!p.structure)
+			{
+				if (!type)
+					type = realType;
+				p.symbol = retain(new VariableSymbol(p.name, type));
+				p.fields.push_back(p.symbol);
+			}
+
+			list.push_back(p);
+			parse_list_separator(lexer);
+		}
+
+		expect(lexer, L::CLOSEPAREN);
+	}
+
+	void parse_toplevelsignature(L& lexer, vector<ToplevelParameter>& inputs,
+			vector<ToplevelParameter>& outputs)
+	{
+		parse_toplevelparamlist(lexer, inputs);
 		expect(lexer, L::COLON);
-		parse_paramlist(lexer, returns);
+		parse_toplevelparamlist(lexer, outputs);
 	}
 
 	ASTNode* parse_variable_or_function_call(L& lexer)
@@ -450,24 +1749,53 @@ private:
 	{
 		ASTNode* value = parse_leaf(lexer);
 
-		switch (lexer.token())
+		/* Postfix operators chain, so m.inverse.vector works. */
+		for (;;)
 		{
-			case L::DOT:
+			switch (lexer.token())
 			{
-				Position position = lexer.position();
-				expect(lexer, L::DOT);
+				case L::DOT:
+				{
+					Position position = lexer.position();
+					expect(lexer, L::DOT);
 
-				string id;
-				parse_identifier(lexer, id);
+					string id;
+					parse_identifier(lexer, id);
 
-				vector<ASTNode*> parameters;
-				parameters.push_back(value);
+					vector<ASTNode*> parameters;
+					parameters.push_back(value);
+
+					if (lexer.token() == L::OPENPAREN)
+					{
+						lexer.next();
+
+						while (lexer.token() != L::CLOSEPAREN)
+						{
+							ASTNode* e = parse_expression(lexer);
+							parameters.push_back(e);
+
+							if (lexer.token() != L::COMMA)
+								break;
+							expect(lexer, L::COMMA);
+						}
 
-				if (lexer.token() == L::OPENPAREN)
+						expect(lexer, L::CLOSEPAREN);
+					}
+
+					value = retain(new ASTFunctionCall(position, "method "+id,
+							parameters));
+					continue;
+				}
+
+				case L::OPENBLOCK:
 				{
-					lexer.next();
+					Position position = lexer.position();
+					expect(lexer, L::OPENBLOCK);
+
+					vector<ASTNode*> parameters;
+					parameters.push_back(value);
 
-					while (lexer.token() != L::CLOSEPAREN)
+					do
 					{
 						ASTNode* e = parse_expression(lexer);
 						parameters.push_back(e);
@@ -476,40 +1804,17 @@ private:
 							break;
 						expect(lexer, L::COMMA);
 					}
+					while (true);
 
-					expect(lexer, L::CLOSEPAREN);
+					expect(lexer, L::CLOSEBLOCK);
+					value = retain(new ASTFunctionCall(position, "method []",
+							parameters));
+					continue;
 				}
+			};
 
-				return retain(new ASTFunctionCall(position, "method "+id,
-						parameters));
-			}
-
-			case L::OPENBLOCK:
-			{
-				Position position = lexer.position();
-				expect(lexer, L::OPENBLOCK);
-
-				vector<ASTNode*> parameters;
-				parameters.push_back(value);
-
-				do
-				{
-					ASTNode* e = parse_expression(lexer);
-					parameters.push_back(e);
-
-					if (lexer.token() != L::COMMA)
-						break;
-					expect(lexer, L::COMMA);
-				}
-				while (true);
-
-				expect(lexer, L::CLOSEBLOCK);
-				return retain(new ASTFunctionCall(position, "method []",
-						parameters));
-			}
-		};
-
-		return value;
+			return value;
+		}
 	}
 
 	ASTNode* parse_unary(L& lexer)
@@ -589,6 +1894,17 @@ private:
 		string id;
 		parse_identifier(lexer, id);
 
+		/* 'memo' is only special when followed by a function name. */
+
+		bool memo = false;
+		if ((id == "memo") && (lexer.token() == L::IDENTIFIER))
+		{
+			memo = true;
+			parse_identifier(lexer, id);
+			if (lexer.token() != L::OPENPAREN)
+				lexer.error("only functions can be memo");
+		}
+
 		Type* returntype;
 		parse_typespec(lexer, returntype);
 
@@ -607,6 +1923,7 @@ private:
 
 			FunctionSymbol* f = retain(
 					new FunctionSymbol(id, arguments, returntype));
+			f->memo = memo;
 
 			expect_operator(lexer, "=");
 			ASTNode* value = parse_expression(lexer);
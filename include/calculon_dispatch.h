@@ -0,0 +1,345 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_DISPATCH_H
+#define CALCULON_DISPATCH_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* A pool of worker threads which runs a program (or anything else) over a
+ * 1D, 2D or 3D index space.
+ *
+ * The space is split evenly between the threads (the calling thread is one
+ * of them). Each thread works through its own share in chunks which shrink
+ * as the share runs out; a thread which runs out of work steals the back
+ * half of the largest remaining share. This keeps every thread busy even
+ * when the cost of items varies wildly, e.g. rows of a Mandelbrot set.
+ *
+ * A Dispatch may be reused for any number of runs, but only one run may be
+ * in progress at a time; it must not be called from inside itself.
+ *
+ * If given a Trace, each run, each chunk of work and each steal is recorded
+ * in it.
+ */
+
+class Dispatch
+{
+public:
+	typedef std::function<void (size_t start, size_t count)> RangeFunction;
+
+	/* threads == 0 means one per CPU. If pin is set, each worker thread is
+	 * bound to its own CPU (where the platform supports it). */
+
+	Dispatch(unsigned threads = 0, bool pin = false, Trace* trace = NULL):
+		_shares(threads ? threads :
+			std::max(1U, std::thread::hardware_concurrency())),
+		_generation(0),
+		_finished(0),
+		_stopping(false),
+		_job(NULL),
+		_trace(trace)
+	{
+		for (unsigned i=1; i<_shares.size(); i++)
+			_threads.push_back(std::thread(&Dispatch::worker, this, i, pin));
+	}
+
+	~Dispatch()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stopping = true;
+		}
+		_wakeup.notify_all();
+
+		for (std::thread& t : _threads)
+			t.join();
+	}
+
+	unsigned threads() const
+	{
+		return _shares.size();
+	}
+
+	/* Calls fn(start, count) on disjoint ranges which together cover
+	 * [0, n). No range is smaller than grain items, except the last one in
+	 * each share. Exceptions thrown by fn are rethrown here (if several
+	 * threads throw, one of them wins). */
+
+	void run(size_t n, const RangeFunction& fn, size_t grain = 1)
+	{
+		if (!n)
+			return;
+		grain = std::max(grain, (size_t)1);
+		Trace::Scope running(_trace, "dispatch", "run",
+			_trace ? ("\"items\": " + std::to_string(n)) : string());
+
+		unsigned t = threads();
+		for (unsigned i=0; i<t; i++)
+		{
+			_shares[i].start = (n * i) / t;
+			_shares[i].end = (n * (i+1)) / t;
+		}
+
+		Job job = { fn, grain, NULL };
+		if (t == 1)
+			work(job, 0);
+		else
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_job = &job;
+				_finished = 0;
+				_generation++;
+			}
+			_wakeup.notify_all();
+
+			work(job, 0);
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_done.wait(lock, [&] { return _finished == (t - 1); });
+			_job = NULL;
+		}
+
+		if (job.exception)
+			std::rethrow_exception(job.exception);
+	}
+
+	/* Calls fn(x, y) for every point of a w x h grid. */
+
+	template <class F>
+	void run(size_t w, size_t h, F fn, size_t grain = 1)
+	{
+		run(w * h,
+			[&](size_t start, size_t count)
+			{
+				for (size_t i = start; i < (start+count); i++)
+					fn(i % w, i / w);
+			},
+			grain);
+	}
+
+	/* Calls fn(x, y, z) for every point of a w x h x d grid. */
+
+	template <class F>
+	void run(size_t w, size_t h, size_t d, F fn, size_t grain = 1)
+	{
+		run(w * h * d,
+			[&](size_t start, size_t count)
+			{
+				for (size_t i = start; i < (start+count); i++)
+					fn(i % w, (i / w) % h, i / (w*h));
+			},
+			grain);
+	}
+
+	/* Runs a batch-enabled program over items [0, n), reading and writing
+	 * the caller's buffers directly. */
+
+	template <class P, class B>
+	void batch(const P& program, size_t n, const B* bindings,
+			size_t grain = 256)
+	{
+		run(n,
+			[&](size_t start, size_t count)
+			{
+				program.batch(start, count, bindings);
+			},
+			grain);
+	}
+
+	/* Runs a grid-enabled program over a width x height rectangle, giving
+	 * each thread bands of at least grain rows. */
+
+	template <class P, class B>
+	void grid(const P& program, size_t width, size_t height, size_t pitch,
+			const B* bindings, size_t grain = 64)
+	{
+		run(height,
+			[&](size_t start, size_t count)
+			{
+				program.grid(0, start, width, count, pitch, bindings);
+			},
+			grain);
+	}
+
+private:
+	/* start and end only change with the mutex held, but may be read
+	 * without it when looking for something to steal. */
+
+	struct Share
+	{
+		std::mutex mutex;
+		std::atomic<size_t> start;
+		std::atomic<size_t> end;
+
+		Share():
+			start(0), end(0)
+		{
+		}
+
+		size_t remaining() const
+		{
+			size_t s = start.load(std::memory_order_relaxed);
+			size_t e = end.load(std::memory_order_relaxed);
+			return (e > s) ? (e - s) : 0;
+		}
+	};
+
+	struct Job
+	{
+		const RangeFunction& fn;
+		size_t grain;
+		std::exception_ptr exception;
+	};
+
+	void worker(unsigned index, bool pin)
+	{
+		if (pin)
+			pinThread(index);
+
+		uint64_t generation = 0;
+		for (;;)
+		{
+			Job* job;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_wakeup.wait(lock,
+					[&] { return _stopping || (_generation != generation); });
+				if (_stopping)
+					return;
+				generation = _generation;
+				job = _job;
+			}
+
+			work(*job, index);
+
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_finished++;
+			}
+			_done.notify_one();
+		}
+	}
+
+	void work(Job& job, unsigned index)
+	{
+		Share& share = _shares[index];
+		for (;;)
+		{
+			/* Take a chunk off the front of our own share: an eighth of what's
+			 * left, so chunks get smaller towards the end. */
+
+			size_t start;
+			size_t count;
+			{
+				std::lock_guard<std::mutex> lock(share.mutex);
+				size_t remaining = share.remaining();
+				count = std::min(remaining,
+					std::max(job.grain, remaining / 8));
+				start = share.start;
+				share.start += count;
+			}
+
+			if (!count && !steal(job, index))
+				return;
+
+			if (count)
+			{
+				Trace::Scope chunk(_trace, "dispatch", "chunk",
+					_trace ? ("\"start\": " + std::to_string(start) +
+						", \"count\": " + std::to_string(count)) : string());
+				try
+				{
+					job.fn(start, count);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(_mutex);
+					if (!job.exception)
+						job.exception = std::current_exception();
+				}
+			}
+		}
+	}
+
+	/* Moves the back half of the largest other share into ours. Returns
+	 * false if there's nothing left worth stealing. */
+
+	bool steal(Job& job, unsigned index)
+	{
+		for (;;)
+		{
+			unsigned victim = index;
+			size_t largest = 0;
+			for (unsigned i=0; i<_shares.size(); i++)
+			{
+				size_t remaining = _shares[i].remaining();
+				if ((i != index) && (remaining > largest))
+				{
+					victim = i;
+					largest = remaining;
+				}
+			}
+			if (!largest)
+				return false;
+
+			size_t start;
+			size_t end;
+			{
+				std::lock_guard<std::mutex> lock(_shares[victim].mutex);
+				Share& share = _shares[victim];
+				size_t remaining = share.remaining();
+				if (!remaining)
+					continue;
+
+				/* Take half, but at least a grain. */
+
+				size_t count = (remaining > job.grain) ?
+					std::max(job.grain, remaining / 2) : remaining;
+				end = share.end;
+				start = end - count;
+				share.end = start;
+			}
+
+			if (_trace)
+				_trace->instant("dispatch", "steal",
+					"\"victim\": " + std::to_string(victim) +
+					", \"count\": " + std::to_string(end - start));
+
+			Share& share = _shares[index];
+			std::lock_guard<std::mutex> lock(share.mutex);
+			share.start = start;
+			share.end = end;
+			return true;
+		}
+	}
+
+	static void pinThread(unsigned index)
+	{
+#if defined(__linux__)
+		unsigned cpus = std::max(1U, std::thread::hardware_concurrency());
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(index % cpus, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+	}
+
+private:
+	vector<Share> _shares;
+	vector<std::thread> _threads;
+	std::mutex _mutex;
+	std::condition_variable _wakeup;
+	std::condition_variable _done;
+	uint64_t _generation;
+	unsigned _finished;
+	bool _stopping;
+	Job* _job;
+	Trace* _trace;
+};
+
+#endif
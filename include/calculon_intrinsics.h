@@ -22,6 +22,15 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!parameters[0].boolean)
+				return false;
+			result = Constant::truth(!parameters[0].value);
+			return true;
+		}
+
 		llvm::Type* returnType(CompilerState& state,
 				const vector<llvm::Type*>& inputTypes)
 		{
@@ -44,11 +53,26 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = Constant::truth(parameters[0].value < parameters[1].value);
+			return true;
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
 			return state.builder.CreateFCmpOLT(parameters[0], parameters[1]);
 		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return state.builder.CreateICmpSLT(parameters[0], parameters[1]);
+		}
 	}
 	_ltMethod;
 
@@ -60,11 +84,26 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = Constant::truth(parameters[0].value <= parameters[1].value);
+			return true;
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
 			return state.builder.CreateFCmpOLE(parameters[0], parameters[1]);
 		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return state.builder.CreateICmpSLE(parameters[0], parameters[1]);
+		}
 	}
 	_leMethod;
 
@@ -76,11 +115,26 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = Constant::truth(parameters[0].value > parameters[1].value);
+			return true;
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
 			return state.builder.CreateFCmpOGT(parameters[0], parameters[1]);
 		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return state.builder.CreateICmpSGT(parameters[0], parameters[1]);
+		}
 	}
 	_gtMethod;
 
@@ -92,11 +146,26 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = Constant::truth(parameters[0].value >= parameters[1].value);
+			return true;
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
 			return state.builder.CreateFCmpOGE(parameters[0], parameters[1]);
 		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return state.builder.CreateICmpSGE(parameters[0], parameters[1]);
+		}
 	}
 	_geMethod;
 
@@ -108,15 +177,35 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (parameters[0].boolean != parameters[1].boolean)
+				return false;
+			result = Constant::truth(parameters[0].value == parameters[1].value);
+			return true;
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
 			Type* type = state.types->find(parameters[0]->getType());
+			vector<llvm::Value*> p = parameters;
+
+			/* Matrices compare exactly like their flattened vectors. */
+			if (MatrixType* mtype = type->asMatrix())
+			{
+				p[0] = mtype->flatten(parameters[0]);
+				p[1] = mtype->flatten(parameters[1]);
+				type = mtype->flattype;
+			}
 
 			if (type == state.realType)
-				return state.builder.CreateFCmpOEQ(parameters[0], parameters[1]);
+				return state.builder.CreateFCmpOEQ(p[0], p[1]);
 			else if (type == state.booleanType)
-				return state.builder.CreateICmpEQ(parameters[0], parameters[1]);
+				return state.builder.CreateICmpEQ(p[0], p[1]);
+			else if (type == state.scriptIntType)
+				return state.builder.CreateICmpEQ(p[0], p[1]);
 			else if (type->asVector())
 			{
 				VectorType* vtype = type->asVector();
@@ -125,8 +214,8 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 
 				for (unsigned i = 0; i < vtype->size; i++)
 				{
-					llvm::Value* x0 = vtype->getElement(parameters[0], i);
-					llvm::Value* x1 = vtype->getElement(parameters[1], i);
+					llvm::Value* x0 = vtype->getElement(p[0], i);
+					llvm::Value* x1 = vtype->getElement(p[1], i);
 					llvm::Value* x = state.builder.CreateFCmpOEQ(x0, x1);
 					v = state.builder.CreateAnd(v, x);
 				}
@@ -150,15 +239,40 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		/* Reals are compared ordered, so NaN != NaN is false. */
+
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			const Constant& a = parameters[0];
+			const Constant& b = parameters[1];
+			if (a.boolean != b.boolean)
+				return false;
+			result = Constant::truth(a.boolean ? (a.value != b.value) :
+					((a.value < b.value) || (a.value > b.value)));
+			return true;
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
 			Type* type = state.types->find(parameters[0]->getType());
+			vector<llvm::Value*> p = parameters;
+
+			/* Matrices compare exactly like their flattened vectors. */
+			if (MatrixType* mtype = type->asMatrix())
+			{
+				p[0] = mtype->flatten(parameters[0]);
+				p[1] = mtype->flatten(parameters[1]);
+				type = mtype->flattype;
+			}
 
 			if (type == state.realType)
-				return state.builder.CreateFCmpONE(parameters[0], parameters[1]);
+				return state.builder.CreateFCmpONE(p[0], p[1]);
 			else if (type == state.booleanType)
-				return state.builder.CreateICmpNE(parameters[0], parameters[1]);
+				return state.builder.CreateICmpNE(p[0], p[1]);
+			else if (type == state.scriptIntType)
+				return state.builder.CreateICmpNE(p[0], p[1]);
 			else if (type->asVector())
 			{
 				VectorType* vtype = type->asVector();
@@ -167,8 +281,8 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 
 				for (unsigned i = 0; i < vtype->size; i++)
 				{
-					llvm::Value* x0 = vtype->getElement(parameters[0], i);
-					llvm::Value* x1 = vtype->getElement(parameters[1], i);
+					llvm::Value* x0 = vtype->getElement(p[0], i);
+					llvm::Value* x1 = vtype->getElement(p[1], i);
 					llvm::Value* x = state.builder.CreateFCmpONE(x0, x1);
 					v = state.builder.CreateOr(v, x);
 				}
@@ -194,6 +308,15 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = Constant::real(parameters[0].value + parameters[1].value);
+			return true;
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
@@ -203,6 +326,12 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 
 			return state.builder.CreateFAdd(lhs, rhs);
 		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return state.builder.CreateAdd(parameters[0], parameters[1]);
+		}
 	}
 	_addMethod;
 
@@ -216,6 +345,18 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			if (parameters.size() == 1)
+				result = Constant::real(-parameters[0].value);
+			else
+				result = Constant::real(parameters[0].value - parameters[1].value);
+			return true;
+		}
+
 		void checkParameterCount(CompilerState& state, int calledwith)
 		{
 			/* Accept one or two parameters. */
@@ -249,6 +390,14 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 					throw 0;
 			}
 		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			if (parameters.size() == 1)
+				return state.builder.CreateNeg(parameters[0]);
+			return state.builder.CreateSub(parameters[0], parameters[1]);
+		}
 	}
 	_subMethod;
 
@@ -262,6 +411,66 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = Constant::real(parameters[0].value * parameters[1].value);
+			return true;
+		}
+
+		llvm::Value* emitCall(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			/* Multiplying a matrix by a matrix or vector is a matrix product.
+			 * Scaling a matrix by a real is handled element by element.
+			 */
+
+			Type* lhst = state.types->find(parameters[0]->getType());
+			Type* rhst = state.types->find(parameters[1]->getType());
+			MatrixType* lhsm = lhst->asMatrix();
+			MatrixType* rhsm = rhst->asMatrix();
+
+			if (lhsm && rhsm)
+			{
+				if (lhsm->columns != rhsm->rows)
+					shapeError(state, lhst, rhst);
+
+				llvm::Value* v = lhsm->multiply(lhsm->flatten(parameters[0]),
+						rhsm, rhsm->flatten(parameters[1]));
+				return rhsm->withRows(lhsm->rows)->unflatten(v);
+			}
+
+			if (lhsm && rhst->asVector())
+			{
+				if (lhsm->columns != rhst->asVector()->size)
+					shapeError(state, lhst, rhst);
+
+				return lhsm->multiplyColumn(lhsm->flatten(parameters[0]),
+						parameters[1]);
+			}
+
+			if (lhst->asVector() && rhsm)
+			{
+				if (lhst->asVector()->size != rhsm->rows)
+					shapeError(state, lhst, rhst);
+
+				return rhsm->multiplyRow(parameters[0],
+						rhsm->flatten(parameters[1]));
+			}
+
+			return BitcodeRealOrVectorArraySymbol::emitCall(state, parameters);
+		}
+
+		void shapeError(CompilerState& state, Type* lhst, Type* rhst)
+		{
+			std::stringstream s;
+			s << "can't multiply a " << lhst->name << " by a " << rhst->name
+			  << " (the sizes don't match)";
+			throw CompilationException(state.position.formatError(s.str()));
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
@@ -271,9 +480,55 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 
 			return state.builder.CreateFMul(lhs, rhs);
 		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return state.builder.CreateMul(parameters[0], parameters[1]);
+		}
 	}
 	_mulMethod;
 
+	/* Integer division never traps: x/0 is 0 and x%0 is x (so that
+	 * x == (x/y)*y + x%y always holds), and INT_MIN/-1 wraps. */
+
+	static llvm::Value* createIntDivision(CompilerState& state,
+			llvm::Value* lhs, llvm::Value* rhs, bool remainder)
+	{
+		llvm::Value* zero = llvm::ConstantInt::get(rhs->getType(), 0);
+		llvm::Value* minusone = llvm::ConstantInt::get(rhs->getType(), -1, true);
+
+		if (llvm::ConstantInt* c = llvm::dyn_cast<llvm::ConstantInt>(rhs))
+		{
+			if (c->isZero())
+				return remainder ? lhs : zero;
+			if (c->isMinusOne())
+				return remainder ? zero : state.builder.CreateNeg(lhs);
+			return remainder ?
+				state.builder.CreateSRem(lhs, rhs) :
+				state.builder.CreateSDiv(lhs, rhs);
+		}
+
+		llvm::Value* iszero = state.builder.CreateICmpEQ(rhs, zero);
+		llvm::Value* isminusone = state.builder.CreateICmpEQ(rhs, minusone);
+		llvm::Value* safe = state.builder.CreateSelect(
+				state.builder.CreateOr(iszero, isminusone),
+				llvm::ConstantInt::get(rhs->getType(), 1), rhs);
+
+		if (remainder)
+		{
+			/* x%1 is already 0, which is right for x%-1. */
+
+			llvm::Value* r = state.builder.CreateSRem(lhs, safe);
+			return state.builder.CreateSelect(iszero, lhs, r);
+		}
+
+		llvm::Value* q = state.builder.CreateSDiv(lhs, safe);
+		q = state.builder.CreateSelect(isminusone,
+				state.builder.CreateNeg(lhs), q);
+		return state.builder.CreateSelect(iszero, zero, q);
+	}
+
 	class DivMethod : public BitcodeRealOrVectorArraySymbol
 	{
 		using BitcodeRealOrVectorArraySymbol::convertRHS;
@@ -284,6 +539,15 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		{
 		}
 
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = Constant::real(parameters[0].value / parameters[1].value);
+			return true;
+		}
+
 		llvm::Value* emitBitcode(CompilerState& state,
 					const vector<llvm::Value*>& parameters)
 		{
@@ -293,9 +557,145 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 
 			return state.builder.CreateFDiv(lhs, rhs);
 		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return createIntDivision(state, parameters[0], parameters[1],
+					false);
+		}
 	}
 	_divMethod;
 
+	class ModMethod : public BitcodeRealOrVectorArraySymbol
+	{
+		using BitcodeRealOrVectorArraySymbol::convertRHS;
+
+	public:
+		ModMethod():
+			BitcodeRealOrVectorArraySymbol("method %", 2)
+		{
+		}
+
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = Constant::real(std::fmod(parameters[0].value, parameters[1].value));
+			return true;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			llvm::Value* lhs = parameters[0];
+			llvm::Value* rhs = parameters[1];
+			rhs = convertRHS(state, lhs, rhs);
+
+			return state.builder.CreateFRem(lhs, rhs);
+		}
+
+		llvm::Value* emitIntBitcode(CompilerState& state,
+					const vector<llvm::Value*>& parameters)
+		{
+			return createIntDivision(state, parameters[0], parameters[1],
+					true);
+		}
+	}
+	_modMethod;
+
+	/* int(x) truncates towards zero, saturating; NaN becomes 0. */
+
+	class IntFunction : public BitcodeSymbol
+	{
+		using CallableSymbol::typeError;
+
+	public:
+		IntFunction():
+			BitcodeSymbol("int", 1)
+		{
+		}
+
+		void typeCheckParameter(CompilerState& state,
+					int index, llvm::Value* argument, Type* type)
+		{
+			Type* t = state.types->find(argument->getType());
+			if (!t->equals(state.realType) && !t->equals(state.scriptIntType) &&
+					!t->equals(state.booleanType))
+				typeError(state, index, argument, "real, int or boolean");
+		}
+
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
+		{
+			return state.scriptIntType->llvm;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			llvm::Value* v = parameters[0];
+			llvm::Type* it = state.scriptIntType->llvm;
+			if (v->getType() == it)
+				return v;
+			if (v->getType() == state.booleanType->llvm)
+				return state.builder.CreateZExt(v, it);
+			return state.builder.CreateIntrinsic(llvm::Intrinsic::fptosi_sat,
+					{ it, v->getType() }, { v });
+		}
+	}
+	_intFunction;
+
+	class RealFunction : public BitcodeSymbol
+	{
+		using CallableSymbol::typeError;
+
+	public:
+		RealFunction():
+			BitcodeSymbol("real", 1)
+		{
+		}
+
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			if (!CallableSymbol::allReals(parameters))
+				return false;
+			result = parameters[0];
+			return true;
+		}
+
+		bool mayReturnInteger(CompilerState& state, bool integerParameters)
+		{
+			return false;
+		}
+
+		void typeCheckParameter(CompilerState& state,
+					int index, llvm::Value* argument, Type* type)
+		{
+			Type* t = state.types->find(argument->getType());
+			if (!t->equals(state.realType) && !t->equals(state.scriptIntType))
+				typeError(state, index, argument, "real or int");
+		}
+
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
+		{
+			return state.realType->llvm;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			llvm::Value* v = parameters[0];
+			if (v->getType() == state.realType->llvm)
+				return v;
+			return state.builder.CreateSIToFP(v, state.realType->llvm);
+		}
+	}
+	_realFunction;
+
 	class LengthMethod : public BitcodeVectorSymbol
 	{
 	public:
@@ -537,44 +937,39 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 	}
 	_wMethod;
 
-	class VectorSquareBracketMethod : public BitcodeSymbol
+	class TransposeMethod : public BitcodeMatrixSymbol
 	{
-		using CallableSymbol::vectorSizeError;
-		using CallableSymbol::typeError;
-
 	public:
-		VectorSquareBracketMethod():
-			BitcodeSymbol("method []", -1)
+		TransposeMethod():
+			BitcodeMatrixSymbol("method transpose")
 		{
 		}
 
-		void checkParameterCount(CompilerState& state, int calledwith)
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
 		{
-			/* Accept one or two parameters. */
-			if ((calledwith == 2) || (calledwith == 3))
-				return;
-
-			/* Otherwise, let the superclass produce the error. */
-			BitcodeSymbol::checkParameterCount(state, calledwith);
+			MatrixType* t = state.types->find(inputTypes[0])->asMatrix();
+			return state.types->findMatrix(t->columns, t->rows)->llvm;
 		}
 
-		void typeCheckParameter(CompilerState& state,
-					int index, llvm::Value* argument, Type* type)
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
 		{
-			Type* t = state.types->find(argument->getType());
+			MatrixType* t = state.types->find(parameters[0]->getType())->asMatrix();
+			MatrixType* rt = state.types->findMatrix(t->columns, t->rows);
+			return rt->unflatten(t->transpose(t->flatten(parameters[0])));
+		}
+	}
+	_transposeMethod;
 
-			switch (index)
-			{
-				case 1:
-					if (!t->asVector())
-						typeError(state, index, argument, type);
-					break;
+	class DeterminantMethod : public BitcodeMatrixSymbol
+	{
+		using BitcodeMatrixSymbol::matrixSizeError;
 
-				default:
-					if (!t->equals(state.realType))
-						typeError(state, index, argument, type);
-					break;
-			}
+	public:
+		DeterminantMethod():
+			BitcodeMatrixSymbol("method determinant")
+		{
 		}
 
 		llvm::Type* returnType(CompilerState& state,
@@ -586,84 +981,862 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 		llvm::Value* emitBitcode(CompilerState& state,
 				const vector<llvm::Value*>& parameters)
 		{
-			llvm::Value* vector = parameters[0];
-			VectorType* t = state.types->find(vector->getType())->asVector();
-
-			llvm::Value* element;
-			switch (parameters.size())
-			{
-				case 2:
-				{
-					element = state.builder.CreateFPToUI(parameters[1],
-							state.intType);
-					break;
-				}
-
-				case 3:
-				{
-					/* Square vectors */
-
-					unsigned root = (unsigned)sqrt(t->size);
-					if ((root*root) != t->size)
-					{
-						std::stringstream s;
-						s << "you can only use a .mXY operator on square vectors, and this one has "
-						  << t->size << " element";
-						if (t->size != 1)
-							s << "s";
-
-						throw CompilationException(state.position.formatError(s.str()));
-					}
-
-					llvm::Value* x = state.builder.CreateFPToUI(parameters[1],
-							state.intType);
-					llvm::Value* y = state.builder.CreateFPToUI(parameters[2],
-							state.intType);
-					element = state.builder.CreateMul(y,
-							llvm::ConstantInt::get(state.intType, root));
-					element = state.builder.CreateAdd(element, x);
-					break;
-				}
-
-				default:
-					assert(false);
-			}
+			MatrixType* t = state.types->find(parameters[0]->getType())->asMatrix();
+			if (!t->isInvertible())
+				matrixSizeError(state, t);
 
-			element = state.builder.CreateURem(element,
-					llvm::ConstantInt::get(state.intType, t->size));
-			return state.builder.CreateExtractElement(vector, element);
+			return t->determinant(t->flatten(parameters[0]));
 		}
 	}
-	_vectorSquareBracketMethod;
+	_determinantMethod;
 
-	class SimpleRealExternal : public IntrinsicFunctionSymbol
+	class InverseMethod : public BitcodeMatrixSymbol
 	{
-		using Symbol::name;
-		using CallableSymbol::typeError;
+		using BitcodeMatrixSymbol::matrixSizeError;
 
 	public:
-		SimpleRealExternal(const string& name, int params):
-			IntrinsicFunctionSymbol(name, params)
+		InverseMethod():
+			BitcodeMatrixSymbol("method inverse")
 		{
 		}
 
-		void typeCheckParameter(CompilerState& state,
-					int index, llvm::Value* argument, char type)
-		{
-			if (argument->getType() != state.realType->llvm)
-				typeError(state, index, argument, type);
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
+		{
+			return inputTypes[0];
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			MatrixType* t = state.types->find(parameters[0]->getType())->asMatrix();
+			if (!t->isInvertible())
+				matrixSizeError(state, t);
+
+			return t->unflatten(t->inverse(t->flatten(parameters[0])));
+		}
+	}
+	_inverseMethod;
+
+	class MatrixToVectorMethod : public BitcodeMatrixSymbol
+	{
+	public:
+		MatrixToVectorMethod():
+			BitcodeMatrixSymbol("method vector")
+		{
 		}
 
 		llvm::Type* returnType(CompilerState& state,
 				const vector<llvm::Type*>& inputTypes)
 		{
-			return inputTypes[0];
+			return state.types->find(inputTypes[0])->asMatrix()->flattype->llvm;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			MatrixType* t = state.types->find(parameters[0]->getType())->asMatrix();
+			return t->flatten(parameters[0]);
+		}
+	}
+	_matrixToVectorMethod;
+
+	class VectorToMatrixMethod : public BitcodeSymbol
+	{
+		using CallableSymbol::typeError;
+
+	public:
+		VectorToMatrixMethod():
+			BitcodeSymbol("method matrix", -1)
+		{
+		}
+
+		bool mayReturnInteger(CompilerState& state, bool integerParameters)
+		{
+			return false;
+		}
+
+		void checkParameterCount(CompilerState& state, int calledwith)
+		{
+			/* Accept an optional row count. */
+			if ((calledwith == 1) || (calledwith == 2))
+				return;
+
+			/* Otherwise, let the superclass produce the error. */
+			BitcodeSymbol::checkParameterCount(state, calledwith);
+		}
+
+		void typeCheckParameter(CompilerState& state,
+					int index, llvm::Value* argument, Type* type)
+		{
+			Type* t = state.types->find(argument->getType());
+
+			switch (index)
+			{
+				case 1:
+					if (!t->asVector())
+						typeError(state, index, argument, "vector");
+					break;
+
+				default:
+					if (!t->equals(state.realType))
+						typeError(state, index, argument, "real");
+					break;
+			}
+		}
+
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
+		{
+			assert(false);
+			throw 0;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			VectorType* t = state.types->find(parameters[0]->getType())->asVector();
+
+			/* Without a row count the vector must be square. */
+
+			unsigned rows = (unsigned)sqrt(t->size);
+			if (parameters.size() == 2)
+			{
+				llvm::ConstantFP* c = llvm::dyn_cast<llvm::ConstantFP>(parameters[1]);
+				if (!c)
+					error(state, "the number of rows in a matrix must be a constant");
+
+				double d = c->getValueAPF().convertToDouble();
+				rows = (unsigned)d;
+				if (((double)rows != d) || (rows == 0) || (t->size % rows))
+				{
+					std::stringstream s;
+					s << "a vector with " << t->size
+					  << " elements can't be split into " << d << " rows";
+					error(state, s.str());
+				}
+			}
+			else if ((rows*rows) != t->size)
+			{
+				std::stringstream s;
+				s << "a vector with " << t->size
+				  << " elements isn't square, so you need to specify the number of rows";
+				error(state, s.str());
+			}
+
+			MatrixType* mt = state.types->findMatrix(rows, t->size / rows);
+			return mt->unflatten(parameters[0]);
+		}
+
+	private:
+		void error(CompilerState& state, const string& what)
+		{
+			throw CompilationException(state.position.formatError(what));
+		}
+	}
+	_vectorToMatrixMethod;
+
+	class VectorSquareBracketMethod : public BitcodeSymbol
+	{
+		using CallableSymbol::vectorSizeError;
+		using CallableSymbol::typeError;
+
+	public:
+		VectorSquareBracketMethod():
+			BitcodeSymbol("method []", -1)
+		{
+		}
+
+		bool mayReturnInteger(CompilerState& state, bool integerParameters)
+		{
+			return false;
+		}
+
+		void checkParameterCount(CompilerState& state, int calledwith)
+		{
+			/* Accept one or two parameters. */
+			if ((calledwith == 2) || (calledwith == 3))
+				return;
+
+			/* Otherwise, let the superclass produce the error. */
+			BitcodeSymbol::checkParameterCount(state, calledwith);
+		}
+
+		void typeCheckParameter(CompilerState& state,
+					int index, llvm::Value* argument, Type* type)
+		{
+			Type* t = state.types->find(argument->getType());
+
+			switch (index)
+			{
+				case 1:
+					if (!t->asVector() && !t->asMatrix())
+						typeError(state, index, argument, "vector or matrix");
+					break;
+
+				default:
+					if (!t->equals(state.realType) && !t->equals(state.scriptIntType))
+						typeError(state, index, argument, "real or int");
+					break;
+			}
+		}
+
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
+		{
+			return state.realType->llvm;
+		}
+
+		llvm::Value* emitBitcode(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			/* Matrices are indexed via their flattened form. */
+
+			llvm::Value* vector = parameters[0];
+			MatrixType* mt = state.types->find(vector->getType())->asMatrix();
+			if (mt)
+				vector = mt->flatten(vector);
+			VectorType* t = state.types->find(vector->getType())->asVector();
+
+			/* Work out the stride for two-dimensional indexing. */
+
+			unsigned root = (unsigned)sqrt(t->size);
+			if (parameters.size() == 3)
+			{
+				/* Square vectors, or matrices */
+
+				if (mt)
+					root = mt->columns;
+				else if ((root*root) != t->size)
+				{
+					std::stringstream s;
+					s << "you can only use a .mXY operator on square vectors, and this one has "
+					  << t->size << " element";
+					if (t->size != 1)
+						s << "s";
+
+					throw CompilationException(state.position.formatError(s.str()));
+				}
+			}
+
+			/* Find the range of the flattened index; if it's a single
+			 * value, the element is known at compile time. */
+
+			Range range;
+			llvm::Value* element;
+			switch (parameters.size())
+			{
+				case 2:
+				{
+					range = indexRange(parameters[1], 0);
+					if (range.isConstant())
+						break;
+
+					element = toIndex(state, parameters[1]);
+					break;
+				}
+
+				case 3:
+				{
+					Range x = indexRange(parameters[1], 0);
+					Range y = indexRange(parameters[2], 0);
+					range = y.scale(root).add(x);
+					if (range.isConstant())
+						break;
+
+					llvm::Value* xi = toIndex(state, parameters[1]);
+					llvm::Value* yi = toIndex(state, parameters[2]);
+					element = state.builder.CreateMul(yi,
+							llvm::ConstantInt::get(state.intType, root));
+					element = state.builder.CreateAdd(element, xi);
+					break;
+				}
+
+				default:
+					assert(false);
+			}
+
+			/* Out of bound indices wrap, so -1 is the last element, unless
+			 * they provably can't be out of bounds. */
+
+			if (range.isConstant())
+			{
+				int64_t i = (int64_t)range.lo % (int64_t)t->size;
+				return t->getElement(vector, (i < 0) ? (i + t->size) : i);
+			}
+
+			if (!range.within(t->size))
+			{
+				llvm::Value* size = llvm::ConstantInt::get(state.intType, t->size);
+				element = state.builder.CreateSRem(element, size);
+				element = state.builder.CreateSelect(
+						state.builder.CreateICmpSLT(element,
+							llvm::ConstantInt::get(state.intType, 0)),
+						state.builder.CreateAdd(element, size),
+						element);
+			}
+
+			/* The backend would spill the vector to do a dynamic
+			 * extractelement anyway. Doing it explicitly, via a slot in the
+			 * entry block, lets the optimisers see the memory access. */
+
+			llvm::Value* slot = state.createEntryAlloca(t->llvm);
+
+			state.builder.CreateStore(vector, slot);
+			llvm::Value* p = state.builder.CreateBitCast(slot,
+					llvm::PointerType::get(state.realType->llvm, 0));
+			p = state.builder.CreateGEP(state.realType->llvm, p, element);
+			return state.builder.CreateAlignedLoad(state.realType->llvm, p,
+					llvm::Align(sizeof(Real)));
+		}
+
+	private:
+		llvm::Value* toIndex(CompilerState& state, llvm::Value* v)
+		{
+			if (v->getType() == state.scriptIntType->llvm)
+				return v;
+			return state.builder.CreateFPToSI(v, state.intType);
+		}
+
+		/* A conservative range of integer values which an index may take
+		 * after truncation. */
+
+		struct Range
+		{
+			double lo, hi;
+			bool known;
+
+			Range():
+				lo(0), hi(0), known(false)
+			{
+			}
+
+			Range(double lo, double hi):
+				lo(trunc(lo)), hi(trunc(hi)),
+				known((lo > INT32_MIN) && (hi < INT32_MAX))
+			{
+			}
+
+			bool isConstant() const
+			{
+				return known && (lo == hi);
+			}
+
+			bool within(unsigned size) const
+			{
+				return known && (lo >= 0) && (hi < size);
+			}
+
+			Range scale(unsigned n) const
+			{
+				if (!known)
+					return Range();
+				return Range(lo*n, hi*n);
+			}
+
+			Range add(const Range& other) const
+			{
+				if (!known || !other.known)
+					return Range();
+				return Range(lo + other.lo, hi + other.hi);
+			}
+		};
+
+		/* Finds the range of a real or int index from the IR which
+		 * computes it. This only understands the things which commonly
+		 * appear in index expressions; anything else may be any value. */
+
+		Range indexRange(llvm::Value* v, int depth)
+		{
+			double lo, hi;
+			realRange(v, lo, hi, depth);
+			return Range(lo, hi);
+		}
+
+		void realRange(llvm::Value* v, double& lo, double& hi, int depth)
+		{
+			lo = -INFINITY;
+			hi = INFINITY;
+			if (depth > 8)
+				return;
+
+			if (llvm::ConstantFP* c = llvm::dyn_cast<llvm::ConstantFP>(v))
+			{
+				lo = hi = c->getValueAPF().convertToDouble();
+				return;
+			}
+
+			if (llvm::ConstantInt* c = llvm::dyn_cast<llvm::ConstantInt>(v))
+			{
+				lo = hi = c->getSExtValue();
+				return;
+			}
+
+			if (llvm::isa<llvm::SIToFPInst>(v))
+			{
+				realRange(llvm::cast<llvm::Instruction>(v)->getOperand(0),
+						lo, hi, depth+1);
+				return;
+			}
+
+			if (llvm::SelectInst* si = llvm::dyn_cast<llvm::SelectInst>(v))
+			{
+				double l0, h0, l1, h1;
+				realRange(si->getTrueValue(), l0, h0, depth+1);
+				realRange(si->getFalseValue(), l1, h1, depth+1);
+				lo = std::min(l0, l1);
+				hi = std::max(h0, h1);
+				return;
+			}
+
+			if (llvm::PHINode* phi = llvm::dyn_cast<llvm::PHINode>(v))
+			{
+				for (unsigned i = 0; i < phi->getNumIncomingValues(); i++)
+				{
+					double l, h;
+					realRange(phi->getIncomingValue(i), l, h, depth+1);
+					lo = (i == 0) ? l : std::min(lo, l);
+					hi = (i == 0) ? h : std::max(hi, h);
+				}
+				return;
+			}
+
+			if (llvm::BinaryOperator* bo = llvm::dyn_cast<llvm::BinaryOperator>(v))
+			{
+				double l0, h0, l1, h1;
+				realRange(bo->getOperand(0), l0, h0, depth+1);
+				realRange(bo->getOperand(1), l1, h1, depth+1);
+
+				switch (bo->getOpcode())
+				{
+					case llvm::Instruction::FAdd:
+					case llvm::Instruction::Add:
+						lo = l0 + l1;
+						hi = h0 + h1;
+						break;
+
+					case llvm::Instruction::FSub:
+					case llvm::Instruction::Sub:
+						lo = l0 - h1;
+						hi = h0 - l1;
+						break;
+
+					case llvm::Instruction::FMul:
+					case llvm::Instruction::Mul:
+					{
+						double p[] = { l0*l1, l0*h1, h0*l1, h0*h1 };
+						lo = *std::min_element(p, p+4);
+						hi = *std::max_element(p, p+4);
+						break;
+					}
+
+					case llvm::Instruction::SRem:
+					{
+						/* Only a constant divisor is interesting. */
+
+						double d = fabs(l1);
+						if ((l1 != h1) || (d < 1))
+							break;
+
+						lo = (l0 >= 0) ? 0 : -(d-1);
+						hi = (h0 <= 0) ? 0 : std::min(d-1, h0);
+						break;
+					}
+
+					default:
+						break;
+				}
+
+				/* inf-inf and 0*inf mean that nothing is known, and ints
+				 * might have wrapped. */
+
+				if (std::isnan(lo) || std::isnan(hi) ||
+						(bo->getType()->isIntegerTy() &&
+						 ((lo < INT32_MIN) || (hi > INT32_MAX))))
+				{
+					lo = -INFINITY;
+					hi = INFINITY;
+				}
+				return;
+			}
+
+			if (llvm::IntrinsicInst* ii = llvm::dyn_cast<llvm::IntrinsicInst>(v))
+			{
+				switch (ii->getIntrinsicID())
+				{
+					case llvm::Intrinsic::floor:
+					case llvm::Intrinsic::trunc:
+					case llvm::Intrinsic::ceil:
+					case llvm::Intrinsic::round:
+					case llvm::Intrinsic::rint:
+					case llvm::Intrinsic::nearbyint:
+						realRange(ii->getArgOperand(0), lo, hi, depth+1);
+						lo = floor(lo);
+						hi = ceil(hi);
+						break;
+
+					case llvm::Intrinsic::fptosi_sat:
+						realRange(ii->getArgOperand(0), lo, hi, depth+1);
+						lo = std::max(trunc(lo), (double)INT32_MIN);
+						hi = std::min(trunc(hi), (double)INT32_MAX);
+						break;
+
+					case llvm::Intrinsic::minnum:
+					case llvm::Intrinsic::maxnum:
+					{
+						double l0, h0, l1, h1;
+						realRange(ii->getArgOperand(0), l0, h0, depth+1);
+						realRange(ii->getArgOperand(1), l1, h1, depth+1);
+
+						if (ii->getIntrinsicID() == llvm::Intrinsic::minnum)
+						{
+							lo = std::min(l0, l1);
+							hi = std::min(h0, h1);
+						}
+						else
+						{
+							lo = std::max(l0, l1);
+							hi = std::max(h0, h1);
+						}
+						break;
+					}
+
+					default:
+						break;
+				}
+			}
+		}
+	}
+	_vectorSquareBracketMethod;
+
+	/* The libm functions. These accept either reals or vectors; with
+	 * vectors, the function is applied to each element, and any real
+	 * parameters are splatted to match.
+	 *
+	 * Functions with a MathKernels implementation use it unless the
+	 * accuracy is LIBM. The accuracy comes from the Program's Options,
+	 * or is fixed by the variant (e.g. sin_fast).
+	 *
+	 * Vectors are handled in one of three ways, fastest first: via an
+	 * LLVM intrinsic which the backend lowers to native instructions; via
+	 * the SIMD entrypoints in glibc's libmvec, if present; or (as a last
+	 * resort) with one libm call per element.
+	 */
+
+	class SimpleRealExternal : public IntrinsicFunctionSymbol
+	{
+		using Symbol::name;
+		using CallableSymbol::typeError;
+		using CallableSymbol::vectorSizeError;
+
+		string _function;
+		bool _fixedaccuracy;
+		MathAccuracy _accuracy;
+
+	public:
+		SimpleRealExternal(const string& name, int params):
+			IntrinsicFunctionSymbol(name, params),
+			_function(name),
+			_fixedaccuracy(false),
+			_accuracy(LIBM)
+		{
+		}
+
+		SimpleRealExternal(const string& function, int params,
+				MathAccuracy accuracy, const string& suffix):
+			IntrinsicFunctionSymbol(function + "_" + suffix, params),
+			_function(function),
+			_fixedaccuracy(true),
+			_accuracy(accuracy)
+		{
+		}
+
+		void typeCheckParameter(CompilerState& state,
+					int index, llvm::Value* argument, Type* type)
+		{
+			Type* at = state.types->find(argument->getType());
+			if (!at->equals(state.realType) && !at->asVector())
+				typeError(state, index, argument, "real or vector");
+		}
+
+		llvm::Type* returnType(CompilerState& state,
+				const vector<llvm::Type*>& inputTypes)
+		{
+			for (llvm::Type* t : inputTypes)
+				if (t != state.realType->llvm)
+					return t;
+			return state.realType->llvm;
+		}
+
+		bool mayReturnInteger(CompilerState& state, bool integerParameters)
+		{
+			return false;
+		}
+
+		/* Only folded where the generated code would call libm too, by
+		 * calling the same function, so that the result is the same. The
+		 * generated call isn't a constant, so neither is the result. */
+
+		bool fold(CompilerState& state, const vector<Constant>& parameters,
+				Constant& result)
+		{
+			MathAccuracy accuracy = _fixedaccuracy ?
+					_accuracy : state.options.accuracy;
+			if (!CallableSymbol::allReals(parameters) ||
+					MathKernels::supports(_function, accuracy))
+				return false;
+
+			void* f = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+					intrinsicName(vector<llvm::Type*>()));
+			if (!f)
+				return false;
+
+			const vector<Constant>& p = parameters;
+			switch (p.size())
+			{
+				case 1:
+					result = Constant::real(((Real (*)(Real)) f)(p[0].value));
+					break;
+
+				case 2:
+					result = Constant::real(((Real (*)(Real, Real)) f)(
+							p[0].value, p[1].value));
+					break;
+
+				case 3:
+					result = Constant::real(((Real (*)(Real, Real, Real)) f)(
+							p[0].value, p[1].value, p[2].value));
+					break;
+
+				default:
+					return false;
+			}
+			result.opaque = true;
+			return true;
 		}
 
 		string intrinsicName(const vector<llvm::Type*>& inputTypes)
 		{
 			const char* suffix = S::chooseDoubleOrFloat("", "f");
-			return name + suffix;
+			return _function + suffix;
+		}
+
+		llvm::Value* emitCall(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			VectorType* vtype = NULL;
+			for (unsigned i = 0; i < parameters.size(); i++)
+			{
+				llvm::Value* v = parameters[i];
+				typeCheckParameter(state, i+1, v, NULL);
+
+				VectorType* t = state.types->find(v->getType())->asVector();
+				if (t)
+				{
+					if (vtype && (t != vtype))
+						typeError(state, i+1, v, vtype);
+					vtype = t;
+				}
+			}
+
+			vector<llvm::Value*> vparameters;
+			for (llvm::Value* v : parameters)
+			{
+				if (vtype && (v->getType() == state.realType->llvm))
+					v = vtype->splat(v);
+				vparameters.push_back(v);
+			}
+
+			MathAccuracy accuracy = _fixedaccuracy ?
+					_accuracy : state.options.accuracy;
+			if (MathKernels::supports(_function, accuracy))
+			{
+				MathKernels kernels(state, accuracy);
+				return kernels.emit(_function, vparameters,
+					[&]()
+					{
+						return emitLibmCall(state, vtype, vparameters);
+					});
+			}
+
+			return emitLibmCall(state, vtype, vparameters);
+		}
+
+	private:
+		llvm::Value* emitLibmCall(CompilerState& state,
+				VectorType* vtype, const vector<llvm::Value*>& vparameters)
+		{
+			/* Use intrinsics where possible, even for scalars, so that
+			 * the optimisers (and vector indexing) can reason about them. */
+
+			llvm::Intrinsic::ID id = nativeIntrinsic();
+			if (id != llvm::Intrinsic::not_intrinsic)
+				return state.builder.CreateIntrinsic(id,
+						vtype ? vtype->llvm : state.realType->llvm,
+						vparameters);
+
+			if (!vtype)
+				return emitScalarCall(state, vparameters);
+
+			llvm::Value* v = emitVectorLibraryCall(state, vtype, vparameters);
+			if (v)
+				return v;
+
+			return emitScalarisedCall(state, vtype, vparameters);
+		}
+
+		/* Functions which LLVM can lower to native vector instructions. */
+
+		llvm::Intrinsic::ID nativeIntrinsic()
+		{
+			static const std::map<string, llvm::Intrinsic::ID> intrinsics =
+			{
+				{ "ceil",      llvm::Intrinsic::ceil },
+				{ "copysign",  llvm::Intrinsic::copysign },
+				{ "fabs",      llvm::Intrinsic::fabs },
+				{ "floor",     llvm::Intrinsic::floor },
+				{ "fma",       llvm::Intrinsic::fma },
+				{ "fmax",      llvm::Intrinsic::maxnum },
+				{ "fmin",      llvm::Intrinsic::minnum },
+				{ "nearbyint", llvm::Intrinsic::nearbyint },
+				{ "rint",      llvm::Intrinsic::rint },
+				{ "round",     llvm::Intrinsic::round },
+				{ "sqrt",      llvm::Intrinsic::sqrt },
+				{ "trunc",     llvm::Intrinsic::trunc },
+			};
+
+			auto i = intrinsics.find(_function);
+			if (i == intrinsics.end())
+				return llvm::Intrinsic::not_intrinsic;
+			return i->second;
+		}
+
+		llvm::Value* emitScalarCall(CompilerState& state,
+				const vector<llvm::Value*>& parameters)
+		{
+			vector<llvm::Type*> types(parameters.size(),
+					state.realType->llvm);
+			llvm::FunctionType* ft = llvm::FunctionType::get(
+					state.realType->llvm, types, false);
+
+			llvm::FunctionCallee f = state.module->getOrInsertFunction(
+					intrinsicName(types), ft);
+			return state.builder.CreateCall(f, parameters);
+		}
+
+		llvm::Value* emitScalarisedCall(CompilerState& state,
+				VectorType* vtype, const vector<llvm::Value*>& parameters)
+		{
+			llvm::Value* result = llvm::UndefValue::get(vtype->llvm);
+			for (unsigned i = 0; i < vtype->size; i++)
+			{
+				vector<llvm::Value*> elements;
+				for (llvm::Value* v : parameters)
+					elements.push_back(vtype->getElement(v, i));
+
+				result = vtype->setElement(result, i,
+						emitScalarCall(state, elements));
+			}
+			return result;
+		}
+
+		/* libmvec entrypoints are named according to the x86 vector
+		 * function ABI: _ZGV<isa>N<lanes><v per parameter>_<name>. We pick
+		 * the narrowest one that covers the whole vector, or the widest
+		 * available and call it repeatedly.
+		 */
+
+		llvm::Value* emitVectorLibraryCall(CompilerState& state,
+				VectorType* vtype, const vector<llvm::Value*>& parameters)
+		{
+			static const struct
+			{
+				char isa;
+				const char* feature;
+				unsigned bits;
+			}
+			variants[] =
+			{
+				{ 'b', "+sse2",    128 },
+				{ 'd', "+avx2",    256 },
+				{ 'c', "+avx",     256 },
+				{ 'e', "+avx512f", 512 },
+			};
+
+			if (!loadVectorLibrary())
+				return NULL;
+
+			llvm::TargetMachine* tm = state.engine->getTargetMachine();
+			if (tm->getTargetTriple().getArch() != llvm::Triple::x86_64)
+				return NULL;
+			llvm::StringRef features = tm->getTargetFeatureString();
+
+			string symbol;
+			unsigned lanes = 0;
+			for (const auto& variant : variants)
+			{
+				if ((variant.isa != 'b') &&
+						!hasFeature(features, variant.feature))
+					continue;
+
+				unsigned l = variant.bits / (sizeof(Real)*8);
+				if (lanes >= vtype->size)
+					break;
+				if (l <= lanes)
+					continue;
+
+				std::stringstream s;
+				s << "_ZGV" << variant.isa << 'N' << l
+				  << string(parameters.size(), 'v')
+				  << '_' << intrinsicName(vector<llvm::Type*>());
+				if (!llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(s.str()))
+					continue;
+
+				symbol = s.str();
+				lanes = l;
+			}
+
+			if (symbol.empty())
+				return NULL;
+
+			VectorType* ltype = state.types->findVector(lanes);
+			vector<llvm::Type*> types(parameters.size(), ltype->llvm);
+			llvm::FunctionType* ft = llvm::FunctionType::get(
+					ltype->llvm, types, false);
+			llvm::FunctionCallee f = state.module->getOrInsertFunction(
+					symbol, ft);
+
+			llvm::Value* result = llvm::UndefValue::get(vtype->llvm);
+			for (unsigned base = 0; base < vtype->size; base += lanes)
+			{
+				vector<int> mask;
+				for (unsigned i = 0; i < lanes; i++)
+					mask.push_back(((base+i) < vtype->size) ? (base+i) : -1);
+
+				vector<llvm::Value*> chunks;
+				for (llvm::Value* v : parameters)
+					chunks.push_back(state.builder.CreateShuffleVector(v, mask));
+
+				llvm::Value* chunk = state.builder.CreateCall(f, chunks);
+				for (unsigned i = 0; (i < lanes) && ((base+i) < vtype->size); i++)
+					result = vtype->setElement(result, base+i,
+							ltype->getElement(chunk, i));
+			}
+			return result;
+		}
+
+		static bool hasFeature(llvm::StringRef features, llvm::StringRef feature)
+		{
+			llvm::SmallVector<llvm::StringRef, 64> f;
+			features.split(f, ',');
+			return std::find(f.begin(), f.end(), feature) != f.end();
+		}
+
+		static bool loadVectorLibrary()
+		{
+			static bool loaded =
+				!llvm::sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+			return loaded;
 		}
 	};
 
@@ -674,8 +1847,11 @@ class StandardSymbolTable : public MultipleSymbolTable, public Allocator
 	#undef REAL1
 	#undef REAL2
 	#undef REAL3
+	SimpleRealExternal _rsqrt;
 	char _dummy;
 
+	map<string, BitcodeModule*> _bitcodeModules;
+
 private:
 	void malformed_function_signature(Lexer& lexer, const string& what)
 	{
@@ -684,33 +1860,7 @@ private:
 
 	string parse_typespec(Lexer& lexer)
 	{
-		typedef Lexer L;
-
-		if (lexer.token() != L::IDENTIFIER)
-			malformed_function_signature(lexer, "expected type name");
-
-		std::stringstream s;
-		s << lexer.id();
-		lexer.next();
-
-		if ((lexer.token() == L::OPERATOR) && (lexer.id() == "*"))
-		{
-			s << "*";
-			lexer.next();
-
-			if (lexer.token() != L::NUMBER)
-				lexer.error("invalid n-vector type specifier");
-			int size = (int)lexer.real();
-			if ((Real)size != lexer.real())
-				lexer.error("n-vector size must be an integer");
-			if (size <= 0)
-				lexer.error("n-vector size must be greater than 0");
-			lexer.next();
-
-			s << size;
-		}
-
-		string type = s.str();
+		string type = lexer.typeName();
 		if (type == "float")
 			return "!float";
 		if (type == "double")
@@ -718,10 +1868,10 @@ private:
 		return type;
 	}
 
-public:
-	/* Registers an external function. */
+	/* Parses an external function signature, such as '(vector*3): real'. */
 
-	void add(const string& name, const string& signature, void (*ptr)())
+	void parse_signature(const string& signature, vector<string>& inputtypes,
+			string& returntype)
 	{
 		std::stringstream stream(signature);
 		Lexer lexer(stream);
@@ -731,7 +1881,6 @@ public:
 			malformed_function_signature(lexer, "expected '('");
 		lexer.next();
 
-		vector<string> inputtypes;
 		while (lexer.token() != L::CLOSEPAREN)
 		{
 			inputtypes.push_back(parse_typespec(lexer));
@@ -746,9 +1895,55 @@ public:
 			malformed_function_signature(lexer, "expected ':'");
 		lexer.next();
 
-		string returntype = parse_typespec(lexer);
+		returntype = parse_typespec(lexer);
+	}
+
+public:
+	/* Registers an external function. */
 
-		add(retain(new ExternalFunctionSymbol(name, inputtypes, returntype, ptr)));
+	void add(const string& name, const string& signature, void (*ptr)(),
+			unsigned flags = 0)
+	{
+		vector<string> inputtypes;
+		string returntype;
+		parse_signature(signature, inputtypes, returntype);
+
+		add(retain(new ExternalFunctionSymbol(name, inputtypes, returntype, ptr,
+				flags)));
+	}
+
+	/* Registers an external function along with an array form,
+	 * arrayptr(n, in1[], in2[]..., out[]), which batch calls use to make
+	 * one call for many items. */
+
+	void add(const string& name, const string& signature, void (*ptr)(),
+			void (*arrayptr)(), unsigned flags = 0)
+	{
+		vector<string> inputtypes;
+		string returntype;
+		parse_signature(signature, inputtypes, returntype);
+
+		add(retain(new ExternalFunctionSymbol(name, inputtypes, returntype, ptr,
+				flags, arrayptr)));
+	}
+
+	/* Registers an external function whose body is LLVM bitcode or textual
+	 * IR, such as the output of clang -emit-llvm; `function` is its name in
+	 * the module. */
+
+	void addBitcode(const string& name, const string& signature,
+			const string& module, const string& function, unsigned flags = 0)
+	{
+		vector<string> inputtypes;
+		string returntype;
+		parse_signature(signature, inputtypes, returntype);
+
+		BitcodeModule*& bitcode = _bitcodeModules[module];
+		if (!bitcode)
+			bitcode = retain(new BitcodeModule(module));
+
+		add(retain(new ExternalBitcodeSymbol(name, inputtypes, returntype,
+				bitcode, function, flags)));
 	}
 
 	/* Registers a real global variable. */
@@ -767,9 +1962,17 @@ public:
 
 public:
 	template <typename T>
-	void add(const string& name, const string& signature, T* ptr)
+	void add(const string& name, const string& signature, T* ptr,
+			unsigned flags = 0)
+	{
+		add(name, signature, (void (*)()) ptr, flags);
+	}
+
+	template <typename T, typename A>
+	void add(const string& name, const string& signature, T* ptr,
+			A* arrayptr, unsigned flags = 0)
 	{
-		add(name, signature, (void (*)()) ptr);
+		add(name, signature, (void (*)()) ptr, (void (*)()) arrayptr, flags);
 	}
 
 public:
@@ -781,6 +1984,7 @@ public:
 		#undef REAL1
 		#undef REAL2
 		#undef REAL3
+		_rsqrt("rsqrt", 1),
 		_dummy(0)
 	{
 		add(&_notMethod);
@@ -794,6 +1998,9 @@ public:
 		add(&_subMethod);
 		add(&_mulMethod);
 		add(&_divMethod);
+		add(&_modMethod);
+		add(&_intFunction);
+		add(&_realFunction);
 		add(&_lengthMethod);
 		add(&_sumMethod);
 		add(&_xMethod);
@@ -801,6 +2008,11 @@ public:
 		add(&_zMethod);
 		add(&_wMethod);
 		add(&_vectorSquareBracketMethod);
+		add(&_transposeMethod);
+		add(&_determinantMethod);
+		add(&_inverseMethod);
+		add(&_matrixToVectorMethod);
+		add(&_vectorToMatrixMethod);
 
 		#define REAL1(n) add(&_##n);
 		#define REAL2(n) add(&_##n);
@@ -809,6 +2021,46 @@ public:
 		#undef REAL1
 		#undef REAL2
 		#undef REAL3
+		add(&_rsqrt);
+
+		/* Variants with a fixed accuracy, like sin_fast. */
+
+		static const struct
+		{
+			const char* function;
+			int params;
+		}
+		tiered[] =
+		{
+			{ "atan2", 2 },
+			{ "cos",   1 },
+			{ "exp",   1 },
+			{ "exp2",  1 },
+			{ "log",   1 },
+			{ "log2",  1 },
+			{ "pow",   2 },
+			{ "rsqrt", 1 },
+			{ "sin",   1 },
+			{ "sqrt",  1 },
+		};
+
+		static const struct
+		{
+			MathAccuracy accuracy;
+			const char* suffix;
+		}
+		tiers[] =
+		{
+			{ LIBM, "libm" },
+			{ ULP1, "ulp1" },
+			{ ULP4, "ulp4" },
+			{ FAST, "fast" },
+		};
+
+		for (const auto& f : tiered)
+			for (const auto& t : tiers)
+				add(retain(new SimpleRealExternal(f.function, f.params,
+						t.accuracy, t.suffix)));
 	}
 };
 
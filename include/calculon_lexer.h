@@ -131,6 +131,71 @@ public:
 		throw LexerException(s, *this);
 	}
 
+	/* Reads a type name, such as 'vector*3', 'matrix*3x4' or 'vector*4 of
+	 * uint8 normalized', for script and external function signatures
+	 * alike. Whether the type exists is up to the caller. */
+
+	string typeName()
+	{
+		if (_token != IDENTIFIER)
+			error("expected a type name");
+
+		std::stringstream typenm;
+		typenm << _idValue;
+		next();
+
+		if ((_token == OPERATOR) && (_idValue == "*"))
+		{
+			typenm << "*";
+			next();
+
+			if (_token != NUMBER)
+				error("invalid n-vector type specifier");
+			int size = (int)_realValue;
+			if ((Real)size != _realValue)
+				error("n-vector size must be an integer");
+			if (size <= 0)
+				error("n-vector size must be greater than 0");
+
+			typenm << size;
+			next();
+
+			/* The 'x4' part of matrix*3x4 lexes as an identifier. */
+
+			if (typenm.str().substr(0, 7) == "matrix*")
+			{
+				if ((_token != IDENTIFIER) || (_idValue.size() < 2) ||
+						(_idValue[0] != 'x') ||
+						(_idValue.find_first_not_of("0123456789", 1) != string::npos))
+					error("invalid matrix type specifier");
+				if (atoi(_idValue.c_str() + 1) <= 0)
+					error("matrix size must be greater than 0");
+
+				typenm << _idValue;
+				next();
+			}
+		}
+
+		/* Storage types: 'vector*4 of uint8 normalized', 'half'. */
+
+		if ((_token == IDENTIFIER) && (_idValue == "of"))
+		{
+			next();
+			if (_token != IDENTIFIER)
+				error("expected a storage format");
+			typenm << " of " << _idValue;
+			next();
+		}
+
+		if ((_token == IDENTIFIER) && (_idValue == "normalized"))
+		{
+			typenm << " normalized";
+			next();
+		}
+
+		return typenm.str();
+	}
+
 	const char* tokenname(int token)
 	{
 		switch (token)
@@ -0,0 +1,676 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_MATHKERNELS_H
+#define CALCULON_MATHKERNELS_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* Inline implementations of the commonly used maths functions. Unlike
+ * libm calls, the optimisers can see into these, so they vectorise and
+ * schedule along with the rest of the script.
+ *
+ * Every kernel works on reals or vectors of reals. Arguments are reduced
+ * into a small range (Cody-Waite style, with the reduction constant split
+ * into parts whose products with the multiplier are exact), then a
+ * truncated series is evaluated with FMAs. The number of terms is worked
+ * out from the truncation error bound of the series and the tolerance of
+ * the selected accuracy tier.
+ *
+ * Arguments which the kernels don't handle --- infinities, NaNs,
+ * subnormals, huge values --- are detected up front and the whole call is
+ * sent to libm instead.
+ */
+
+class MathKernels
+{
+public:
+	typedef std::function<llvm::Value* ()> Emitter;
+
+private:
+	CompilerState& state;
+	llvm::IRBuilder<>& builder;
+	MathAccuracy accuracy;
+
+public:
+	MathKernels(CompilerState& state, MathAccuracy accuracy):
+		state(state),
+		builder(state.builder),
+		accuracy(accuracy)
+	{
+	}
+
+	static bool supports(const string& function, MathAccuracy accuracy)
+	{
+		/* rsqrt isn't in libm, so it's always done inline. */
+		if (function == "rsqrt")
+			return true;
+		if (accuracy == LIBM)
+			return false;
+
+		/* pow needs an extended-precision log to be accurate; only the
+		 * fast tier does it inline. */
+		if (function == "pow")
+			return accuracy == FAST;
+
+		return (function == "sin") || (function == "cos") ||
+			(function == "exp") || (function == "exp2") ||
+			(function == "log") || (function == "log2") ||
+			(function == "sqrt") || (function == "atan2");
+	}
+
+	/* Emits the kernel for the named function. libm is called to generate
+	 * the fallback call for exceptional arguments. */
+
+	llvm::Value* emit(const string& function,
+			const vector<llvm::Value*>& parameters, const Emitter& libm)
+	{
+		if (function == "sin")
+			return sincos(parameters[0], 0, libm);
+		else if (function == "cos")
+			return sincos(parameters[0], 1, libm);
+		else if (function == "exp")
+			return exp(parameters[0], libm);
+		else if (function == "exp2")
+			return exp2(parameters[0], libm);
+		else if (function == "log")
+			return log(parameters[0], false, libm);
+		else if (function == "log2")
+			return log(parameters[0], true, libm);
+		else if (function == "pow")
+			return pow(parameters[0], parameters[1], libm);
+		else if (function == "sqrt")
+			return sqrt(parameters[0]);
+		else if (function == "rsqrt")
+			return rsqrt(parameters[0]);
+		else if (function == "atan2")
+			return atan2(parameters[0], parameters[1], libm);
+
+		assert(false);
+		throw 0;
+	}
+
+private:
+	/* Relative error budget for the truncated series. Rounding error in
+	 * the evaluation comes on top of this. */
+
+	double tolerance(llvm::Type* type)
+	{
+		int mantissa = type->getScalarType()->getFPMantissaWidth();
+		double epsilon = ldexp(1.0, 1-mantissa);
+
+		switch (accuracy)
+		{
+			case ULP1: return epsilon / 16;
+			case ULP4: return epsilon * 2;
+			case FAST: return std::max(epsilon, ldexp(1.0, -17));
+			default:
+				assert(false);
+				throw 0;
+		}
+	}
+
+	/* Returns the smallest number of terms for which error(terms) is
+	 * within tolerance. */
+
+	template <class F>
+	unsigned terms(llvm::Type* type, F error)
+	{
+		double tol = tolerance(type);
+		unsigned n = 1;
+		while ((error(n) > tol) && (n < 30))
+			n++;
+		return n;
+	}
+
+	llvm::Constant* constant(llvm::Type* type, double value)
+	{
+		return llvm::ConstantFP::get(type, value);
+	}
+
+	llvm::Constant* constant(llvm::Type* type, double d, double f)
+	{
+		return constant(type, type->getScalarType()->isDoubleTy() ? d : f);
+	}
+
+	llvm::Type* intTypeFor(llvm::Type* type)
+	{
+		if (llvm::VectorType* vt = llvm::dyn_cast<llvm::VectorType>(type))
+			return llvm::VectorType::getInteger(vt);
+		return llvm::IntegerType::get(state.context,
+				type->getPrimitiveSizeInBits());
+	}
+
+	unsigned mantissaBits(llvm::Type* type)
+	{
+		return type->getScalarType()->getFPMantissaWidth() - 1;
+	}
+
+	llvm::Value* intConstant(llvm::Type* type, int64_t value)
+	{
+		return llvm::ConstantInt::get(intTypeFor(type), value, true);
+	}
+
+	/* c[0] + x*c[1] + x^2*c[2]..., by Horner's rule. */
+
+	llvm::Value* polynomial(llvm::Value* x, const vector<double>& c)
+	{
+		llvm::Type* type = x->getType();
+		llvm::Value* v = constant(type, c.back());
+		for (int i = c.size()-2; i >= 0; i--)
+			v = state.createFMulAdd(v, x, constant(type, c[i]));
+		return v;
+	}
+
+	llvm::Value* fabs(llvm::Value* x)
+	{
+		return builder.CreateUnaryIntrinsic(llvm::Intrinsic::fabs, x);
+	}
+
+	llvm::Value* rint(llvm::Value* x)
+	{
+		return builder.CreateUnaryIntrinsic(llvm::Intrinsic::rint, x);
+	}
+
+	llvm::Value* select(llvm::Value* c, llvm::Value* t, llvm::Value* f)
+	{
+		return builder.CreateSelect(c, t, f);
+	}
+
+	/* Given hi = a + b rounded, returns the rounding error (Knuth's
+	 * TwoSum). */
+
+	llvm::Value* twoSumError(llvm::Value* a, llvm::Value* b, llvm::Value* hi)
+	{
+		llvm::Value* bb = builder.CreateFSub(hi, a);
+		llvm::Value* ab = builder.CreateFSub(hi, bb);
+		return builder.CreateFAdd(
+				builder.CreateFSub(a, ab), builder.CreateFSub(b, bb));
+	}
+
+	/* Multiplies p by 2^n by adding n directly into p's exponent. Only
+	 * valid if the result is a normal number. */
+
+	llvm::Value* scale(llvm::Value* p, llvm::Value* n)
+	{
+		llvm::Type* type = p->getType();
+		llvm::Type* itype = intTypeFor(type);
+
+		llvm::Value* e = builder.CreateFPToSI(n, itype);
+		e = builder.CreateShl(e, mantissaBits(type));
+		llvm::Value* bits = builder.CreateBitCast(p, itype);
+		return builder.CreateBitCast(builder.CreateAdd(bits, e), type);
+	}
+
+	/* Runs fast if none of the elements are exceptional, or libm if any
+	 * of them are. */
+
+	llvm::Value* guard(llvm::Value* exceptional, const Emitter& fast,
+			const Emitter& libm)
+	{
+		if (exceptional->getType()->isVectorTy())
+			exceptional = builder.CreateOrReduce(exceptional);
+
+		llvm::BasicBlock* bb = builder.GetInsertBlock();
+		llvm::BasicBlock* fastblock = llvm::BasicBlock::Create(
+				state.context, "", bb->getParent());
+		llvm::BasicBlock* libmblock = llvm::BasicBlock::Create(
+				state.context, "", bb->getParent());
+		llvm::BasicBlock* mergeblock = llvm::BasicBlock::Create(
+				state.context, "", bb->getParent());
+
+		llvm::MDBuilder md(state.context);
+		builder.CreateCondBr(exceptional, libmblock, fastblock,
+				md.createBranchWeights(1, 1000));
+
+		builder.SetInsertPoint(fastblock);
+		llvm::Value* fastresult = fast();
+		fastblock = builder.GetInsertBlock();
+		builder.CreateBr(mergeblock);
+
+		builder.SetInsertPoint(libmblock);
+		llvm::Value* libmresult = libm();
+		libmblock = builder.GetInsertBlock();
+		builder.CreateBr(mergeblock);
+
+		builder.SetInsertPoint(mergeblock);
+		llvm::PHINode* phi = builder.CreatePHI(fastresult->getType(), 2);
+		phi->addIncoming(fastresult, fastblock);
+		phi->addIncoming(libmresult, libmblock);
+		return phi;
+	}
+
+	/* exp(x) = 2^n * exp(r), where r = x - n*ln2 and |r| <= ln2/2. */
+
+	llvm::Value* exp(llvm::Value* x, const Emitter& libm)
+	{
+		llvm::Type* type = x->getType();
+
+		/* Only results in the normal range take the fast path. */
+		llvm::Value* ok = builder.CreateAnd(
+			builder.CreateFCmpOLT(x, constant(type, 709.7, 88.7)),
+			builder.CreateFCmpOGT(x, constant(type, -708.3, -87.3)));
+
+		return guard(builder.CreateNot(ok),
+			[&]()
+			{
+				llvm::Value* n = rint(builder.CreateFMul(x,
+						constant(type, M_LOG2E)));
+				llvm::Value* r = builder.CreateFSub(x, builder.CreateFMul(n,
+						constant(type, 6.93147180369123816490e-01, 0.693359375)));
+				r = builder.CreateFSub(r, builder.CreateFMul(n,
+						constant(type, 1.90821492927058770002e-10, -2.12194440e-4)));
+
+				return scale(expSeries(r, M_LN2/2, 1.0), n);
+			},
+			libm);
+	}
+
+	/* exp2(x) = 2^n * exp2(r), where n = rint(x); the reduction is exact. */
+
+	llvm::Value* exp2(llvm::Value* x, const Emitter& libm)
+	{
+		llvm::Type* type = x->getType();
+
+		llvm::Value* ok = builder.CreateAnd(
+			builder.CreateFCmpOLT(x, constant(type, 1023.0, 127.0)),
+			builder.CreateFCmpOGT(x, constant(type, -1022.0, -126.0)));
+
+		return guard(builder.CreateNot(ok),
+			[&]()
+			{
+				llvm::Value* n = rint(x);
+				llvm::Value* r = builder.CreateFSub(x, n);
+				return scale(expSeries(r, 0.5, M_LN2), n);
+			},
+			libm);
+	}
+
+	/* exp(k*r) for |r| <= bound, as the Taylor series. */
+
+	llvm::Value* expSeries(llvm::Value* r, double bound, double k)
+	{
+		double kr = k * bound;
+		unsigned n = terms(r->getType(),
+			[=](unsigned n)
+			{
+				/* First omitted term, relative to a result of at least
+				 * exp(-kr). */
+				return ::pow(kr, n) / tgamma(n+1) * ::exp(kr);
+			});
+
+		vector<double> c;
+		double t = 1.0;
+		for (unsigned i = 0; i < n; i++)
+		{
+			c.push_back(t);
+			t = t * k / (i+1);
+		}
+		return polynomial(r, c);
+	}
+
+	/* x = m * 2^e, with sqrt(0.5) <= m < sqrt(2). Then, with f = m-1,
+	 * log(m) = 2*atanh(s) where s = f/(2+f), and |s| <= 0.1716. */
+
+	llvm::Value* log(llvm::Value* x, bool base2, const Emitter& libm)
+	{
+		llvm::Type* type = x->getType();
+
+		/* Only positive normal numbers take the fast path. */
+		llvm::Value* ok = builder.CreateAnd(
+			builder.CreateFCmpOGE(x, constant(type, DBL_MIN, FLT_MIN)),
+			builder.CreateFCmpOLT(x, constant(type, INFINITY)));
+
+		return guard(builder.CreateNot(ok),
+			[&]()
+			{
+				llvm::Value* e;
+				llvm::Value* lnm = logSeries(x, e);
+
+				if (base2)
+				{
+					lnm = builder.CreateFMul(lnm, constant(type, M_LOG2E));
+					return builder.CreateFAdd(e, lnm);
+				}
+
+				llvm::Value* v = state.createFMulAdd(e,
+						constant(type, 1.90821492927058770002e-10, -2.12194440e-4),
+						lnm);
+				return state.createFMulAdd(e,
+						constant(type, 6.93147180369123816490e-01, 0.693359375),
+						v);
+			},
+			libm);
+	}
+
+	/* Returns log(m), and the exponent e as a real, for positive normal x. */
+
+	llvm::Value* logSeries(llvm::Value* x, llvm::Value*& e)
+	{
+		llvm::Type* type = x->getType();
+		llvm::Type* itype = intTypeFor(type);
+		unsigned mbits = mantissaBits(type);
+		int64_t bias = type->getScalarType()->isDoubleTy() ? 1023 : 127;
+
+		llvm::Value* bits = builder.CreateBitCast(x, itype);
+		llvm::Value* ei = builder.CreateSub(
+				builder.CreateLShr(bits, mbits), intConstant(type, bias));
+		bits = builder.CreateAnd(bits,
+				intConstant(type, (int64_t(1) << mbits) - 1));
+		bits = builder.CreateOr(bits, intConstant(type, bias << mbits));
+		llvm::Value* m = builder.CreateBitCast(bits, type);
+
+		llvm::Value* big = builder.CreateFCmpOGT(m, constant(type, M_SQRT2));
+		m = select(big, builder.CreateFMul(m, constant(type, 0.5)), m);
+		ei = builder.CreateAdd(ei, builder.CreateZExt(big, itype));
+		e = builder.CreateSIToFP(ei, type);
+
+		llvm::Value* f = builder.CreateFSub(m, constant(type, 1.0));
+		llvm::Value* s = builder.CreateFDiv(f,
+				builder.CreateFAdd(f, constant(type, 2.0)));
+		llvm::Value* z = builder.CreateFMul(s, s);
+
+		double zmax = ::pow((M_SQRT2-1) / (M_SQRT2+1), 2);
+		unsigned n = terms(type,
+			[=](unsigned n)
+			{
+				return ::pow(zmax, n) / (2*n + 1) / (1 - zmax);
+			});
+
+		/* 2*atanh(s) = 2s + s*R, where R = 2z/3 + 2z^2/5 + ...; and
+		 * 2s = f - s*f. This is evaluated as f - (f*f/2 - s*(f*f/2 + R)),
+		 * as fdlibm does, so that the rounding error falls on the small
+		 * terms. */
+
+		llvm::Value* hfsq = builder.CreateFMul(constant(type, 0.5),
+				builder.CreateFMul(f, f));
+		llvm::Value* v = hfsq;
+		if (n > 1)
+		{
+			vector<double> c;
+			for (unsigned i = 1; i < n; i++)
+				c.push_back(2.0 / (2*i + 1));
+			v = state.createFMulAdd(z, polynomial(z, c), hfsq);
+		}
+
+		return builder.CreateFSub(f,
+				builder.CreateFSub(hfsq, builder.CreateFMul(s, v)));
+	}
+
+	/* pow(x, y) = exp2(y * log2(x)), for positive x only. */
+
+	llvm::Value* pow(llvm::Value* x, llvm::Value* y, const Emitter& libm)
+	{
+		llvm::Type* type = x->getType();
+
+		llvm::Value* e;
+		llvm::Value* lnm = logSeries(x, e);
+		llvm::Value* l = state.createFMulAdd(lnm, constant(type, M_LOG2E), e);
+		llvm::Value* t = builder.CreateFMul(y, l);
+
+		llvm::Value* ok = builder.CreateAnd(
+			builder.CreateFCmpOGE(x, constant(type, DBL_MIN, FLT_MIN)),
+			builder.CreateFCmpOLT(x, constant(type, INFINITY)));
+		ok = builder.CreateAnd(ok,
+			builder.CreateFCmpOLT(t, constant(type, 1023.0, 127.0)));
+		ok = builder.CreateAnd(ok,
+			builder.CreateFCmpOGT(t, constant(type, -1022.0, -126.0)));
+
+		return guard(builder.CreateNot(ok),
+			[&]()
+			{
+				llvm::Value* n = rint(t);
+				llvm::Value* r = builder.CreateFSub(t, n);
+				return scale(expSeries(r, 0.5, M_LN2), n);
+			},
+			libm);
+	}
+
+	/* sin and cos share a reduction: n = rint(x * 2/pi), r = x - n*pi/2,
+	 * and |r| <= pi/4. The quadrant (n + offset) & 3 then picks between
+	 * sin(r) and cos(r) and their negations. */
+
+	llvm::Value* sincos(llvm::Value* x, int offset, const Emitter& libm)
+	{
+		llvm::Type* type = x->getType();
+		bool isdouble = type->getScalarType()->isDoubleTy();
+
+		/* The reduction constants are exact to this many multiples of
+		 * pi/2. */
+		llvm::Value* ok = builder.CreateFCmpOLE(fabs(x),
+				constant(type, 524288.0, 4096.0));
+
+		return guard(builder.CreateNot(ok),
+			[&]()
+			{
+				llvm::Value* n = rint(builder.CreateFMul(x,
+						constant(type, M_2_PI)));
+
+				static const double doubleparts[] =
+				{
+					1.57079632673412561417e+00,
+					6.07710050630396597660e-11,
+					2.02226624871116645580e-21,
+					8.47842766036889956997e-32
+				};
+				static const double floatparts[] =
+				{
+					1.57080078125,
+					-4.453584551811218e-06,
+					-8.705515752716053e-10,
+					5.721188726109832e-18
+				};
+				const double* parts = isdouble ? doubleparts : floatparts;
+
+				/* x - n*parts[0] is exact. For ULP1, the rounding error of
+				 * the rest of the reduction is carried along in rlo. */
+				llvm::Value* r = builder.CreateFSub(x,
+						builder.CreateFMul(n, constant(type, parts[0])));
+				llvm::Value* rlo = NULL;
+				if (accuracy == ULP1)
+				{
+					llvm::Value* t = builder.CreateFMul(n, constant(type, parts[1]));
+					llvm::Value* hi = builder.CreateFSub(r, t);
+					llvm::Value* lo = twoSumError(r, builder.CreateFNeg(t), hi);
+					for (int i = 2; i < 4; i++)
+						lo = builder.CreateFSub(lo, builder.CreateFMul(n,
+								constant(type, parts[i])));
+
+					r = builder.CreateFAdd(hi, lo);
+					rlo = builder.CreateFAdd(builder.CreateFSub(hi, r), lo);
+				}
+				else
+				{
+					for (int i = 1; i < 4; i++)
+						r = builder.CreateFSub(r, builder.CreateFMul(n,
+								constant(type, parts[i])));
+				}
+				llvm::Value* z = builder.CreateFMul(r, r);
+
+				double rmax = M_PI_4 * 1.0001;
+				double rmax2 = rmax * rmax;
+
+				/* sin(r) = r + r*z*(-1/3! + z/5! - ...) */
+				unsigned sn = terms(type,
+					[=](unsigned n)
+					{
+						return ::pow(rmax, 2*n) / tgamma(2*n + 2);
+					});
+				vector<double> sc;
+				for (unsigned i = 1; i < sn; i++)
+					sc.push_back(((i & 1) ? -1.0 : 1.0) / tgamma(2*i + 2));
+				llvm::Value* s = rlo ? rlo : constant(type, 0.0);
+				if (!sc.empty())
+					s = state.createFMulAdd(builder.CreateFMul(r, z),
+							polynomial(z, sc), s);
+				s = builder.CreateFAdd(r, s);
+
+				/* cos(r) = 1 - z/2 + z*z*(1/4! - z/6! + ...) */
+				unsigned cn = terms(type,
+					[=](unsigned n)
+					{
+						return ::pow(rmax2, n) / tgamma(2*n + 1) / M_SQRT1_2;
+					});
+				vector<double> cc;
+				for (unsigned i = 2; i < cn; i++)
+					cc.push_back(((i & 1) ? -1.0 : 1.0) / tgamma(2*i + 1));
+
+				/* As fdlibm, w = 1 - z/2 is rounded; its rounding error is
+				 * added back in with the small terms. */
+				llvm::Value* hz = builder.CreateFMul(z, constant(type, 0.5));
+				llvm::Value* one = constant(type, 1.0);
+				llvm::Value* w = builder.CreateFSub(one, hz);
+				llvm::Value* c = builder.CreateFSub(
+						builder.CreateFSub(one, w), hz);
+				if (rlo)
+					c = builder.CreateFSub(c, builder.CreateFMul(r, rlo));
+				if (!cc.empty())
+					c = state.createFMulAdd(builder.CreateFMul(z, z),
+							polynomial(z, cc), c);
+				c = builder.CreateFAdd(w, c);
+
+				llvm::Type* itype = intTypeFor(type);
+				llvm::Value* q = builder.CreateAdd(builder.CreateFPToSI(n, itype),
+						intConstant(type, offset));
+				llvm::Value* zero = intConstant(type, 0);
+
+				llvm::Value* v = select(
+						builder.CreateICmpNE(builder.CreateAnd(q, intConstant(type, 1)), zero),
+						c, s);
+				v = select(
+						builder.CreateICmpNE(builder.CreateAnd(q, intConstant(type, 2)), zero),
+						builder.CreateFNeg(v), v);
+
+				/* Preserve the sign of zero. */
+				if (offset == 0)
+					v = select(builder.CreateFCmpOEQ(x, constant(type, 0.0)), x, v);
+				return v;
+			},
+			libm);
+	}
+
+	/* atan2(y, x) reduces to atan(t) with 0 <= t = min/max <= 1, then
+	 * to atan(t) = atan(c) + atan((t-c)/(1+t*c)) using the nearest of
+	 * c = tan(0), tan(pi/8), tan(pi/4), which leaves |t| <= tan(pi/16). */
+
+	llvm::Value* atan2(llvm::Value* y, llvm::Value* x, const Emitter& libm)
+	{
+		llvm::Type* type = x->getType();
+		llvm::Value* ax = fabs(x);
+		llvm::Value* ay = fabs(y);
+		llvm::Value* inf = constant(type, INFINITY);
+		llvm::Value* zero = constant(type, 0.0);
+
+		/* Both must be finite and not both zero. */
+		llvm::Value* ok = builder.CreateAnd(
+				builder.CreateFCmpOLT(ax, inf), builder.CreateFCmpOLT(ay, inf));
+		ok = builder.CreateAnd(ok, builder.CreateOr(
+				builder.CreateFCmpOGT(ax, zero), builder.CreateFCmpOGT(ay, zero)));
+
+		return guard(builder.CreateNot(ok),
+			[&]()
+			{
+				llvm::Value* swap = builder.CreateFCmpOGT(ay, ax);
+				llvm::Value* mn = select(swap, ax, ay);
+				llvm::Value* mx = select(swap, ay, ax);
+				llvm::Value* t = builder.CreateFDiv(mn, mx);
+
+				/* For ULP1, recover the rounding error of the division
+				 * with an exact FMA. */
+				llvm::Value* tlo = zero;
+				if (accuracy == ULP1)
+					tlo = builder.CreateFDiv(
+						builder.CreateIntrinsic(llvm::Intrinsic::fma, type,
+							{ builder.CreateFNeg(t), mx, mn }),
+						mx);
+
+				llvm::Value* upper = builder.CreateFCmpOGT(t,
+						constant(type, 0.6681786379192989));
+				llvm::Value* middle = builder.CreateFCmpOGT(t,
+						constant(type, 0.198912367379658));
+				/* c and base are stored as a rounded value plus the
+				 * rounding error, which matters when the result is much
+				 * smaller than base. */
+				llvm::Value* c = select(upper, constant(type, 1.0),
+						select(middle, constant(type, 0.41421356237309503), zero));
+				llvm::Value* clo = select(middle,
+						select(upper, zero,
+							constant(type, 1.4349369327986523e-17, -5.599088178737374e-09)),
+						zero);
+				llvm::Value* base = select(upper, constant(type, M_PI_4),
+						select(middle, constant(type, M_PI/8), zero));
+				llvm::Value* baselo = select(upper,
+						constant(type, 3.061616997868383e-17, -2.1855695000931213e-08),
+						select(middle,
+							constant(type, 1.5308084989341915e-17, -1.0927847500465606e-08),
+							zero));
+
+				t = builder.CreateFDiv(
+						builder.CreateFAdd(builder.CreateFSub(t, c),
+							builder.CreateFSub(tlo, clo)),
+						state.createFMulAdd(t, c, constant(type, 1.0)));
+				llvm::Value* z = builder.CreateFMul(t, t);
+
+				double tmax2 = ::pow(0.198912367379658, 2);
+				unsigned n = terms(type,
+					[=](unsigned n)
+					{
+						return ::pow(tmax2, n) / (2*n + 1);
+					});
+				vector<double> cs;
+				for (unsigned i = 1; i < n; i++)
+					cs.push_back(((i & 1) ? -1.0 : 1.0) / (2*i + 1));
+
+				llvm::Value* a = baselo;
+				if (!cs.empty())
+					a = state.createFMulAdd(builder.CreateFMul(t, z),
+							polynomial(z, cs), a);
+				a = builder.CreateFAdd(base, builder.CreateFAdd(t, a));
+
+				/* pi/2 - a and pi - a, with the rounding error of the constant
+				 * added back in. */
+				a = select(swap,
+					builder.CreateFAdd(
+						builder.CreateFSub(constant(type, M_PI_2), a),
+						constant(type, 6.123233995736766e-17, -4.371139000186241e-08)),
+					a);
+				a = select(builder.CreateFCmpOLT(x, zero),
+					builder.CreateFAdd(
+						builder.CreateFSub(constant(type, M_PI), a),
+						constant(type, 1.2246467991473532e-16, -8.742278000372482e-08)),
+					a);
+
+				return builder.CreateBinaryIntrinsic(llvm::Intrinsic::copysign,
+						a, y);
+			},
+			libm);
+	}
+
+	llvm::Value* sqrt(llvm::Value* x)
+	{
+		return builder.CreateUnaryIntrinsic(llvm::Intrinsic::sqrt, x);
+	}
+
+	/* In the fast tier, the backend is allowed to use a hardware
+	 * reciprocal square root estimate. */
+
+	llvm::Value* rsqrt(llvm::Value* x)
+	{
+		llvm::IRBuilder<>::FastMathFlagGuard fmfguard(builder);
+		if (accuracy == FAST)
+		{
+			llvm::FastMathFlags fmf;
+			fmf.setApproxFunc();
+			fmf.setAllowReciprocal();
+			builder.setFastMathFlags(fmf);
+		}
+
+		return builder.CreateFDiv(constant(x->getType(), 1.0), sqrt(x));
+	}
+};
+
+#endif
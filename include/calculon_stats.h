@@ -0,0 +1,563 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_STATS_H
+#define CALCULON_STATS_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* Call statistics for Programs in production.
+ *
+ * Wrap a Program in a Timed and call that instead (it can also be handed to
+ * a Dispatch in place of the Program). Every call, batch and grid run is
+ * counted, and one in every interval of each is timed with steady_clock
+ * into a histogram. Each thread records into its own counters and
+ * histograms, so threads never contend; snapshot() merges them. Snapshots
+ * can be merged with each other (e.g. across Programs or processes) and
+ * written out as JSON or in the Prometheus text format.
+ */
+
+/* A histogram of nanosecond values with four significant bits: values below
+ * 16 are exact, and bigger ones are within 1/16 (6%). */
+
+class Histogram
+{
+public:
+	enum
+	{
+		SUB_BITS = 4,
+		SUB_BUCKETS = 1<<SUB_BITS,
+		BUCKETS = SUB_BUCKETS + (64-SUB_BITS)*SUB_BUCKETS
+	};
+
+	Histogram():
+		_count(0),
+		_sum(0),
+		_min(UINT64_MAX),
+		_max(0),
+		_buckets(BUCKETS, 0)
+	{
+	}
+
+	void record(uint64_t value)
+	{
+		_count++;
+		_sum += value;
+		_min = std::min(_min, value);
+		_max = std::max(_max, value);
+		_buckets[bucket(value)]++;
+	}
+
+	void merge(const Histogram& other)
+	{
+		_count += other._count;
+		_sum += other._sum;
+		_min = std::min(_min, other._min);
+		_max = std::max(_max, other._max);
+		for (unsigned b=0; b<BUCKETS; b++)
+			_buckets[b] += other._buckets[b];
+	}
+
+	uint64_t count() const { return _count; }
+	uint64_t sum() const { return _sum; }
+	uint64_t min() const { return _count ? _min : 0; }
+	uint64_t max() const { return _max; }
+
+	double mean() const
+	{
+		return _count ? ((double)_sum / _count) : 0;
+	}
+
+	/* The smallest value which at least fraction q of the values are no
+	 * bigger than, to within the bucket precision. */
+
+	uint64_t percentile(double q) const
+	{
+		if (!_count)
+			return 0;
+
+		uint64_t wanted = std::max((uint64_t)1, (uint64_t)ceil(q * _count));
+		uint64_t seen = 0;
+		for (unsigned b=0; b<BUCKETS; b++)
+		{
+			seen += _buckets[b];
+			if (seen >= wanted)
+				return std::max(_min, std::min(_max, highest(b)));
+		}
+		return _max;
+	}
+
+	static unsigned bucket(uint64_t value)
+	{
+		if (value < SUB_BUCKETS)
+			return value;
+
+		unsigned msb = llvm::Log2_64(value);
+		return SUB_BUCKETS + (msb - SUB_BITS)*SUB_BUCKETS +
+			((value >> (msb - SUB_BITS)) - SUB_BUCKETS);
+	}
+
+	/* The biggest value which lands in bucket b. */
+
+	static uint64_t highest(unsigned b)
+	{
+		if (b < SUB_BUCKETS)
+			return b;
+
+		unsigned shift = (b - SUB_BUCKETS) / SUB_BUCKETS;
+		uint64_t sub = (b - SUB_BUCKETS) % SUB_BUCKETS;
+		return ((SUB_BUCKETS + sub) << shift) + ((1ULL << shift) - 1);
+	}
+
+private:
+	uint64_t _count;
+	uint64_t _sum;
+	uint64_t _min;
+	uint64_t _max;
+	vector<uint64_t> _buckets;
+};
+
+class Stats
+{
+public:
+	enum Entrypoint
+	{
+		CALL,
+		BATCH,
+		GRID,
+		ENTRYPOINTS
+	};
+
+	enum Format
+	{
+		JSON,
+		PROMETHEUS
+	};
+
+private:
+	struct Shard;
+
+public:
+	/* Everything known about one entrypoint. Latencies are per call, or
+	 * per batch or grid run. */
+
+	struct Counters
+	{
+		uint64_t calls;
+		uint64_t items;
+		uint64_t sampleditems;
+		Histogram latency;
+
+		Counters():
+			calls(0),
+			items(0),
+			sampleditems(0)
+		{
+		}
+
+		void merge(const Counters& other)
+		{
+			calls += other.calls;
+			items += other.items;
+			sampleditems += other.sampleditems;
+			latency.merge(other.latency);
+		}
+	};
+
+	struct Snapshot
+	{
+		string name;
+		unsigned interval;
+		Counters entrypoints[ENTRYPOINTS];
+
+		Snapshot(const string& name = "", unsigned interval = 1):
+			name(name),
+			interval(interval)
+		{
+		}
+
+		void merge(const Snapshot& other)
+		{
+			for (unsigned e=0; e<ENTRYPOINTS; e++)
+				entrypoints[e].merge(other.entrypoints[e]);
+		}
+	};
+
+	/* Times one call in every interval on each thread (and always the
+	 * first). name identifies the Program in the output. */
+
+	Stats(const string& name, unsigned interval = 64):
+		_name(name),
+		_interval(std::max(interval, 1U)),
+		_id(nextId()++)
+	{
+	}
+
+	const string& name() const
+	{
+		return _name;
+	}
+
+	unsigned interval() const
+	{
+		return _interval;
+	}
+
+	/* Counts an entrypoint call of `items` items for as long as it's in
+	 * scope, timing it if it's one of the sampled ones. stats may be
+	 * NULL, which does nothing. */
+
+	class Timer
+	{
+	public:
+		Timer(Stats* stats, Entrypoint entrypoint, uint64_t items):
+			_shard(stats ? stats->begin(entrypoint, items) : NULL),
+			_entrypoint(entrypoint),
+			_items(items)
+		{
+			if (_shard)
+				_start = std::chrono::steady_clock::now();
+		}
+
+		~Timer()
+		{
+			if (_shard)
+			{
+				std::chrono::steady_clock::duration d =
+					std::chrono::steady_clock::now() - _start;
+				_shard->record(_entrypoint, _items,
+					std::chrono::duration_cast<std::chrono::nanoseconds>(d)
+						.count());
+			}
+		}
+
+	private:
+		Shard* _shard;
+		Entrypoint _entrypoint;
+		uint64_t _items;
+		std::chrono::steady_clock::time_point _start;
+	};
+
+	/* Merges every thread's figures so far. Calls in progress on other
+	 * threads may or may not be included. */
+
+	Snapshot snapshot() const
+	{
+		Snapshot s(_name, _interval);
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (const unique_ptr<Shard>& shard : _shards)
+		{
+			std::lock_guard<std::mutex> shardlock(shard->mutex);
+			for (unsigned e=0; e<ENTRYPOINTS; e++)
+			{
+				Counters c;
+				c.calls = shard->calls[e].load(std::memory_order_relaxed);
+				c.items = shard->items[e].load(std::memory_order_relaxed);
+				c.sampleditems = shard->sampleditems[e];
+				c.latency = shard->latency[e];
+				s.entrypoints[e].merge(c);
+			}
+		}
+		return s;
+	}
+
+	static void write(std::ostream& stream, Format format,
+			const vector<Snapshot>& snapshots)
+	{
+		if (format == JSON)
+			writeJSON(stream, snapshots);
+		else
+			writePrometheus(stream, snapshots);
+	}
+
+	/* Replaces filename with the snapshots. The file is written under
+	 * another name and renamed into place, so that anything polling it
+	 * (like Prometheus' textfile collector) never sees half of it. */
+
+	static void write(const string& filename, Format format,
+			const vector<Snapshot>& snapshots)
+	{
+		string temporary = filename + ".tmp";
+		{
+			std::ofstream stream(temporary.c_str());
+			write(stream, format, snapshots);
+			stream.flush();
+			if (!stream)
+				throw std::runtime_error("can't write '" + temporary + "'");
+		}
+		if (rename(temporary.c_str(), filename.c_str()) != 0)
+			throw std::runtime_error("can't rename '" + temporary + "' to '" +
+				filename + "'");
+	}
+
+	void write(const string& filename, Format format) const
+	{
+		write(filename, format, vector<Snapshot>(1, snapshot()));
+	}
+
+private:
+	/* One thread's figures. Only the owning thread writes them; the counts
+	 * are atomic, and the rest guarded by the mutex, so that snapshot()
+	 * can read them at any time. */
+
+	struct Shard
+	{
+		std::thread::id thread;
+		std::mutex mutex;
+		std::atomic<uint64_t> calls[ENTRYPOINTS];
+		std::atomic<uint64_t> items[ENTRYPOINTS];
+		unsigned countdown[ENTRYPOINTS];
+		uint64_t sampleditems[ENTRYPOINTS];
+		Histogram latency[ENTRYPOINTS];
+
+		Shard(std::thread::id thread):
+			thread(thread)
+		{
+			for (unsigned e=0; e<ENTRYPOINTS; e++)
+			{
+				calls[e] = 0;
+				items[e] = 0;
+				countdown[e] = 1;
+				sampleditems[e] = 0;
+			}
+		}
+
+		void record(Entrypoint e, uint64_t n, uint64_t ns)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			sampleditems[e] += n;
+			latency[e].record(ns);
+		}
+	};
+
+	/* Counts a call, and returns the shard to record its time in if it's
+	 * to be timed. */
+
+	Shard* begin(Entrypoint e, uint64_t n)
+	{
+		Shard& s = shard();
+		s.calls[e].store(s.calls[e].load(std::memory_order_relaxed) + 1,
+			std::memory_order_relaxed);
+		s.items[e].store(s.items[e].load(std::memory_order_relaxed) + n,
+			std::memory_order_relaxed);
+		if (--s.countdown[e])
+			return NULL;
+		s.countdown[e] = _interval;
+		return &s;
+	}
+
+	/* Finds the calling thread's shard. Each thread remembers the shards of
+	 * the last few Stats it used; Stats are told apart by a serial number,
+	 * as the same address may be reused by a later one. */
+
+	Shard& shard()
+	{
+		enum
+		{
+			CACHE_SIZE = 8
+		};
+
+		struct CacheEntry
+		{
+			uint64_t id;
+			Shard* shard;
+		};
+		static thread_local CacheEntry cache[CACHE_SIZE];
+
+		CacheEntry& entry = cache[_id % CACHE_SIZE];
+		if (entry.id == _id)
+			return *entry.shard;
+
+		std::thread::id me = std::this_thread::get_id();
+		std::lock_guard<std::mutex> lock(_mutex);
+		Shard* found = NULL;
+		for (const unique_ptr<Shard>& s : _shards)
+			if (s->thread == me)
+				found = s.get();
+		if (!found)
+		{
+			found = new Shard(me);
+			_shards.push_back(unique_ptr<Shard>(found));
+		}
+
+		entry.id = _id;
+		entry.shard = found;
+		return *found;
+	}
+
+	static std::atomic<uint64_t>& nextId()
+	{
+		static std::atomic<uint64_t> id(1);
+		return id;
+	}
+
+	static const char* entrypointName(unsigned e)
+	{
+		static const char* names[] = { "call", "batch", "grid" };
+		return names[e];
+	}
+
+	static void writeJSON(std::ostream& stream,
+			const vector<Snapshot>& snapshots)
+	{
+		stream << "{\n"
+			   << "  \"format\": 1,\n"
+			   << "  \"programs\": [\n";
+		for (size_t i=0; i<snapshots.size(); i++)
+		{
+			const Snapshot& s = snapshots[i];
+			stream << "    {\n"
+				   << "      \"program\": " << Trace::quote(s.name) << ",\n"
+				   << "      \"sample_interval\": " << s.interval;
+			for (unsigned e=0; e<ENTRYPOINTS; e++)
+			{
+				const Counters& c = s.entrypoints[e];
+				const Histogram& h = c.latency;
+				double perItem = c.sampleditems ?
+					((double)h.sum() / c.sampleditems) : 0;
+				stream << ",\n"
+					   << "      \"" << entrypointName(e) << "\": {\n"
+					   << "        \"calls\": " << c.calls << ",\n"
+					   << "        \"items\": " << c.items << ",\n"
+					   << "        \"samples\": " << h.count() << ",\n"
+					   << "        \"min_ns\": " << h.min() << ",\n"
+					   << "        \"mean_ns\": " << h.mean() << ",\n"
+					   << "        \"p50_ns\": " << h.percentile(0.5) << ",\n"
+					   << "        \"p90_ns\": " << h.percentile(0.9) << ",\n"
+					   << "        \"p99_ns\": " << h.percentile(0.99) << ",\n"
+					   << "        \"p999_ns\": " << h.percentile(0.999) << ",\n"
+					   << "        \"max_ns\": " << h.max() << ",\n"
+					   << "        \"mean_ns_per_item\": " << perItem << "\n"
+					   << "      }";
+			}
+			stream << "\n    }" << ((i+1 < snapshots.size()) ? "," : "") << "\n";
+		}
+		stream << "  ]\n"
+			   << "}\n";
+	}
+
+	static void writePrometheus(std::ostream& stream,
+			const vector<Snapshot>& snapshots)
+	{
+		static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+		stream << "# HELP calculon_calls_total Calls made to each entrypoint.\n"
+			   << "# TYPE calculon_calls_total counter\n";
+		for (const Snapshot& s : snapshots)
+			for (unsigned e=0; e<ENTRYPOINTS; e++)
+				stream << "calculon_calls_total" << labels(s, e) << " "
+					   << s.entrypoints[e].calls << "\n";
+
+		stream << "# HELP calculon_items_total Items processed by each entrypoint.\n"
+			   << "# TYPE calculon_items_total counter\n";
+		for (const Snapshot& s : snapshots)
+			for (unsigned e=0; e<ENTRYPOINTS; e++)
+				stream << "calculon_items_total" << labels(s, e) << " "
+					   << s.entrypoints[e].items << "\n";
+
+		stream << "# HELP calculon_latency_seconds Sampled time per call to each entrypoint.\n"
+			   << "# TYPE calculon_latency_seconds summary\n";
+		for (const Snapshot& s : snapshots)
+		{
+			for (unsigned e=0; e<ENTRYPOINTS; e++)
+			{
+				const Histogram& h = s.entrypoints[e].latency;
+				string l = labels(s, e);
+				for (double q : quantiles)
+				{
+					std::ostringstream ql;
+					ql << l.substr(0, l.size()-1) << ",quantile=\"" << q << "\"}";
+					stream << "calculon_latency_seconds" << ql.str() << " "
+						   << (h.percentile(q) * 1e-9) << "\n";
+				}
+				stream << "calculon_latency_seconds_sum" << l << " "
+					   << (h.sum() * 1e-9) << "\n"
+					   << "calculon_latency_seconds_count" << l << " "
+					   << h.count() << "\n";
+			}
+		}
+	}
+
+	/* Prometheus label values only escape backslashes, double quotes and
+	 * newlines; anything else, control characters included, goes as is. */
+
+	static string labels(const Snapshot& s, unsigned e)
+	{
+		string program;
+		for (char c : s.name)
+		{
+			if (c == '\n')
+				program += "\\n";
+			else
+			{
+				if ((c == '"') || (c == '\\'))
+					program += '\\';
+				program += c;
+			}
+		}
+		return "{program=\"" + program + "\",entrypoint=\"" +
+			entrypointName(e) + "\"}";
+	}
+
+private:
+	string _name;
+	unsigned _interval;
+	uint64_t _id;
+	mutable std::mutex _mutex;
+	vector<unique_ptr<Shard> > _shards;
+};
+
+/* Forwards to a Program (or a Captured), counting and timing the calls in
+ * stats (which may be NULL, in which case it just forwards). */
+
+template <class P>
+class Timed
+{
+public:
+	typedef typename P::Function Function;
+
+	Timed(const P& program, Stats* stats):
+		_program(program),
+		_stats(stats)
+	{
+	}
+
+	template <typename... Args>
+	auto operator () (Args... args) const ->
+		decltype(std::declval<const P&>()(args...))
+	{
+		Stats::Timer timer(_stats, Stats::CALL, 1);
+		return _program(args...);
+	}
+
+	template <class B>
+	void batch(size_t start, size_t count, const B* bindings) const
+	{
+		Stats::Timer timer(_stats, Stats::BATCH, count);
+		_program.batch(start, count, bindings);
+	}
+
+	template <class B>
+	void grid(size_t x, size_t y, size_t width, size_t height,
+			size_t pitch, const B* bindings) const
+	{
+		Stats::Timer timer(_stats, Stats::GRID, (uint64_t)width * height);
+		_program.grid(x, y, width, height, pitch, bindings);
+	}
+
+private:
+	const P& _program;
+	Stats* _stats;
+};
+
+template <class P>
+Timed<P> timed(const P& program, Stats* stats)
+{
+	return Timed<P>(program, stats);
+}
+
+#endif
@@ -16,6 +16,39 @@ class VariableSymbol;
 class FunctionSymbol;
 class ToplevelSymbol;
 
+/* A real or boolean worked out at compile time, by the AST folder.
+ * Without folding, some of these would have been runtime values rather
+ * than LLVM constants (the results of calls and conditionals, and
+ * upvalues); they're opaque, so that they're type checked the same way. */
+
+struct Constant
+{
+	bool boolean;
+	Real value; /* 0 or 1 for booleans */
+	bool opaque;
+
+	static Constant real(Real value)
+	{
+		Constant c = { false, value, false };
+		return c;
+	}
+
+	static Constant truth(bool value)
+	{
+		Constant c = { true, (Real)(value ? 1 : 0), false };
+		return c;
+	}
+
+	/* Whether a number literal with this value would become an int where
+	 * an int is wanted (see coerceConstant()). */
+
+	bool integral() const
+	{
+		return !boolean && !opaque && (value == floor(value)) &&
+			(value >= INT32_MIN) && (value <= INT32_MAX);
+	}
+};
+
 class Symbol : public Object
 {
 public:
@@ -71,6 +104,13 @@ public:
 	}
 
 	virtual llvm::Value* emitValue(CompilerState& state) = 0;
+
+	/* Returns true, with the value, if it's known at compile time. */
+
+	virtual bool fold(CompilerState& state, Constant& result)
+	{
+		return false;
+	}
 };
 
 class ExternalRealConstantSymbol : public ValuedSymbol
@@ -88,6 +128,12 @@ public:
 	{
 		return llvm::ConstantFP::get(state.realType->llvm, value);
 	}
+
+	bool fold(CompilerState& state, Constant& result)
+	{
+		result = Constant::real((Real)value);
+		return true;
+	}
 };
 
 class ExternalVectorConstantSymbol : public ValuedSymbol
@@ -217,6 +263,32 @@ public:
 
 	virtual llvm::Value* emitCall(CompilerState& state,
 			const vector<llvm::Value*>& parameters) = 0;
+
+	/* For the AST folder: works out the result of a call whose parameters
+	 * are all known at compile time, exactly as the generated code would.
+	 * Returns false if this call can't be folded. */
+
+	virtual bool fold(CompilerState& state, const vector<Constant>& parameters,
+			Constant& result)
+	{
+		return false;
+	}
+
+	/* For the AST folder: whether a call might return an int, given
+	 * whether any of its parameters might be one. */
+
+	virtual bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return true;
+	}
+
+	static bool allReals(const vector<Constant>& parameters)
+	{
+		for (const Constant& c : parameters)
+			if (c.boolean)
+				return false;
+		return true;
+	}
 };
 
 class FunctionSymbol : public CallableSymbol
@@ -226,6 +298,8 @@ public:
 	const Type* returntype;
 	llvm::Function* function;
 	FunctionSymbol* parent; // parent function in the static scope
+	bool memo; // cache results within each outermost call
+	llvm::Function* memofunction; // takes the cache as an extra parameter
 
 	typedef map<VariableSymbol*, VariableSymbol*> LocalsMap;
 	LocalsMap locals; // maps root variable -> local variable
@@ -241,7 +315,9 @@ public:
 		arguments(arguments),
 		returntype(returntype),
 		function(NULL),
-		parent(NULL)
+		parent(NULL),
+		memo(false),
+		memofunction(NULL)
 	{
 		for (typename vector<VariableSymbol*>::const_iterator i = arguments.begin(),
 				e = arguments.end(); i != e; i++)
@@ -261,26 +337,41 @@ public:
 		CallableSymbol::checkParameterCount(state, calledwith, arguments.size());
 	}
 
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return returntype->llvm == state.scriptIntType->llvm;
+	}
+
 	llvm::Value* emitCall(CompilerState& state,
 			const vector<llvm::Value*>& parameters)
 	{
 		/* Type-check the parameters. (Only the formal arguments.) */
 
+		vector<llvm::Value*> p = parameters;
 		int i = 1;
 		typename vector<VariableSymbol*>::const_iterator ai = arguments.begin();
-		vector<llvm::Value*>::const_iterator pi = parameters.begin();
+		vector<llvm::Value*>::iterator pi = p.begin();
 		while (ai != arguments.end())
 		{
-			llvm::Value* v = *pi;
-			typeCheckParameter(state, i, v, (*ai)->type);
+			*pi = state.coerceConstant(*pi, (*ai)->type);
+			typeCheckParameter(state, i, *pi, (*ai)->type);
 
 			i++;
 			pi++;
 			ai++;
 		}
 
+		/* Recursive calls to a memo function share their caller's cache. */
+
+		llvm::Function* caller = state.builder.GetInsertBlock()->getParent();
+		if (memofunction && (caller == memofunction))
+		{
+			p.push_back(memofunction->getArg(memofunction->arg_size() - 1));
+			return state.builder.CreateCall(memofunction, p);
+		}
+
 		assert(function);
-		return state.builder.CreateCall(function, parameters);
+		return state.builder.CreateCall(function, p);
 	}
 
 	VariableSymbol* importUpvalue(CompilerState& compiler, VariableSymbol* symbol)
@@ -381,6 +472,29 @@ public:
 		return emitBitcode(state, parameters);
 	}
 
+	/* If any of the parameters is an int, number literals are converted
+	 * to ints and the rest must be ints too. Returns false (and does
+	 * nothing) if there are no ints. */
+
+	bool coerceToInts(CompilerState& state, vector<llvm::Value*>& parameters)
+	{
+		bool found = false;
+		for (llvm::Value* v : parameters)
+			if (v->getType() == state.scriptIntType->llvm)
+				found = true;
+		if (!found)
+			return false;
+
+		for (unsigned i = 0; i < parameters.size(); i++)
+		{
+			parameters[i] = state.coerceConstant(parameters[i],
+					state.scriptIntType);
+			if (parameters[i]->getType() != state.scriptIntType->llvm)
+				typeError(state, i+1, parameters[i], state.scriptIntType);
+		}
+		return true;
+	}
+
 	virtual llvm::Type* returnType(CompilerState& state,
 			const vector<llvm::Type*>& inputTypes) = 0;
 	virtual llvm::Value* emitBitcode(CompilerState& state,
@@ -392,6 +506,8 @@ class ExternalFunctionSymbol : public CallableSymbol
 	vector<string> inputtypenames;
 	string returntypename;
 	void (*pointer)();
+	void (*arraypointer)();
+	unsigned flags;
 
 public:
 	using Symbol::name;
@@ -399,11 +515,14 @@ public:
 	using CallableSymbol::typeError;
 
 	ExternalFunctionSymbol(const string& name, const vector<string>& inputtypes,
-			string returntype, void (*pointer)()):
+			string returntype, void (*pointer)(), unsigned flags = 0,
+			void (*arraypointer)() = NULL):
 		CallableSymbol(name),
 		inputtypenames(inputtypes),
 		returntypename(returntype),
-		pointer(pointer)
+		pointer(pointer),
+		arraypointer(arraypointer),
+		flags(flags)
 	{
 	}
 
@@ -428,33 +547,136 @@ private:
 		return t;
 	}
 
+	/* With BYVALUE, real vectors are passed as themselves (storage vectors
+	 * are still passed by pointer). Only vectors which fill one SSE
+	 * register (a power of two elements, 16 bytes at most) are passed the
+	 * same way whatever vector instructions the host code was compiled
+	 * for. emitCall() checks, so that the error points at the call even if
+	 * the call is made later. */
+
+	bool passByValue(CompilerState& state, Type* type)
+	{
+		if (!(flags & BYVALUE) || !type->asVector() ||
+				(type->llvmx != llvm::PointerType::get(type->llvm, 0)))
+			return false;
+
+		unsigned size = type->asVector()->size;
+		if ((size & (size-1)) || ((size * sizeof(Real)) > 16))
+		{
+			std::stringstream s;
+			s << "external function '" << name << "' can't pass a "
+			  << type->name << " by value";
+			throw CompilationException(state.position.formatError(s.str()));
+		}
+		return true;
+	}
+
 public:
 	llvm::Value* emitCall(CompilerState& state,
 			const vector<llvm::Value*>& parameters)
+	{
+		vector<llvm::Value*> values;
+		for (unsigned i=0; i<parameters.size(); i++)
+		{
+			Type* internalctype = lookup_type(state, inputtypenames[i]);
+			llvm::Value* value = state.coerceConstant(parameters[i], internalctype);
+			typeCheckParameter(state, i+1, value, internalctype);
+			passByValue(state, internalctype);
+			values.push_back(value);
+		}
+		passByValue(state, lookup_type(state, returntypename));
+
+		/* Calls in the body of a batched script are left as placeholders;
+		 * the compiler decides how to make them once it knows whether
+		 * they're being batched. */
+
+		llvm::Function* f = state.builder.GetInsertBlock()->getParent();
+		if (arraypointer && state.options.batch && (f == state.toplevelFunction))
+			return emitBatchSite(state, values);
+
+		return emitScalarCall(state, values);
+	}
+
+	/* The types of the parameters and return value, as the script sees
+	 * them. */
+
+	vector<Type*> inputTypes(CompilerState& state)
+	{
+		vector<Type*> types;
+		for (const string& s : inputtypenames)
+			types.push_back(lookup_type(state, s));
+		return types;
+	}
+
+	Type* returnType(CompilerState& state)
+	{
+		return lookup_type(state, returntypename);
+	}
+
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		Type* t = state.types->find(returntypename);
+		return !t || (t->llvm == state.scriptIntType->llvm);
+	}
+
+	/* Calls the array form: f(n, in1[], in2[]..., out[]). */
+
+	void emitArrayCall(CompilerState& state, llvm::Value* count,
+			const vector<llvm::Value*>& arrays)
+	{
+		vector<llvm::Value*> parameters;
+		vector<llvm::Type*> types;
+		parameters.push_back(count);
+		parameters.insert(parameters.end(), arrays.begin(), arrays.end());
+		for (llvm::Value* v : parameters)
+			types.push_back(v->getType());
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				llvm::Type::getVoidTy(state.context), types, false);
+		llvm::Constant* iptr = llvm::ConstantInt::get(
+				state.engine->getDataLayout().getIntPtrType(state.context, 0),
+				(uint64_t) arraypointer);
+		llvm::Value* fptr = llvm::ConstantExpr::getIntToPtr(iptr,
+				llvm::PointerType::get(ft, 0));
+
+		llvm::CallInst* call = state.builder.CreateCall(
+				llvm::FunctionCallee(ft, fptr), parameters);
+		if (flags & NOUNWIND)
+			call->addFnAttr(llvm::Attribute::NoUnwind);
+	}
+
+	/* Calls the function for a single set of already type-checked
+	 * parameters. */
+
+	llvm::Value* emitScalarCall(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
 	{
 		int i = 0;
 		vector<llvm::Value*>::const_iterator pi = parameters.begin();
 		vector<llvm::Value*> llvmvalues;
 		vector<llvm::Type*> llvmtypes;
+		vector<unsigned> pointerparams;
 
 		Type* returntype = lookup_type(state, returntypename);
 		llvm::Type* externalreturntype = returntype->llvmx;
 
-		/* Convert and add ordinary parameters. */
+		/* Convert and add ordinary parameters. Aggregates are passed by
+		 * pointer to a slot in the entry block, so that calls in a loop
+		 * don't grow the stack. */
 
 		while (pi != parameters.end())
 		{
-			llvm::Value* value = *pi;
 			Type* internalctype = lookup_type(state, inputtypenames[i]);
-			typeCheckParameter(state, i+1, value, internalctype);
+			llvm::Value* value = *pi;
 
-			if (internalctype->asVector())
+			if (passByValue(state, internalctype))
+				;
+			else if (internalctype->isAggregate())
 			{
-				llvm::Value* p = state.builder.CreateAlloca(
-						internalctype->asVector()->llvm,
-						llvm::ConstantInt::get(state.intType, 1));
-				internalctype->asVector()->storeToArray(value, p);
+				llvm::Value* p = state.createEntryAlloca(internalctype->llvm);
+				internalctype->storeToArray(value, p);
 				value = p;
+				pointerparams.push_back(i);
 			}
 			else
 				value = internalctype->convertToExternal(value);
@@ -469,36 +691,249 @@ public:
 		/* If we're returning a vector, insert the return pointer at the end.
 		 */
 
-		if (returntype->asVector())
+		bool returnpointer = false;
+		if (passByValue(state, returntype))
+			externalreturntype = returntype->llvm;
+		else if (returntype->isAggregate())
 		{
-			llvm::Value* p = state.builder.CreateAlloca(
-					returntype->asVector()->llvm,
-					llvm::ConstantInt::get(state.intType, 1));
+			llvm::Value* p = state.createEntryAlloca(returntype->llvm);
 
 			llvmvalues.push_back(p);
 			llvmtypes.push_back(p->getType());
 
 			externalreturntype = llvm::Type::getVoidTy(state.context);
+			returnpointer = true;
 		}
 
 		llvm::FunctionType* ft = llvm::FunctionType::get(
 				externalreturntype, llvmtypes, false);
 
-		/* Create the function. */
+		llvm::CallInst* call = createCall(state, ft, llvmvalues);
+		addAttributes(call, pointerparams, returnpointer);
+
+		llvm::Value* retval = call;
+		if (passByValue(state, returntype))
+			;
+		else if (returntype->isAggregate())
+			retval = returntype->loadFromArray(llvmvalues.back());
+		else
+			retval = returntype->convertToInternal(retval);
+		return retval;
+	}
+
+private:
+	/* Only scalars and real vectors have an obvious array layout. */
+
+	void checkArrayType(CompilerState& state, Type* type)
+	{
+		if (!type->isAggregate())
+			return;
+		if (type->asVector() &&
+				(type->llvmx == llvm::PointerType::get(type->llvm, 0)))
+			return;
+
+		std::stringstream s;
+		s << "the array form of external function '" << name
+		  << "' can't use a " << type->name;
+		throw CompilationException(s.str());
+	}
+
+	llvm::Value* emitBatchSite(CompilerState& state,
+			const vector<llvm::Value*>& values)
+	{
+		vector<llvm::Type*> types;
+		for (llvm::Value* v : values)
+			types.push_back(v->getType());
+		for (Type* t : inputTypes(state))
+			checkArrayType(state, t);
+		Type* returntype = lookup_type(state, returntypename);
+		checkArrayType(state, returntype);
+
+		llvm::FunctionType* ft = llvm::FunctionType::get(
+				returntype->llvm, types, false);
+		llvm::Function* site = llvm::Function::Create(ft,
+				llvm::Function::ExternalLinkage, "batchsite." + name,
+				state.module);
+		state.batchSites.push_back(std::make_pair(site, this));
+		return state.builder.CreateCall(site, values);
+	}
+
+protected:
+	/* Calls the host function through its address. */
 
+	virtual llvm::CallInst* createCall(CompilerState& state,
+			llvm::FunctionType* ft, vector<llvm::Value*>& parameters)
+	{
 		llvm::Constant* iptr = llvm::ConstantInt::get(
 				state.engine->getDataLayout().getIntPtrType(state.context, 0),
 				(uint64_t) pointer);
 		llvm::Value* fptr = llvm::ConstantExpr::getIntToPtr(iptr,
 				llvm::PointerType::get(ft, 0));
 
-		llvm::Value* retval = state.builder.CreateCall(
-				llvm::FunctionCallee(ft, fptr), llvmvalues);
-		if (returntype->asVector())
-			retval = returntype->asVector()->loadFromArray(llvmvalues[0]);
-		else
-			retval = returntype->convertToInternal(retval);
-		return retval;
+		return state.builder.CreateCall(
+				llvm::FunctionCallee(ft, fptr), parameters);
+	}
+
+private:
+	/* Tells LLVM what the flags promise. A side-effect free function may
+	 * still read its pointer parameters and write its return slot, so those
+	 * are described per parameter. */
+
+	void addAttributes(llvm::CallInst* call, const vector<unsigned>& pointerparams,
+			bool returnpointer)
+	{
+		if (flags & NOUNWIND)
+			call->addFnAttr(llvm::Attribute::NoUnwind);
+		if (flags & WILLRETURN)
+			call->addFnAttr(llvm::Attribute::WillReturn);
+
+		if (!(flags & (PURE | READNONE)))
+			return;
+
+		for (unsigned i : pointerparams)
+		{
+			call->addParamAttr(i, llvm::Attribute::NoCapture);
+			call->addParamAttr(i, llvm::Attribute::ReadOnly);
+		}
+
+		if (returnpointer)
+		{
+			unsigned i = call->arg_size() - 1;
+			call->addParamAttr(i, llvm::Attribute::NoCapture);
+			call->addParamAttr(i, llvm::Attribute::WriteOnly);
+		}
+
+		bool pointers = returnpointer || !pointerparams.empty();
+		if (flags & READNONE)
+		{
+			if (pointers)
+				call->addFnAttr(llvm::Attribute::ArgMemOnly);
+			else
+				call->addFnAttr(llvm::Attribute::ReadNone);
+		}
+		else if (!returnpointer)
+			call->addFnAttr(llvm::Attribute::ReadOnly);
+	}
+};
+
+/* The contents of an LLVM bitcode or IR file, kept as bytes because each
+ * Program parses it again into its own context. */
+
+class BitcodeModule : public Object
+{
+public:
+	const string data;
+
+	BitcodeModule(const string& data):
+		data(data)
+	{
+	}
+};
+
+/* An external function whose body is in a BitcodeModule. The first call in
+ * a Program to any function in the module links the whole module in; its
+ * functions and variables are made internal, so they're inlined and
+ * optimised along with the script and anything unused is thrown away. That
+ * means each Program has its own copy of the module's variables. Static
+ * constructors and destructors would never be run, so modules with them
+ * are rejected. */
+
+class ExternalBitcodeSymbol : public ExternalFunctionSymbol
+{
+	BitcodeModule* bitcode;
+	string function;
+
+public:
+	using Symbol::name;
+
+	ExternalBitcodeSymbol(const string& name, const vector<string>& inputtypes,
+			string returntype, BitcodeModule* bitcode, const string& function,
+			unsigned flags = 0):
+		ExternalFunctionSymbol(name, inputtypes, returntype, NULL, flags),
+		bitcode(bitcode),
+		function(function)
+	{
+	}
+
+protected:
+	llvm::CallInst* createCall(CompilerState& state,
+			llvm::FunctionType* ft, vector<llvm::Value*>& parameters)
+	{
+		if (state.linkedBitcode.insert(bitcode).second)
+			link(state);
+		llvm::Function* f = state.module->getFunction(function);
+		if (!f || f->isDeclaration())
+			error("does not define '" + function + "'");
+
+		/* Pointers may be to differently named types on the C side (such
+		 * as a Vector struct); anything else must match exactly. */
+
+		llvm::FunctionType* fft = f->getFunctionType();
+		if ((fft->getNumParams() != ft->getNumParams()) ||
+				(fft->getReturnType() != ft->getReturnType()))
+			error("doesn't match its signature");
+
+		for (unsigned i=0; i<parameters.size(); i++)
+		{
+			llvm::Type* t = fft->getParamType(i);
+			if (t == parameters[i]->getType())
+				continue;
+			if (!t->isPointerTy() || !parameters[i]->getType()->isPointerTy())
+				error("doesn't match its signature");
+			parameters[i] = state.builder.CreatePointerCast(parameters[i], t);
+		}
+
+		return state.builder.CreateCall(f, parameters);
+	}
+
+private:
+	void error(const string& what)
+	{
+		throw CompilationException("bitcode for external function '" + name +
+				"' " + what);
+	}
+
+	void link(CompilerState& state)
+	{
+		llvm::SMDiagnostic diagnostic;
+		unique_ptr<llvm::Module> m = llvm::parseIR(
+				llvm::MemoryBufferRef(bitcode->data, name), diagnostic,
+				state.context);
+		if (!m)
+			error("could not be read: " + diagnostic.getMessage().str());
+
+		m->setDataLayout(state.module->getDataLayout());
+		m->setTargetTriple(state.module->getTargetTriple());
+
+		if (m->getNamedGlobal("llvm.global_ctors") ||
+				m->getNamedGlobal("llvm.global_dtors"))
+			error("has static constructors or destructors, which would "
+					"never be run");
+
+		for (llvm::Function& f : *m)
+		{
+			/* Compiled with -O0, clang forbids any optimisation at all. */
+			f.removeFnAttr(llvm::Attribute::OptimizeNone);
+			f.removeFnAttr(llvm::Attribute::NoInline);
+		}
+
+		/* Everything defined is only used by this Program. The linker
+		 * renames anything internal already here which has the same name,
+		 * so afterwards the names refer to this module's definitions. */
+
+		vector<string> defined;
+		for (llvm::GlobalValue& g : m->global_values())
+		{
+			if (!g.isDeclaration() && !g.hasLocalLinkage())
+				defined.push_back(g.getName().str());
+		}
+
+		if (llvm::Linker::linkModules(*state.module, std::move(m)))
+			error("could not be linked");
+
+		for (const string& s : defined)
+			state.module->getNamedValue(s)->setLinkage(
+					llvm::GlobalValue::InternalLinkage);
 	}
 };
 
@@ -512,6 +947,11 @@ public:
 	{
 	}
 
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return false;
+	}
+
 	void typeCheckParameter(CompilerState& state,
 				int index, llvm::Value* argument, Type* type)
 	{
@@ -531,6 +971,11 @@ public:
 	{
 	}
 
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return false;
+	}
+
 	void typeCheckParameter(CompilerState& state,
 				int index, llvm::Value* argument, Type* type)
 	{
@@ -542,6 +987,7 @@ public:
 class BitcodeRealComparisonSymbol : public BitcodeSymbol
 {
 	using CallableSymbol::typeError;
+	using BitcodeSymbol::coerceToInts;
 
 public:
 	BitcodeRealComparisonSymbol(string id):
@@ -549,6 +995,24 @@ public:
 	{
 	}
 
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return false;
+	}
+
+	llvm::Value* emitCall(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
+	{
+		vector<llvm::Value*> p = parameters;
+		if (coerceToInts(state, p))
+			return emitIntBitcode(state, p);
+
+		return BitcodeSymbol::emitCall(state, parameters);
+	}
+
+	virtual llvm::Value* emitIntBitcode(CompilerState& state,
+			const vector<llvm::Value*>& parameters) = 0;
+
 	void typeCheckParameter(CompilerState& state,
 				int index, llvm::Value* argument, Type* type)
 	{
@@ -573,6 +1037,11 @@ public:
 	{
 	}
 
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return false;
+	}
+
 	void typeCheckParameter(CompilerState& state,
 				int index, llvm::Value* argument, Type* type)
 	{
@@ -581,6 +1050,38 @@ public:
 	}
 };
 
+class BitcodeMatrixSymbol : public BitcodeSymbol
+{
+	using CallableSymbol::typeError;
+
+public:
+	BitcodeMatrixSymbol(string id):
+		BitcodeSymbol(id, 1)
+	{
+	}
+
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return false;
+	}
+
+	void typeCheckParameter(CompilerState& state,
+				int index, llvm::Value* argument, Type* type)
+	{
+		if (!state.types->find(argument->getType())->asMatrix())
+			typeError(state, index, argument, "matrix");
+	}
+
+	void matrixSizeError(CompilerState& state, MatrixType* matrixtype)
+	{
+		std::stringstream s;
+		s << "this doesn't make sense for a " << matrixtype->rows
+		  << "x" << matrixtype->columns << " matrix";
+
+		throw CompilationException(state.position.formatError(s.str()));
+	}
+};
+
 class BitcodeRealOrVectorSymbol : public BitcodeSymbol
 {
 	using CallableSymbol::typeError;
@@ -591,6 +1092,11 @@ public:
 	{
 	}
 
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return false;
+	}
+
 	void typeCheckParameter(CompilerState& state,
 				int index, llvm::Value* argument, Type* type)
 	{
@@ -640,12 +1146,27 @@ public:
 
 class BitcodeComparisonSymbol : public BitcodeHomogeneousSymbol
 {
+	using BitcodeSymbol::coerceToInts;
+
 public:
 	BitcodeComparisonSymbol(string id):
 		BitcodeHomogeneousSymbol(id, 2)
 	{
 	}
 
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return false;
+	}
+
+	llvm::Value* emitCall(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
+	{
+		vector<llvm::Value*> p = parameters;
+		coerceToInts(state, p);
+		return BitcodeHomogeneousSymbol::emitCall(state, p);
+	}
+
 	llvm::Type* returnType(CompilerState& state,
 			const vector<llvm::Type*>& inputTypes)
 	{
@@ -663,6 +1184,11 @@ public:
 	{
 	}
 
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return false;
+	}
+
 	void typeCheckParameter(CompilerState& state,
 				int index, llvm::Value* argument, Type* type)
 	{
@@ -686,6 +1212,7 @@ class BitcodeRealOrVectorArraySymbol : public BitcodeSymbol
 	Type* _firsttype;
 
 	using CallableSymbol::typeError;
+	using BitcodeSymbol::coerceToInts;
 
 public:
 	BitcodeRealOrVectorArraySymbol(const string& id, int parameters):
@@ -693,6 +1220,13 @@ public:
 	{
 	}
 
+	/* Ints only mix with ints (or number literals). */
+
+	bool mayReturnInteger(CompilerState& state, bool integerParameters)
+	{
+		return integerParameters;
+	}
+
 	void typeCheckParameter(CompilerState& state,
 				int index, llvm::Value* argument, Type* type)
 	{
@@ -722,6 +1256,39 @@ public:
 		return inputTypes[0];
 	}
 
+	llvm::Value* emitCall(CompilerState& state,
+			const vector<llvm::Value*>& parameters)
+	{
+		/* Ints only mix with ints (or number literals). */
+
+		vector<llvm::Value*> p = parameters;
+		if (coerceToInts(state, p))
+			return emitIntBitcode(state, p);
+
+		/* Matrices are operated on element by element, exactly like their
+		 * flattened vectors, and may be mixed only with reals.
+		 */
+
+		MatrixType* mt = state.types->find(parameters[0]->getType())->asMatrix();
+		if (!mt)
+			return BitcodeSymbol::emitCall(state, parameters);
+
+		vector<llvm::Value*> flattened;
+		for (unsigned i = 0; i < parameters.size(); i++)
+		{
+			llvm::Value* v = parameters[i];
+			Type* t = state.types->find(v->getType());
+			if (t->equals(mt))
+				v = mt->flatten(v);
+			else if (!t->equals(state.realType))
+				typeError(state, i+1, v, mt);
+
+			flattened.push_back(v);
+		}
+
+		return mt->unflatten(BitcodeSymbol::emitCall(state, flattened));
+	}
+
 	llvm::Value* convertRHS(CompilerState& state, llvm::Value* lhs,
 			llvm::Value* rhs)
 	{
@@ -740,6 +1307,9 @@ public:
 
 		return rhs;
 	}
+
+	virtual llvm::Value* emitIntBitcode(CompilerState& state,
+			const vector<llvm::Value*>& parameters) = 0;
 };
 
 class IntrinsicFunctionSymbol : public CallableSymbol
@@ -0,0 +1,220 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+#ifndef CALCULON_TRACE_H
+#define CALCULON_TRACE_H
+
+#ifndef CALCULON_H
+#error "Don't include this, include calculon.h instead."
+#endif
+
+/* Records what Calculon is doing, on every thread, as Chrome trace_event
+ * JSON which chrome://tracing or Perfetto (ui.perfetto.dev) can display.
+ *
+ * Point Options::trace at one to record each phase of compiling a Program,
+ * and pass one to a Dispatch to record each chunk of work and each steal.
+ * One Trace may be shared by any number of Programs and Dispatches on any
+ * number of threads; events are kept in memory until written out.
+ */
+
+class Trace
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/* pid is only used to tell processes apart if several traces are
+	 * loaded together. */
+
+	Trace(int pid = 1):
+		_pid(pid),
+		_epoch(Clock::now())
+	{
+	}
+
+	/* Records an event from start to now, on the calling thread. args, if
+	 * given, is the body of a JSON object, e.g. "\"count\": 4". */
+
+	void complete(const char* category, const string& name,
+			Clock::time_point start, const string& args = "")
+	{
+		Clock::time_point end = Clock::now();
+		add(Event { category, name, args, 'X', micros(start),
+			micros(end) - micros(start), 0 });
+	}
+
+	/* Records a moment on the calling thread. */
+
+	void instant(const char* category, const string& name,
+			const string& args = "")
+	{
+		add(Event { category, name, args, 'i', micros(Clock::now()), 0, 0 });
+	}
+
+	/* Records an event covering its own lifetime (or until end() is
+	 * called). trace may be NULL, which does nothing. */
+
+	class Scope
+	{
+	public:
+		Scope(Trace* trace, const char* category, const string& name,
+				const string& args = ""):
+			_trace(trace),
+			_category(category)
+		{
+			if (_trace)
+			{
+				_name = name;
+				_args = args;
+				_start = Clock::now();
+			}
+		}
+
+		~Scope()
+		{
+			end();
+		}
+
+		void end()
+		{
+			if (_trace)
+				_trace->complete(_category, _name, _start, _args);
+			_trace = NULL;
+		}
+
+	private:
+		Trace* _trace;
+		const char* _category;
+		string _name;
+		string _args;
+		Clock::time_point _start;
+	};
+
+	size_t size() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _events.size();
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_events.clear();
+	}
+
+	/* Writes everything recorded so far. Threads are numbered in the order
+	 * they first recorded something. */
+
+	void write(std::ostream& stream) const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		std::ostringstream s;
+		s.precision(3);
+		s << std::fixed;
+
+		s << "{\"traceEvents\": [\n";
+		for (unsigned t=0; t<_threads.size(); t++)
+			s << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << _pid
+			  << ", \"tid\": " << (t+1)
+			  << ", \"args\": {\"name\": \"thread " << (t+1) << "\"}},\n";
+
+		for (size_t i=0; i<_events.size(); i++)
+		{
+			const Event& e = _events[i];
+			s << "{\"name\": " << quote(e.name)
+			  << ", \"cat\": \"" << e.category << "\""
+			  << ", \"ph\": \"" << e.phase << "\""
+			  << ", \"ts\": " << e.ts;
+			if (e.phase == 'X')
+				s << ", \"dur\": " << e.dur;
+			else
+				s << ", \"s\": \"t\"";
+			s << ", \"pid\": " << _pid
+			  << ", \"tid\": " << e.tid;
+			if (!e.args.empty())
+				s << ", \"args\": {" << e.args << "}";
+			s << "}" << ((i+1 < _events.size()) ? ",\n" : "\n");
+		}
+		s << "],\n"
+		  << "\"displayTimeUnit\": \"ns\"}\n";
+
+		stream << s.str();
+	}
+
+	/* Replaces filename with the trace. */
+
+	void write(const string& filename) const
+	{
+		std::ofstream stream(filename.c_str());
+		write(stream);
+		stream.flush();
+		if (!stream)
+			throw std::runtime_error("can't write '" + filename + "'");
+	}
+
+	/* s as a JSON string; Stats uses this too. */
+
+	static string quote(const string& s)
+	{
+		string result = "\"";
+		for (unsigned char c : s)
+		{
+			if ((c == '"') || (c == '\\'))
+			{
+				result += '\\';
+				result += c;
+			}
+			else if (c < 0x20)
+			{
+				char buffer[8];
+				snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+				result += buffer;
+			}
+			else
+				result += c;
+		}
+		return result + "\"";
+	}
+
+private:
+	struct Event
+	{
+		const char* category;
+		string name;
+		string args;
+		char phase;
+		double ts;  /* us since the epoch */
+		double dur; /* us */
+		unsigned tid;
+	};
+
+	double micros(Clock::time_point t) const
+	{
+		return std::chrono::duration<double, std::micro>(t - _epoch).count();
+	}
+
+	void add(Event e)
+	{
+		std::thread::id me = std::this_thread::get_id();
+		std::lock_guard<std::mutex> lock(_mutex);
+
+		unsigned tid = 0;
+		while ((tid < _threads.size()) && (_threads[tid] != me))
+			tid++;
+		if (tid == _threads.size())
+			_threads.push_back(me);
+
+		e.tid = tid + 1;
+		_events.push_back(std::move(e));
+	}
+
+private:
+	int _pid;
+	Clock::time_point _epoch;
+	mutable std::mutex _mutex;
+	vector<std::thread::id> _threads;
+	vector<Event> _events;
+};
+
+#endif
@@ -11,6 +11,7 @@
 #endif
 
 class VectorType;
+class MatrixType;
 class RealType;
 
 class Type : public Object
@@ -49,6 +50,20 @@ public:
 		return NULL;
 	}
 
+	virtual MatrixType* asMatrix()
+	{
+		return NULL;
+	}
+
+	/* Aggregate types are passed to and from C code by pointer, and must be
+	 * moved in and out of memory with loadFromArray() and storeToArray().
+	 */
+
+	virtual bool isAggregate() const
+	{
+		return false;
+	}
+
 	virtual llvm::Value* convertToExternal(llvm::Value* value)
 	{
 		return value;
@@ -58,6 +73,17 @@ public:
 	{
 		return value;
 	}
+
+	virtual void storeToArray(llvm::Value* value, llvm::Value* pointer) const
+	{
+		assert(false && "should only be called on aggregates");
+	}
+
+	virtual llvm::Value* loadFromArray(llvm::Value* pointer) const
+	{
+		assert(false && "should only be called on aggregates");
+		return NULL;
+	}
 };
 
 class RealType : public Type
@@ -146,6 +172,20 @@ public:
 	}
 };
 
+/* Ints are 32-bit signed integers, and are passed to and from C code as
+ * int32_t. They're scalar only.
+ */
+
+class IntType : public Type
+{
+public:
+	IntType(CompilerState& state, const string& name):
+		Type(state, name)
+	{
+		this->llvm = this->llvmx = llvm::IntegerType::get(state.context, 32);
+	}
+};
+
 class VectorType : public Type
 {
 public:
@@ -176,6 +216,11 @@ public:
 		return this;
 	}
 
+	bool isAggregate() const
+	{
+		return true;
+	}
+
 	llvm::Value* convertToExternal(llvm::Value* value)
 	{
 		assert(false && "should not be called on vector");
@@ -212,6 +257,707 @@ public:
 		return state.builder.CreateLoad(llvm, pointer);
 	}
 
+	/* Returns a vector of this size with every element set to v. */
+
+	llvm::Value* splat(llvm::Value* v) const
+	{
+		return state.builder.CreateVectorSplat(size, v);
+	}
+};
+
+class MatrixType : public Type
+{
+public:
+	unsigned rows;
+	unsigned columns;
+	VectorType* flattype; /* row-major vector*(rows*columns) */
+
+	using Type::state;
+	using Type::llvm;
+	using Type::llvmx;
+
+public:
+	MatrixType(CompilerState& state, const string& name,
+			unsigned rows, unsigned columns):
+		Type(state, name),
+		rows(rows),
+		columns(columns)
+	{
+		std::stringstream s;
+		s << "vector*" << (rows * columns);
+		flattype = state.types->find(s.str())->asVector();
+
+		/* Matrices are wrapped in a named struct so that they don't get
+		 * confused with vectors of the same size.
+		 */
+
+		llvm = llvm::StructType::create(state.context, flattype->llvm, name);
+		llvmx = llvm::PointerType::get(llvm, 0);
+	}
+
+	MatrixType* asMatrix()
+	{
+		return this;
+	}
+
+	bool isAggregate() const
+	{
+		return true;
+	}
+
+	bool isSquare() const
+	{
+		return rows == columns;
+	}
+
+	llvm::Value* convertToExternal(llvm::Value* value)
+	{
+		assert(false && "should not be called on matrix");
+		return NULL;
+	}
+
+	llvm::Value* convertToInternal(llvm::Value* value)
+	{
+		assert(false && "should not be called on matrix");
+		return NULL;
+	}
+
+	void storeToArray(llvm::Value* value, llvm::Value* pointer) const
+	{
+		/* The C side is only guaranteed to be aligned to an element. */
+
+		llvm::Value* p = state.builder.CreateBitCast(pointer,
+				llvm::PointerType::get(flattype->llvm, 0));
+		state.builder.CreateAlignedStore(flatten(value), p, elementAlignment());
+	}
+
+	llvm::Value* loadFromArray(llvm::Value* pointer) const
+	{
+		llvm::Value* p = state.builder.CreateBitCast(pointer,
+				llvm::PointerType::get(flattype->llvm, 0));
+		return unflatten(state.builder.CreateAlignedLoad(flattype->llvm, p,
+				elementAlignment()));
+	}
+
+	/* Converts between a matrix and its row-major vector. */
+
+	llvm::Value* flatten(llvm::Value* matrix) const
+	{
+		return state.builder.CreateExtractValue(matrix, 0);
+	}
+
+	llvm::Value* unflatten(llvm::Value* flat) const
+	{
+		return state.builder.CreateInsertValue(llvm::UndefValue::get(llvm),
+				flat, 0);
+	}
+
+	/* These all operate on flattened matrices. */
+
+	llvm::Value* getElement(llvm::Value* flat, unsigned row, unsigned column) const
+	{
+		assert(row < rows);
+		assert(column < columns);
+		return flattype->getElement(flat, row*columns + column);
+	}
+
+	llvm::Value* getRow(llvm::Value* flat, unsigned row) const
+	{
+		vector<int> mask;
+		for (unsigned i = 0; i < columns; i++)
+			mask.push_back(row*columns + i);
+		return state.builder.CreateShuffleVector(flat, mask);
+	}
+
+	llvm::Value* getColumn(llvm::Value* flat, unsigned column) const
+	{
+		vector<int> mask;
+		for (unsigned i = 0; i < rows; i++)
+			mask.push_back(i*columns + column);
+		return state.builder.CreateShuffleVector(flat, mask);
+	}
+
+	/* Assembles a flattened matrix out of a list of row vectors, using a
+	 * tree of shuffles.
+	 */
+
+	llvm::Value* fromRows(const vector<llvm::Value*>& rowvalues) const
+	{
+		assert(rowvalues.size() == rows);
+		vector<llvm::Value*> parts(rowvalues);
+
+		while (parts.size() > 1)
+		{
+			vector<llvm::Value*> merged;
+			for (unsigned i = 0; i < parts.size(); i += 2)
+			{
+				if ((i+1) == parts.size())
+					merged.push_back(parts[i]);
+				else
+					merged.push_back(concatenate(parts[i], parts[i+1]));
+			}
+			parts = merged;
+		}
+
+		return parts[0];
+	}
+
+	/* Returns the flattened transpose, which is a columns x rows matrix. */
+
+	llvm::Value* transpose(llvm::Value* flat) const
+	{
+		vector<int> mask;
+		for (unsigned c = 0; c < columns; c++)
+			for (unsigned r = 0; r < rows; r++)
+				mask.push_back(r*columns + c);
+		return state.builder.CreateShuffleVector(flat, mask);
+	}
+
+	/* Matrix product of this matrix and a columns x n matrix; returns a
+	 * flattened rows x n matrix. Each output row is accumulated as a vector
+	 * of splatted left-hand elements times right-hand rows.
+	 */
+
+	llvm::Value* multiply(llvm::Value* flat, const MatrixType* other,
+			llvm::Value* otherflat) const
+	{
+		assert(other->rows == columns);
+
+		vector<llvm::Value*> otherrows;
+		for (unsigned k = 0; k < columns; k++)
+			otherrows.push_back(other->getRow(otherflat, k));
+
+		vector<llvm::Value*> results;
+		for (unsigned r = 0; r < rows; r++)
+		{
+			llvm::Value* acc = NULL;
+			for (unsigned k = 0; k < columns; k++)
+			{
+				llvm::Value* e = state.builder.CreateVectorSplat(
+						other->columns, getElement(flat, r, k));
+				if (acc)
+					acc = state.createFMulAdd(e, otherrows[k], acc);
+				else
+					acc = state.builder.CreateFMul(e, otherrows[k]);
+			}
+			results.push_back(acc);
+		}
+
+		return other->withRows(rows)->fromRows(results);
+	}
+
+	/* Matrix times column vector (of size columns); returns a vector of size
+	 * rows.
+	 */
+
+	llvm::Value* multiplyColumn(llvm::Value* flat, llvm::Value* v) const
+	{
+		llvm::Value* acc = NULL;
+		for (unsigned k = 0; k < columns; k++)
+		{
+			llvm::Value* e = state.builder.CreateVectorSplat(rows,
+					state.builder.CreateExtractElement(v, k));
+			llvm::Value* c = getColumn(flat, k);
+			if (acc)
+				acc = state.createFMulAdd(c, e, acc);
+			else
+				acc = state.builder.CreateFMul(c, e);
+		}
+		return acc;
+	}
+
+	/* Row vector (of size rows) times matrix; returns a vector of size
+	 * columns.
+	 */
+
+	llvm::Value* multiplyRow(llvm::Value* v, llvm::Value* flat) const
+	{
+		llvm::Value* acc = NULL;
+		for (unsigned k = 0; k < rows; k++)
+		{
+			llvm::Value* e = state.builder.CreateVectorSplat(columns,
+					state.builder.CreateExtractElement(v, k));
+			llvm::Value* r = getRow(flat, k);
+			if (acc)
+				acc = state.createFMulAdd(e, r, acc);
+			else
+				acc = state.builder.CreateFMul(e, r);
+		}
+		return acc;
+	}
+
+	/* Determinants and inverses are only supported for 2x2, 3x3 and 4x4
+	 * matrices. Singular matrices produce infinities or NaNs.
+	 */
+
+	bool isInvertible() const
+	{
+		return isSquare() && (rows >= 2) && (rows <= 4);
+	}
+
+	llvm::Value* determinant(llvm::Value* flat) const
+	{
+		assert(isInvertible());
+		switch (rows)
+		{
+			case 2:
+				return differenceOfProducts(
+						getElement(flat, 0, 0), getElement(flat, 1, 1),
+						getElement(flat, 0, 1), getElement(flat, 1, 0));
+
+			case 3:
+			{
+				llvm::Value* r0 = getRow(flat, 0);
+				llvm::Value* r1 = getRow(flat, 1);
+				llvm::Value* r2 = getRow(flat, 2);
+				return dot3(r0, cross3(r1, r2));
+			}
+
+			case 4:
+			{
+				Minors4 m(*this, flat);
+				return m.determinant();
+			}
+		}
+
+		assert(false);
+		return NULL;
+	}
+
+	llvm::Value* inverse(llvm::Value* flat) const
+	{
+		assert(isInvertible());
+		switch (rows)
+		{
+			case 2:
+			{
+				/* [a b; c d]^-1 = [d -b; -c a] / det */
+
+				llvm::Value* det = determinant(flat);
+				llvm::Value* v = state.builder.CreateShuffleVector(flat,
+						vector<int> { 3, 1, 2, 0 });
+				llvm::Value* signs = llvm::ConstantVector::get(
+						vector<llvm::Constant*> {
+							llvm::ConstantFP::get(realType(), 1.0),
+							llvm::ConstantFP::get(realType(), -1.0),
+							llvm::ConstantFP::get(realType(), -1.0),
+							llvm::ConstantFP::get(realType(), 1.0)
+						});
+				v = state.builder.CreateFMul(v, signs);
+				return scale(v, reciprocal(det));
+			}
+
+			case 3:
+			{
+				/* The columns of the inverse are the cross products of
+				 * pairs of rows, divided by the determinant.
+				 */
+
+				llvm::Value* r0 = getRow(flat, 0);
+				llvm::Value* r1 = getRow(flat, 1);
+				llvm::Value* r2 = getRow(flat, 2);
+				llvm::Value* c0 = cross3(r1, r2);
+				llvm::Value* c1 = cross3(r2, r0);
+				llvm::Value* c2 = cross3(r0, r1);
+				llvm::Value* det = dot3(r0, c0);
+
+				llvm::Value* v = transpose(fromRows(
+						vector<llvm::Value*> { c0, c1, c2 }));
+				return scale(v, reciprocal(det));
+			}
+
+			case 4:
+			{
+				Minors4 m(*this, flat);
+				return scale(m.adjugate(), reciprocal(m.determinant()));
+			}
+		}
+
+		assert(false);
+		return NULL;
+	}
+
+	/* Returns the matrix type with the same number of columns as this one
+	 * but a different number of rows.
+	 */
+
+	MatrixType* withRows(unsigned newrows) const
+	{
+		return state.types->findMatrix(newrows, columns);
+	}
+
+private:
+	/* The 4x4 determinant and inverse are computed via the twelve 2x2
+	 * minors of the top and bottom pairs of rows (Laplace expansion).
+	 */
+
+	struct Minors4
+	{
+		const MatrixType& type;
+		llvm::Value* a[4][4];
+		llvm::Value* s[6];
+		llvm::Value* c[6];
+
+		Minors4(const MatrixType& type, llvm::Value* flat):
+			type(type)
+		{
+			for (unsigned r = 0; r < 4; r++)
+				for (unsigned col = 0; col < 4; col++)
+					a[r][col] = type.getElement(flat, r, col);
+
+			s[0] = type.differenceOfProducts(a[0][0], a[1][1], a[1][0], a[0][1]);
+			s[1] = type.differenceOfProducts(a[0][0], a[1][2], a[1][0], a[0][2]);
+			s[2] = type.differenceOfProducts(a[0][0], a[1][3], a[1][0], a[0][3]);
+			s[3] = type.differenceOfProducts(a[0][1], a[1][2], a[1][1], a[0][2]);
+			s[4] = type.differenceOfProducts(a[0][1], a[1][3], a[1][1], a[0][3]);
+			s[5] = type.differenceOfProducts(a[0][2], a[1][3], a[1][2], a[0][3]);
+
+			c[5] = type.differenceOfProducts(a[2][2], a[3][3], a[3][2], a[2][3]);
+			c[4] = type.differenceOfProducts(a[2][1], a[3][3], a[3][1], a[2][3]);
+			c[3] = type.differenceOfProducts(a[2][1], a[3][2], a[3][1], a[2][2]);
+			c[2] = type.differenceOfProducts(a[2][0], a[3][3], a[3][0], a[2][3]);
+			c[1] = type.differenceOfProducts(a[2][0], a[3][2], a[3][0], a[2][2]);
+			c[0] = type.differenceOfProducts(a[2][0], a[3][1], a[3][0], a[2][1]);
+		}
+
+		llvm::Value* determinant()
+		{
+			llvm::Value* v1 = type.differenceOfProducts(s[0], c[5], s[1], c[4]);
+			llvm::Value* v2 = type.differenceOfProducts(s[2], c[3], type.negate(s[3]), c[2]);
+			llvm::Value* v3 = type.differenceOfProducts(s[5], c[0], s[4], c[1]);
+			return type.state.builder.CreateFAdd(
+					type.state.builder.CreateFAdd(v1, v2), v3);
+		}
+
+		/* Returns the flattened transposed cofactor matrix. */
+
+		llvm::Value* adjugate()
+		{
+			llvm::Value* e[16] =
+			{
+				sum3(+1, a[1][1], c[5], -1, a[1][2], c[4], +1, a[1][3], c[3]),
+				sum3(-1, a[0][1], c[5], +1, a[0][2], c[4], -1, a[0][3], c[3]),
+				sum3(+1, a[3][1], s[5], -1, a[3][2], s[4], +1, a[3][3], s[3]),
+				sum3(-1, a[2][1], s[5], +1, a[2][2], s[4], -1, a[2][3], s[3]),
+
+				sum3(-1, a[1][0], c[5], +1, a[1][2], c[2], -1, a[1][3], c[1]),
+				sum3(+1, a[0][0], c[5], -1, a[0][2], c[2], +1, a[0][3], c[1]),
+				sum3(-1, a[3][0], s[5], +1, a[3][2], s[2], -1, a[3][3], s[1]),
+				sum3(+1, a[2][0], s[5], -1, a[2][2], s[2], +1, a[2][3], s[1]),
+
+				sum3(+1, a[1][0], c[4], -1, a[1][1], c[2], +1, a[1][3], c[0]),
+				sum3(-1, a[0][0], c[4], +1, a[0][1], c[2], -1, a[0][3], c[0]),
+				sum3(+1, a[3][0], s[4], -1, a[3][1], s[2], +1, a[3][3], s[0]),
+				sum3(-1, a[2][0], s[4], +1, a[2][1], s[2], -1, a[2][3], s[0]),
+
+				sum3(-1, a[1][0], c[3], +1, a[1][1], c[1], -1, a[1][2], c[0]),
+				sum3(+1, a[0][0], c[3], -1, a[0][1], c[1], +1, a[0][2], c[0]),
+				sum3(-1, a[3][0], s[3], +1, a[3][1], s[1], -1, a[3][2], s[0]),
+				sum3(+1, a[2][0], s[3], -1, a[2][1], s[1], +1, a[2][2], s[0])
+			};
+
+			llvm::Value* v = llvm::UndefValue::get(type.flattype->llvm);
+			for (unsigned i = 0; i < 16; i++)
+				v = type.flattype->setElement(v, i, e[i]);
+			return v;
+		}
+
+	private:
+		llvm::Value* sign(int sign, llvm::Value* v)
+		{
+			return (sign < 0) ? type.negate(v) : v;
+		}
+
+		/* s1*x1*y1 + s2*x2*y2 + s3*x3*y3, where the s are +1 or -1. */
+
+		llvm::Value* sum3(int s1, llvm::Value* x1, llvm::Value* y1,
+				int s2, llvm::Value* x2, llvm::Value* y2,
+				int s3, llvm::Value* x3, llvm::Value* y3)
+		{
+			llvm::Value* v = type.state.builder.CreateFMul(sign(s3, x3), y3);
+			v = type.state.createFMulAdd(sign(s2, x2), y2, v);
+			return type.state.createFMulAdd(sign(s1, x1), y1, v);
+		}
+	};
+
+	llvm::Type* realType() const
+	{
+		return flattype->llvm->getScalarType();
+	}
+
+	llvm::Value* negate(llvm::Value* v) const
+	{
+		return state.builder.CreateFNeg(v);
+	}
+
+	/* a*b - c*d */
+
+	llvm::Value* differenceOfProducts(llvm::Value* a, llvm::Value* b,
+			llvm::Value* c, llvm::Value* d) const
+	{
+		return state.createFMulAdd(a, b,
+				negate(state.builder.CreateFMul(c, d)));
+	}
+
+	llvm::Value* reciprocal(llvm::Value* v) const
+	{
+		return state.builder.CreateFDiv(llvm::ConstantFP::get(realType(), 1.0), v);
+	}
+
+	llvm::Value* scale(llvm::Value* v, llvm::Value* factor) const
+	{
+		unsigned n = vectorSize(v);
+		return state.builder.CreateFMul(v, state.builder.CreateVectorSplat(n, factor));
+	}
+
+	/* a.yzx*b.zxy - a.zxy*b.yzx, on 3-vectors. */
+
+	llvm::Value* cross3(llvm::Value* a, llvm::Value* b) const
+	{
+		vector<int> yzx { 1, 2, 0 };
+		vector<int> zxy { 2, 0, 1 };
+		llvm::Value* p = state.builder.CreateFMul(
+				state.builder.CreateShuffleVector(a, zxy),
+				state.builder.CreateShuffleVector(b, yzx));
+		return state.createFMulAdd(
+				state.builder.CreateShuffleVector(a, yzx),
+				state.builder.CreateShuffleVector(b, zxy),
+				negate(p));
+	}
+
+	llvm::Value* dot3(llvm::Value* a, llvm::Value* b) const
+	{
+		llvm::Value* p = state.builder.CreateFMul(a, b);
+		llvm::Value* v = state.builder.CreateFAdd(
+				state.builder.CreateExtractElement(p, (uint64_t)0),
+				state.builder.CreateExtractElement(p, 1));
+		return state.builder.CreateFAdd(v,
+				state.builder.CreateExtractElement(p, 2));
+	}
+
+	llvm::Align elementAlignment() const
+	{
+		return llvm::Align(sizeof(typename S::Real));
+	}
+
+	unsigned vectorSize(llvm::Value* v) const
+	{
+		return llvm::cast<llvm::FixedVectorType>(v->getType())->getNumElements();
+	}
+
+	llvm::Value* concatenate(llvm::Value* v1, llvm::Value* v2) const
+	{
+		unsigned n1 = vectorSize(v1);
+		unsigned n2 = vectorSize(v2);
+
+		/* shufflevector needs both operands to be the same size, so pad the
+		 * smaller one out with undefined elements.
+		 */
+
+		unsigned n = std::max(n1, n2);
+		if (n1 < n)
+			v1 = widen(v1, n);
+		if (n2 < n)
+			v2 = widen(v2, n);
+
+		vector<int> mask;
+		for (unsigned i = 0; i < n1; i++)
+			mask.push_back(i);
+		for (unsigned i = 0; i < n2; i++)
+			mask.push_back(n + i);
+		return state.builder.CreateShuffleVector(v1, v2, mask);
+	}
+
+	llvm::Value* widen(llvm::Value* v, unsigned size) const
+	{
+		vector<int> mask;
+		unsigned n = vectorSize(v);
+		for (unsigned i = 0; i < size; i++)
+			mask.push_back((i < n) ? (int)i : llvm::UndefMaskElem);
+		return state.builder.CreateShuffleVector(v, mask);
+	}
+};
+
+/* A real or vector which is stored outside Calculon code in a different
+ * format, like 'half' or 'vector*4 of uint8 normalized'. Inside Calculon
+ * it's just the compute type; values are converted as they're loaded and
+ * stored. Vectors are passed by pointer to tightly packed elements, aligned
+ * to an element.
+ */
+
+class StorageType : public Type
+{
+public:
+	Type* computetype;
+	llvm::Type* element;
+	llvm::Type* storagetype; /* element, or a vector of elements */
+	bool issigned;
+	bool normalized;
+
+	using Type::state;
+	using Type::llvm;
+	using Type::llvmx;
+
+public:
+	StorageType(CompilerState& state, const string& name, Type* computetype,
+			llvm::Type* element, bool issigned, bool normalized):
+		Type(state, name),
+		computetype(computetype),
+		element(element),
+		issigned(issigned),
+		normalized(normalized)
+	{
+		llvm = computetype->llvm;
+		if (VectorType* vt = computetype->asVector())
+		{
+			storagetype = llvm::VectorType::get(element, vt->size, false);
+			llvmx = llvm::PointerType::get(storagetype, 0);
+		}
+		else
+			storagetype = llvmx = element;
+	}
+
+	/* Parses a storage format like 'half' or 'uint8 normalized'. Returns
+	 * NULL if it's not one. */
+
+	static llvm::Type* parse(CompilerState& state, string format,
+			bool& issigned, bool& normalized)
+	{
+		const string suffix = " normalized";
+		normalized = false;
+		if ((format.size() > suffix.size()) &&
+				(format.compare(format.size() - suffix.size(),
+					suffix.size(), suffix) == 0))
+		{
+			normalized = true;
+			format.erase(format.size() - suffix.size());
+		}
+
+		if (format.empty())
+			return NULL;
+
+		issigned = (format[0] == 'i');
+		llvm::Type* element = NULL;
+		if (format == "half")
+			element = llvm::Type::getHalfTy(state.context);
+		else if (format == "float")
+			element = llvm::Type::getFloatTy(state.context);
+		else if (format == "double")
+			element = llvm::Type::getDoubleTy(state.context);
+		else if ((format == "uint8") || (format == "int8"))
+			element = llvm::IntegerType::get(state.context, 8);
+		else if ((format == "uint16") || (format == "int16"))
+			element = llvm::IntegerType::get(state.context, 16);
+
+		if (element && normalized && !element->isIntegerTy())
+			return NULL;
+		return element;
+	}
+
+	VectorType* asVector()
+	{
+		return computetype->asVector();
+	}
+
+	const VectorType* asVector() const
+	{
+		return computetype->asVector();
+	}
+
+	bool isAggregate() const
+	{
+		return computetype->isAggregate();
+	}
+
+	llvm::Value* convertToExternal(llvm::Value* value)
+	{
+		if (element->isFloatingPointTy())
+			return resize(value, storagetype);
+
+		if (normalized)
+		{
+			value = clamp(value, issigned ? -1 : 0, 1);
+			value = state.builder.CreateFMul(value,
+					llvm::ConstantFP::get(value->getType(), maximum()));
+		}
+
+		/* Round to nearest; the conversion saturates, and turns NaN into 0. */
+
+		value = state.builder.CreateUnaryIntrinsic(llvm::Intrinsic::rint,
+				value);
+		return state.builder.CreateIntrinsic(
+				issigned ? llvm::Intrinsic::fptosi_sat : llvm::Intrinsic::fptoui_sat,
+				{ storagetype, value->getType() }, { value });
+	}
+
+	llvm::Value* convertToInternal(llvm::Value* value)
+	{
+		if (element->isFloatingPointTy())
+			return resize(value, llvm);
+
+		value = issigned ?
+				state.builder.CreateSIToFP(value, llvm) :
+				state.builder.CreateUIToFP(value, llvm);
+		if (normalized)
+		{
+			value = state.builder.CreateFDiv(value,
+					llvm::ConstantFP::get(llvm, maximum()));
+
+			/* The most negative signed value is out of range. */
+			if (issigned)
+				value = clamp(value, -1, 1);
+		}
+		return value;
+	}
+
+	void storeToArray(llvm::Value* value, llvm::Value* pointer) const
+	{
+		llvm::Value* p = state.builder.CreateBitCast(pointer,
+				llvm::PointerType::get(storagetype, 0));
+		value = const_cast<StorageType*>(this)->convertToExternal(value);
+		state.builder.CreateAlignedStore(value, p, alignment());
+	}
+
+	llvm::Value* loadFromArray(llvm::Value* pointer) const
+	{
+		llvm::Value* p = state.builder.CreateBitCast(pointer,
+				llvm::PointerType::get(storagetype, 0));
+		llvm::Value* v = state.builder.CreateAlignedLoad(storagetype, p,
+				alignment());
+		return const_cast<StorageType*>(this)->convertToInternal(v);
+	}
+
+private:
+	llvm::Align alignment() const
+	{
+		return llvm::Align(element->getPrimitiveSizeInBits() / 8);
+	}
+
+	double maximum() const
+	{
+		unsigned bits = element->getPrimitiveSizeInBits();
+		return (double)((1U << (bits - (issigned ? 1 : 0))) - 1);
+	}
+
+	llvm::Value* resize(llvm::Value* value, llvm::Type* type)
+	{
+		unsigned from = value->getType()->getScalarSizeInBits();
+		unsigned to = type->getScalarSizeInBits();
+		if (from > to)
+			return state.builder.CreateFPTrunc(value, type);
+		if (from < to)
+			return state.builder.CreateFPExt(value, type);
+		return value;
+	}
+
+	llvm::Value* clamp(llvm::Value* value, double lo, double hi)
+	{
+		llvm::Type* t = value->getType();
+		value = state.builder.CreateBinaryIntrinsic(llvm::Intrinsic::maxnum,
+				value, llvm::ConstantFP::get(t, lo));
+		return state.builder.CreateBinaryIntrinsic(llvm::Intrinsic::minnum,
+				value, llvm::ConstantFP::get(t, hi));
+	}
 };
 
 class TypeRegistry
@@ -238,7 +984,10 @@ public:
 	void addType(Type* type)
 	{
 		_byname[type->name] = type;
-		_byllvm[type->llvm] = type;
+
+		/* Several types may share an LLVM type (e.g. real and its storage
+		 * types); looking it up must find the first, canonical one. */
+		_byllvm.insert(std::make_pair(type->llvm, type));
 	}
 
 	Type* find(string name)
@@ -252,10 +1001,30 @@ public:
 			return i->second;
 
 		Type* type;
-		if (name == "real")
+		if (name.find(" of ") != string::npos)
+		{
+			/* vector*4 of uint8 normalized */
+
+			string::size_type of = name.find(" of ");
+			Type* computetype = find(name.substr(0, of));
+			if (!computetype || !isStorable(computetype))
+				return NULL;
+			type = createStorage(name, computetype, name.substr(of + 4));
+			if (!type)
+				return NULL;
+		}
+		else if (isStorageFormat(name))
+		{
+			/* A bare storage format, like half, is a stored real. */
+
+			type = createStorage(name, find("real"), name);
+		}
+		else if (name == "real")
 			type = _compiler.retain(new RealType(_compiler, name));
 		else if (name == "boolean")
 			type = _compiler.retain(new BooleanType(_compiler, name));
+		else if (name == "int")
+			type = _compiler.retain(new IntType(_compiler, name));
 		else if (name == "!float")
 			type = _compiler.retain(new FloatType(_compiler, name));
 		else if (name == "!double")
@@ -263,8 +1032,24 @@ public:
 		else if (name == "vector")
 			type = _compiler.retain(new VectorType(_compiler, name, 3));
 		else if (name.substr(0, 7) == "vector*")
-			type = _compiler.retain(new VectorType(_compiler, name,
-					atoi(name.c_str() + 7)));
+		{
+			unsigned size;
+			char dummy;
+			if ((sscanf(name.c_str() + 7, "%u%c", &size, &dummy) != 1)
+					|| (size == 0))
+				return NULL;
+			type = _compiler.retain(new VectorType(_compiler, name, size));
+		}
+		else if (name.substr(0, 7) == "matrix*")
+		{
+			unsigned rows, columns;
+			char dummy;
+			if ((sscanf(name.c_str() + 7, "%ux%u%c", &rows, &columns, &dummy) != 2)
+					|| (rows == 0) || (columns == 0))
+				return NULL;
+			type = _compiler.retain(new MatrixType(_compiler, name,
+					rows, columns));
+		}
 		else
 			return NULL;
 
@@ -272,6 +1057,49 @@ public:
 		return type;
 	}
 
+private:
+	StorageType* createStorage(const string& name, Type* computetype,
+			const string& format)
+	{
+		bool issigned, normalized;
+		llvm::Type* element = StorageType::parse(_compiler, format,
+				issigned, normalized);
+		if (!element)
+			return NULL;
+
+		return _compiler.retain(new StorageType(_compiler, name,
+				computetype, element, issigned, normalized));
+	}
+
+	bool isStorageFormat(const string& format)
+	{
+		bool issigned, normalized;
+		return StorageType::parse(_compiler, format, issigned, normalized);
+	}
+
+	/* Only plain reals and vectors have storage types. */
+
+	bool isStorable(Type* type)
+	{
+		return (type == find("real")) || (type->asVector() == type);
+	}
+
+public:
+
+	VectorType* findVector(unsigned size)
+	{
+		std::stringstream s;
+		s << "vector*" << size;
+		return find(s.str())->asVector();
+	}
+
+	MatrixType* findMatrix(unsigned rows, unsigned columns)
+	{
+		std::stringstream s;
+		s << "matrix*" << rows << "x" << columns;
+		return find(s.str())->asMatrix();
+	}
+
 	Type* find(llvm::Type* llvmtype)
 	{
 		typename ByLLVMMap::const_iterator i = _byllvm.find(llvmtype);
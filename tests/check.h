@@ -0,0 +1,34 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+/* What the C++ test programs share: check() prints TEST FAILED (as runtest
+ * does) for anything that's wrong, and finish() reports the result and
+ * returns main()'s exit status.
+ */
+
+#ifndef CALCULON_TESTS_CHECK_H
+#define CALCULON_TESTS_CHECK_H
+
+#include <stdio.h>
+#include <string>
+
+static unsigned failures = 0;
+
+static void check(bool ok, const std::string& what)
+{
+	if (!ok)
+	{
+		printf("%s\nTEST FAILED\n", what.c_str());
+		failures++;
+	}
+}
+
+static int finish(const char* name)
+{
+	printf("%s: %s\n", name, failures ? "failed" : "ok");
+	return failures ? 1 : 0;
+}
+
+#endif
@@ -0,0 +1,194 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+/* Checks Calculon::Dispatch directly: that every item is run exactly once
+ * whatever the sizes, grains and thread counts, that exceptions get back to
+ * the caller, and that grid runs cover every cell.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <atomic>
+#include <stdexcept>
+
+#include "calculon.h"
+#include "check.h"
+
+using std::string;
+using std::vector;
+
+static string describe(unsigned threads, size_t n, size_t grain)
+{
+	return "threads=" + std::to_string(threads) + " n=" + std::to_string(n) +
+		" grain=" + std::to_string(grain);
+}
+
+/* Counts how many times each item is run. */
+
+static void items(Calculon::Dispatch& dispatch, size_t n, size_t grain)
+{
+	vector<std::atomic<unsigned>> counts(n);
+	for (auto& c : counts)
+		c = 0;
+
+	std::atomic<bool> small(false);
+	dispatch.run(n,
+		[&](size_t start, size_t count)
+		{
+			if (!count || ((start + count) > n))
+				small = true;
+			for (size_t i = start; i < std::min(start+count, n); i++)
+				counts[i]++;
+		},
+		grain);
+
+	string what = describe(dispatch.threads(), n, grain);
+	check(!small, what + ": empty or out of range chunk");
+	for (size_t i = 0; i < n; i++)
+	{
+		if (counts[i] != 1)
+		{
+			check(false, what + ": item " + std::to_string(i) + " run " +
+				std::to_string(counts[i]) + " times");
+			break;
+		}
+	}
+}
+
+static void exceptions(Calculon::Dispatch& dispatch, size_t n)
+{
+	bool caught = false;
+	try
+	{
+		dispatch.run(n,
+			[&](size_t start, size_t count)
+			{
+				if ((start <= (n/2)) && ((n/2) < (start+count)))
+					throw std::runtime_error("item failed");
+			});
+	}
+	catch (const std::runtime_error& e)
+	{
+		caught = (string(e.what()) == "item failed");
+	}
+	check(caught, describe(dispatch.threads(), n, 1) +
+		": exception not rethrown");
+
+	/* The pool must still work afterwards. */
+
+	items(dispatch, n, 1);
+}
+
+/* Stands in for a Program compiled with Options::grid. */
+
+struct GridCounter
+{
+	size_t width;
+	size_t height;
+	vector<std::atomic<unsigned>>& counts;
+	std::atomic<bool>& wrong;
+
+	void grid(size_t x, size_t y, size_t w, size_t h, size_t pitch,
+			const int* bindings) const
+	{
+		if (((x + w) > width) || ((y + h) > height) || (pitch != width) ||
+				(*bindings != 42))
+		{
+			wrong = true;
+			return;
+		}
+		for (size_t j = y; j < (y+h); j++)
+			for (size_t i = x; i < (x+w); i++)
+				counts[j*pitch + i]++;
+	}
+};
+
+static void grid(Calculon::Dispatch& dispatch, size_t width, size_t height,
+		size_t grain)
+{
+	vector<std::atomic<unsigned>> counts(width * height);
+	for (auto& c : counts)
+		c = 0;
+	std::atomic<bool> wrong(false);
+	GridCounter program = { width, height, counts, wrong };
+	int binding = 42;
+	dispatch.grid(program, width, height, width, &binding, grain);
+
+	string what = "threads=" + std::to_string(dispatch.threads()) +
+		" grid=" + std::to_string(width) + "x" + std::to_string(height) +
+		" grain=" + std::to_string(grain);
+	check(!wrong, what + ": bad rectangle");
+	for (size_t i = 0; i < counts.size(); i++)
+	{
+		if (counts[i] != 1)
+		{
+			check(false, what + ": cell " + std::to_string(i % width) + "," +
+				std::to_string(i / width) + " run " +
+				std::to_string(counts[i]) + " times");
+			break;
+		}
+	}
+
+	/* ...and the same through the 2D and 3D forms of run(). */
+
+	vector<std::atomic<unsigned>> cells(width * height * 3);
+	for (auto& c : cells)
+		c = 0;
+	dispatch.run(width, height,
+		[&](size_t x, size_t y)
+		{
+			cells[y*width + x]++;
+		},
+		grain);
+	dispatch.run(width, height, 2,
+		[&](size_t x, size_t y, size_t z)
+		{
+			cells[((z+1)*height + y)*width + x]++;
+		},
+		grain);
+	for (size_t i = 0; i < cells.size(); i++)
+	{
+		if (cells[i] != 1)
+		{
+			check(false, what + ": run() point " + std::to_string(i) + " run " +
+				std::to_string(cells[i]) + " times");
+			break;
+		}
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	const size_t sizes[] = { 1, 2, 3, 7, 100, 1001, 65537 };
+	const size_t grains[] = { 1, 3, 64, 100000 };
+	const unsigned threadcounts[] = { 1, 2, 3, 8, 33 };
+
+	for (unsigned threads : threadcounts)
+	{
+		Calculon::Dispatch dispatch(threads);
+		check(dispatch.threads() == threads, "wrong number of threads");
+
+		for (size_t n : sizes)
+			for (size_t grain : grains)
+				items(dispatch, n, grain);
+
+		exceptions(dispatch, 1);
+		exceptions(dispatch, 1001);
+
+		grid(dispatch, 1, 1, 1);
+		grid(dispatch, 13, 7, 1);
+		grid(dispatch, 64, 65, 64);
+		grid(dispatch, 5, 300, 4);
+	}
+
+	/* Running nothing mustn't call anything. */
+
+	Calculon::Dispatch dispatch(4);
+	bool called = false;
+	dispatch.run(0, [&](size_t start, size_t count) { called = true; });
+	check(!called, "run(0) called the function");
+
+	return finish("dispatch");
+}
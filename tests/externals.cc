@@ -0,0 +1,264 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+/* Checks the kinds of external function the filter demo doesn't use: real
+ * vectors passed and returned by value (BYVALUE), including the error for
+ * sizes which can't be, and functions linked in as LLVM IR.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "calculon.h"
+#include "check.h"
+
+using std::string;
+using std::vector;
+
+template <typename Real>
+struct Vectors
+{
+	typedef Real Real2 __attribute__((vector_size(2*sizeof(Real))));
+
+	static Real2 swap(Real2 v, Real scale)
+	{
+		Real2 r = { v[1]*scale, v[0]*scale };
+		return r;
+	}
+
+	static Real first(const Real* v)
+	{
+		return v[0];
+	}
+};
+
+/* vector*4 fits in an SSE register only when real is float. */
+
+typedef float Float4 __attribute__((vector_size(16)));
+
+static Float4 reverse4(Float4 v)
+{
+	Float4 r = { v[3], v[2], v[1], v[0] };
+	return r;
+}
+
+/* Compiles a script which should fail, and checks that the error says what
+ * and where. */
+
+template <typename Compiler, typename Function>
+static void compile_error(typename Compiler::StandardSymbolTable& symbols,
+		const string& script, const string& signature,
+		const typename Compiler::Options& options, const string& expected,
+		const string& what)
+{
+	try
+	{
+		typename Compiler::template Program<Function> program(symbols, script,
+			signature, {}, options);
+		check(false, what + ": compiled");
+	}
+	catch (const typename Compiler::CompilationException& e)
+	{
+		check(string(e.what()) == expected,
+			what + ": got error '" + e.what() + "'");
+	}
+}
+
+template <typename Settings>
+static void byvalue(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+	typedef Vectors<Real> V;
+
+	const unsigned flags = Compiler::READNONE | Compiler::NOUNWIND |
+		Compiler::WILLRETURN | Compiler::BYVALUE;
+	typename Compiler::StandardSymbolTable symbols;
+	symbols.add("swap", "(vector*2, real): vector*2", (void (*)()) V::swap,
+		flags);
+	symbols.add("first", "(vector*3): real", (void (*)()) V::first, flags);
+	symbols.add("make", "(real): vector*3", (void (*)()) V::first, flags);
+	symbols.add("reverse4", "(vector*4): vector*4", (void (*)()) reverse4,
+		flags);
+
+	/* vector*2 goes in and out in registers, in scalar and batch calls. */
+
+	typedef void SwapFunction(typename Compiler::template Vector<2>* in,
+		typename Compiler::template Vector<2>* out);
+	typename Compiler::Options options;
+	options.batch = true;
+	typename Compiler::template Program<SwapFunction> program(symbols,
+		"let out = swap(in, 2) + [1, 0] in return",
+		"(in: vector*2): (out: vector*2)", {}, options);
+
+	typename Compiler::template Vector<2> in, out;
+	in.m[0] = 3;
+	in.m[1] = 5;
+	program(&in, &out);
+	check((out.m[0] == 11) && (out.m[1] == 6),
+		precision + ": a by-value call gave the wrong result");
+
+	Real ins[] = { 1, 2, 3, 4, 5, 6 };
+	Real outs[6];
+	typename Compiler::Binding bindings[] = { ins, outs };
+	program.batch(0, 3, bindings);
+	for (unsigned i = 0; i < 3; i++)
+		check((outs[i*2] == (ins[i*2+1]*2 + 1)) &&
+				(outs[i*2+1] == (ins[i*2]*2)),
+			precision + ": a batched by-value call gave the wrong result");
+
+	typedef void ReverseFunction(typename Compiler::template Vector<4>* in,
+		typename Compiler::template Vector<4>* out);
+	const char* reverse = "let out = reverse4(in) in return";
+	const char* reversesignature = "(in: vector*4): (out: vector*4)";
+	if (sizeof(Real) == sizeof(float))
+	{
+		typename Compiler::template Program<ReverseFunction> program(symbols,
+			reverse, reversesignature, {}, options);
+		typename Compiler::template Vector<4> in, out;
+		for (unsigned i = 0; i < 4; i++)
+			in.m[i] = i + 1;
+		program(&in, &out);
+		check((out.m[0] == 4) && (out.m[1] == 3) && (out.m[2] == 2) &&
+				(out.m[3] == 1),
+			precision + ": a vector*4 by-value call gave the wrong result");
+	}
+	else
+	{
+		/* Doubles would need a 32-byte AVX register. */
+
+		compile_error<Compiler, ReverseFunction>(symbols, reverse,
+			reversesignature, options,
+			"external function 'reverse4' can't pass a vector*4 by value at 1:11",
+			precision + ": vector*4 of doubles");
+	}
+
+	/* vector*3 can't be passed by value, either way; the error points at
+	 * the call, even when it's only made while compiling the batch
+	 * entrypoint. */
+
+	typedef void FirstFunction(typename Compiler::template Vector<3>* in,
+		Real* out);
+	typedef void MakeFunction(Real in, typename Compiler::template Vector<3>* out);
+	for (bool batch : { false, true })
+	{
+		string what = precision + (batch ? ", batch" : ", scalar");
+		options.batch = batch;
+
+		compile_error<Compiler, FirstFunction>(symbols,
+			"let a = in in\nlet out = 1 + first(a) in return",
+			"(in: vector*3): (out: real)", options,
+			"external function 'first' can't pass a vector*3 by value at 2:15",
+			what + ": vector*3 parameter");
+
+		compile_error<Compiler, MakeFunction>(symbols,
+			"let out =\n  make(in) in return",
+			"(in: real): (out: vector*3)", options,
+			"external function 'make' can't pass a vector*3 by value at 2:3",
+			what + ": vector*3 return value");
+	}
+}
+
+/* Two modules with a private helper of the same name, and a counter which
+ * every call bumps. */
+
+static const char* scaler2 =
+	"@calls = global i32 0\n"
+	"define double @scale(double %x) {\n"
+	"  %r = fmul double %x, 2.0\n"
+	"  ret double %r\n"
+	"}\n"
+	"define double @double_it(double %x) {\n"
+	"  %n = load i32, i32* @calls\n"
+	"  %n1 = add i32 %n, 1\n"
+	"  store i32 %n1, i32* @calls\n"
+	"  %r = call double @scale(double %x)\n"
+	"  ret double %r\n"
+	"}\n"
+	"define double @count(double %x) {\n"
+	"  %n = load i32, i32* @calls\n"
+	"  %r = sitofp i32 %n to double\n"
+	"  ret double %r\n"
+	"}\n";
+
+static const char* scaler3 =
+	"define double @scale(double %x) {\n"
+	"  %r = fmul double %x, 3.0\n"
+	"  ret double %r\n"
+	"}\n"
+	"define double @triple_it(double %x) {\n"
+	"  %r = call double @scale(double %x)\n"
+	"  ret double %r\n"
+	"}\n";
+
+static const char* constructed =
+	"@value = global double 0.0\n"
+	"@llvm.global_ctors = appending global [1 x { i32, void ()*, i8* }]\n"
+	"  [{ i32, void ()*, i8* } { i32 65535, void ()* @init, i8* null }]\n"
+	"define void @init() {\n"
+	"  store double 1.0, double* @value\n"
+	"  ret void\n"
+	"}\n"
+	"define double @get(double %x) {\n"
+	"  %v = load double, double* @value\n"
+	"  ret double %v\n"
+	"}\n";
+
+template <typename Settings>
+static void bitcode(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+
+	typename Compiler::StandardSymbolTable symbols;
+	symbols.addBitcode("double_it", "(double): double", scaler2, "double_it");
+	symbols.addBitcode("count", "(double): double", scaler2, "count");
+	symbols.addBitcode("triple_it", "(double): double", scaler3, "triple_it");
+	symbols.addBitcode("scale3", "(double): double", scaler3, "scale");
+	symbols.addBitcode("get", "(double): double", constructed, "get");
+
+	/* Each function calls its own module's helper, even when it's asked for
+	 * by name after the other module's has been linked, and a module is
+	 * only linked once however many of its functions are used. */
+
+	typedef void Function(Real in, Real* out);
+	const char* script =
+		"let a = double_it(in) in\n"
+		"let c = scale3(in) in\n"
+		"let b = triple_it(in) in\n"
+		"let out = a*1000 + b*100 + c*10 + count(in) in return";
+	const char* signature = "(in: real): (out: real)";
+	typename Compiler::template Program<Function> first(symbols, script,
+		signature);
+	Real out;
+	first(1, &out);
+	check(out == 2331, precision + ": first call gave " + std::to_string(out));
+	first(1, &out);
+	check(out == 2332, precision + ": second call gave " + std::to_string(out));
+
+	/* Each Program has its own copy of the module's variables. */
+
+	typename Compiler::template Program<Function> second(symbols, script,
+		signature);
+	second(1, &out);
+	check(out == 2331, precision + ": another Program's first call gave " +
+		std::to_string(out));
+
+	compile_error<Compiler, Function>(symbols,
+		"let out = get(in) in return", signature, typename Compiler::Options(),
+		"bitcode for external function 'get' has static constructors or "
+		"destructors, which would never be run",
+		precision + ": static constructors");
+}
+
+int main(int argc, const char* argv[])
+{
+	byvalue<Calculon::RealIsDouble>("double");
+	byvalue<Calculon::RealIsFloat>("float");
+	bitcode<Calculon::RealIsDouble>("double");
+	bitcode<Calculon::RealIsFloat>("float");
+
+	return finish("externals");
+}
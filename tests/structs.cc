@@ -0,0 +1,130 @@
+/* Calculon © 2013 David Given
+ * This code is made available under the terms of the Simplified BSD License.
+ * Please see the COPYING file for the full license text.
+ */
+
+/* Checks struct parameters (Options::structs): fields read and written in
+ * place, unset output fields copied from the input, in-place updates, and
+ * batch calls over an array of structs, at both precisions.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "calculon.h"
+#include "check.h"
+
+using std::string;
+using std::vector;
+
+static const char* script =
+	"let position = position + velocity * dt in\n"
+	"let bounces = if position.y < 0 then bounces + 1 else bounces in\n"
+	"return";
+
+template <typename Settings>
+static void structs(const string& precision)
+{
+	typedef Calculon::Instance<Settings> Compiler;
+	typedef typename Compiler::Real Real;
+
+	struct Particle
+	{
+		typename Compiler::template Vector<3> position;
+		typename Compiler::template Vector<3> velocity;
+		float mass;
+		int bounces;
+	};
+
+	typename Compiler::Struct particle(sizeof(Particle));
+	particle.add("position", offsetof(Particle, position), "vector*3")
+	        .add("velocity", offsetof(Particle, velocity), "vector*3")
+	        .add("mass", offsetof(Particle, mass), "float")
+	        .add("bounces", offsetof(Particle, bounces), "int");
+
+	typename Compiler::Options options;
+	options.structs["Particle"] = particle;
+	options.batch = true;
+	options.inputLayouts["dt"] = Compiler::Layout::uniform();
+
+	typedef void ScriptFunction(const Particle* in, Real dt, Particle* out);
+	typename Compiler::StandardSymbolTable symbols;
+	typename Compiler::template Program<ScriptFunction> program(symbols, script,
+		"(p: Particle, dt: real): (p: Particle)", {}, options);
+
+	const unsigned count = 37;
+	vector<Particle> particles(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		Particle& p = particles[i];
+		memset(&p, 0, sizeof(p));
+		for (unsigned j = 0; j < 3; j++)
+		{
+			p.position.m[j] = i + j;
+			p.velocity.m[j] = (j == 1) ? -(Real)i : 1;
+		}
+		p.mass = 0.5f * i;
+		p.bounces = i % 3;
+	}
+
+	/* Each particle moves by velocity*dt, bounces when it goes below 0, and
+	 * keeps its velocity and mass. */
+
+	auto expected =
+		[&](const Particle& before, Real dt, const Particle& after,
+			const string& what)
+		{
+			bool ok = true;
+			for (unsigned j = 0; j < 3; j++)
+			{
+				Real p = before.position.m[j] + before.velocity.m[j]*dt;
+				ok = ok && (after.position.m[j] == p) &&
+					(after.velocity.m[j] == before.velocity.m[j]);
+			}
+			Real y = before.position.m[1] + before.velocity.m[1]*dt;
+			ok = ok && (after.mass == before.mass) &&
+				(after.bounces == (before.bounces + ((y < 0) ? 1 : 0)));
+			check(ok, precision + ": " + what + " gave the wrong particle");
+		};
+
+	/* Separate input and output. */
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		Particle out;
+		memset(&out, 0xff, sizeof(out));
+		program(&particles[i], 2, &out);
+		expected(particles[i], 2, out, "a scalar call");
+	}
+
+	/* In place. */
+
+	Particle p = particles[5];
+	program(&p, 3, &p);
+	expected(particles[5], 3, p, "an in-place call");
+
+	/* A batch, with one dt shared by every item; structs are always aos,
+	 * one item every sizeof(Particle) bytes. Only part of the array is
+	 * run, so the rest of the output must be left alone. */
+
+	vector<Particle> out(count);
+	memset(&out[0], 0, count * sizeof(Particle));
+	Real dt = 0.25;
+	typename Compiler::Binding bindings[] =
+		{ &particles[0], &dt, &out[0] };
+	program.batch(1, count-2, bindings);
+	for (unsigned i = 1; i < (count-1); i++)
+		expected(particles[i], dt, out[i], "a batch call");
+	check((out[0].mass == 0) && (out[count-1].mass == 0),
+		precision + ": a batch call wrote outside its range");
+}
+
+int main(int argc, const char* argv[])
+{
+	structs<Calculon::RealIsDouble>("double");
+	structs<Calculon::RealIsFloat>("float");
+
+	return finish("structs");
+}